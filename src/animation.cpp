@@ -0,0 +1,1239 @@
+#include "animation.H"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ANIMATION_SSE 1
+#endif
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+#include "animation_shader.H"
+#include "jobs.H"
+
+namespace {
+// Joint indices are UINT8 vertex attributes.
+auto constexpr MAX_JOINTS = 256;
+// Characters posed per task.
+auto constexpr CHARACTER_GRAIN = 32;
+// Palette texels after the joints' rows: the active morph targets, their weights.
+auto constexpr MORPH_TEXELS = 2;
+auto constexpr PI = 3.14159265f;
+// Tube tessellation of the figure.
+auto constexpr TUBE_SIDES = 6;
+auto constexpr TUBE_RINGS = 5;
+// The part of a tube, from its start, that bends with the parent joint.
+auto constexpr TUBE_BLEND = 0.3f;
+
+// The top three rows of a rigid transform, row-major.
+struct Affine {
+    float m[12];
+};
+
+auto to_affine(const animation::Transform& transform) -> Affine {
+    const Vec4& q = transform.rotation;
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+    const Vec3& t = transform.translation;
+    return {{1.0f - 2.0f * (yy + zz), 2.0f * (xy - wz), 2.0f * (xz + wy), t.x,
+             2.0f * (xy + wz), 1.0f - 2.0f * (xx + zz), 2.0f * (yz - wx), t.y,
+             2.0f * (xz - wy), 2.0f * (yz + wx), 1.0f - 2.0f * (xx + yy), t.z}};
+}
+
+auto to_affine(const Mat4& matrix) -> Affine {
+    Affine result;
+    for (int row = 0; row < 3; ++row) {
+        for (int column = 0; column < 4; ++column) {
+            result.m[row * 4 + column] = matrix(row, column);
+        }
+    }
+    return result;
+}
+
+auto operator*(const Affine& a, const Affine& b) -> Affine {
+    Affine r;
+    for (int row = 0; row < 3; ++row) {
+        const float* ar = &a.m[row * 4];
+        for (int column = 0; column < 4; ++column) {
+            r.m[row * 4 + column] = ar[0] * b.m[column] + ar[1] * b.m[4 + column] +
+                                    ar[2] * b.m[8 + column];
+        }
+        r.m[row * 4 + 3] += ar[3];
+    }
+    return r;
+}
+
+// Model space transforms of every joint of `skeleton` in `pose`.
+void model_transforms(const animation::Skeleton& skeleton,
+                      const animation::Pose& pose,
+                      Affine* models) {
+    for (int joint = 0; joint < skeleton.joint_count(); ++joint) {
+        auto j = static_cast<size_t>(joint);
+        Affine local = to_affine(
+            animation::Transform {{pose.rx[j], pose.ry[j], pose.rz[j], pose.rw[j]},
+                                  {pose.tx[j], pose.ty[j], pose.tz[j]}});
+        int parent = skeleton.parents[j];
+        models[joint] = parent < 0 ? local : models[parent] * local;
+    }
+}
+
+// Lerps translations and nlerps rotations along the shorter arc from `a` to `b`.
+void mix(const animation::Pose& a,
+         const animation::Pose& b,
+         float weight,
+         animation::Pose& result) {
+    size_t count = a.padded_count();
+#ifdef ANIMATION_SSE
+    __m128 w = _mm_set1_ps(weight);
+    __m128 zero = _mm_setzero_ps();
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    auto lerp = [w](__m128 from, __m128 to) {
+        return _mm_add_ps(from, _mm_mul_ps(_mm_sub_ps(to, from), w));
+    };
+    for (size_t j = 0; j < count; j += 4) {
+        __m128 ax = _mm_loadu_ps(&a.rx[j]);
+        __m128 ay = _mm_loadu_ps(&a.ry[j]);
+        __m128 az = _mm_loadu_ps(&a.rz[j]);
+        __m128 aw = _mm_loadu_ps(&a.rw[j]);
+        __m128 bx = _mm_loadu_ps(&b.rx[j]);
+        __m128 by = _mm_loadu_ps(&b.ry[j]);
+        __m128 bz = _mm_loadu_ps(&b.rz[j]);
+        __m128 bw = _mm_loadu_ps(&b.rw[j]);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)),
+                              _mm_add_ps(_mm_mul_ps(az, bz), _mm_mul_ps(aw, bw)));
+        // q and -q are the same rotation; negate b where it is on the far side.
+        __m128 flip = _mm_and_ps(_mm_cmplt_ps(d, zero), sign);
+        __m128 x = lerp(ax, _mm_xor_ps(bx, flip));
+        __m128 y = lerp(ay, _mm_xor_ps(by, flip));
+        __m128 z = lerp(az, _mm_xor_ps(bz, flip));
+        __m128 q = lerp(aw, _mm_xor_ps(bw, flip));
+        __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                                    _mm_add_ps(_mm_mul_ps(z, z), _mm_mul_ps(q, q)));
+        __m128 inverse_length = _mm_div_ps(one, _mm_sqrt_ps(length2));
+        _mm_storeu_ps(&result.rx[j], _mm_mul_ps(x, inverse_length));
+        _mm_storeu_ps(&result.ry[j], _mm_mul_ps(y, inverse_length));
+        _mm_storeu_ps(&result.rz[j], _mm_mul_ps(z, inverse_length));
+        _mm_storeu_ps(&result.rw[j], _mm_mul_ps(q, inverse_length));
+        _mm_storeu_ps(&result.tx[j],
+                      lerp(_mm_loadu_ps(&a.tx[j]), _mm_loadu_ps(&b.tx[j])));
+        _mm_storeu_ps(&result.ty[j],
+                      lerp(_mm_loadu_ps(&a.ty[j]), _mm_loadu_ps(&b.ty[j])));
+        _mm_storeu_ps(&result.tz[j],
+                      lerp(_mm_loadu_ps(&a.tz[j]), _mm_loadu_ps(&b.tz[j])));
+    }
+#else
+    auto lerp = [weight](float from, float to) { return from + (to - from) * weight; };
+    for (size_t j = 0; j < count; ++j) {
+        float d = a.rx[j] * b.rx[j] + a.ry[j] * b.ry[j] + a.rz[j] * b.rz[j] +
+                  a.rw[j] * b.rw[j];
+        float s = d < 0.0f ? -1.0f : 1.0f;
+        float x = lerp(a.rx[j], b.rx[j] * s);
+        float y = lerp(a.ry[j], b.ry[j] * s);
+        float z = lerp(a.rz[j], b.rz[j] * s);
+        float w = lerp(a.rw[j], b.rw[j] * s);
+        float inverse_length = 1.0f / std::sqrt(x * x + y * y + z * z + w * w);
+        result.rx[j] = x * inverse_length;
+        result.ry[j] = y * inverse_length;
+        result.rz[j] = z * inverse_length;
+        result.rw[j] = w * inverse_length;
+        result.tx[j] = lerp(a.tx[j], b.tx[j]);
+        result.ty[j] = lerp(a.ty[j], b.ty[j]);
+        result.tz[j] = lerp(a.tz[j], b.tz[j]);
+    }
+#endif
+}
+
+// A baked character, as its vertex shader reads it.
+struct BakedInstance {
+    Vec4 placement; // position, heading
+    Vec4 animation; // scale, time, blend
+};
+
+// Scales the rotations of `pose` back to unit length.
+void normalize_rotations(animation::Pose& pose) {
+    size_t count = pose.padded_count();
+#ifdef ANIMATION_SSE
+    __m128 one = _mm_set1_ps(1.0f);
+    for (size_t j = 0; j < count; j += 4) {
+        __m128 x = _mm_loadu_ps(&pose.rx[j]);
+        __m128 y = _mm_loadu_ps(&pose.ry[j]);
+        __m128 z = _mm_loadu_ps(&pose.rz[j]);
+        __m128 w = _mm_loadu_ps(&pose.rw[j]);
+        __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)),
+                                    _mm_add_ps(_mm_mul_ps(z, z), _mm_mul_ps(w, w)));
+        __m128 inverse_length = _mm_div_ps(one, _mm_sqrt_ps(length2));
+        _mm_storeu_ps(&pose.rx[j], _mm_mul_ps(x, inverse_length));
+        _mm_storeu_ps(&pose.ry[j], _mm_mul_ps(y, inverse_length));
+        _mm_storeu_ps(&pose.rz[j], _mm_mul_ps(z, inverse_length));
+        _mm_storeu_ps(&pose.rw[j], _mm_mul_ps(w, inverse_length));
+    }
+#else
+    for (size_t j = 0; j < count; ++j) {
+        float inverse_length =
+            1.0f / std::sqrt(pose.rx[j] * pose.rx[j] + pose.ry[j] * pose.ry[j] +
+                             pose.rz[j] * pose.rz[j] + pose.rw[j] * pose.rw[j]);
+        pose.rx[j] *= inverse_length;
+        pose.ry[j] *= inverse_length;
+        pose.rz[j] *= inverse_length;
+        pose.rw[j] *= inverse_length;
+    }
+#endif
+}
+
+auto channels(animation::Pose& pose) -> std::array<float*, 7> {
+    return {pose.rx.data(),
+            pose.ry.data(),
+            pose.rz.data(),
+            pose.rw.data(),
+            pose.tx.data(),
+            pose.ty.data(),
+            pose.tz.data()};
+}
+
+auto channels(const animation::Pose& pose) -> std::array<const float*, 7> {
+    return {pose.rx.data(),
+            pose.ry.data(),
+            pose.rz.data(),
+            pose.rw.data(),
+            pose.tx.data(),
+            pose.ty.data(),
+            pose.tz.data()};
+}
+
+// Writes the pose `t` of the way from the keyframe record `a` to `b` of `clip`.
+// Rotation tracks were stored on a consistent side, so their components are
+// interpolated on their own and only renormalized.
+void decode(const animation::CompressedClip& clip,
+            const uint16_t* a,
+            const uint16_t* b,
+            float t,
+            animation::Pose& pose) {
+    pose = clip.base;
+    auto targets = channels(pose);
+    for (size_t i = 0; i < clip.tracks.size(); ++i) {
+        float from = a[i];
+        float to = b[i];
+        const auto& track = clip.tracks[i];
+        float value = (from + (to - from) * t) * clip.scales[i];
+        targets[track.channel][track.joint] += value;
+    }
+    normalize_rotations(pose);
+}
+
+// The largest difference of a rotation and a translation component between `a`
+// and `b`.
+auto pose_error(const animation::Pose& a, const animation::Pose& b)
+    -> std::pair<float, float> {
+    auto from = channels(a);
+    auto to = channels(b);
+    float rotation = 0.0f;
+    float translation = 0.0f;
+    for (size_t channel = 0; channel < 7; ++channel) {
+        float& error = channel < 4 ? rotation : translation;
+        for (size_t j = 0; j < a.padded_count(); ++j) {
+            error = std::max(error, std::abs(from[channel][j] - to[channel][j]));
+        }
+    }
+    return {rotation, translation};
+}
+
+auto axis_angle(const Vec3& axis, float angle) -> Vec4 {
+    Vec3 a = normalize(axis) * std::sin(angle * 0.5f);
+    return {a.x, a.y, a.z, std::cos(angle * 0.5f)};
+}
+
+auto to_unorm8(float value) -> uint8_t {
+    return static_cast<uint8_t>(std::clamp(value, 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// Joints of the figure.
+enum Joint {
+    PELVIS,
+    CHEST,
+    NECK,
+    LEFT_SHOULDER,
+    LEFT_ELBOW,
+    RIGHT_SHOULDER,
+    RIGHT_ELBOW,
+    LEFT_HIP,
+    LEFT_KNEE,
+    RIGHT_HIP,
+    RIGHT_KNEE,
+    JOINT_COUNT
+};
+
+// Model space position of every joint of the bind pose.
+auto bind_positions(const animation::Skeleton& skeleton) -> std::vector<Vec3> {
+    std::vector<Vec3> positions(skeleton.parents.size());
+    for (size_t joint = 0; joint < positions.size(); ++joint) {
+        int parent = skeleton.parents[joint];
+        // The figure's bind pose has no rotations.
+        positions[joint] = skeleton.bind_pose[joint].translation;
+        if (parent >= 0) {
+            positions[joint] = positions[joint] + positions[parent];
+        }
+    }
+    return positions;
+}
+
+// Appends a capped tube from `from` to `to` bound to `joint`, whose start bends
+// with the joint's parent.
+void add_tube(animation::SkinnedMesh& mesh,
+              const animation::Skeleton& skeleton,
+              int joint,
+              const Vec3& from,
+              const Vec3& to,
+              float radius,
+              const Vec3& color) {
+    Vec3 axis = normalize(to - from);
+    Vec3 helper = std::fabs(axis.y) < 0.9f ? Vec3 {0.0f, 1.0f, 0.0f}
+                                           : Vec3 {1.0f, 0.0f, 0.0f};
+    Vec3 u = normalize(cross(axis, helper));
+    Vec3 v = cross(axis, u);
+    int parent = skeleton.parents[static_cast<size_t>(joint)];
+
+    auto add_vertex = [&](const Vec3& position, float t) {
+        animation::SkinnedVertex vertex {};
+        vertex.position[0] = position.x;
+        vertex.position[1] = position.y;
+        vertex.position[2] = position.z;
+        vertex.color[0] = to_unorm8(color.x);
+        vertex.color[1] = to_unorm8(color.y);
+        vertex.color[2] = to_unorm8(color.z);
+        vertex.color[3] = 255;
+        float parent_weight =
+            parent < 0 ? 0.0f : 0.5f * std::max(0.0f, 1.0f - t / TUBE_BLEND);
+        int joints[4] = {joint, std::max(parent, 0), 0, 0};
+        float weights[4] = {1.0f - parent_weight, parent_weight, 0.0f, 0.0f};
+        set_weights(vertex, joints, weights);
+        mesh.vertices.push_back(vertex);
+        return static_cast<uint16_t>(mesh.vertices.size() - 1);
+    };
+
+    auto first = static_cast<uint16_t>(mesh.vertices.size());
+    for (int ring = 0; ring < TUBE_RINGS; ++ring) {
+        float t = static_cast<float>(ring) / static_cast<float>(TUBE_RINGS - 1);
+        Vec3 center = from + (to - from) * t;
+        for (int side = 0; side < TUBE_SIDES; ++side) {
+            float angle = 2.0f * PI * static_cast<float>(side) /
+                          static_cast<float>(TUBE_SIDES);
+            add_vertex(center + u * (radius * std::cos(angle)) +
+                           v * (radius * std::sin(angle)),
+                       t);
+        }
+    }
+    for (int ring = 0; ring + 1 < TUBE_RINGS; ++ring) {
+        for (int side = 0; side < TUBE_SIDES; ++side) {
+            int next = (side + 1) % TUBE_SIDES;
+            auto a = static_cast<uint16_t>(first + ring * TUBE_SIDES + side);
+            auto b = static_cast<uint16_t>(first + ring * TUBE_SIDES + next);
+            auto c = static_cast<uint16_t>(a + TUBE_SIDES);
+            auto d = static_cast<uint16_t>(b + TUBE_SIDES);
+            mesh.indices.insert(mesh.indices.end(), {a, b, d, a, d, c});
+        }
+    }
+    uint16_t caps[2] = {add_vertex(from, 0.0f), add_vertex(to, 1.0f)};
+    for (int side = 0; side < TUBE_SIDES; ++side) {
+        int next = (side + 1) % TUBE_SIDES;
+        auto last_ring = first + (TUBE_RINGS - 1) * TUBE_SIDES;
+        mesh.indices.insert(mesh.indices.end(),
+                            {caps[0],
+                             static_cast<uint16_t>(first + next),
+                             static_cast<uint16_t>(first + side),
+                             caps[1],
+                             static_cast<uint16_t>(last_ring + side),
+                             static_cast<uint16_t>(last_ring + next)});
+    }
+}
+
+// Pushes the vertices in [first, last) away from the axis from `from` to `to`,
+// by `amount` of their distance to it in the middle and not at all at the ends,
+// and by `front` more on the +z side. Vertices that do not move are left out.
+auto bulge(const animation::SkinnedMesh& mesh,
+           size_t first,
+           size_t last,
+           const Vec3& from,
+           const Vec3& to,
+           float amount,
+           float front) -> animation::MorphTarget {
+    animation::MorphTarget target;
+    Vec3 axis = to - from;
+    float length2 = dot(axis, axis);
+    for (size_t v = first; v < last; ++v) {
+        const float* position = mesh.vertices[v].position;
+        Vec3 offset = Vec3 {position[0], position[1], position[2]} - from;
+        float t = std::clamp(dot(offset, axis) / length2, 0.0f, 1.0f);
+        Vec3 radial = offset - axis * t;
+        float distance = length(radial);
+        if (distance < 1e-6f) {
+            continue;
+        }
+        float scale = amount * std::sin(PI * t) * (1.0f + front * radial.z / distance);
+        Vec3 delta = radial * scale;
+        if (length(delta) < 1e-5f) {
+            continue;
+        }
+        target.vertices.push_back(static_cast<uint16_t>(v));
+        target.deltas.push_back(delta);
+    }
+    return target;
+}
+
+// A clip of `frame_count` frames at 30 per second, `pose` filling every frame given
+// its phase in [0, 2 pi).
+template <typename PoseFn>
+auto make_clip(const animation::Skeleton& skeleton, int frame_count, PoseFn pose)
+    -> animation::Clip {
+    animation::Clip clip;
+    clip.frames.resize(static_cast<size_t>(frame_count));
+    for (int frame = 0; frame < frame_count; ++frame) {
+        std::vector<animation::Transform> transforms = skeleton.bind_pose;
+        float phase =
+            2.0f * PI * static_cast<float>(frame) / static_cast<float>(frame_count);
+        pose(phase, transforms);
+        animation::Pose& out = clip.frames[static_cast<size_t>(frame)];
+        out.resize(skeleton.joint_count());
+        for (int joint = 0; joint < skeleton.joint_count(); ++joint) {
+            out.set(joint, transforms[static_cast<size_t>(joint)]);
+        }
+    }
+    return clip;
+}
+} // namespace
+
+namespace animation {
+void Skeleton::compute_inverse_bind() {
+    std::vector<Affine> models(parents.size());
+    Pose pose;
+    pose.resize(joint_count());
+    for (int joint = 0; joint < joint_count(); ++joint) {
+        pose.set(joint, bind_pose[static_cast<size_t>(joint)]);
+    }
+    model_transforms(*this, pose, models.data());
+    inverse_bind.resize(parents.size());
+    for (size_t joint = 0; joint < parents.size(); ++joint) {
+        // The inverse of a rigid transform: transposed rotation, rotated and
+        // negated translation.
+        const float* m = models[joint].m;
+        Mat4& inverse = inverse_bind[joint];
+        for (int row = 0; row < 3; ++row) {
+            for (int column = 0; column < 3; ++column) {
+                inverse(row, column) = m[column * 4 + row];
+            }
+            inverse(row, 3) =
+                -(m[row] * m[3] + m[4 + row] * m[7] + m[8 + row] * m[11]);
+        }
+    }
+}
+
+void Pose::resize(int joint_count) {
+    auto padded = static_cast<size_t>((joint_count + 3) & ~3);
+    for (auto* channel : {&rx, &ry, &rz, &tx, &ty, &tz}) {
+        channel->assign(padded, 0.0f);
+    }
+    rw.assign(padded, 1.0f);
+}
+
+void Pose::set(int joint, const Transform& transform) {
+    auto j = static_cast<size_t>(joint);
+    rx[j] = transform.rotation.x;
+    ry[j] = transform.rotation.y;
+    rz[j] = transform.rotation.z;
+    rw[j] = transform.rotation.w;
+    tx[j] = transform.translation.x;
+    ty[j] = transform.translation.y;
+    tz[j] = transform.translation.z;
+}
+
+void sample(const Clip& clip, float time, Pose& pose) {
+    if (clip.frames.empty()) {
+        return;
+    }
+    auto count = static_cast<int>(clip.frames.size());
+    float frame = std::fmod(time * clip.frame_rate, static_cast<float>(count));
+    if (frame < 0.0f) {
+        frame += static_cast<float>(count);
+    }
+    int first = std::min(static_cast<int>(frame), count - 1);
+    const Pose& a = clip.frames[static_cast<size_t>(first)];
+    const Pose& b = clip.frames[static_cast<size_t>((first + 1) % count)];
+    if (pose.padded_count() != a.padded_count()) {
+        pose.resize(static_cast<int>(a.padded_count()));
+    }
+    mix(a, b, frame - static_cast<float>(first), pose);
+}
+
+void sample(const CompressedClip& clip, float time, Pose& pose) {
+    if (clip.key_frames.empty()) {
+        return;
+    }
+    auto count = static_cast<float>(clip.frame_count);
+    float frame = std::fmod(time * clip.frame_rate, count);
+    if (frame < 0.0f) {
+        frame += count;
+    }
+    const auto& key_frames = clip.key_frames;
+    auto next = std::upper_bound(key_frames.begin(), key_frames.end(), frame);
+    auto first = static_cast<size_t>(next - key_frames.begin() - 1);
+    // Past the last keyframe the clip blends back into the first.
+    bool wraps = next == key_frames.end();
+    float from = key_frames[first];
+    float to = wraps ? count : static_cast<float>(*next);
+    size_t second = wraps ? 0 : first + 1;
+    size_t stride = clip.tracks.size();
+    decode(clip,
+           clip.keys.data() + first * stride,
+           clip.keys.data() + second * stride,
+           (frame - from) / (to - from),
+           pose);
+}
+
+auto CompressedClip::bytes() const -> size_t {
+    return 7 * base.padded_count() * sizeof(float) +
+           tracks.size() * (sizeof(Track) + sizeof(float)) +
+           (key_frames.size() + keys.size()) * sizeof(uint16_t);
+}
+
+auto compress(const Clip& clip, const CompressionSettings& settings)
+    -> CompressedClip {
+    CompressedClip result;
+    result.frame_rate = clip.frame_rate;
+    if (clip.frames.empty()) {
+        return result;
+    }
+    if (clip.frames.size() > 65535) {
+        spdlog::error("Clips are limited to 65535 frames, not {}", clip.frames.size());
+        return result;
+    }
+    result.frame_count = static_cast<int>(clip.frames.size());
+    size_t padded = clip.frames[0].padded_count();
+
+    // Flip every rotation onto the side of the previous frame's, so that no track
+    // jumps between q and -q.
+    std::vector<Pose> frames = clip.frames;
+    for (size_t f = 1; f < frames.size(); ++f) {
+        Pose& pose = frames[f];
+        const Pose& previous = frames[f - 1];
+        for (size_t j = 0; j < padded; ++j) {
+            float d = pose.rx[j] * previous.rx[j] + pose.ry[j] * previous.ry[j] +
+                      pose.rz[j] * previous.rz[j] + pose.rw[j] * previous.rw[j];
+            if (d < 0.0f) {
+                pose.rx[j] = -pose.rx[j];
+                pose.ry[j] = -pose.ry[j];
+                pose.rz[j] = -pose.rz[j];
+                pose.rw[j] = -pose.rw[j];
+            }
+        }
+    }
+
+    // Constant tracks go into the base pose, the others are quantized over their
+    // range, the base holding the minimum.
+    result.base = frames[0];
+    auto base = channels(result.base);
+    for (uint16_t channel = 0; channel < 7; ++channel) {
+        for (size_t j = 0; j < padded; ++j) {
+            float low = base[channel][j];
+            float high = low;
+            for (const Pose& pose : frames) {
+                float value = channels(pose)[channel][j];
+                low = std::min(low, value);
+                high = std::max(high, value);
+            }
+            if (high - low <= 1e-6f) {
+                continue;
+            }
+            base[channel][j] = low;
+            result.tracks.push_back({static_cast<uint16_t>(j), channel});
+            result.scales.push_back((high - low) / 65535.0f);
+        }
+    }
+    size_t stride = result.tracks.size();
+    std::vector<uint16_t> quantized(frames.size() * stride);
+    for (size_t f = 0; f < frames.size(); ++f) {
+        auto values = channels(frames[f]);
+        for (size_t i = 0; i < stride; ++i) {
+            const auto& track = result.tracks[i];
+            float offset = values[track.channel][track.joint] -
+                           base[track.channel][track.joint];
+            quantized[f * stride + i] = static_cast<uint16_t>(
+                std::clamp(std::lround(offset / result.scales[i]), 0L, 65535L));
+        }
+    }
+
+    // Greedily extend every span between two kept keyframes as far as the frames
+    // it skips are still reproduced within tolerance. The last frame is always
+    // kept, the span past it being the wrap back to the first.
+    auto last = frames.size() - 1;
+    Pose decoded;
+    auto within_tolerance = [&](size_t start, size_t end) {
+        for (size_t f = start + 1; f < end; ++f) {
+            decode(result,
+                   quantized.data() + start * stride,
+                   quantized.data() + end * stride,
+                   static_cast<float>(f - start) / static_cast<float>(end - start),
+                   decoded);
+            auto [rotation, translation] = pose_error(decoded, frames[f]);
+            if (rotation > settings.rotation_tolerance ||
+                translation > settings.translation_tolerance) {
+                return false;
+            }
+        }
+        return true;
+    };
+    size_t start = 0;
+    result.key_frames.push_back(0);
+    while (start < last) {
+        size_t end = start + 1;
+        while (end < last && within_tolerance(start, end + 1)) {
+            ++end;
+        }
+        result.key_frames.push_back(static_cast<uint16_t>(end));
+        start = end;
+    }
+    result.keys.reserve(result.key_frames.size() * stride);
+    for (uint16_t frame : result.key_frames) {
+        const uint16_t* record = quantized.data() + frame * stride;
+        result.keys.insert(result.keys.end(), record, record + stride);
+    }
+    spdlog::info("Compressed a clip of {} frames from {} to {} bytes: {} of {} "
+                 "tracks animated, {} keyframes kept",
+                 frames.size(),
+                 frames.size() * 7 * padded * sizeof(float),
+                 result.bytes(),
+                 stride,
+                 7 * padded,
+                 result.key_frames.size());
+    return result;
+}
+
+void blend(const Pose& a, const Pose& b, float weight, Pose& result) {
+    if (result.padded_count() != a.padded_count()) {
+        result.resize(static_cast<int>(a.padded_count()));
+    }
+    mix(a, b, weight, result);
+}
+
+void skinning_palette(const Skeleton& skeleton,
+                      const Pose& pose,
+                      const Mat4& world,
+                      Vec4* palette) {
+    Affine models[MAX_JOINTS];
+    model_transforms(skeleton, pose, models);
+    Affine placement = to_affine(world);
+    for (int joint = 0; joint < skeleton.joint_count(); ++joint) {
+        Affine skin = placement * models[joint] *
+                      to_affine(skeleton.inverse_bind[static_cast<size_t>(joint)]);
+        for (int row = 0; row < 3; ++row) {
+            const float* m = &skin.m[row * 4];
+            palette[joint * 3 + row] = {m[0], m[1], m[2], m[3]};
+        }
+    }
+}
+
+void set_weights(SkinnedVertex& vertex, const int joints[4], const float weights[4]) {
+    float total = weights[0] + weights[1] + weights[2] + weights[3];
+    float scale = total > 0.0f ? 255.0f / total : 0.0f;
+    int sum = 0;
+    int largest = 0;
+    for (int i = 0; i < 4; ++i) {
+        vertex.joints[i] = static_cast<uint8_t>(joints[i]);
+        int weight = static_cast<int>(weights[i] * scale + 0.5f);
+        vertex.weights[i] = static_cast<uint8_t>(std::clamp(weight, 0, 255));
+        sum += vertex.weights[i];
+        if (weights[i] > weights[largest]) {
+            largest = i;
+        }
+    }
+    // Rounding errors go to the largest weight, so the vertex never shrinks
+    // towards the origin.
+    vertex.weights[largest] =
+        static_cast<uint8_t>(vertex.weights[largest] + 255 - sum);
+}
+
+auto figure_skeleton() -> Skeleton {
+    Skeleton skeleton;
+    auto add = [&](int parent, const Vec3& offset) {
+        skeleton.parents.push_back(parent);
+        skeleton.bind_pose.push_back({{0.0f, 0.0f, 0.0f, 1.0f}, offset});
+    };
+    add(-1, {0.0f, 0.52f, 0.0f});               // PELVIS
+    add(PELVIS, {0.0f, 0.25f, 0.0f});           // CHEST
+    add(CHEST, {0.0f, 0.08f, 0.0f});            // NECK
+    add(CHEST, {0.13f, 0.06f, 0.0f});           // LEFT_SHOULDER
+    add(LEFT_SHOULDER, {0.0f, -0.17f, 0.0f});   // LEFT_ELBOW
+    add(CHEST, {-0.13f, 0.06f, 0.0f});          // RIGHT_SHOULDER
+    add(RIGHT_SHOULDER, {0.0f, -0.17f, 0.0f});  // RIGHT_ELBOW
+    add(PELVIS, {0.07f, -0.02f, 0.0f});         // LEFT_HIP
+    add(LEFT_HIP, {0.0f, -0.24f, 0.0f});        // LEFT_KNEE
+    add(PELVIS, {-0.07f, -0.02f, 0.0f});        // RIGHT_HIP
+    add(RIGHT_HIP, {0.0f, -0.24f, 0.0f});       // RIGHT_KNEE
+    skeleton.compute_inverse_bind();
+    return skeleton;
+}
+
+auto figure_mesh(const Skeleton& skeleton) -> SkinnedMesh {
+    std::vector<Vec3> p = bind_positions(skeleton);
+    Vec3 shirt {0.2f, 0.35f, 0.7f};
+    Vec3 skin {0.9f, 0.7f, 0.55f};
+    Vec3 trousers {0.25f, 0.25f, 0.3f};
+    Vec3 down {0.0f, -1.0f, 0.0f};
+    SkinnedMesh mesh;
+    add_tube(mesh, skeleton, PELVIS, p[PELVIS], p[CHEST], 0.075f, shirt);
+    size_t chest = mesh.vertices.size();
+    add_tube(mesh, skeleton, CHEST, p[CHEST], p[NECK], 0.085f, shirt);
+    size_t head = mesh.vertices.size();
+    Vec3 crown = p[NECK] + Vec3 {0.0f, 0.15f, 0.0f};
+    add_tube(mesh, skeleton, NECK, p[NECK], crown, 0.06f, skin);
+    size_t limbs = mesh.vertices.size();
+    mesh.morph_targets.resize(2);
+    mesh.morph_targets[FIGURE_PUFFED_HEAD] =
+        bulge(mesh, head, limbs, p[NECK], crown, 0.6f, 0.0f);
+    mesh.morph_targets[FIGURE_DEEP_BREATH] =
+        bulge(mesh, chest, head, p[CHEST], p[NECK], 0.2f, 0.5f);
+    for (int side = 0; side < 2; ++side) {
+        int shoulder = side == 0 ? LEFT_SHOULDER : RIGHT_SHOULDER;
+        int elbow = shoulder + 1;
+        int hip = side == 0 ? LEFT_HIP : RIGHT_HIP;
+        int knee = hip + 1;
+        add_tube(mesh, skeleton, shoulder, p[shoulder], p[elbow], 0.03f, shirt);
+        add_tube(
+            mesh, skeleton, elbow, p[elbow], p[elbow] + down * 0.16f, 0.025f, skin);
+        add_tube(mesh, skeleton, hip, p[hip], p[knee], 0.04f, trousers);
+        add_tube(
+            mesh, skeleton, knee, p[knee], p[knee] + down * 0.26f, 0.035f, trousers);
+    }
+    return mesh;
+}
+
+auto figure_walk(const Skeleton& skeleton) -> Clip {
+    return make_clip(skeleton, 30, [](float phase, std::vector<Transform>& joints) {
+        Vec3 x_axis {1.0f, 0.0f, 0.0f};
+        float swing = std::sin(phase);
+        joints[PELVIS].translation.y += 0.015f * std::cos(2.0f * phase);
+        joints[CHEST].rotation = axis_angle({0.0f, 1.0f, 0.0f}, 0.1f * swing);
+        joints[LEFT_HIP].rotation = axis_angle(x_axis, 0.5f * swing);
+        joints[RIGHT_HIP].rotation = axis_angle(x_axis, -0.5f * swing);
+        joints[LEFT_KNEE].rotation =
+            axis_angle(x_axis, 0.6f * std::max(0.0f, std::sin(phase + 0.5f)));
+        joints[RIGHT_KNEE].rotation =
+            axis_angle(x_axis, 0.6f * std::max(0.0f, -std::sin(phase + 0.5f)));
+        joints[LEFT_SHOULDER].rotation = axis_angle(x_axis, -0.4f * swing);
+        joints[RIGHT_SHOULDER].rotation = axis_angle(x_axis, 0.4f * swing);
+        joints[LEFT_ELBOW].rotation = axis_angle(x_axis, -0.3f);
+        joints[RIGHT_ELBOW].rotation = axis_angle(x_axis, -0.3f);
+    });
+}
+
+auto figure_wave(const Skeleton& skeleton) -> Clip {
+    return make_clip(skeleton, 30, [](float phase, std::vector<Transform>& joints) {
+        Vec3 z_axis {0.0f, 0.0f, 1.0f};
+        joints[PELVIS].translation.y += 0.005f * std::cos(phase);
+        joints[CHEST].rotation = axis_angle(z_axis, 0.05f * std::sin(phase));
+        joints[RIGHT_SHOULDER].rotation = axis_angle(z_axis, -2.5f);
+        joints[RIGHT_ELBOW].rotation =
+            axis_angle(z_axis, -0.4f - 0.4f * std::sin(2.0f * phase));
+        joints[LEFT_SHOULDER].rotation = axis_angle(z_axis, 0.1f);
+    });
+}
+
+auto Crowd::init(const Skeleton& skeleton,
+                 const SkinnedMesh& mesh,
+                 const CompressedClip& first,
+                 const CompressedClip& second,
+                 int capacity) -> bool {
+    if (skeleton.joint_count() == 0 || skeleton.joint_count() > MAX_JOINTS) {
+        spdlog::error("Skeletons need 1 to {} joints, not {}",
+                      MAX_JOINTS,
+                      skeleton.joint_count());
+        return false;
+    }
+    if (mesh.vertices.size() > 65536) {
+        spdlog::error("Skinned meshes are limited to 16-bit indices");
+        return false;
+    }
+    for (const MorphTarget& target : mesh.morph_targets) {
+        if (target.deltas.size() != target.vertices.size() ||
+            std::any_of(target.vertices.begin(),
+                        target.vertices.end(),
+                        [&](uint16_t v) { return v >= mesh.vertices.size(); })) {
+            spdlog::error("Morph targets need a delta per vertex of the mesh");
+            return false;
+        }
+    }
+    skeleton_ = skeleton;
+    clips_[0] = first;
+    clips_[1] = second;
+    palette_stride_ = skeleton_.joint_count() * 3 + MORPH_TEXELS;
+    capacity_ = std::max(capacity, 0);
+    index_count_ = static_cast<int>(mesh.indices.size());
+
+    glGenVertexArrays(1, &VAO_);
+    glGenBuffers(1, &VBO_);
+    glGenBuffers(1, &EBO_);
+    glBindVertexArray(VAO_);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_);
+    glBufferData(GL_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(mesh.vertices.size() * sizeof(SkinnedVertex)),
+                 mesh.vertices.data(),
+                 GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(mesh.indices.size() * sizeof(uint16_t)),
+                 mesh.indices.data(),
+                 GL_STATIC_DRAW);
+    auto stride = static_cast<GLsizei>(sizeof(SkinnedVertex));
+    glVertexAttribPointer(0,
+                          3,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          stride,
+                          (void*)offsetof(SkinnedVertex, position)); // NOLINT
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1,
+                          4,
+                          GL_UNSIGNED_BYTE,
+                          GL_TRUE,
+                          stride,
+                          (void*)offsetof(SkinnedVertex, color)); // NOLINT
+    glEnableVertexAttribArray(1);
+    // Integer attributes keep the joint indices exact.
+    glVertexAttribIPointer(2,
+                           4,
+                           GL_UNSIGNED_BYTE,
+                           stride,
+                           (void*)offsetof(SkinnedVertex, joints)); // NOLINT
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(3,
+                          4,
+                          GL_UNSIGNED_BYTE,
+                          GL_TRUE,
+                          stride,
+                          (void*)offsetof(SkinnedVertex, weights)); // NOLINT
+    glEnableVertexAttribArray(3);
+    glBindVertexArray(0);
+
+    size_t segment_bytes = static_cast<size_t>(capacity_) *
+                           static_cast<size_t>(palette_stride_) * sizeof(Vec4);
+    glGenBuffers(1, &palette_buffer_);
+    glBindBuffer(GL_TEXTURE_BUFFER, palette_buffer_);
+    glBufferData(GL_TEXTURE_BUFFER,
+                 static_cast<GLsizeiptr>(
+                     std::max<size_t>(segment_bytes * RING_SIZE, 16)),
+                 nullptr,
+                 GL_STREAM_DRAW);
+    glGenTextures(1, &palette_texture_);
+    glBindTexture(GL_TEXTURE_BUFFER, palette_texture_);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, palette_buffer_);
+
+    // Regroup the deltas by vertex: a range of every vertex's deltas, and the
+    // deltas with their target in w.
+    std::vector<uint32_t> ranges(mesh.vertices.size() * 2, 0);
+    for (const MorphTarget& target : mesh.morph_targets) {
+        for (uint16_t v : target.vertices) {
+            ++ranges[v * 2 + 1];
+        }
+    }
+    uint32_t offset = 0;
+    for (size_t v = 0; v < mesh.vertices.size(); ++v) {
+        ranges[v * 2] = offset;
+        offset += ranges[v * 2 + 1];
+    }
+    std::vector<Vec4> deltas(offset);
+    std::vector<uint32_t> filled(mesh.vertices.size(), 0);
+    for (size_t t = 0; t < mesh.morph_targets.size(); ++t) {
+        const MorphTarget& target = mesh.morph_targets[t];
+        for (size_t i = 0; i < target.vertices.size(); ++i) {
+            uint16_t v = target.vertices[i];
+            const Vec3& delta = target.deltas[i];
+            deltas[ranges[v * 2] + filled[v]++] = {
+                delta.x, delta.y, delta.z, static_cast<float>(t)};
+        }
+    }
+    stats_.morph_deltas = static_cast<int>(deltas.size());
+    glGenBuffers(1, &morph_range_buffer_);
+    glBindBuffer(GL_TEXTURE_BUFFER, morph_range_buffer_);
+    glBufferData(GL_TEXTURE_BUFFER,
+                 static_cast<GLsizeiptr>(ranges.size() * sizeof(uint32_t)),
+                 ranges.data(),
+                 GL_STATIC_DRAW);
+    glGenTextures(1, &morph_range_texture_);
+    glBindTexture(GL_TEXTURE_BUFFER, morph_range_texture_);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, morph_range_buffer_);
+    glGenBuffers(1, &morph_delta_buffer_);
+    glBindBuffer(GL_TEXTURE_BUFFER, morph_delta_buffer_);
+    // Never empty, so the texture always has storage.
+    deltas.resize(std::max<size_t>(deltas.size(), 1));
+    glBufferData(GL_TEXTURE_BUFFER,
+                 static_cast<GLsizeiptr>(deltas.size() * sizeof(Vec4)),
+                 deltas.data(),
+                 GL_STATIC_DRAW);
+    glGenTextures(1, &morph_delta_texture_);
+    glBindTexture(GL_TEXTURE_BUFFER, morph_delta_texture_);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, morph_delta_buffer_);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    return true;
+}
+
+void Crowd::shutdown() {
+    for (void*& fence : fences_) {
+        if (fence != nullptr) {
+            glDeleteSync(static_cast<GLsync>(fence));
+            fence = nullptr;
+        }
+    }
+    glDeleteTextures(1, &morph_delta_texture_);
+    glDeleteBuffers(1, &morph_delta_buffer_);
+    glDeleteTextures(1, &morph_range_texture_);
+    glDeleteBuffers(1, &morph_range_buffer_);
+    glDeleteTextures(1, &palette_texture_);
+    glDeleteBuffers(1, &palette_buffer_);
+    glDeleteBuffers(1, &EBO_);
+    glDeleteBuffers(1, &VBO_);
+    glDeleteVertexArrays(1, &VAO_);
+    morph_delta_texture_ = morph_delta_buffer_ = 0;
+    morph_range_texture_ = morph_range_buffer_ = 0;
+    palette_texture_ = palette_buffer_ = EBO_ = VBO_ = VAO_ = 0;
+    count_ = 0;
+}
+
+auto Crowd::vertex_shader_source() -> const char* {
+    return shaders::skinning_vertex_src;
+}
+
+void Crowd::update(const std::vector<Character>& characters) {
+    auto start = std::chrono::steady_clock::now();
+
+    // Everything reading the current segment has been issued by now. The next one
+    // was last read RING_SIZE frames ago; its fence only blocks when the GPU is
+    // that far behind.
+    if (fences_[segment_] != nullptr) {
+        glDeleteSync(static_cast<GLsync>(fences_[segment_]));
+    }
+    fences_[segment_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    segment_ = (segment_ + 1) % RING_SIZE;
+    if (fences_[segment_] != nullptr) {
+        auto fence = static_cast<GLsync>(fences_[segment_]);
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        glDeleteSync(fence);
+        fences_[segment_] = nullptr;
+    }
+
+    count_ = std::min(static_cast<int>(characters.size()), capacity_);
+    auto texels = static_cast<size_t>(palette_stride_);
+    Vec4* palettes = nullptr;
+    if (count_ > 0) {
+        size_t segment_bytes = static_cast<size_t>(capacity_) * texels * sizeof(Vec4);
+        glBindBuffer(GL_TEXTURE_BUFFER, palette_buffer_);
+        // The fence already did the synchronization.
+        palettes = static_cast<Vec4*>(glMapBufferRange(
+            GL_TEXTURE_BUFFER,
+            static_cast<GLintptr>(segment_bytes * static_cast<size_t>(segment_)),
+            static_cast<GLsizeiptr>(static_cast<size_t>(count_) * texels *
+                                    sizeof(Vec4)),
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                GL_MAP_UNSYNCHRONIZED_BIT));
+        if (palettes == nullptr) {
+            count_ = 0;
+        }
+    }
+
+    if (count_ > 0) {
+        size_t tasks = (static_cast<size_t>(count_) + CHARACTER_GRAIN - 1) /
+                       CHARACTER_GRAIN;
+        if (scratch_.size() < tasks * 3) {
+            scratch_.resize(tasks * 3);
+            for (Pose& pose : scratch_) {
+                pose.resize(skeleton_.joint_count());
+            }
+        }
+        jobs::parallel_for(
+            0,
+            static_cast<size_t>(count_),
+            CHARACTER_GRAIN,
+            [&](size_t first, size_t last) {
+                Pose* poses = &scratch_[first / CHARACTER_GRAIN * 3];
+                for (size_t i = first; i < last; ++i) {
+                    const Character& character = characters[i];
+                    sample(clips_[0], character.time, poses[0]);
+                    sample(clips_[1], character.time, poses[1]);
+                    blend(poses[0], poses[1], character.blend, poses[2]);
+                    float c = std::cos(character.heading) * character.scale;
+                    float s = std::sin(character.heading) * character.scale;
+                    Mat4 world = translate(character.position);
+                    world(0, 0) = c;
+                    world(0, 2) = s;
+                    world(1, 1) = character.scale;
+                    world(2, 0) = -s;
+                    world(2, 2) = c;
+                    Vec4* palette = palettes + i * texels;
+                    skinning_palette(skeleton_, poses[2], world, palette);
+                    const int* targets = character.morph_targets;
+                    const float* weights = character.morph_weights;
+                    palette[texels - 2] = {static_cast<float>(targets[0]),
+                                           static_cast<float>(targets[1]),
+                                           static_cast<float>(targets[2]),
+                                           static_cast<float>(targets[3])};
+                    palette[texels - 1] = {
+                        weights[0], weights[1], weights[2], weights[3]};
+                }
+            });
+        glUnmapBuffer(GL_TEXTURE_BUFFER);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    stats_.characters = count_;
+    stats_.joints = count_ * skeleton_.joint_count();
+    stats_.update_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                  start)
+            .count();
+}
+
+void Crowd::draw(unsigned int program, int unit) const {
+    if (count_ == 0) {
+        return;
+    }
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(unit));
+    glBindTexture(GL_TEXTURE_BUFFER, palette_texture_);
+    glUniform1i(glGetUniformLocation(program, "uPalette"), unit);
+    glUniform1i(glGetUniformLocation(program, "uPaletteOffset"),
+                segment_ * capacity_ * palette_stride_);
+    glUniform1i(glGetUniformLocation(program, "uJointCount"), skeleton_.joint_count());
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(unit + 1));
+    glBindTexture(GL_TEXTURE_BUFFER, morph_range_texture_);
+    glUniform1i(glGetUniformLocation(program, "uMorphRanges"), unit + 1);
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(unit + 2));
+    glBindTexture(GL_TEXTURE_BUFFER, morph_delta_texture_);
+    glUniform1i(glGetUniformLocation(program, "uMorphDeltas"), unit + 2);
+    glBindVertexArray(VAO_);
+    glDrawElementsInstanced(
+        GL_TRIANGLES, index_count_, GL_UNSIGNED_SHORT, nullptr, count_);
+    glBindVertexArray(0);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+auto BakedCrowd::init(const Skeleton& skeleton,
+                      const SkinnedMesh& mesh,
+                      const CompressedClip& first,
+                      const CompressedClip& second,
+                      int capacity) -> bool {
+    if (skeleton.joint_count() == 0 || skeleton.joint_count() > MAX_JOINTS) {
+        spdlog::error("Skeletons need 1 to {} joints, not {}",
+                      MAX_JOINTS,
+                      skeleton.joint_count());
+        return false;
+    }
+    if (mesh.vertices.size() > 65536) {
+        spdlog::error("Skinned meshes are limited to 16-bit indices");
+        return false;
+    }
+    const CompressedClip* clips[] = {&first, &second};
+    int rows = 0;
+    for (int clip = 0; clip < 2; ++clip) {
+        if (clips[clip]->frame_count == 0) {
+            spdlog::error("Baked clips need at least one frame");
+            return false;
+        }
+        first_rows_[clip] = rows;
+        frame_counts_[clip] = clips[clip]->frame_count;
+        frame_rates_[clip] = clips[clip]->frame_rate;
+        rows += frame_counts_[clip] + 1;
+    }
+    auto width = static_cast<int>(mesh.vertices.size());
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if (width > max_size || rows > max_size) {
+        spdlog::error("A vertex animation texture of {}x{} exceeds the limit of {}",
+                      width,
+                      rows,
+                      max_size);
+        return false;
+    }
+    capacity_ = std::max(capacity, 0);
+    index_count_ = static_cast<int>(mesh.indices.size());
+
+    // Skin every frame on the CPU, a row of the texture per frame.
+    std::vector<Vec4> positions(static_cast<size_t>(width) *
+                                static_cast<size_t>(rows));
+    jobs::parallel_for(
+        0, static_cast<size_t>(rows), 1, [&](size_t first_row, size_t last_row) {
+            Pose pose;
+            pose.resize(skeleton.joint_count());
+            std::vector<Vec4> palette(static_cast<size_t>(skeleton.joint_count()) * 3);
+            for (size_t row = first_row; row < last_row; ++row) {
+                int clip = static_cast<int>(row) >= first_rows_[1] ? 1 : 0;
+                int frame = (static_cast<int>(row) - first_rows_[clip]) %
+                            frame_counts_[clip];
+                sample(*clips[clip],
+                       static_cast<float>(frame) / frame_rates_[clip],
+                       pose);
+                skinning_palette(skeleton, pose, Mat4 {}, palette.data());
+                Vec4* texels = &positions[row * static_cast<size_t>(width)];
+                for (size_t v = 0; v < mesh.vertices.size(); ++v) {
+                    const SkinnedVertex& vertex = mesh.vertices[v];
+                    float p[4] = {vertex.position[0],
+                                  vertex.position[1],
+                                  vertex.position[2],
+                                  1.0f};
+                    float skinned[3] = {};
+                    for (int i = 0; i < 4; ++i) {
+                        float weight = static_cast<float>(vertex.weights[i]) / 255.0f;
+                        const Vec4* matrix = &palette[vertex.joints[i] * 3];
+                        for (int r = 0; r < 3; ++r) {
+                            skinned[r] += weight * (matrix[r].x * p[0] +
+                                                    matrix[r].y * p[1] +
+                                                    matrix[r].z * p[2] + matrix[r].w);
+                        }
+                    }
+                    texels[v] = {skinned[0], skinned[1], skinned[2], 1.0f};
+                }
+            }
+        });
+    glGenTextures(1, &positions_);
+    glBindTexture(GL_TEXTURE_2D, positions_);
+    glTexImage2D(GL_TEXTURE_2D,
+                 0,
+                 GL_RGBA16F,
+                 width,
+                 rows,
+                 0,
+                 GL_RGBA,
+                 GL_FLOAT,
+                 positions.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    stats_.texture_bytes = positions.size() * 4 * sizeof(uint16_t);
+
+    // Only the color is left of the vertex, the texture has the positions.
+    glGenVertexArrays(1, &VAO_);
+    glGenBuffers(1, &VBO_);
+    glGenBuffers(1, &EBO_);
+    glGenBuffers(1, &instance_buffer_);
+    glBindVertexArray(VAO_);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_);
+    glBufferData(GL_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(mesh.vertices.size() * sizeof(SkinnedVertex)),
+                 mesh.vertices.data(),
+                 GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO_);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(mesh.indices.size() * sizeof(uint16_t)),
+                 mesh.indices.data(),
+                 GL_STATIC_DRAW);
+    glVertexAttribPointer(1,
+                          4,
+                          GL_UNSIGNED_BYTE,
+                          GL_TRUE,
+                          sizeof(SkinnedVertex),
+                          (void*)offsetof(SkinnedVertex, color)); // NOLINT
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ARRAY_BUFFER, instance_buffer_);
+    glBufferData(GL_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(
+                     std::max<size_t>(static_cast<size_t>(capacity_), 1) *
+                     sizeof(BakedInstance)),
+                 nullptr,
+                 GL_STREAM_DRAW);
+    glVertexAttribPointer(4,
+                          4,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(BakedInstance),
+                          (void*)offsetof(BakedInstance, placement)); // NOLINT
+    glEnableVertexAttribArray(4);
+    glVertexAttribDivisor(4, 1);
+    glVertexAttribPointer(5,
+                          4,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          sizeof(BakedInstance),
+                          (void*)offsetof(BakedInstance, animation)); // NOLINT
+    glEnableVertexAttribArray(5);
+    glVertexAttribDivisor(5, 1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return true;
+}
+
+void BakedCrowd::shutdown() {
+    glDeleteTextures(1, &positions_);
+    glDeleteBuffers(1, &instance_buffer_);
+    glDeleteBuffers(1, &EBO_);
+    glDeleteBuffers(1, &VBO_);
+    glDeleteVertexArrays(1, &VAO_);
+    positions_ = instance_buffer_ = EBO_ = VBO_ = VAO_ = 0;
+    count_ = 0;
+}
+
+auto BakedCrowd::vertex_shader_source() -> const char* {
+    return shaders::baked_vertex_src;
+}
+
+void BakedCrowd::update(const std::vector<Character>& characters) {
+    auto start = std::chrono::steady_clock::now();
+    count_ = std::min(static_cast<int>(characters.size()), capacity_);
+    if (count_ > 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, instance_buffer_);
+        // Invalidating the whole buffer lets the driver hand out fresh memory
+        // instead of waiting for last frame's draw.
+        auto* instances = static_cast<BakedInstance*>(glMapBufferRange(
+            GL_ARRAY_BUFFER,
+            0,
+            static_cast<GLsizeiptr>(static_cast<size_t>(count_) *
+                                    sizeof(BakedInstance)),
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (instances != nullptr) {
+            for (size_t i = 0; i < static_cast<size_t>(count_); ++i) {
+                const Character& character = characters[i];
+                instances[i] = {{character.position.x,
+                                 character.position.y,
+                                 character.position.z,
+                                 character.heading},
+                                {character.scale,
+                                 character.time,
+                                 character.blend,
+                                 0.0f}};
+            }
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        } else {
+            count_ = 0;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    stats_.characters = count_;
+    stats_.update_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                  start)
+            .count();
+}
+
+void BakedCrowd::draw(unsigned int program, int unit) const {
+    if (count_ == 0) {
+        return;
+    }
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(unit));
+    glBindTexture(GL_TEXTURE_2D, positions_);
+    glUniform1i(glGetUniformLocation(program, "uPositions"), unit);
+    glUniform1iv(glGetUniformLocation(program, "uFirstRow"), 2, first_rows_);
+    glUniform1iv(glGetUniformLocation(program, "uFrameCount"), 2, frame_counts_);
+    glUniform1fv(glGetUniformLocation(program, "uFrameRate"), 2, frame_rates_);
+    glBindVertexArray(VAO_);
+    glDrawElementsInstanced(
+        GL_TRIANGLES, index_count_, GL_UNSIGNED_SHORT, nullptr, count_);
+    glBindVertexArray(0);
+    glActiveTexture(GL_TEXTURE0);
+}
+} // namespace animation
@@ -0,0 +1,255 @@
+#include "debug_draw.H"
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+#include <imgui.h>
+#include <spdlog/spdlog.h>
+
+#include "debug_draw_shader.H"
+#include "shader.H"
+
+namespace {
+struct Vertex {
+    Vec3 position;
+    uint32_t color;
+};
+
+struct Label {
+    Vec3 position;
+    uint32_t color;
+    std::string text;
+};
+
+// One buffer per recording thread. Buffers are pushed onto an intrusive lock-free
+// list the first time a thread records something and live until shutdown(), even if
+// their thread exits, because the render thread may still have to drain them.
+// shutdown() frees the buffers of every thread but can only forget its own, so it
+// bumps the generation: a thread whose buffer is of an older one starts a new one.
+struct ThreadBuffer {
+    std::vector<Vertex> lines[2]; // [0] depth tested, [1] overlay
+    std::vector<Label> labels;
+    ThreadBuffer* next = nullptr;
+};
+
+std::atomic<ThreadBuffer*> buffers_head {nullptr};
+std::atomic<uint32_t> generation {0};
+thread_local ThreadBuffer* local_buffer = nullptr;
+thread_local uint32_t local_generation = 0;
+
+unsigned int program = 0;
+int view_proj_location = -1;
+unsigned int VAO = 0;
+unsigned int VBO = 0;
+size_t vbo_capacity = 0; // in vertices
+
+auto thread_buffer() -> ThreadBuffer& {
+    uint32_t current = generation.load(std::memory_order_acquire);
+    if (local_buffer == nullptr || local_generation != current) {
+        auto* buffer = new ThreadBuffer;
+        buffer->next = buffers_head.load(std::memory_order_relaxed);
+        while (!buffers_head.compare_exchange_weak(buffer->next,
+                                                   buffer,
+                                                   std::memory_order_release,
+                                                   std::memory_order_relaxed)) {
+        }
+        local_buffer = buffer;
+        local_generation = current;
+    }
+    return *local_buffer;
+}
+} // namespace
+
+namespace debug_draw {
+auto init() -> bool {
+    spdlog::info("Initializing debug draw");
+    program = link_program(shaders::debug_draw_vertex_src,
+                           shaders::debug_draw_fragment_src);
+    if (program == 0) {
+        return false;
+    }
+    view_proj_location = glGetUniformLocation(program, "uViewProj");
+
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1,
+                          4,
+                          GL_UNSIGNED_BYTE,
+                          GL_TRUE,
+                          sizeof(Vertex),
+                          (void*)offsetof(Vertex, color)); // NOLINT
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+    return true;
+}
+
+void shutdown() {
+    glDeleteVertexArrays(1, &VAO);
+    glDeleteBuffers(1, &VBO);
+    glDeleteProgram(program);
+    VAO = VBO = program = 0;
+    vbo_capacity = 0;
+
+    ThreadBuffer* buffer = buffers_head.exchange(nullptr, std::memory_order_acquire);
+    while (buffer != nullptr) {
+        ThreadBuffer* next = buffer->next;
+        delete buffer;
+        buffer = next;
+    }
+    generation.fetch_add(1, std::memory_order_release);
+    local_buffer = nullptr;
+}
+
+void line(const Vec3& a, const Vec3& b, uint32_t color, bool depth_test) {
+    auto& lines = thread_buffer().lines[depth_test ? 0 : 1];
+    lines.push_back({a, color});
+    lines.push_back({b, color});
+}
+
+void aabb(const Vec3& min, const Vec3& max, uint32_t color, bool depth_test) {
+    Vec3 c[8];
+    for (int i = 0; i < 8; ++i) {
+        c[i] = {(i & 1) != 0 ? max.x : min.x,
+                (i & 2) != 0 ? max.y : min.y,
+                (i & 4) != 0 ? max.z : min.z};
+    }
+    // Corners are indexed by their (x, y, z) bits, so two corners share an edge when
+    // their indices differ in exactly one bit.
+    for (int i = 0; i < 8; ++i) {
+        for (int bit = 1; bit < 8; bit <<= 1) {
+            if ((i & bit) == 0) {
+                line(c[i], c[i | bit], color, depth_test);
+            }
+        }
+    }
+}
+
+void frustum(const Mat4& view_proj, uint32_t color, bool depth_test) {
+    // Unproject the corners of the NDC cube, indexed the same way as in aabb().
+    Mat4 inv = inverse(view_proj);
+    Vec3 c[8];
+    for (int i = 0; i < 8; ++i) {
+        c[i] = transform_point(inv,
+                               {(i & 1) != 0 ? 1.0f : -1.0f,
+                                (i & 2) != 0 ? 1.0f : -1.0f,
+                                (i & 4) != 0 ? 1.0f : -1.0f});
+    }
+    for (int i = 0; i < 8; ++i) {
+        for (int bit = 1; bit < 8; bit <<= 1) {
+            if ((i & bit) == 0) {
+                line(c[i], c[i | bit], color, depth_test);
+            }
+        }
+    }
+}
+
+void sphere(const Vec3& center,
+            float radius,
+            uint32_t color,
+            bool depth_test,
+            int segments) {
+    // Three great circles, one per axis plane.
+    float step = 6.28318530718f / static_cast<float>(segments);
+    for (int i = 0; i < segments; ++i) {
+        float a0 = step * static_cast<float>(i);
+        float a1 = step * static_cast<float>(i + 1);
+        float c0 = std::cos(a0) * radius, s0 = std::sin(a0) * radius;
+        float c1 = std::cos(a1) * radius, s1 = std::sin(a1) * radius;
+        line(center + Vec3 {c0, s0, 0}, center + Vec3 {c1, s1, 0}, color, depth_test);
+        line(center + Vec3 {c0, 0, s0}, center + Vec3 {c1, 0, s1}, color, depth_test);
+        line(center + Vec3 {0, c0, s0}, center + Vec3 {0, c1, s1}, color, depth_test);
+    }
+}
+
+void text(const Vec3& position, std::string_view text, uint32_t color) {
+    thread_buffer().labels.push_back({position, color, std::string(text)});
+}
+
+void flush(const Mat4& view_proj) {
+    ThreadBuffer* head = buffers_head.load(std::memory_order_acquire);
+
+    size_t counts[2] = {0, 0};
+    for (ThreadBuffer* b = head; b != nullptr; b = b->next) {
+        counts[0] += b->lines[0].size();
+        counts[1] += b->lines[1].size();
+    }
+    size_t total = counts[0] + counts[1];
+
+    if (total > 0 && program != 0) {
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        if (total > vbo_capacity) {
+            while (vbo_capacity < total) {
+                vbo_capacity = vbo_capacity == 0 ? 4096 : vbo_capacity * 2;
+            }
+            glBufferData(GL_ARRAY_BUFFER,
+                         static_cast<GLsizeiptr>(vbo_capacity * sizeof(Vertex)),
+                         nullptr,
+                         GL_STREAM_DRAW);
+        }
+
+        // Invalidating the whole buffer lets the driver hand us fresh memory instead
+        // of waiting for last frame's draw to finish reading it.
+        auto* dst = static_cast<Vertex*>(
+            glMapBufferRange(GL_ARRAY_BUFFER,
+                             0,
+                             static_cast<GLsizeiptr>(total * sizeof(Vertex)),
+                             GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (dst != nullptr) {
+            size_t offset = 0;
+            for (int list = 0; list < 2; ++list) {
+                for (ThreadBuffer* b = head; b != nullptr; b = b->next) {
+                    const auto& lines = b->lines[list];
+                    std::memcpy(
+                        dst + offset, lines.data(), lines.size() * sizeof(Vertex));
+                    offset += lines.size();
+                }
+            }
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+
+            GLboolean depth_was_enabled = glIsEnabled(GL_DEPTH_TEST);
+            glUseProgram(program);
+            glUniformMatrix4fv(view_proj_location, 1, GL_FALSE, view_proj.m);
+
+            glEnable(GL_DEPTH_TEST);
+            glDrawArrays(GL_LINES, 0, static_cast<GLsizei>(counts[0]));
+            glDisable(GL_DEPTH_TEST);
+            glDrawArrays(GL_LINES,
+                         static_cast<GLint>(counts[0]),
+                         static_cast<GLsizei>(counts[1]));
+            if (depth_was_enabled == GL_TRUE) {
+                glEnable(GL_DEPTH_TEST);
+            }
+        }
+        glBindVertexArray(0);
+    }
+
+    // Labels are projected here and drawn as part of the ImGui pass.
+    ImDrawList* draw_list = ImGui::GetForegroundDrawList();
+    ImVec2 display = ImGui::GetIO().DisplaySize;
+    for (ThreadBuffer* b = head; b != nullptr; b = b->next) {
+        for (const Label& label : b->labels) {
+            Vec4 clip = view_proj * Vec4 {
+                label.position.x, label.position.y, label.position.z, 1.0f};
+            if (clip.w <= 0.0f) {
+                continue;
+            }
+            float x = (clip.x / clip.w * 0.5f + 0.5f) * display.x;
+            float y = (0.5f - clip.y / clip.w * 0.5f) * display.y;
+            draw_list->AddText(ImVec2(x, y), label.color, label.text.c_str());
+        }
+        b->lines[0].clear();
+        b->lines[1].clear();
+        b->labels.clear();
+    }
+}
+} // namespace debug_draw
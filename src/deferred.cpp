@@ -0,0 +1,131 @@
+#include "deferred.H"
+
+#include <string>
+
+#include <glad/glad.h>
+
+#include "deferred_shader.H"
+#include "shader.H"
+
+namespace {
+auto constexpr ALBEDO_FORMAT = GL_RGBA8;
+auto constexpr NORMAL_FORMAT = GL_RGB10_A2;
+auto constexpr DEPTH_FORMAT = GL_DEPTH24_STENCIL8;
+auto constexpr LIGHT_FORMAT = GL_RGBA16F;
+
+// Texture units of the G-buffer; the light buffers, shadow maps and environment
+// follow them.
+enum Unit {
+    ALBEDO_UNIT,
+    NORMAL_UNIT,
+    DEPTH_UNIT,
+    LIGHTS_UNIT,
+    SHADOW_UNIT = LIGHTS_UNIT + 3,
+    ATLAS_UNIT,
+    ENVIRONMENT_UNIT = ATLAS_UNIT + 2
+};
+} // namespace
+
+namespace deferred {
+auto DeferredShading::init() -> bool {
+    // The lighting functions are shared with the forward path.
+    std::string fragment_src = std::string(shaders::deferred_lighting_fragment_src) +
+                               lighting::ClusteredLighting::shader_source() +
+                               shadows::CascadedShadowMaps::shader_source() +
+                               shadows::ShadowAtlas::shader_source() +
+                               ibl::ImageBasedLighting::shader_source();
+    program_ = link_program(shaders::deferred_vertex_src, fragment_src.c_str());
+    if (program_ == 0) {
+        return false;
+    }
+    glUseProgram(program_);
+    glUniform1i(glGetUniformLocation(program_, "uAlbedo"), ALBEDO_UNIT);
+    glUniform1i(glGetUniformLocation(program_, "uNormal"), NORMAL_UNIT);
+    glUniform1i(glGetUniformLocation(program_, "uDepth"), DEPTH_UNIT);
+    glUseProgram(0);
+    glGenVertexArrays(1, &VAO_);
+    timer_.init();
+    return true;
+}
+
+void DeferredShading::shutdown() {
+    timer_.shutdown();
+    glDeleteVertexArrays(1, &VAO_);
+    glDeleteProgram(program_);
+    VAO_ = program_ = 0;
+}
+
+auto DeferredShading::gbuffer_source() -> const char* {
+    return shaders::gbuffer_src;
+}
+
+auto DeferredShading::create_gbuffer(RenderGraph::PassBuilder& builder,
+                                     int width,
+                                     int height) -> GBuffer {
+    GBuffer gbuffer;
+    gbuffer.albedo = builder.create("gbuffer_albedo", {width, height, ALBEDO_FORMAT});
+    gbuffer.normal = builder.create("gbuffer_normal", {width, height, NORMAL_FORMAT});
+    gbuffer.depth = builder.create("scene_depth", {width, height, DEPTH_FORMAT});
+    return gbuffer;
+}
+
+auto DeferredShading::add_lighting_pass(RenderGraph& graph,
+                                        const GBuffer& gbuffer,
+                                        const lighting::ClusteredLighting& lighting,
+                                        const shadows::CascadedShadowMaps& shadow_maps,
+                                        const shadows::ShadowAtlas& shadow_atlas,
+                                        const ibl::ImageBasedLighting& environment,
+                                        const Mat4& proj,
+                                        const Vec3& background)
+    -> RenderGraph::Resource {
+    RenderGraph::TextureDesc desc = graph.desc(gbuffer.albedo);
+    desc.format = LIGHT_FORMAT;
+    Mat4 inverse_proj = inverse(proj);
+    RenderGraph::Resource result = -1;
+    graph.add_pass(
+        "deferred_lighting",
+        [&](RenderGraph::PassBuilder& builder) {
+            builder.read(gbuffer.albedo);
+            builder.read(gbuffer.normal);
+            builder.read(gbuffer.depth);
+            result = builder.create("scene_color", desc);
+        },
+        [this,
+         gbuffer,
+         &lighting,
+         &shadow_maps,
+         &shadow_atlas,
+         &environment,
+         inverse_proj,
+         background](RenderGraph::PassContext& context) {
+            timer_.begin();
+            glUseProgram(program_);
+            glUniform2i(glGetUniformLocation(program_, "uSize"),
+                        context.width,
+                        context.height);
+            glUniformMatrix4fv(glGetUniformLocation(program_, "uInverseProj"),
+                               1,
+                               GL_FALSE,
+                               inverse_proj.m);
+            glUniform3f(glGetUniformLocation(program_, "uBackground"),
+                        background.x,
+                        background.y,
+                        background.z);
+            lighting.bind(program_, LIGHTS_UNIT);
+            shadow_maps.bind(program_, SHADOW_UNIT);
+            shadow_atlas.bind(program_, ATLAS_UNIT);
+            environment.bind(program_, ENVIRONMENT_UNIT);
+            glActiveTexture(GL_TEXTURE0 + DEPTH_UNIT);
+            glBindTexture(GL_TEXTURE_2D, context.texture(gbuffer.depth));
+            glActiveTexture(GL_TEXTURE0 + NORMAL_UNIT);
+            glBindTexture(GL_TEXTURE_2D, context.texture(gbuffer.normal));
+            glActiveTexture(GL_TEXTURE0 + ALBEDO_UNIT);
+            glBindTexture(GL_TEXTURE_2D, context.texture(gbuffer.albedo));
+            glBindVertexArray(VAO_);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glBindVertexArray(0);
+            timer_.end();
+        });
+    return result;
+}
+} // namespace deferred
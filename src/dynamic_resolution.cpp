@@ -0,0 +1,26 @@
+#include "dynamic_resolution.H"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// Relative scale errors below this are left alone.
+auto constexpr DEADBAND = 0.05f;
+// Fraction of the way to the ideal scale covered per update.
+auto constexpr DROP_RATE = 0.5f;
+auto constexpr RAISE_RATE = 0.05f;
+} // namespace
+
+namespace dynamic_resolution {
+void Controller::update(double gpu_ms) {
+    if (gpu_ms <= 0.0) {
+        return;
+    }
+    auto ideal = scale_ * static_cast<float>(std::sqrt(budget_ms / gpu_ms));
+    if (std::abs(ideal / scale_ - 1.0f) < DEADBAND) {
+        return;
+    }
+    float rate = ideal < scale_ ? DROP_RATE : RAISE_RATE;
+    scale_ = std::clamp(scale_ + (ideal - scale_) * rate, min_scale, max_scale);
+}
+} // namespace dynamic_resolution
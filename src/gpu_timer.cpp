@@ -0,0 +1,64 @@
+#include "gpu_timer.H"
+
+#include <cstdint>
+
+#include <glad/glad.h>
+
+void GpuTimer::init() {
+    glGenQueries(LATENCY * 2, &queries_[0][0]);
+    for (bool& pending : pending_) {
+        pending = false;
+    }
+    next_ = 0;
+    milliseconds_ = -1.0;
+    results_ = 0;
+}
+
+void GpuTimer::shutdown() {
+    glDeleteQueries(LATENCY * 2, &queries_[0][0]);
+    for (auto& pair : queries_) {
+        pair[0] = pair[1] = 0;
+    }
+}
+
+void GpuTimer::begin() {
+    collect();
+    // All queries still in flight: skip this measurement rather than wait.
+    if (pending_[next_]) {
+        return;
+    }
+    glQueryCounter(queries_[next_][0], GL_TIMESTAMP);
+    running_ = true;
+}
+
+void GpuTimer::end() {
+    if (!running_) {
+        return;
+    }
+    glQueryCounter(queries_[next_][1], GL_TIMESTAMP);
+    pending_[next_] = true;
+    next_ = (next_ + 1) % LATENCY;
+    running_ = false;
+}
+
+void GpuTimer::collect() {
+    // Oldest first, so the last result read is the newest one.
+    for (int i = 0; i < LATENCY; ++i) {
+        int slot = (next_ + i) % LATENCY;
+        if (!pending_[slot]) {
+            continue;
+        }
+        int available = 0;
+        glGetQueryObjectiv(queries_[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available == 0) {
+            // Queries complete in order, so nothing newer is ready either.
+            return;
+        }
+        uint64_t start = 0, end = 0;
+        glGetQueryObjectui64v(queries_[slot][0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(queries_[slot][1], GL_QUERY_RESULT, &end);
+        milliseconds_ = static_cast<double>(end - start) * 1e-6;
+        results_++;
+        pending_[slot] = false;
+    }
+}
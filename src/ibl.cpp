@@ -0,0 +1,582 @@
+#include "ibl.H"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+#include "hash.H"
+#include "ibl_shader.H"
+#include "jobs.H"
+#include "shader.H"
+
+namespace {
+auto constexpr CACHE_MAGIC = 0x504C4249u; // "IBLP"
+auto constexpr CACHE_VERSION = 1u;
+auto constexpr SAMPLE_COUNT = 128;
+auto constexpr PI = 3.14159265f;
+
+// Unnormalized direction through (s, t) in [-1, 1]^2 of a cube face, the inverse of
+// the face selection in the GL specification.
+auto face_direction(int face, float s, float t) -> Vec3 {
+    switch (face) {
+        case 0:
+            return {1.0f, -t, -s};
+        case 1:
+            return {-1.0f, -t, s};
+        case 2:
+            return {s, 1.0f, t};
+        case 3:
+            return {s, -1.0f, -t};
+        case 4:
+            return {s, -t, 1.0f};
+        default:
+            return {-s, -t, -1.0f};
+    }
+}
+
+// Face and [0, 1]^2 face coordinates of a direction.
+auto face_coordinates(const Vec3& d, float& s, float& t) -> int {
+    float ax = std::abs(d.x), ay = std::abs(d.y), az = std::abs(d.z);
+    int face;
+    float sc, tc, ma;
+    if (ax >= ay && ax >= az) {
+        face = d.x > 0.0f ? 0 : 1;
+        sc = d.x > 0.0f ? -d.z : d.z;
+        tc = -d.y;
+        ma = ax;
+    } else if (ay >= az) {
+        face = d.y > 0.0f ? 2 : 3;
+        sc = d.x;
+        tc = d.y > 0.0f ? d.z : -d.z;
+        ma = ay;
+    } else {
+        face = d.z > 0.0f ? 4 : 5;
+        sc = d.z > 0.0f ? d.x : -d.x;
+        tc = -d.y;
+        ma = az;
+    }
+    s = (sc / ma + 1.0f) * 0.5f;
+    t = (tc / ma + 1.0f) * 0.5f;
+    return face;
+}
+
+// Direction through the centre of texel (x, y) of a face.
+auto texel_direction(int face, int x, int y, int size) -> Vec3 {
+    float s = (static_cast<float>(x) + 0.5f) / static_cast<float>(size) * 2.0f - 1.0f;
+    float t = (static_cast<float>(y) + 0.5f) / static_cast<float>(size) * 2.0f - 1.0f;
+    return face_direction(face, s, t);
+}
+
+// Real spherical harmonics basis up to the second band, in the order the shader
+// expects.
+void sh_basis(const Vec3& d, float basis[9]) {
+    basis[0] = 0.282095f;
+    basis[1] = 0.488603f * d.y;
+    basis[2] = 0.488603f * d.z;
+    basis[3] = 0.488603f * d.x;
+    basis[4] = 1.092548f * d.x * d.y;
+    basis[5] = 1.092548f * d.y * d.z;
+    basis[6] = 0.315392f * (3.0f * d.z * d.z - 1.0f);
+    basis[7] = 1.092548f * d.x * d.z;
+    basis[8] = 0.546274f * (d.x * d.x - d.y * d.y);
+}
+
+auto radical_inverse(uint32_t bits) -> float {
+    bits = (bits << 16u) | (bits >> 16u);
+    bits = ((bits & 0x55555555u) << 1u) | ((bits & 0xAAAAAAAAu) >> 1u);
+    bits = ((bits & 0x33333333u) << 2u) | ((bits & 0xCCCCCCCCu) >> 2u);
+    bits = ((bits & 0x0F0F0F0Fu) << 4u) | ((bits & 0xF0F0F0F0u) >> 4u);
+    bits = ((bits & 0x00FF00FFu) << 8u) | ((bits & 0xFF00FF00u) >> 8u);
+    return static_cast<float>(bits) * 2.3283064e-10f;
+}
+
+// Box filtered mip chain of a cubemap, for sampling with a footprint.
+struct MipChain {
+    std::vector<int> sizes;
+    std::vector<std::vector<float>> levels;
+
+    explicit MipChain(const ibl::Environment& environment) {
+        sizes.push_back(environment.size);
+        levels.push_back(environment.pixels);
+        while (sizes.back() > 1) {
+            int source = sizes.back();
+            int size = source / 2;
+            const std::vector<float>& from = levels.back();
+            std::vector<float> to(static_cast<size_t>(6 * size * size * 3));
+            for (int face = 0; face < 6; ++face) {
+                for (int y = 0; y < size; ++y) {
+                    for (int x = 0; x < size; ++x) {
+                        auto at = [&](int dx, int dy, int c) {
+                            int sx = x * 2 + dx, sy = y * 2 + dy;
+                            return from[static_cast<size_t>(
+                                ((face * source + sy) * source + sx) * 3 + c)];
+                        };
+                        auto texel = static_cast<size_t>((face * size + y) * size + x);
+                        for (int c = 0; c < 3; ++c) {
+                            float sum =
+                                at(0, 0, c) + at(1, 0, c) + at(0, 1, c) + at(1, 1, c);
+                            to[texel * 3 + static_cast<size_t>(c)] = sum * 0.25f;
+                        }
+                    }
+                }
+            }
+            sizes.push_back(size);
+            levels.push_back(std::move(to));
+        }
+    }
+
+    // Bilinear within the face, clamped at its edges.
+    auto sample(int level, const Vec3& direction) const -> Vec3 {
+        float s, t;
+        int face = face_coordinates(direction, s, t);
+        int size = sizes[static_cast<size_t>(level)];
+        const std::vector<float>& pixels = levels[static_cast<size_t>(level)];
+        float fx = std::clamp(s * static_cast<float>(size) - 0.5f,
+                              0.0f,
+                              static_cast<float>(size - 1));
+        float fy = std::clamp(t * static_cast<float>(size) - 0.5f,
+                              0.0f,
+                              static_cast<float>(size - 1));
+        int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+        int x1 = std::min(x0 + 1, size - 1), y1 = std::min(y0 + 1, size - 1);
+        float wx = fx - static_cast<float>(x0), wy = fy - static_cast<float>(y0);
+        auto texel = [&](int x, int y) {
+            const float* p =
+                &pixels[static_cast<size_t>(((face * size + y) * size + x) * 3)];
+            return Vec3 {p[0], p[1], p[2]};
+        };
+        Vec3 top = texel(x0, y0) * (1.0f - wx) + texel(x1, y0) * wx;
+        Vec3 bottom = texel(x0, y1) * (1.0f - wx) + texel(x1, y1) * wx;
+        return top * (1.0f - wy) + bottom * wy;
+    }
+
+    // Trilinear, `lod` being relative to the top level.
+    auto sample_lod(float lod, const Vec3& direction) const -> Vec3 {
+        lod = std::clamp(lod, 0.0f, static_cast<float>(sizes.size() - 1));
+        int level = static_cast<int>(lod);
+        float blend = lod - static_cast<float>(level);
+        Vec3 result = sample(level, direction);
+        if (blend > 0.0f) {
+            result = result * (1.0f - blend) + sample(level + 1, direction) * blend;
+        }
+        return result;
+    }
+};
+
+// A GGX importance sample for the view along the normal, in tangent space.
+struct LobeSample {
+    Vec3 direction;
+    float weight; // n.l
+    float lod;    // of the source texels covering the sample's solid angle
+};
+
+auto ggx_samples(float roughness, int source_size) -> std::vector<LobeSample> {
+    float alpha = roughness * roughness;
+    float alpha2 = alpha * alpha;
+    float texel_solid_angle =
+        4.0f * PI / (6.0f * static_cast<float>(source_size * source_size));
+    std::vector<LobeSample> samples;
+    for (int i = 0; i < SAMPLE_COUNT; ++i) {
+        float u = static_cast<float>(i) / SAMPLE_COUNT;
+        float v = radical_inverse(static_cast<uint32_t>(i));
+        float phi = 2.0f * PI * u;
+        float cos_theta = std::sqrt((1.0f - v) / (1.0f + (alpha2 - 1.0f) * v));
+        float sin_theta = std::sqrt(1.0f - cos_theta * cos_theta);
+        Vec3 h {std::cos(phi) * sin_theta, std::sin(phi) * sin_theta, cos_theta};
+        // Reflect the view, which is the normal (0, 0, 1), about h.
+        Vec3 l = h * (2.0f * cos_theta) - Vec3 {0.0f, 0.0f, 1.0f};
+        if (l.z <= 0.0f) {
+            continue;
+        }
+        // With the view along the normal the pdf of l is D / 4. Reading the level
+        // whose texels match the solid angle the sample stands for keeps a
+        // handful of samples free of fireflies (filtered importance sampling).
+        float denominator = cos_theta * cos_theta * (alpha2 - 1.0f) + 1.0f;
+        float d = alpha2 / (PI * denominator * denominator);
+        float sample_solid_angle = 1.0f / (SAMPLE_COUNT * d * 0.25f + 1e-6f);
+        float lod =
+            roughness == 0.0f
+                ? 0.0f
+                : 0.5f * std::log2(sample_solid_angle / texel_solid_angle) + 1.0f;
+        samples.push_back({l, l.z, std::max(lod, 0.0f)});
+    }
+    return samples;
+}
+
+template <typename T>
+void write(std::ofstream& file, const T* data, size_t count) {
+    file.write(reinterpret_cast<const char*>(data),
+               static_cast<std::streamsize>(count * sizeof(T)));
+}
+
+template <typename T>
+void read(std::ifstream& file, T* data, size_t count) {
+    file.read(reinterpret_cast<char*>(data),
+              static_cast<std::streamsize>(count * sizeof(T)));
+}
+} // namespace
+
+namespace ibl {
+auto procedural_sky(int size, const Vec3& sun_direction) -> Environment {
+    Environment environment;
+    environment.size = size;
+    environment.pixels.resize(static_cast<size_t>(6 * size * size * 3));
+    Vec3 to_sun = normalize(sun_direction) * -1.0f;
+    auto rows = static_cast<size_t>(6 * size);
+    jobs::parallel_for(0, rows, 8, [&](size_t first, size_t last) {
+        for (size_t row = first; row < last; ++row) {
+            int face = static_cast<int>(row) / size;
+            int y = static_cast<int>(row) % size;
+            for (int x = 0; x < size; ++x) {
+                Vec3 d = normalize(texel_direction(face, x, y, size));
+                Vec3 horizon {1.0f, 0.9f, 0.8f};
+                Vec3 zenith {0.2f, 0.4f, 0.9f};
+                Vec3 ground {0.15f, 0.13f, 0.12f};
+                float up = std::max(d.y, 0.0f);
+                Vec3 sky = horizon * (1.0f - std::sqrt(up)) + zenith * std::sqrt(up);
+                // Blend into the ground just below the horizon.
+                float above = std::clamp(d.y * 20.0f + 1.0f, 0.0f, 1.0f);
+                Vec3 color = ground * (1.0f - above) + sky * above;
+                float cos_sun = dot(d, to_sun);
+                color = color + Vec3 {1.0f, 0.85f, 0.6f} *
+                                    (0.5f * std::pow(std::max(cos_sun, 0.0f), 64.0f));
+                // A disc half a degree wide, bright enough to dominate the
+                // highlights.
+                if (cos_sun > 0.99996f) {
+                    color = color + Vec3 {1.0f, 0.95f, 0.9f} * 500.0f;
+                }
+                size_t texel = row * static_cast<size_t>(size) +
+                               static_cast<size_t>(x);
+                float* p = &environment.pixels[texel * 3];
+                p[0] = color.x;
+                p[1] = color.y;
+                p[2] = color.z;
+            }
+        }
+    });
+    return environment;
+}
+
+auto hash_environment(const Environment& environment) -> uint64_t {
+    // The size and the raw texels.
+    uint64_t hash = fnv1a(&environment.size, sizeof(environment.size));
+    return fnv1a(
+        environment.pixels.data(), environment.pixels.size() * sizeof(float), hash);
+}
+
+auto prefilter(const Environment& environment, int size, int levels) -> Prefiltered {
+    auto start = std::chrono::steady_clock::now();
+    Prefiltered result;
+    result.source_hash = hash_environment(environment);
+    result.size = size;
+    int source_size = environment.size;
+
+    // Irradiance: project the radiance onto the basis, weighting every texel by
+    // the solid angle it covers, one face row per task.
+    std::vector<std::array<float, 28>> rows(static_cast<size_t>(6 * source_size));
+    jobs::parallel_for(0, rows.size(), 16, [&](size_t first, size_t last) {
+        for (size_t row = first; row < last; ++row) {
+            std::array<float, 28>& sums = rows[row];
+            sums.fill(0.0f);
+            int face = static_cast<int>(row) / source_size;
+            int y = static_cast<int>(row) % source_size;
+            for (int x = 0; x < source_size; ++x) {
+                Vec3 d = texel_direction(face, x, y, source_size);
+                float length2 = dot(d, d);
+                float solid_angle = 1.0f / (length2 * std::sqrt(length2));
+                d = d * (1.0f / std::sqrt(length2));
+                float basis[9];
+                sh_basis(d, basis);
+                size_t texel = row * static_cast<size_t>(source_size) +
+                               static_cast<size_t>(x);
+                const float* p = &environment.pixels[texel * 3];
+                for (int i = 0; i < 9; ++i) {
+                    for (int c = 0; c < 3; ++c) {
+                        sums[static_cast<size_t>(i * 3 + c)] +=
+                            p[c] * basis[i] * solid_angle;
+                    }
+                }
+                sums[27] += solid_angle;
+            }
+        }
+    });
+    std::array<float, 28> total {};
+    for (const auto& sums : rows) {
+        for (size_t i = 0; i < total.size(); ++i) {
+            total[i] += sums[i];
+        }
+    }
+    // The weights are only proportional to the solid angles; they have to add up
+    // to the whole sphere. Convolving with the cosine lobe scales each band by
+    // pi, 2 pi / 3 and pi / 4, and the division by pi is folded in as well.
+    float normalization = 4.0f * PI / total[27];
+    for (size_t i = 0; i < 9; ++i) {
+        float band = i == 0 ? 1.0f : (i < 4 ? 2.0f / 3.0f : 0.25f);
+        float scale = normalization * band;
+        result.irradiance[i] = {
+            total[i * 3] * scale, total[i * 3 + 1] * scale, total[i * 3 + 2] * scale};
+    }
+
+    // Specular: each level convolves the source with the GGX lobe of its
+    // roughness, assuming the view along the normal as usual.
+    MipChain chain(environment);
+    while (levels > 1 && (size >> (levels - 1)) < 1) {
+        --levels;
+    }
+    result.levels.resize(static_cast<size_t>(levels));
+    for (int level = 0; level < levels; ++level) {
+        int level_size = size >> level;
+        float roughness =
+            levels > 1 ? static_cast<float>(level) / static_cast<float>(levels - 1)
+                       : 0.0f;
+        std::vector<LobeSample> samples = ggx_samples(roughness, source_size);
+        // A mirror only needs the source at the level's own resolution.
+        float mirror_lod = std::log2(static_cast<float>(source_size) /
+                                     static_cast<float>(level_size));
+        std::vector<float>& pixels = result.levels[static_cast<size_t>(level)];
+        pixels.resize(static_cast<size_t>(6 * level_size * level_size * 3));
+        jobs::parallel_for(
+            0, static_cast<size_t>(6 * level_size), 4, [&](size_t first, size_t last) {
+                for (size_t row = first; row < last; ++row) {
+                    int face = static_cast<int>(row) / level_size;
+                    int y = static_cast<int>(row) % level_size;
+                    for (int x = 0; x < level_size; ++x) {
+                        Vec3 n = normalize(texel_direction(face, x, y, level_size));
+                        Vec3 color;
+                        if (level == 0) {
+                            color = chain.sample_lod(std::max(mirror_lod, 0.0f), n);
+                        } else {
+                            Vec3 up = std::abs(n.z) < 0.999f ? Vec3 {0.0f, 0.0f, 1.0f}
+                                                             : Vec3 {1.0f, 0.0f, 0.0f};
+                            Vec3 tangent = normalize(cross(up, n));
+                            Vec3 bitangent = cross(n, tangent);
+                            float weight = 0.0f;
+                            for (const LobeSample& sample : samples) {
+                                Vec3 l = tangent * sample.direction.x +
+                                         bitangent * sample.direction.y +
+                                         n * sample.direction.z;
+                                color = color + chain.sample_lod(sample.lod, l) *
+                                                    sample.weight;
+                                weight += sample.weight;
+                            }
+                            color = color * (1.0f / weight);
+                        }
+                        size_t texel = row * static_cast<size_t>(level_size) +
+                                       static_cast<size_t>(x);
+                        float* p = &pixels[texel * 3];
+                        p[0] = color.x;
+                        p[1] = color.y;
+                        p[2] = color.z;
+                    }
+                }
+            });
+    }
+
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    spdlog::info("Prefiltered the environment in {:.1f} ms", elapsed.count());
+    return result;
+}
+
+auto save_prefiltered(const Prefiltered& prefiltered, const char* path) -> bool {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        spdlog::error("Failed to open {} for writing", path);
+        return false;
+    }
+    uint32_t header[] = {CACHE_MAGIC,
+                         CACHE_VERSION,
+                         static_cast<uint32_t>(prefiltered.size),
+                         static_cast<uint32_t>(prefiltered.levels.size())};
+    write(file, header, 4);
+    write(file, &prefiltered.source_hash, 1);
+    write(file, prefiltered.irradiance.data(), prefiltered.irradiance.size());
+    for (const std::vector<float>& level : prefiltered.levels) {
+        write(file, level.data(), level.size());
+    }
+    return static_cast<bool>(file);
+}
+
+auto load_prefiltered(const char* path, uint64_t source_hash)
+    -> std::optional<Prefiltered> {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return std::nullopt;
+    }
+    uint32_t header[4];
+    read(file, header, 4);
+    Prefiltered prefiltered;
+    read(file, &prefiltered.source_hash, 1);
+    // Every level has to be at least 1x1, the smallest a power of two.
+    uint32_t size = header[2];
+    uint32_t levels = header[3];
+    if (!file || header[0] != CACHE_MAGIC || header[1] != CACHE_VERSION ||
+        !std::has_single_bit(size) || size > (1u << 14) || levels == 0 ||
+        levels > 15 || (size >> (levels - 1)) == 0) {
+        spdlog::warn("{} is not a compatible environment cache", path);
+        return std::nullopt;
+    }
+    if (prefiltered.source_hash != source_hash) {
+        spdlog::info("{} was made from a different environment", path);
+        return std::nullopt;
+    }
+
+    // The levels have to fill the rest of the file exactly, which also keeps a
+    // corrupt header from allocating more than the file holds.
+    size_t payload = prefiltered.irradiance.size() * sizeof(Vec3);
+    for (uint32_t i = 0; i < levels; ++i) {
+        size_t level_size = size >> i;
+        payload += 6 * level_size * level_size * 3 * sizeof(float);
+    }
+    std::streamoff start = file.tellg();
+    file.seekg(0, std::ios::end);
+    std::streamoff end = file.tellg();
+    file.seekg(start);
+    if (!file || end - start != static_cast<std::streamoff>(payload)) {
+        spdlog::warn("{} is truncated", path);
+        return std::nullopt;
+    }
+
+    prefiltered.size = static_cast<int>(size);
+    read(file, prefiltered.irradiance.data(), prefiltered.irradiance.size());
+    prefiltered.levels.resize(levels);
+    for (size_t i = 0; i < prefiltered.levels.size(); ++i) {
+        auto level_size = static_cast<size_t>(size >> i);
+        prefiltered.levels[i].resize(6 * level_size * level_size * 3);
+        read(file, prefiltered.levels[i].data(), prefiltered.levels[i].size());
+    }
+    if (!file) {
+        spdlog::warn("{} is truncated", path);
+        return std::nullopt;
+    }
+    return prefiltered;
+}
+
+auto ImageBasedLighting::init(const Prefiltered& prefiltered) -> bool {
+    // Filtering across cube face edges, which GL 3.2 made core but leaves off.
+    glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+    glGenTextures(1, &cubemap_);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap_);
+    max_level_ = static_cast<int>(prefiltered.levels.size()) - 1;
+    for (int level = 0; level <= max_level_; ++level) {
+        int size = prefiltered.size >> level;
+        const std::vector<float>& pixels =
+            prefiltered.levels[static_cast<size_t>(level)];
+        for (int face = 0; face < 6; ++face) {
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + static_cast<GLenum>(face),
+                         level,
+                         GL_RGB16F,
+                         size,
+                         size,
+                         0,
+                         GL_RGB,
+                         GL_FLOAT,
+                         &pixels[static_cast<size_t>(face * size * size * 3)]);
+        }
+    }
+    glTexParameteri(
+        GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, max_level_);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    irradiance_ = prefiltered.irradiance;
+
+    // The BRDF table is integrated once per texel on the GPU.
+    unsigned int program = link_program(shaders::brdf_lut_vertex_src,
+                                        shaders::brdf_lut_fragment_src);
+    if (program == 0) {
+        shutdown();
+        return false;
+    }
+    glGenTextures(1, &brdf_lut_);
+    glBindTexture(GL_TEXTURE_2D, brdf_lut_);
+    glTexImage2D(GL_TEXTURE_2D,
+                 0,
+                 GL_RG16F,
+                 BRDF_LUT_SIZE,
+                 BRDF_LUT_SIZE,
+                 0,
+                 GL_RG,
+                 GL_FLOAT,
+                 nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    unsigned int framebuffer, vao;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(
+        GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, brdf_lut_, 0);
+    bool complete =
+        glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    if (complete) {
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        glViewport(0, 0, BRDF_LUT_SIZE, BRDF_LUT_SIZE);
+        glUseProgram(program);
+        glUniform1i(glGetUniformLocation(program, "uSize"), BRDF_LUT_SIZE);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(0);
+        glDeleteVertexArrays(1, &vao);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteProgram(program);
+    if (!complete) {
+        spdlog::error("BRDF table framebuffer is incomplete");
+        shutdown();
+        return false;
+    }
+    return true;
+}
+
+void ImageBasedLighting::shutdown() {
+    glDeleteTextures(1, &cubemap_);
+    glDeleteTextures(1, &brdf_lut_);
+    cubemap_ = brdf_lut_ = 0;
+}
+
+auto ImageBasedLighting::shader_source() -> const char* {
+    return shaders::image_based_lighting_src;
+}
+
+void ImageBasedLighting::update(const Mat4& view) {
+    // The view is rigid, so its inverse rotation is the transpose.
+    for (int column = 0; column < 3; ++column) {
+        for (int row = 0; row < 3; ++row) {
+            view_to_world_[column * 3 + row] = view(column, row);
+        }
+    }
+}
+
+void ImageBasedLighting::bind(unsigned int program, int first_unit) const {
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(first_unit));
+    glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap_);
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(first_unit + 1));
+    glBindTexture(GL_TEXTURE_2D, brdf_lut_);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(glGetUniformLocation(program, "uEnvironment"), first_unit);
+    glUniform1i(glGetUniformLocation(program, "uBrdfLut"), first_unit + 1);
+
+    glUniformMatrix3fv(
+        glGetUniformLocation(program, "uViewToWorld"), 1, GL_FALSE, view_to_world_);
+    glUniform3fv(glGetUniformLocation(program, "uIrradiance"),
+                 static_cast<int>(irradiance_.size()),
+                 &irradiance_[0].x);
+    glUniform1f(glGetUniformLocation(program, "uEnvironmentMaxLevel"),
+                static_cast<float>(max_level_));
+    glUniform1f(glGetUniformLocation(program, "uEnvironmentIntensity"), intensity);
+}
+} // namespace ibl
@@ -0,0 +1,135 @@
+#include "jobs.H"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace {
+std::vector<std::thread> workers;
+std::deque<std::function<void()>> queue;
+std::mutex queue_mutex;
+std::condition_variable queue_cv;
+bool stopping = false;
+
+void worker_loop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock lock(queue_mutex);
+            queue_cv.wait(lock, [] { return stopping || !queue.empty(); });
+            if (stopping && queue.empty()) {
+                return;
+            }
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+        task();
+    }
+}
+
+// Shared between the caller of parallel_for and the helper tasks it submits. Helpers
+// may start after the loop is already finished, so the state must outlive the call.
+struct ParallelFor {
+    std::atomic<size_t> next_chunk {0};
+    std::atomic<size_t> chunks_done {0};
+    size_t chunk_count = 0;
+    size_t begin = 0;
+    size_t end = 0;
+    size_t grain = 1;
+    const std::function<void(size_t, size_t)>* fn = nullptr;
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+
+    void run_chunks() {
+        size_t chunk;
+        while ((chunk = next_chunk.fetch_add(1, std::memory_order_relaxed)) <
+               chunk_count) {
+            size_t first = begin + chunk * grain;
+            size_t last = std::min(end, first + grain);
+            (*fn)(first, last);
+            size_t done = chunks_done.fetch_add(1, std::memory_order_acq_rel) + 1;
+            if (done == chunk_count) {
+                std::lock_guard lock(done_mutex);
+                done_cv.notify_all();
+            }
+        }
+    }
+};
+} // namespace
+
+namespace jobs {
+void init(unsigned int thread_count) {
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    }
+    spdlog::info("Starting {} worker threads", thread_count);
+    stopping = false;
+    for (unsigned int i = 0; i < thread_count; ++i) {
+        workers.emplace_back(worker_loop);
+    }
+}
+
+void shutdown() {
+    {
+        std::lock_guard lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+}
+
+auto concurrency() -> unsigned int {
+    return static_cast<unsigned int>(workers.size()) + 1;
+}
+
+void submit(std::function<void()> task) {
+    if (workers.empty()) {
+        task();
+        return;
+    }
+    {
+        std::lock_guard lock(queue_mutex);
+        queue.push_back(std::move(task));
+    }
+    queue_cv.notify_one();
+}
+
+void parallel_for(size_t begin,
+                  size_t end,
+                  size_t grain,
+                  const std::function<void(size_t, size_t)>& fn) {
+    if (begin >= end) {
+        return;
+    }
+    grain = std::max<size_t>(grain, 1);
+
+    auto state = std::make_shared<ParallelFor>();
+    state->chunk_count = (end - begin + grain - 1) / grain;
+    state->begin = begin;
+    state->end = end;
+    state->grain = grain;
+    state->fn = &fn;
+
+    size_t helpers = std::min(workers.size(), state->chunk_count - 1);
+    for (size_t i = 0; i < helpers; ++i) {
+        submit([state] { state->run_chunks(); });
+    }
+    state->run_chunks();
+
+    std::unique_lock lock(state->done_mutex);
+    state->done_cv.wait(lock, [&] {
+        return state->chunks_done.load(std::memory_order_acquire) ==
+               state->chunk_count;
+    });
+}
+} // namespace jobs
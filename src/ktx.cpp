@@ -0,0 +1,640 @@
+#include "ktx.H"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string_view>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+#include "hash.H"
+#include "mipmaps.H"
+#include "texture_compression.H"
+
+namespace {
+using texture_compression::Format;
+
+constexpr uint8_t KTX2_IDENTIFIER[12] = {
+    0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+// The identifier, the header and the index, before the level index.
+auto constexpr HEADER_SIZE = size_t {80};
+auto constexpr LEVEL_INDEX_ENTRY_SIZE = size_t {24};
+auto constexpr MAX_LEVELS = 15u;
+
+// Cooked files say what cooked them, and from what, in their key/value data: the
+// version of the encoders and the hash of the source.
+auto constexpr WRITER = "gl-play";
+auto constexpr COOKER_KEY = "gl-play.cooker";
+auto constexpr COOKER_VERSION = 2u;
+
+// Data format descriptor constants, from the Khronos Data Format specification.
+auto constexpr DF_VERSION = 2u;
+auto constexpr DF_MODEL_BC1A = 128u;
+auto constexpr DF_MODEL_BC3 = 130u;
+auto constexpr DF_MODEL_BC7 = 134u;
+auto constexpr DF_PRIMARIES_BT709 = 1u;
+auto constexpr DF_TRANSFER_LINEAR = 1u;
+auto constexpr DF_TRANSFER_SRGB = 2u;
+auto constexpr DF_CHANNEL_BC3_ALPHA = 15u;
+
+// GL capabilities a format depends on.
+enum class Support { Always, S3tc, S3tcSrgb, Bptc, Etc };
+
+struct FormatInfo {
+    uint32_t vk_format;
+    const char* name;
+    GLenum gl_format;
+    Support support;
+    int block_size;   // texels a side, 1 for uncompressed formats
+    int block_bytes;
+    std::optional<Format> decoded; // by texture_compression, when unsupported
+    bool srgb;
+};
+
+// The formats of the KTX2 files worth loading, by their VkFormat, with their GL
+// enums in hex as the core 3.3 headers lack most. RGTC is core since GL 3.0, and
+// signed formats are only ever loaded natively.
+const FormatInfo FORMATS[] = {
+    {37, "RGBA8", GL_RGBA8, Support::Always, 1, 4, {}, false},
+    {43, "RGBA8 sRGB", GL_SRGB8_ALPHA8, Support::Always, 1, 4, {}, true},
+    {131, "BC1", 0x83F0, Support::S3tc, 4, 8, Format::BC1, false},
+    {132, "BC1 sRGB", 0x8C4C, Support::S3tcSrgb, 4, 8, Format::BC1, true},
+    {133, "BC1 RGBA", 0x83F1, Support::S3tc, 4, 8, Format::BC1_ALPHA, false},
+    {134, "BC1 RGBA sRGB", 0x8C4D, Support::S3tcSrgb, 4, 8, Format::BC1_ALPHA, true},
+    {135, "BC2", 0x83F2, Support::S3tc, 4, 16, Format::BC2, false},
+    {136, "BC2 sRGB", 0x8C4E, Support::S3tcSrgb, 4, 16, Format::BC2, true},
+    {137, "BC3", 0x83F3, Support::S3tc, 4, 16, Format::BC3, false},
+    {138, "BC3 sRGB", 0x8C4F, Support::S3tcSrgb, 4, 16, Format::BC3, true},
+    {139, "BC4", 0x8DBB, Support::Always, 4, 8, Format::BC4, false},
+    {140, "BC4 signed", 0x8DBC, Support::Always, 4, 8, {}, false},
+    {141, "BC5", 0x8DBD, Support::Always, 4, 16, Format::BC5, false},
+    {142, "BC5 signed", 0x8DBE, Support::Always, 4, 16, {}, false},
+    {143, "BC6H", 0x8E8F, Support::Bptc, 4, 16, {}, false},
+    {144, "BC6H signed", 0x8E8E, Support::Bptc, 4, 16, {}, false},
+    {145, "BC7", 0x8E8C, Support::Bptc, 4, 16, Format::BC7, false},
+    {146, "BC7 sRGB", 0x8E8D, Support::Bptc, 4, 16, Format::BC7, true},
+    {147, "ETC2", 0x9274, Support::Etc, 4, 8, Format::ETC2_RGB, false},
+    {148, "ETC2 sRGB", 0x9275, Support::Etc, 4, 8, Format::ETC2_RGB, true},
+    {149, "ETC2 A1", 0x9276, Support::Etc, 4, 8, Format::ETC2_RGB_A1, false},
+    {150, "ETC2 A1 sRGB", 0x9277, Support::Etc, 4, 8, Format::ETC2_RGB_A1, true},
+    {151, "ETC2 RGBA", 0x9278, Support::Etc, 4, 16, Format::ETC2_RGBA, false},
+    {152, "ETC2 RGBA sRGB", 0x9279, Support::Etc, 4, 16, Format::ETC2_RGBA, true},
+    {153, "EAC R11", 0x9270, Support::Etc, 4, 8, Format::EAC_R11, false},
+    {154, "EAC R11 signed", 0x9271, Support::Etc, 4, 8, {}, false},
+    {155, "EAC RG11", 0x9272, Support::Etc, 4, 16, Format::EAC_RG11, false},
+    {156, "EAC RG11 signed", 0x9273, Support::Etc, 4, 16, {}, false},
+};
+
+auto has_extension(std::string_view name) -> bool {
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i) {
+        auto* extension = reinterpret_cast<const char*>(
+            glGetStringi(GL_EXTENSIONS, static_cast<GLuint>(i)));
+        if (extension != nullptr && name == extension) {
+            return true;
+        }
+    }
+    return false;
+}
+
+auto is_supported(Support support) -> bool {
+    switch (support) {
+        case Support::Always:
+            return true;
+        case Support::S3tc:
+            return has_extension("GL_EXT_texture_compression_s3tc");
+        case Support::S3tcSrgb:
+            return has_extension("GL_EXT_texture_compression_s3tc") &&
+                   (has_extension("GL_EXT_texture_sRGB") ||
+                    has_extension("GL_EXT_texture_compression_s3tc_srgb"));
+        case Support::Bptc:
+            return GLAD_GL_VERSION_4_2 != 0 ||
+                   has_extension("GL_ARB_texture_compression_bptc");
+        case Support::Etc:
+            return GLAD_GL_VERSION_4_3 != 0 ||
+                   has_extension("GL_ARB_ES3_compatibility");
+    }
+    return false;
+}
+
+// A read only view of a whole file, mapped so the page cache is read directly.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    auto operator=(const MappedFile&) -> MappedFile& = delete;
+    ~MappedFile() { close(); }
+
+    auto open(const char* path) -> bool;
+    void close();
+
+    auto data() const -> const uint8_t* { return data_; }
+    auto size() const -> size_t { return size_; }
+
+private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+};
+
+#ifdef _WIN32
+auto MappedFile::open(const char* path) -> bool {
+    file_ = CreateFileA(path,
+                        GENERIC_READ,
+                        FILE_SHARE_READ,
+                        nullptr,
+                        OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN,
+                        nullptr);
+    LARGE_INTEGER size;
+    if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size) ||
+        size.QuadPart == 0) {
+        close();
+        return false;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_ != nullptr) {
+        data_ = static_cast<const uint8_t*>(
+            MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (data_ == nullptr) {
+        close();
+        return false;
+    }
+    size_ = static_cast<size_t>(size.QuadPart);
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_ != nullptr) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_ != nullptr) {
+        CloseHandle(mapping_);
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+}
+#else
+auto MappedFile::open(const char* path) -> bool {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    auto size = static_cast<size_t>(info.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open.
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    // Every level is about to be read, start paging them in.
+    madvise(data, size, MADV_WILLNEED);
+    data_ = static_cast<const uint8_t*>(data);
+    size_ = size;
+    return true;
+}
+
+void MappedFile::close() {
+    if (data_ != nullptr) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+}
+#endif
+
+template <typename T>
+auto read(const uint8_t* bytes) -> T {
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+struct Level {
+    uint64_t offset;
+    uint64_t length;
+};
+
+auto find_format(Format format, bool srgb) -> const FormatInfo* {
+    for (const FormatInfo& info : FORMATS) {
+        if (info.decoded == format && info.srgb == srgb) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
+
+// The data format descriptor KTX2 requires, a basic descriptor block with a
+// sample per compressed plane of the block.
+auto data_format_descriptor(Format format, bool srgb) -> std::vector<uint32_t> {
+    struct Sample {
+        uint32_t bit_offset;
+        uint32_t bit_length;
+        uint32_t channel;
+    };
+    // Alpha is never sRGB encoded.
+    auto constexpr LINEAR_SAMPLE = 0x10u;
+    uint32_t color_model = DF_MODEL_BC1A;
+    std::vector<Sample> samples = {{0, 64, 0}};
+    if (format == Format::BC3) {
+        color_model = DF_MODEL_BC3;
+        samples = {{0, 64, DF_CHANNEL_BC3_ALPHA | (srgb ? LINEAR_SAMPLE : 0)},
+                   {64, 64, 0}};
+    } else if (format == Format::BC7) {
+        color_model = DF_MODEL_BC7;
+        samples = {{0, 128, 0}};
+    }
+    auto block_size = static_cast<uint32_t>(24 + 16 * samples.size());
+    std::vector<uint32_t> words = {
+        4 + block_size,
+        0,                              // Khronos vendor, basic descriptor type
+        DF_VERSION | block_size << 16,
+        color_model | DF_PRIMARIES_BT709 << 8 |
+            (srgb ? DF_TRANSFER_SRGB : DF_TRANSFER_LINEAR) << 16,
+        0x0303,                         // 4x4x1x1 texel blocks
+        static_cast<uint32_t>(texture_compression::block_bytes(format)),
+        0,
+    };
+    for (const Sample& sample : samples) {
+        words.push_back(sample.bit_offset | (sample.bit_length - 1) << 16 |
+                        sample.channel << 24);
+        words.push_back(0);           // sample position
+        words.push_back(0);           // lower
+        words.push_back(0xFFFFFFFFu); // upper
+    }
+    return words;
+}
+
+// Appends a key/value data entry, padded to 4 bytes.
+void append_entry(std::vector<uint8_t>& data,
+                  std::string_view key,
+                  const void* value,
+                  size_t value_bytes) {
+    auto length = static_cast<uint32_t>(key.size() + 1 + value_bytes);
+    const auto* length_bytes = reinterpret_cast<const uint8_t*>(&length);
+    data.insert(data.end(), length_bytes, length_bytes + 4);
+    data.insert(data.end(), key.begin(), key.end());
+    data.push_back(0);
+    const auto* value_bytes_begin = static_cast<const uint8_t*>(value);
+    data.insert(data.end(), value_bytes_begin, value_bytes_begin + value_bytes);
+    data.resize((data.size() + 3) & ~size_t {3});
+}
+
+template <typename T>
+void write(std::ofstream& file, const T* data, size_t count) {
+    file.write(reinterpret_cast<const char*>(data),
+               static_cast<std::streamsize>(count * sizeof(T)));
+}
+} // namespace
+
+namespace ktx {
+auto load_texture(const char* path) -> std::optional<Texture> {
+    auto start = std::chrono::steady_clock::now();
+    MappedFile file;
+    if (!file.open(path)) {
+        spdlog::error("Failed to open {}", path);
+        return std::nullopt;
+    }
+    if (file.size() < HEADER_SIZE ||
+        std::memcmp(file.data(), KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0) {
+        spdlog::warn("{} is not a KTX2 file", path);
+        return std::nullopt;
+    }
+
+    // The header, all little-endian like every x86 and ARM target.
+    const uint8_t* header = file.data() + sizeof(KTX2_IDENTIFIER);
+    auto vk_format = read<uint32_t>(header);
+    auto width = read<uint32_t>(header + 8);
+    auto height = read<uint32_t>(header + 12);
+    auto depth = read<uint32_t>(header + 16);
+    auto layers = read<uint32_t>(header + 20);
+    auto faces = read<uint32_t>(header + 24);
+    auto level_count = read<uint32_t>(header + 28);
+    auto supercompression = read<uint32_t>(header + 32);
+    if (depth != 0 || layers != 0 || faces != 1 || width == 0 || height == 0 ||
+        width > (1u << 14) || height > (1u << 14)) {
+        spdlog::warn("{} is not a 2D texture", path);
+        return std::nullopt;
+    }
+    if (supercompression != 0 || vk_format == 0) {
+        spdlog::warn("{} is supercompressed or in a universal format, which "
+                     "needs transcoding to a GPU format first",
+                     path);
+        return std::nullopt;
+    }
+    const FormatInfo* info = nullptr;
+    for (const FormatInfo& format : FORMATS) {
+        if (format.vk_format == vk_format) {
+            info = &format;
+        }
+    }
+    if (info == nullptr) {
+        spdlog::warn("{} has the unsupported VkFormat {}", path, vk_format);
+        return std::nullopt;
+    }
+
+    // A level count of 0 asks for the levels to be generated at load time.
+    uint32_t levels = std::max(level_count, 1u);
+    if (levels > MAX_LEVELS ||
+        file.size() < HEADER_SIZE + levels * LEVEL_INDEX_ENTRY_SIZE) {
+        spdlog::warn("{} is truncated", path);
+        return std::nullopt;
+    }
+    std::vector<Level> level_index(levels);
+    for (uint32_t i = 0; i < levels; ++i) {
+        const uint8_t* entry = file.data() + HEADER_SIZE + i * LEVEL_INDEX_ENTRY_SIZE;
+        level_index[i] = {read<uint64_t>(entry), read<uint64_t>(entry + 8)};
+    }
+    auto level_width = [&](uint32_t level) { return std::max(width >> level, 1u); };
+    auto level_height = [&](uint32_t level) { return std::max(height >> level, 1u); };
+    auto level_bytes = [&](uint32_t level) {
+        auto size = static_cast<uint32_t>(info->block_size);
+        return static_cast<size_t>((level_width(level) + size - 1) / size) *
+               ((level_height(level) + size - 1) / size) *
+               static_cast<size_t>(info->block_bytes);
+    };
+    for (uint32_t i = 0; i < levels; ++i) {
+        const Level& level = level_index[i];
+        if (level.length < level_bytes(i) || level.offset > file.size() ||
+            level.length > file.size() - level.offset) {
+            spdlog::warn("{} is truncated", path);
+            return std::nullopt;
+        }
+    }
+
+    bool native = is_supported(info->support);
+    if (!native && !info->decoded) {
+        spdlog::error("{} is {}, which the driver does not support", path, info->name);
+        return std::nullopt;
+    }
+
+    Texture texture;
+    texture.width = static_cast<int>(width);
+    texture.height = static_cast<int>(height);
+    texture.levels = static_cast<int>(levels);
+    texture.format = info->name;
+    texture.transcoded = !native;
+    glGenTextures(1, &texture.id);
+    glBindTexture(GL_TEXTURE_2D, texture.id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    std::vector<uint8_t> decoded;
+    for (uint32_t i = 0; i < levels; ++i) {
+        const uint8_t* data = file.data() + level_index[i].offset;
+        auto w = static_cast<GLsizei>(level_width(i));
+        auto h = static_cast<GLsizei>(level_height(i));
+        auto level = static_cast<GLint>(i);
+        if (info->block_size == 1) {
+            glTexImage2D(GL_TEXTURE_2D,
+                         level,
+                         static_cast<GLint>(info->gl_format),
+                         w,
+                         h,
+                         0,
+                         GL_RGBA,
+                         GL_UNSIGNED_BYTE,
+                         data);
+            texture.gpu_bytes += level_bytes(i);
+        } else if (native) {
+            // Straight from the mapping: the driver's copy is the only one.
+            glCompressedTexImage2D(GL_TEXTURE_2D,
+                                   level,
+                                   info->gl_format,
+                                   w,
+                                   h,
+                                   0,
+                                   static_cast<GLsizei>(level_bytes(i)),
+                                   data);
+            texture.gpu_bytes += level_bytes(i);
+        } else {
+            decoded.resize(static_cast<size_t>(w) * static_cast<size_t>(h) * 4);
+            texture_compression::decode(*info->decoded, data, w, h, decoded.data());
+            glTexImage2D(GL_TEXTURE_2D,
+                         level,
+                         info->srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8,
+                         w,
+                         h,
+                         0,
+                         GL_RGBA,
+                         GL_UNSIGNED_BYTE,
+                         decoded.data());
+            texture.gpu_bytes += decoded.size();
+        }
+    }
+    // Generated on the CPU, filtered in linear light unlike most drivers'
+    // glGenerateMipmap. Compressed levels cannot be generated, those textures keep
+    // one level.
+    if (level_count == 0 && (info->block_size == 1 || !native)) {
+        const uint8_t* texels = info->block_size == 1
+                                    ? file.data() + level_index[0].offset
+                                    : decoded.data();
+        auto chain = mipmaps::generate(texels,
+                                       static_cast<int>(width),
+                                       static_cast<int>(height),
+                                       info->srgb,
+                                       mipmaps::Filter::Kaiser);
+        for (uint32_t i = 1; i < chain.size(); ++i) {
+            glTexImage2D(GL_TEXTURE_2D,
+                         static_cast<GLint>(i),
+                         info->srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8,
+                         static_cast<GLsizei>(level_width(i)),
+                         static_cast<GLsizei>(level_height(i)),
+                         0,
+                         GL_RGBA,
+                         GL_UNSIGNED_BYTE,
+                         chain[i].data());
+            texture.gpu_bytes += chain[i].size();
+        }
+        texture.levels = static_cast<int>(chain.size());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, texture.levels - 1);
+    glTexParameteri(GL_TEXTURE_2D,
+                    GL_TEXTURE_MIN_FILTER,
+                    texture.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    texture.load_ms = elapsed.count();
+    if (texture.transcoded) {
+        spdlog::info("Decoded {}, {} the driver lacks, in {:.1f} ms",
+                     path,
+                     info->name,
+                     texture.load_ms);
+    }
+    return texture;
+}
+
+auto save_texture(const char* path,
+                  texture_compression::Format format,
+                  bool srgb,
+                  int width,
+                  int height,
+                  const std::vector<std::vector<uint8_t>>& levels,
+                  uint64_t source_hash) -> bool {
+    const FormatInfo* info = find_format(format, srgb);
+    if (info == nullptr || !texture_compression::can_encode(format) ||
+        levels.empty() || levels.size() > MAX_LEVELS) {
+        spdlog::error("Cannot cook {} in that format", path);
+        return false;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::vector<uint8_t>> encoded(levels.size());
+    for (size_t i = 0; i < levels.size(); ++i) {
+        int w = std::max(width >> i, 1);
+        int h = std::max(height >> i, 1);
+        if (levels[i].size() != static_cast<size_t>(w) * static_cast<size_t>(h) * 4) {
+            spdlog::error("Level {} of {} has the wrong size", i, path);
+            return false;
+        }
+        encoded[i].resize(static_cast<size_t>((w + 3) / 4) * ((h + 3) / 4) *
+                          static_cast<size_t>(info->block_bytes));
+        texture_compression::encode(format, levels[i].data(), w, h, encoded[i].data());
+    }
+
+    std::vector<uint32_t> descriptor = data_format_descriptor(format, srgb);
+    std::vector<uint8_t> key_values;
+    append_entry(key_values, "KTXwriter", WRITER, std::strlen(WRITER) + 1);
+    uint8_t cooker[12];
+    std::memcpy(cooker, &COOKER_VERSION, 4);
+    std::memcpy(cooker + 4, &source_hash, 8);
+    append_entry(key_values, COOKER_KEY, cooker, sizeof(cooker));
+
+    // Levels are stored coarsest first, each aligned to a block.
+    size_t level_index_size = levels.size() * LEVEL_INDEX_ENTRY_SIZE;
+    size_t descriptor_offset = HEADER_SIZE + level_index_size;
+    size_t key_values_offset = descriptor_offset + descriptor.size() * 4;
+    auto alignment = static_cast<size_t>(info->block_bytes);
+    size_t offset = key_values_offset + key_values.size();
+    std::vector<uint64_t> level_index(levels.size() * 3);
+    for (size_t i = levels.size(); i-- > 0;) {
+        offset = (offset + alignment - 1) / alignment * alignment;
+        level_index[i * 3] = offset;
+        level_index[i * 3 + 1] = encoded[i].size();
+        level_index[i * 3 + 2] = encoded[i].size();
+        offset += encoded[i].size();
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        spdlog::error("Failed to open {} for writing", path);
+        return false;
+    }
+    uint32_t header[] = {info->vk_format,
+                         1, // type size of block compressed formats
+                         static_cast<uint32_t>(width),
+                         static_cast<uint32_t>(height),
+                         0, // depth
+                         0, // layers
+                         1, // faces
+                         static_cast<uint32_t>(levels.size()),
+                         0, // supercompression
+                         static_cast<uint32_t>(descriptor_offset),
+                         static_cast<uint32_t>(descriptor.size() * 4),
+                         static_cast<uint32_t>(key_values_offset),
+                         static_cast<uint32_t>(key_values.size())};
+    uint64_t supercompression_data[] = {0, 0};
+    write(file, KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER));
+    write(file, header, std::size(header));
+    write(file, supercompression_data, 2);
+    write(file, level_index.data(), level_index.size());
+    write(file, descriptor.data(), descriptor.size());
+    write(file, key_values.data(), key_values.size());
+    size_t written = key_values_offset + key_values.size();
+    const uint8_t padding[16] = {};
+    for (size_t i = levels.size(); i-- > 0;) {
+        write(file, padding, level_index[i * 3] - written);
+        write(file, encoded[i].data(), encoded[i].size());
+        written = level_index[i * 3] + encoded[i].size();
+    }
+    if (!file) {
+        spdlog::error("Failed to write {}", path);
+        return false;
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    spdlog::info("Cooked {} in {:.1f} ms", path, elapsed.count());
+    return true;
+}
+
+auto is_cooked(const char* path,
+               texture_compression::Format format,
+               bool srgb,
+               uint64_t source_hash) -> bool {
+    MappedFile file;
+    if (!file.open(path) || file.size() < HEADER_SIZE ||
+        std::memcmp(file.data(), KTX2_IDENTIFIER, sizeof(KTX2_IDENTIFIER)) != 0) {
+        return false;
+    }
+    const uint8_t* header = file.data() + sizeof(KTX2_IDENTIFIER);
+    const FormatInfo* info = find_format(format, srgb);
+    auto key_values_offset = read<uint32_t>(header + 44);
+    auto key_values_length = read<uint32_t>(header + 48);
+    if (info == nullptr || read<uint32_t>(header) != info->vk_format ||
+        key_values_offset > file.size() ||
+        key_values_length > file.size() - key_values_offset) {
+        return false;
+    }
+    // Entries are a length, then the key and the value, padded to 4 bytes.
+    const uint8_t* entry = file.data() + key_values_offset;
+    const uint8_t* end = entry + key_values_length;
+    while (end - entry >= 4) {
+        auto length = read<uint32_t>(entry);
+        const auto* key = reinterpret_cast<const char*>(entry + 4);
+        if (length > static_cast<size_t>(end - entry - 4)) {
+            break;
+        }
+        std::string_view key_value(key, length);
+        size_t key_length = key_value.find('\0');
+        if (key_value.substr(0, key_length) == COOKER_KEY &&
+            length - key_length - 1 == 12) {
+            const auto* value = entry + 4 + key_length + 1;
+            return read<uint32_t>(value) == COOKER_VERSION &&
+                   read<uint64_t>(value + 4) == source_hash;
+        }
+        entry += 4 + ((length + 3) & ~3u);
+    }
+    return false;
+}
+
+auto hash_levels(const std::vector<std::vector<uint8_t>>& levels) -> uint64_t {
+    // The levels' sizes and texels.
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    for (const std::vector<uint8_t>& level : levels) {
+        size_t size = level.size();
+        hash = fnv1a(&size, sizeof(size), hash);
+        hash = fnv1a(level.data(), level.size(), hash);
+    }
+    return hash;
+}
+} // namespace ktx
@@ -0,0 +1,296 @@
+#include "lighting.H"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define LIGHTING_SSE 1
+#endif
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+#include "jobs.H"
+#include "lighting_shader.H"
+
+namespace {
+// The enum values double as the order of the buffers and texture units.
+enum Buffer { LIGHTS, CLUSTERS, INDICES, BUFFER_COUNT };
+
+auto constexpr BUFFER_FORMATS = std::array {GL_RGBA32F, GL_RG32UI, GL_R16UI};
+auto constexpr SAMPLER_NAMES = std::array {"uLights", "uClusters", "uLightIndices"};
+
+// Position of the padding lights, far enough away to fail every overlap test while
+// its square stays finite.
+auto constexpr FAR_AWAY = 1e18f;
+
+template <typename T>
+void upload(unsigned int buffer, const std::vector<T>& data) {
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+    // A fresh store every frame, so the driver never waits for the previous
+    // frame's draws to finish reading the old one. An empty buffer still gets an
+    // element, some drivers reject zero-sized texture buffers.
+    glBufferData(GL_TEXTURE_BUFFER,
+                 static_cast<GLsizeiptr>(std::max<size_t>(data.size(), 1) * sizeof(T)),
+                 data.empty() ? nullptr : data.data(),
+                 GL_STREAM_DRAW);
+}
+} // namespace
+
+namespace lighting {
+auto ClusteredLighting::init() -> bool {
+    glGenBuffers(BUFFER_COUNT, buffers_);
+    glGenTextures(BUFFER_COUNT, textures_);
+    for (int i = 0; i < BUFFER_COUNT; ++i) {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers_[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_STREAM_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, textures_[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, BUFFER_FORMATS[i], buffers_[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    slices_.resize(GRID_Z);
+    bounds_.resize(CLUSTER_COUNT);
+    clusters_.assign(CLUSTER_COUNT * 2, 0);
+    bounds_valid_ = false;
+    return true;
+}
+
+void ClusteredLighting::shutdown() {
+    glDeleteTextures(BUFFER_COUNT, textures_);
+    glDeleteBuffers(BUFFER_COUNT, buffers_);
+    for (int i = 0; i < BUFFER_COUNT; ++i) {
+        textures_[i] = buffers_[i] = 0;
+    }
+}
+
+auto ClusteredLighting::shader_source() -> const char* {
+    return shaders::clustered_lighting_src;
+}
+
+void ClusteredLighting::build_bounds(const Mat4& proj) {
+    // Inverts the depth mapping of perspective().
+    near_ = proj(2, 3) / (proj(2, 2) - 1.0f);
+    far_ = proj(2, 3) / (proj(2, 2) + 1.0f);
+    Mat4 inverse_proj = inverse(proj);
+
+    // Rays through the tile corners, scaled to unit view depth.
+    Vec3 rays[GRID_Y + 1][GRID_X + 1];
+    for (int y = 0; y <= GRID_Y; ++y) {
+        for (int x = 0; x <= GRID_X; ++x) {
+            Vec3 ndc {-1.0f + 2.0f * static_cast<float>(x) / GRID_X,
+                      -1.0f + 2.0f * static_cast<float>(y) / GRID_Y,
+                      -1.0f};
+            Vec3 on_near_plane = transform_point(inverse_proj, ndc);
+            rays[y][x] = on_near_plane * (1.0f / -on_near_plane.z);
+        }
+    }
+
+    for (int z = 0; z < GRID_Z; ++z) {
+        float depths[2];
+        for (int i = 0; i < 2; ++i) {
+            float t = static_cast<float>(z + i) / GRID_Z;
+            depths[i] = near_ * std::pow(far_ / near_, t);
+        }
+        for (int y = 0; y < GRID_Y; ++y) {
+            for (int x = 0; x < GRID_X; ++x) {
+                Bounds& b = bounds_[(z * GRID_Y + y) * GRID_X + x];
+                b.min_x = b.min_y = b.min_z = INFINITY;
+                b.max_x = b.max_y = b.max_z = -INFINITY;
+                for (int corner = 0; corner < 8; ++corner) {
+                    Vec3 p = rays[y + (corner >> 1 & 1)][x + (corner & 1)] *
+                             depths[corner >> 2];
+                    b.min_x = std::min(b.min_x, p.x);
+                    b.min_y = std::min(b.min_y, p.y);
+                    b.min_z = std::min(b.min_z, p.z);
+                    b.max_x = std::max(b.max_x, p.x);
+                    b.max_y = std::max(b.max_y, p.y);
+                    b.max_z = std::max(b.max_z, p.z);
+                }
+            }
+        }
+    }
+    bounds_proj_ = proj;
+    bounds_valid_ = true;
+}
+
+void ClusteredLighting::update(const std::vector<PointLight>& lights,
+                               const Mat4& view,
+                               const Mat4& proj,
+                               int width,
+                               int height) {
+    auto start = std::chrono::steady_clock::now();
+    if (!bounds_valid_ || std::memcmp(proj.m, bounds_proj_.m, sizeof(proj.m)) != 0) {
+        build_bounds(proj);
+    }
+    cluster_scale_ = {static_cast<float>(GRID_X) / static_cast<float>(width),
+                      static_cast<float>(GRID_Y) / static_cast<float>(height)};
+
+    size_t count = std::min(lights.size(), static_cast<size_t>(MAX_LIGHTS));
+    if (count < lights.size()) {
+        spdlog::warn(
+            "Only the first {} of {} lights are shaded", count, lights.size());
+    }
+    for (auto* array : {&x_, &y_, &z_, &radius_}) {
+        array->resize(count);
+    }
+    gpu_lights_.resize(count * 2);
+    for (size_t i = 0; i < count; ++i) {
+        const PointLight& light = lights[i];
+        Vec3 p = transform_point(view, light.position);
+        x_[i] = p.x;
+        y_[i] = p.y;
+        z_[i] = p.z;
+        radius_[i] = light.radius;
+        gpu_lights_[i * 2] = {p.x, p.y, p.z, light.radius};
+        gpu_lights_[i * 2 + 1] = {light.color.x,
+                                  light.color.y,
+                                  light.color.z,
+                                  static_cast<float>(light.shadow)};
+    }
+
+    // Every depth slice bins independently into its own scratch lists.
+    jobs::parallel_for(0, GRID_Z, 1, [&](size_t first_slice, size_t last_slice) {
+        for (size_t z = first_slice; z < last_slice; ++z) {
+            Slice& s = slices_[z];
+            const Bounds* slice_bounds = &bounds_[z * GRID_X * GRID_Y];
+            float slice_min_z = slice_bounds[0].min_z;
+            float slice_max_z = slice_bounds[0].max_z;
+
+            // Most lights miss most slices, so the tile tests only see the lights
+            // overlapping this slice's depth range.
+            s.candidates.clear();
+            for (size_t i = 0; i < count; ++i) {
+                if (z_[i] - radius_[i] <= slice_max_z &&
+                    z_[i] + radius_[i] >= slice_min_z) {
+                    s.candidates.push_back(static_cast<uint16_t>(i));
+                }
+            }
+            size_t candidate_count = s.candidates.size();
+            size_t padded = (candidate_count + 3) & ~size_t {3};
+            for (auto* array : {&s.x, &s.y, &s.z, &s.radius}) {
+                array->resize(padded);
+            }
+            for (size_t i = 0; i < padded; ++i) {
+                if (i < candidate_count) {
+                    uint16_t light = s.candidates[i];
+                    s.x[i] = x_[light];
+                    s.y[i] = y_[light];
+                    s.z[i] = z_[light];
+                    s.radius[i] = radius_[light];
+                } else {
+                    s.x[i] = s.y[i] = s.z[i] = FAR_AWAY;
+                    s.radius[i] = 0.0f;
+                }
+            }
+
+            s.indices.clear();
+            for (int tile = 0; tile < GRID_X * GRID_Y; ++tile) {
+                const Bounds& b = slice_bounds[tile];
+                size_t before = s.indices.size();
+                size_t i = 0;
+#ifdef LIGHTING_SSE
+                // Squared distance from each sphere centre to the box, per axis
+                // max(min - c, c - max, 0).
+                __m128 min_x = _mm_set1_ps(b.min_x);
+                __m128 min_y = _mm_set1_ps(b.min_y);
+                __m128 min_z = _mm_set1_ps(b.min_z);
+                __m128 max_x = _mm_set1_ps(b.max_x);
+                __m128 max_y = _mm_set1_ps(b.max_y);
+                __m128 max_z = _mm_set1_ps(b.max_z);
+                __m128 zero = _mm_setzero_ps();
+                for (; i < padded; i += 4) {
+                    __m128 view_x = _mm_loadu_ps(&s.x[i]);
+                    __m128 view_y = _mm_loadu_ps(&s.y[i]);
+                    __m128 view_z = _mm_loadu_ps(&s.z[i]);
+                    __m128 r = _mm_loadu_ps(&s.radius[i]);
+                    __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(min_x, view_x),
+                                                      _mm_sub_ps(view_x, max_x)),
+                                           zero);
+                    __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(min_y, view_y),
+                                                      _mm_sub_ps(view_y, max_y)),
+                                           zero);
+                    __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(min_z, view_z),
+                                                      _mm_sub_ps(view_z, max_z)),
+                                           zero);
+                    __m128 distance2 =
+                        _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+                                   _mm_mul_ps(dz, dz));
+                    auto mask = static_cast<unsigned>(
+                        _mm_movemask_ps(_mm_cmple_ps(distance2, _mm_mul_ps(r, r))));
+                    while (mask != 0) {
+                        s.indices.push_back(s.candidates[i + std::countr_zero(mask)]);
+                        mask &= mask - 1;
+                    }
+                }
+#endif
+                for (; i < candidate_count; ++i) {
+                    float dx = std::max({b.min_x - s.x[i], s.x[i] - b.max_x, 0.0f});
+                    float dy = std::max({b.min_y - s.y[i], s.y[i] - b.max_y, 0.0f});
+                    float dz = std::max({b.min_z - s.z[i], s.z[i] - b.max_z, 0.0f});
+                    if (dx * dx + dy * dy + dz * dz <= s.radius[i] * s.radius[i]) {
+                        s.indices.push_back(s.candidates[i]);
+                    }
+                }
+                s.counts[tile] = static_cast<uint32_t>(s.indices.size() - before);
+            }
+        }
+    });
+
+    // Concatenate the slices' lists and turn the counts into offsets.
+    indices_.clear();
+    int max_cluster_lights = 0;
+    for (int z = 0; z < GRID_Z; ++z) {
+        const Slice& s = slices_[z];
+        auto offset = static_cast<uint32_t>(indices_.size());
+        for (int tile = 0; tile < GRID_X * GRID_Y; ++tile) {
+            size_t cluster = static_cast<size_t>(z * GRID_X * GRID_Y + tile);
+            clusters_[cluster * 2] = offset;
+            clusters_[cluster * 2 + 1] = s.counts[tile];
+            offset += s.counts[tile];
+            max_cluster_lights =
+                std::max(max_cluster_lights, static_cast<int>(s.counts[tile]));
+        }
+        indices_.insert(indices_.end(), s.indices.begin(), s.indices.end());
+    }
+
+    upload(buffers_[LIGHTS], gpu_lights_);
+    upload(buffers_[CLUSTERS], clusters_);
+    upload(buffers_[INDICES], indices_);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    stats_.lights = static_cast<int>(count);
+    stats_.references = static_cast<int>(indices_.size());
+    stats_.max_cluster_lights = max_cluster_lights;
+    stats_.binning_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                  start)
+            .count();
+}
+
+void ClusteredLighting::bind(unsigned int program, int first_unit) const {
+    for (int i = 0; i < BUFFER_COUNT; ++i) {
+        glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(first_unit + i));
+        glBindTexture(GL_TEXTURE_BUFFER, textures_[i]);
+        glUniform1i(glGetUniformLocation(program, SAMPLER_NAMES[i]), first_unit + i);
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    // slice = log(depth / near) / log(far / near) * GRID_Z, as scale and bias on
+    // log(depth).
+    float slice_scale = static_cast<float>(GRID_Z) / std::log(far_ / near_);
+    glUniform3i(glGetUniformLocation(program, "uClusterGrid"), GRID_X, GRID_Y, GRID_Z);
+    glUniform2f(glGetUniformLocation(program, "uClusterScale"),
+                cluster_scale_.x,
+                cluster_scale_.y);
+    glUniform2f(glGetUniformLocation(program, "uSliceScaleBias"),
+                slice_scale,
+                -std::log(near_) * slice_scale);
+}
+} // namespace lighting
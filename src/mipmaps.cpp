@@ -0,0 +1,260 @@
+#include "mipmaps.H"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MIPMAPS_SSE 1
+#endif
+
+#include "jobs.H"
+
+namespace {
+using mipmaps::Filter;
+
+auto constexpr PI = 3.14159265f;
+// The Kaiser filter's radius, in texels of the smaller level, and the shape of its
+// window: larger alphas ring less and blur more.
+auto constexpr KAISER_RADIUS = 3.0f;
+auto constexpr KAISER_ALPHA = 4.0f;
+// Rows filtered per task.
+auto constexpr ROW_GRAIN = 8;
+// Buckets of the table that encodes linear values to sRGB.
+auto constexpr ENCODE_BUCKETS = 4096;
+
+// sRGB decoding of every 8 bit value, and for encoding, a first guess per bucket
+// of linear values and the linear values halfway between consecutive codes, from
+// which the guess is corrected to the exact rounding.
+struct SrgbTables {
+    float decode[256];
+    float midpoints[256];
+    uint8_t guesses[ENCODE_BUCKETS];
+};
+
+auto srgb_to_linear(float v) -> float {
+    return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+}
+
+auto srgb_tables() -> const SrgbTables& {
+    static const SrgbTables tables = [] {
+        SrgbTables t = {};
+        for (int i = 0; i < 256; ++i) {
+            t.decode[i] = srgb_to_linear(static_cast<float>(i) / 255.0f);
+            // Past 255 nothing rounds up any more.
+            float halfway = (static_cast<float>(i) + 0.5f) / 255.0f;
+            t.midpoints[i] = i < 255 ? srgb_to_linear(halfway) : 2.0f;
+        }
+        // The code of each bucket's lowest value, which a value in the bucket can
+        // only exceed.
+        int code = 0;
+        for (int i = 0; i < ENCODE_BUCKETS; ++i) {
+            float v = static_cast<float>(i) / ENCODE_BUCKETS;
+            while (v >= t.midpoints[code]) {
+                ++code;
+            }
+            t.guesses[i] = static_cast<uint8_t>(code);
+        }
+        return t;
+    }();
+    return tables;
+}
+
+auto encode_srgb(const SrgbTables& tables, float v) -> uint8_t {
+    auto bucket = std::min(static_cast<int>(v * ENCODE_BUCKETS), ENCODE_BUCKETS - 1);
+    int code = tables.guesses[bucket];
+    while (v >= tables.midpoints[code]) {
+        ++code;
+    }
+    return static_cast<uint8_t>(code);
+}
+
+// Taps of a 1D resampling: the source texels and weights of every destination
+// texel, those of texel i from offsets[i] to offsets[i + 1].
+struct Taps {
+    std::vector<int> offsets;
+    std::vector<int> sources;
+    std::vector<float> weights;
+};
+
+// The modified Bessel function of the first kind of order zero, by its series.
+auto bessel_i0(float x) -> float {
+    float sum = 1.0f;
+    float term = 1.0f;
+    float quarter = x * x / 4.0f;
+    for (int k = 1; k < 32 && term > sum * 1e-7f; ++k) {
+        term *= quarter / static_cast<float>(k * k);
+        sum += term;
+    }
+    return sum;
+}
+
+// The Kaiser windowed sinc at `t` texels of the smaller level from a texel.
+auto kaiser(float t) -> float {
+    if (std::abs(t) >= KAISER_RADIUS) {
+        return 0.0f;
+    }
+    float sinc = t == 0.0f ? 1.0f : std::sin(PI * t) / (PI * t);
+    float r = t / KAISER_RADIUS;
+    return sinc * bessel_i0(KAISER_ALPHA * std::sqrt(1.0f - r * r)) /
+           bessel_i0(KAISER_ALPHA);
+}
+
+auto make_taps(int source_size, int size, Filter filter) -> Taps {
+    Taps taps;
+    float scale = static_cast<float>(source_size) / static_cast<float>(size);
+    for (int i = 0; i < size; ++i) {
+        taps.offsets.push_back(static_cast<int>(taps.sources.size()));
+        float low = static_cast<float>(i) * scale;
+        float high = low + scale;
+        float sum = 0.0f;
+        if (filter == Filter::Box) {
+            // How much of each source texel the destination texel covers.
+            for (auto s = static_cast<int>(low); static_cast<float>(s) < high; ++s) {
+                float weight = std::min(high, static_cast<float>(s + 1)) -
+                               std::max(low, static_cast<float>(s));
+                if (weight > 0.0f && s < source_size) {
+                    taps.sources.push_back(s);
+                    taps.weights.push_back(weight);
+                    sum += weight;
+                }
+            }
+        } else {
+            float center = low + 0.5f * scale;
+            float support = KAISER_RADIUS * scale;
+            for (auto s = static_cast<int>(std::floor(center - support));
+                 static_cast<float>(s) < center + support;
+                 ++s) {
+                float weight = kaiser((static_cast<float>(s) + 0.5f - center) / scale);
+                if (weight != 0.0f) {
+                    taps.sources.push_back(std::clamp(s, 0, source_size - 1));
+                    taps.weights.push_back(weight);
+                    sum += weight;
+                }
+            }
+        }
+        for (size_t t = static_cast<size_t>(taps.offsets.back());
+             t < taps.weights.size();
+             ++t) {
+            taps.weights[t] /= sum;
+        }
+    }
+    taps.offsets.push_back(static_cast<int>(taps.sources.size()));
+    return taps;
+}
+
+// destination += weight * source, over `count` RGBA texels.
+void accumulate(float* destination, const float* source, float weight, int count) {
+#ifdef MIPMAPS_SSE
+    __m128 w = _mm_set1_ps(weight);
+    for (int i = 0; i < count; ++i) {
+        __m128 sum = _mm_loadu_ps(destination + i * 4);
+        sum = _mm_add_ps(sum, _mm_mul_ps(w, _mm_loadu_ps(source + i * 4)));
+        _mm_storeu_ps(destination + i * 4, sum);
+    }
+#else
+    for (int i = 0; i < count * 4; ++i) {
+        destination[i] += weight * source[i];
+    }
+#endif
+}
+
+// A level as linear floats, four a texel.
+struct Image {
+    int width = 0;
+    int height = 0;
+    std::vector<float> texels;
+};
+
+// Filters `source` down to `width` by `height`, rows then columns, storing the
+// result both as floats and as RGBA8 into `encoded`.
+auto downsample(const Image& source,
+                int width,
+                int height,
+                bool srgb,
+                Filter filter,
+                std::vector<uint8_t>& encoded) -> Image {
+    Taps row_taps = make_taps(source.width, width, filter);
+    Taps column_taps = make_taps(source.height, height, filter);
+
+    // Every source row is filtered to the new width first.
+    std::vector<float> rows(static_cast<size_t>(width) * source.height * 4);
+    auto filter_rows = [&](size_t first, size_t last) {
+        for (size_t y = first; y < last; ++y) {
+            const float* in = &source.texels[y * source.width * 4];
+            float* out = &rows[y * width * 4];
+            for (int x = 0; x < width; ++x) {
+                for (int t = row_taps.offsets[x]; t < row_taps.offsets[x + 1]; ++t) {
+                    const float* texel = in + row_taps.sources[t] * 4;
+                    accumulate(out + x * 4, texel, row_taps.weights[t], 1);
+                }
+            }
+        }
+    };
+    jobs::parallel_for(0, static_cast<size_t>(source.height), ROW_GRAIN, filter_rows);
+
+    // Then the columns, a whole row of them per tap.
+    Image image;
+    image.width = width;
+    image.height = height;
+    image.texels.assign(static_cast<size_t>(width) * height * 4, 0.0f);
+    encoded.resize(image.texels.size());
+    const SrgbTables& tables = srgb_tables();
+    auto filter_columns = [&](size_t first, size_t last) {
+        for (size_t y = first; y < last; ++y) {
+            float* out = &image.texels[y * width * 4];
+            for (int t = column_taps.offsets[y]; t < column_taps.offsets[y + 1]; ++t) {
+                const float* in = &rows[static_cast<size_t>(column_taps.sources[t]) *
+                                        width * 4];
+                accumulate(out, in, column_taps.weights[t], width);
+            }
+            // The Kaiser filter rings past the range of its input.
+            uint8_t* texels = &encoded[y * width * 4];
+            for (int i = 0; i < width * 4; ++i) {
+                float v = std::clamp(out[i], 0.0f, 1.0f);
+                out[i] = v;
+                texels[i] = srgb && i % 4 != 3
+                                ? encode_srgb(tables, v)
+                                : static_cast<uint8_t>(v * 255.0f + 0.5f);
+            }
+        }
+    };
+    jobs::parallel_for(0, static_cast<size_t>(height), ROW_GRAIN, filter_columns);
+    return image;
+}
+} // namespace
+
+namespace mipmaps {
+auto generate(const uint8_t* texels, int width, int height, bool srgb, Filter filter)
+    -> std::vector<std::vector<uint8_t>> {
+    std::vector<std::vector<uint8_t>> levels;
+    size_t count = static_cast<size_t>(width) * static_cast<size_t>(height) * 4;
+    levels.emplace_back(texels, texels + count);
+
+    Image image;
+    image.width = width;
+    image.height = height;
+    image.texels.resize(count);
+    const SrgbTables& tables = srgb_tables();
+    auto decode_rows = [&](size_t first, size_t last) {
+        for (size_t i = first * width * 4; i < last * width * 4; ++i) {
+            image.texels[i] = srgb && i % 4 != 3
+                                  ? tables.decode[texels[i]]
+                                  : static_cast<float>(texels[i]) / 255.0f;
+        }
+    };
+    jobs::parallel_for(0, static_cast<size_t>(height), ROW_GRAIN, decode_rows);
+
+    while (image.width > 1 || image.height > 1) {
+        levels.emplace_back();
+        image = downsample(image,
+                           std::max(image.width / 2, 1),
+                           std::max(image.height / 2, 1),
+                           srgb,
+                           filter,
+                           levels.back());
+    }
+    return levels;
+}
+} // namespace mipmaps
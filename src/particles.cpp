@@ -0,0 +1,511 @@
+#include "particles.H"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PARTICLES_SSE 1
+#endif
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+#include "jobs.H"
+#include "particles_shader.H"
+#include "shader.H"
+
+namespace {
+auto constexpr CPU_CHUNK = 16384;
+
+auto next_random(uint32_t& state) -> float {
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return static_cast<float>(state) / 4294967295.0f;
+}
+
+auto signed_random(uint32_t& state) -> float {
+    return next_random(state) * 2.0f - 1.0f;
+}
+
+void set_uniform(unsigned int program, const char* name, unsigned int value) {
+    glUniform1ui(glGetUniformLocation(program, name), value);
+}
+
+void set_uniform(unsigned int program, const char* name, float value) {
+    glUniform1f(glGetUniformLocation(program, name), value);
+}
+
+void set_uniform(unsigned int program, const char* name, const Vec3& value) {
+    glUniform3f(glGetUniformLocation(program, name), value.x, value.y, value.z);
+}
+} // namespace
+
+namespace particles {
+auto backend_name(Backend backend) -> const char* {
+    switch (backend) {
+        case Backend::Compute:
+            return "Compute shader";
+        case Backend::TransformFeedback:
+            return "Transform feedback";
+        case Backend::Cpu:
+            return "CPU (SIMD)";
+    }
+    return "Unknown";
+}
+
+auto is_supported(Backend backend) -> bool {
+    switch (backend) {
+        case Backend::Compute:
+            return GLAD_GL_VERSION_4_3 != 0;
+        case Backend::TransformFeedback:
+        case Backend::Cpu:
+            return true;
+    }
+    return false;
+}
+
+void ParticleSystem::CpuState::resize(size_t capacity) {
+    for (auto* array : {&x, &y, &z, &vx, &vy, &vz, &life, &total_life}) {
+        array->resize(capacity);
+    }
+    count = 0;
+}
+
+auto ParticleSystem::init(Backend backend, size_t capacity) -> bool {
+    if (!is_supported(backend)) {
+        spdlog::error("{} particles are not supported by this context",
+                      backend_name(backend));
+        return false;
+    }
+    spdlog::info("Initializing {} particles using the {} backend",
+                 capacity,
+                 backend_name(backend));
+    backend_ = backend;
+    capacity_ = capacity;
+    emit_accumulator_ = 0.0f;
+    glGenVertexArrays(1, &VAO_);
+    switch (backend) {
+        case Backend::Compute:
+            return init_compute();
+        case Backend::TransformFeedback:
+            return init_feedback();
+        case Backend::Cpu:
+            return init_cpu();
+    }
+    return false;
+}
+
+auto ParticleSystem::init_compute() -> bool {
+    prepare_program_ = link_compute_program(shaders::particles_prepare_src);
+    emit_program_ = link_compute_program(shaders::particles_emit_src);
+    simulate_program_ = link_compute_program(shaders::particles_simulate_src);
+    finalize_program_ = link_compute_program(shaders::particles_finalize_src);
+    render_program_ = link_program(shaders::particles_gpu_vertex_src,
+                                   shaders::particles_fragment_src);
+    if (prepare_program_ == 0 || emit_program_ == 0 || simulate_program_ == 0 ||
+        finalize_program_ == 0 || render_program_ == 0) {
+        return false;
+    }
+
+    // Every particle starts out dead, so the dead list holds every index.
+    std::vector<uint32_t> dead(capacity_);
+    for (size_t i = 0; i < capacity_; ++i) {
+        dead[i] = static_cast<uint32_t>(i);
+    }
+    uint32_t counters[4] = {static_cast<uint32_t>(capacity_), 0, 0, 0};
+    uint32_t indirect[10] = {0, 1, 1, 0, 1, 1, 4, 0, 0, 0};
+
+    glGenBuffers(BUFFER_COUNT, buffers_);
+    auto allocate = [&](Buffer buffer, size_t bytes, const void* data) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers_[buffer]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     static_cast<GLsizeiptr>(bytes),
+                     data,
+                     GL_DYNAMIC_DRAW);
+    };
+    allocate(PARTICLES, capacity_ * 2 * sizeof(Vec4), nullptr);
+    allocate(DEAD_LIST, capacity_ * sizeof(uint32_t), dead.data());
+    allocate(ALIVE_LISTS, capacity_ * 2 * sizeof(uint32_t), nullptr);
+    allocate(COUNTERS, sizeof(counters), counters);
+    allocate(INDIRECT, sizeof(indirect), indirect);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    current_ = 0;
+    return true;
+}
+
+auto ParticleSystem::init_feedback() -> bool {
+    const char* varyings[] = {"outPosition", "outVelocity"};
+    feedback_program_ =
+        link_feedback_program(shaders::particles_feedback_update_src, varyings, 2);
+    render_program_ = link_program(shaders::particles_feedback_vertex_src,
+                                   shaders::particles_fragment_src);
+    if (feedback_program_ == 0 || render_program_ == 0) {
+        return false;
+    }
+
+    // Zeroed state means every slot starts out dead.
+    std::vector<Vec4> zeroes(capacity_ * 2);
+    glGenBuffers(2, state_buffers_);
+    glGenVertexArrays(2, update_vaos_);
+    glGenVertexArrays(2, render_vaos_);
+    for (int i = 0; i < 2; ++i) {
+        glBindBuffer(GL_ARRAY_BUFFER, state_buffers_[i]);
+        glBufferData(GL_ARRAY_BUFFER,
+                     static_cast<GLsizeiptr>(zeroes.size() * sizeof(Vec4)),
+                     zeroes.data(),
+                     GL_DYNAMIC_COPY);
+        for (unsigned int divisor = 0; divisor < 2; ++divisor) {
+            glBindVertexArray(divisor == 0 ? update_vaos_[i] : render_vaos_[i]);
+            glVertexAttribPointer(
+                0, 4, GL_FLOAT, GL_FALSE, 2 * sizeof(Vec4), (void*)0);
+            glEnableVertexAttribArray(0);
+            glVertexAttribDivisor(0, divisor);
+            glVertexAttribPointer(1,
+                                  4,
+                                  GL_FLOAT,
+                                  GL_FALSE,
+                                  2 * sizeof(Vec4),
+                                  (void*)sizeof(Vec4)); // NOLINT
+            glEnableVertexAttribArray(1);
+            glVertexAttribDivisor(1, divisor);
+        }
+    }
+    glBindVertexArray(0);
+    current_ = 0;
+    emit_cursor_ = 0;
+    return true;
+}
+
+auto ParticleSystem::init_cpu() -> bool {
+    render_program_ = link_program(shaders::particles_cpu_vertex_src,
+                                   shaders::particles_fragment_src);
+    if (render_program_ == 0) {
+        return false;
+    }
+    front_.resize(capacity_);
+    back_.resize(capacity_);
+    instances_.resize(capacity_);
+
+    glGenBuffers(1, &VBO_);
+    glBindVertexArray(VAO_);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_);
+    glBufferData(GL_ARRAY_BUFFER,
+                 static_cast<GLsizeiptr>(capacity_ * sizeof(Vec4)),
+                 nullptr,
+                 GL_STREAM_DRAW);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(Vec4), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribDivisor(0, 1);
+    glBindVertexArray(0);
+    return true;
+}
+
+void ParticleSystem::shutdown() {
+    for (unsigned int program : {prepare_program_,
+                                 emit_program_,
+                                 simulate_program_,
+                                 finalize_program_,
+                                 feedback_program_,
+                                 render_program_}) {
+        glDeleteProgram(program);
+    }
+    prepare_program_ = emit_program_ = simulate_program_ = finalize_program_ = 0;
+    feedback_program_ = render_program_ = 0;
+    glDeleteBuffers(BUFFER_COUNT, buffers_);
+    std::fill(std::begin(buffers_), std::end(buffers_), 0);
+    glDeleteBuffers(2, state_buffers_);
+    glDeleteVertexArrays(2, update_vaos_);
+    glDeleteVertexArrays(2, render_vaos_);
+    for (int i = 0; i < 2; ++i) {
+        state_buffers_[i] = update_vaos_[i] = render_vaos_[i] = 0;
+    }
+    glDeleteBuffers(1, &VBO_);
+    glDeleteVertexArrays(1, &VAO_);
+    VBO_ = VAO_ = 0;
+
+    front_ = {};
+    back_ = {};
+    instances_ = {};
+    capacity_ = 0;
+}
+
+void ParticleSystem::update(const Emitter& emitter, float dt) {
+    if (render_program_ == 0) {
+        return;
+    }
+    emit_accumulator_ += emitter.rate * dt;
+    auto emit_count = static_cast<unsigned int>(emit_accumulator_);
+    emit_accumulator_ -= static_cast<float>(emit_count);
+
+    switch (backend_) {
+        case Backend::Compute:
+            update_compute(emitter, dt, emit_count);
+            break;
+        case Backend::TransformFeedback:
+            update_feedback(emitter, dt, emit_count);
+            break;
+        case Backend::Cpu:
+            update_cpu(emitter, dt, emit_count);
+            break;
+    }
+}
+
+void ParticleSystem::update_compute(const Emitter& emitter,
+                                    float dt,
+                                    unsigned int emit_count) {
+    for (unsigned int i = 0; i < BUFFER_COUNT; ++i) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, i, buffers_[i]);
+    }
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, buffers_[INDIRECT]);
+    auto capacity = static_cast<unsigned int>(capacity_);
+
+    glUseProgram(prepare_program_);
+    set_uniform(prepare_program_, "uEmitRequest", emit_count);
+    set_uniform(prepare_program_, "uCurrent", current_);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+    glUseProgram(emit_program_);
+    set_uniform(emit_program_, "uCurrent", current_);
+    set_uniform(emit_program_, "uCapacity", capacity);
+    set_uniform(emit_program_, "uSeed", seed_++);
+    set_uniform(emit_program_, "uOrigin", emitter.origin);
+    set_uniform(emit_program_, "uSpread", emitter.spread);
+    set_uniform(emit_program_, "uVelocity", emitter.velocity);
+    set_uniform(emit_program_, "uVelocityJitter", emitter.velocity_jitter);
+    glUniform2f(glGetUniformLocation(emit_program_, "uLifeRange"),
+                emitter.min_life,
+                emitter.max_life);
+    glDispatchComputeIndirect(0);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    glUseProgram(simulate_program_);
+    set_uniform(simulate_program_, "uCurrent", current_);
+    set_uniform(simulate_program_, "uCapacity", capacity);
+    set_uniform(simulate_program_, "uDeltaTime", dt);
+    set_uniform(simulate_program_, "uGravity", emitter.gravity);
+    glDispatchComputeIndirect(3 * sizeof(uint32_t));
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    current_ = 1 - current_;
+    glUseProgram(finalize_program_);
+    set_uniform(finalize_program_, "uCurrent", current_);
+    glDispatchCompute(1, 1, 1);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+    glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
+void ParticleSystem::update_feedback(const Emitter& emitter,
+                                     float dt,
+                                     unsigned int emit_count) {
+    auto capacity = static_cast<unsigned int>(capacity_);
+    emit_count = std::min(emit_count, capacity);
+
+    glUseProgram(feedback_program_);
+    set_uniform(feedback_program_, "uDeltaTime", dt);
+    set_uniform(feedback_program_, "uGravity", emitter.gravity);
+    set_uniform(feedback_program_, "uCapacity", capacity);
+    set_uniform(feedback_program_, "uEmitStart", emit_cursor_);
+    set_uniform(feedback_program_, "uEmitCount", emit_count);
+    set_uniform(feedback_program_, "uSeed", seed_++);
+    set_uniform(feedback_program_, "uOrigin", emitter.origin);
+    set_uniform(feedback_program_, "uSpread", emitter.spread);
+    set_uniform(feedback_program_, "uVelocity", emitter.velocity);
+    set_uniform(feedback_program_, "uVelocityJitter", emitter.velocity_jitter);
+    glUniform2f(glGetUniformLocation(feedback_program_, "uLifeRange"),
+                emitter.min_life,
+                emitter.max_life);
+    emit_cursor_ = (emit_cursor_ + emit_count) % capacity;
+
+    // Read the current state, capture the next one. Nothing is rasterized.
+    unsigned int next = 1 - current_;
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBindVertexArray(update_vaos_[current_]);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, state_buffers_[next]);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(capacity_));
+    glEndTransformFeedback();
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glBindVertexArray(0);
+    glDisable(GL_RASTERIZER_DISCARD);
+    current_ = next;
+}
+
+void ParticleSystem::update_cpu(const Emitter& emitter,
+                                float dt,
+                                unsigned int emit_count) {
+    CpuState& s = front_;
+    size_t chunk_count = (s.count + CPU_CHUNK - 1) / CPU_CHUNK;
+    chunk_alive_.assign(chunk_count, 0);
+
+    // Integrate every particle and count the survivors of each chunk.
+    jobs::parallel_for(0, chunk_count, 1, [&](size_t first_chunk, size_t last_chunk) {
+        for (size_t chunk = first_chunk; chunk < last_chunk; ++chunk) {
+            size_t begin = chunk * CPU_CHUNK;
+            size_t end = std::min(s.count, begin + CPU_CHUNK);
+            size_t alive = 0;
+            size_t i = begin;
+#ifdef PARTICLES_SSE
+            __m128 dt4 = _mm_set1_ps(dt);
+            __m128 gx = _mm_set1_ps(emitter.gravity.x * dt);
+            __m128 gy = _mm_set1_ps(emitter.gravity.y * dt);
+            __m128 gz = _mm_set1_ps(emitter.gravity.z * dt);
+            __m128 zero = _mm_setzero_ps();
+            for (; i + 4 <= end; i += 4) {
+                __m128 vx = _mm_add_ps(_mm_loadu_ps(&s.vx[i]), gx);
+                __m128 vy = _mm_add_ps(_mm_loadu_ps(&s.vy[i]), gy);
+                __m128 vz = _mm_add_ps(_mm_loadu_ps(&s.vz[i]), gz);
+                _mm_storeu_ps(&s.vx[i], vx);
+                _mm_storeu_ps(&s.vy[i], vy);
+                _mm_storeu_ps(&s.vz[i], vz);
+                _mm_storeu_ps(&s.x[i],
+                              _mm_add_ps(_mm_loadu_ps(&s.x[i]), _mm_mul_ps(vx, dt4)));
+                _mm_storeu_ps(&s.y[i],
+                              _mm_add_ps(_mm_loadu_ps(&s.y[i]), _mm_mul_ps(vy, dt4)));
+                _mm_storeu_ps(&s.z[i],
+                              _mm_add_ps(_mm_loadu_ps(&s.z[i]), _mm_mul_ps(vz, dt4)));
+                __m128 life = _mm_sub_ps(_mm_loadu_ps(&s.life[i]), dt4);
+                _mm_storeu_ps(&s.life[i], life);
+                auto mask =
+                    static_cast<unsigned>(_mm_movemask_ps(_mm_cmpgt_ps(life, zero)));
+                alive += static_cast<size_t>(std::popcount(mask));
+            }
+#endif
+            for (; i < end; ++i) {
+                s.vx[i] += emitter.gravity.x * dt;
+                s.vy[i] += emitter.gravity.y * dt;
+                s.vz[i] += emitter.gravity.z * dt;
+                s.x[i] += s.vx[i] * dt;
+                s.y[i] += s.vy[i] * dt;
+                s.z[i] += s.vz[i] * dt;
+                s.life[i] -= dt;
+                alive += s.life[i] > 0.0f ? 1 : 0;
+            }
+            chunk_alive_[chunk] = alive;
+        }
+    });
+
+    // Turn the survivor counts into output offsets, then compact each chunk into the
+    // back buffer and fill the instance data in the same pass.
+    size_t total = 0;
+    for (size_t& alive : chunk_alive_) {
+        size_t offset = total;
+        total += alive;
+        alive = offset;
+    }
+    CpuState& d = back_;
+    jobs::parallel_for(0, chunk_count, 1, [&](size_t first_chunk, size_t last_chunk) {
+        for (size_t chunk = first_chunk; chunk < last_chunk; ++chunk) {
+            size_t out = chunk_alive_[chunk];
+            size_t end = std::min(s.count, (chunk + 1) * CPU_CHUNK);
+            for (size_t i = chunk * CPU_CHUNK; i < end; ++i) {
+                if (s.life[i] <= 0.0f) {
+                    continue;
+                }
+                d.x[out] = s.x[i];
+                d.y[out] = s.y[i];
+                d.z[out] = s.z[i];
+                d.vx[out] = s.vx[i];
+                d.vy[out] = s.vy[i];
+                d.vz[out] = s.vz[i];
+                d.life[out] = s.life[i];
+                d.total_life[out] = s.total_life[i];
+                float age = 1.0f - s.life[i] / s.total_life[i];
+                instances_[out] = {s.x[i], s.y[i], s.z[i], age};
+                ++out;
+            }
+        }
+    });
+    d.count = total;
+    std::swap(front_, back_);
+
+    CpuState& p = front_;
+    size_t emitted = std::min<size_t>(emit_count, capacity_ - p.count);
+    for (size_t n = 0; n < emitted; ++n) {
+        size_t i = p.count++;
+        p.x[i] = emitter.origin.x + signed_random(seed_) * emitter.spread;
+        p.y[i] = emitter.origin.y + signed_random(seed_) * emitter.spread;
+        p.z[i] = emitter.origin.z + signed_random(seed_) * emitter.spread;
+        p.vx[i] = emitter.velocity.x + signed_random(seed_) * emitter.velocity_jitter;
+        p.vy[i] = emitter.velocity.y + signed_random(seed_) * emitter.velocity_jitter;
+        p.vz[i] = emitter.velocity.z + signed_random(seed_) * emitter.velocity_jitter;
+        float t = next_random(seed_);
+        p.life[i] = p.total_life[i] =
+            emitter.min_life + (emitter.max_life - emitter.min_life) * t;
+        instances_[i] = {p.x[i], p.y[i], p.z[i], 0.0f};
+    }
+}
+
+void ParticleSystem::render(const Mat4& view_proj,
+                            const Vec3& right,
+                            const Vec3& up,
+                            float size) {
+    if (render_program_ == 0) {
+        return;
+    }
+    glBindVertexArray(backend_ == Backend::TransformFeedback ? render_vaos_[current_]
+                                                             : VAO_);
+    if (backend_ == Backend::Cpu) {
+        if (front_.count == 0) {
+            glBindVertexArray(0);
+            return;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, VBO_);
+        size_t bytes = front_.count * sizeof(Vec4);
+        void* dst = glMapBufferRange(GL_ARRAY_BUFFER,
+                                     0,
+                                     static_cast<GLsizeiptr>(bytes),
+                                     GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (dst == nullptr) {
+            glBindVertexArray(0);
+            return;
+        }
+        std::memcpy(dst, instances_.data(), bytes);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+
+    // Particles are additive and do not occlude each other, so they are drawn
+    // unsorted without writing depth.
+    GLboolean blend_was_enabled = glIsEnabled(GL_BLEND);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glDepthMask(GL_FALSE);
+
+    glUseProgram(render_program_);
+    glUniformMatrix4fv(
+        glGetUniformLocation(render_program_, "uViewProj"), 1, GL_FALSE, view_proj.m);
+    set_uniform(render_program_, "uRight", right);
+    set_uniform(render_program_, "uUp", up);
+    set_uniform(render_program_, "uSize", size);
+
+    if (backend_ == Backend::Compute) {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLES, buffers_[PARTICLES]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ALIVE_LISTS, buffers_[ALIVE_LISTS]);
+        auto alive_offset = current_ * static_cast<unsigned int>(capacity_);
+        set_uniform(render_program_, "uAliveOffset", alive_offset);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffers_[INDIRECT]);
+        glDrawArraysIndirect(GL_TRIANGLE_STRIP,
+                             (void*)(6 * sizeof(uint32_t))); // NOLINT
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    } else if (backend_ == Backend::TransformFeedback) {
+        glDrawArraysInstanced(
+            GL_TRIANGLE_STRIP, 0, 4, static_cast<GLsizei>(capacity_));
+    } else {
+        glDrawArraysInstanced(
+            GL_TRIANGLE_STRIP, 0, 4, static_cast<GLsizei>(front_.count));
+    }
+
+    glDepthMask(GL_TRUE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (blend_was_enabled != GL_TRUE) {
+        glDisable(GL_BLEND);
+    }
+    glBindVertexArray(0);
+}
+} // namespace particles
@@ -0,0 +1,626 @@
+#include "post_process.H"
+
+#include <algorithm>
+
+#include <glad/glad.h>
+
+#include "post_process_shader.H"
+#include "shader.H"
+
+namespace {
+// The chain stops before a level gets smaller than this in either dimension.
+auto constexpr MIN_MIP_SIZE = 8;
+auto constexpr BLOOM_FORMAT = GL_R11F_G11F_B10F;
+// The half resolution buffers SSAO works on.
+auto constexpr DEPTH_NORMAL_FORMAT = GL_RGBA16F;
+auto constexpr AO_FORMAT = GL_R8;
+// TAA cycles through this many sub-pixel offsets.
+auto constexpr JITTER_PHASES = 8;
+
+void set_uniform(unsigned int program, const char* name, int value) {
+    glUniform1i(glGetUniformLocation(program, name), value);
+}
+
+void set_uniform(unsigned int program, const char* name, float value) {
+    glUniform1f(glGetUniformLocation(program, name), value);
+}
+
+void set_uniform(unsigned int program, const char* name, const Vec2& value) {
+    glUniform2f(glGetUniformLocation(program, name), value.x, value.y);
+}
+
+void set_uniform(unsigned int program, const char* name, const Mat4& value) {
+    glUniformMatrix4fv(glGetUniformLocation(program, name), 1, GL_FALSE, value.m);
+}
+
+void set_size_uniform(unsigned int program, const char* name, int width, int height) {
+    glUniform2i(glGetUniformLocation(program, name), width, height);
+}
+
+// Binds `depth` for shaders reading it through either uDepth (unit `unit`) or
+// uDepthMultisample (unit `unit` + 1), depending on whether it is multisampled.
+void bind_depth(unsigned int program,
+                const RenderGraph::PassContext& context,
+                RenderGraph::Resource depth,
+                int unit) {
+    bool multisampled = context.desc(depth).samples > 1;
+    set_uniform(program, "uMultisampled", multisampled ? 1 : 0);
+    int target_unit = multisampled ? unit + 1 : unit;
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(target_unit));
+    glBindTexture(multisampled ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D,
+                  context.texture(depth));
+}
+
+auto next_random(uint32_t& state) -> float {
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return static_cast<float>(state) / 4294967295.0f;
+}
+
+// Element `index` of the Halton sequence in `base`, in [0, 1).
+auto halton(uint32_t index, uint32_t base) -> float {
+    float fraction = 1.0f;
+    float result = 0.0f;
+    while (index > 0) {
+        fraction /= static_cast<float>(base);
+        result += fraction * static_cast<float>(index % base);
+        index /= base;
+    }
+    return result;
+}
+
+void draw_fullscreen(unsigned int VAO) {
+    glBindVertexArray(VAO);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+}
+} // namespace
+
+namespace post {
+auto source_rect(const RenderGraph::PassContext& context,
+                 RenderGraph::Resource resource) -> SourceRect {
+    const auto& desc = context.desc(resource);
+    auto extent = context.extent(resource);
+    auto width = static_cast<float>(extent.width);
+    auto height = static_cast<float>(extent.height);
+    return {{static_cast<float>(desc.width) / width,
+             static_cast<float>(desc.height) / height},
+            {1.0f / width, 1.0f / height}};
+}
+
+auto Bloom::init() -> bool {
+    down_program_ = link_program(shaders::fullscreen_vertex_src,
+                                 shaders::bloom_downsample_fragment_src);
+    up_program_ = link_program(shaders::fullscreen_vertex_src,
+                               shaders::bloom_upsample_fragment_src);
+    if (down_program_ == 0 || up_program_ == 0) {
+        shutdown();
+        return false;
+    }
+    glUseProgram(up_program_);
+    set_uniform(up_program_, "uCurrent", 1);
+    glUseProgram(0);
+    // The core profile refuses to draw without a vertex array object, even one
+    // without any attributes.
+    glGenVertexArrays(1, &VAO_);
+    return true;
+}
+
+void Bloom::shutdown() {
+    glDeleteVertexArrays(1, &VAO_);
+    glDeleteProgram(down_program_);
+    glDeleteProgram(up_program_);
+    VAO_ = down_program_ = up_program_ = 0;
+}
+
+auto Bloom::add_passes(RenderGraph& graph,
+                       RenderGraph::Resource source,
+                       int width,
+                       int height) -> RenderGraph::Resource {
+    static const char* const MIP_NAMES[MAX_MIPS] = {"bloom_mip0",
+                                                     "bloom_mip1",
+                                                     "bloom_mip2",
+                                                     "bloom_mip3",
+                                                     "bloom_mip4",
+                                                     "bloom_mip5"};
+    static const char* const UP_NAMES[MAX_MIPS - 1] = {
+        "bloom_up0", "bloom_up1", "bloom_up2", "bloom_up3", "bloom_up4"};
+
+    // Downsample: every level is half the size of the one above and filtered with
+    // the 13-tap kernel. The first level also applies the Karis average.
+    RenderGraph::Resource mips[MAX_MIPS];
+    int mip_count = 0;
+    RenderGraph::Resource input = source;
+    while (mip_count < MAX_MIPS) {
+        width /= 2;
+        height /= 2;
+        if (std::min(width, height) < MIN_MIP_SIZE) {
+            break;
+        }
+        int level = mip_count;
+        graph.add_pass(
+            "bloom_down",
+            [&](RenderGraph::PassBuilder& builder) {
+                builder.read(input);
+                mips[level] = builder.create(MIP_NAMES[level],
+                                             {width, height, BLOOM_FORMAT});
+            },
+            [this, input, level](RenderGraph::PassContext& context) {
+                SourceRect rect = source_rect(context, input);
+                glUseProgram(down_program_);
+                set_uniform(down_program_, "uUvMax", rect.uv_max);
+                set_uniform(down_program_, "uTexel", rect.texel);
+                set_uniform(down_program_, "uKarisAverage", level == 0 ? 1 : 0);
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, context.texture(input));
+                draw_fullscreen(VAO_);
+            });
+        input = mips[level];
+        ++mip_count;
+    }
+    if (mip_count == 0) {
+        return -1;
+    }
+
+    // Upsample: walk back up, adding the tent-filtered smaller level to the larger
+    // one, so every level ends up holding the sum of all blurs below it. Each step
+    // writes a new target instead of blending onto the downsampled one; a pass
+    // writing what an earlier pass has read would tie the chain into a cycle the
+    // graph could never cull.
+    RenderGraph::Resource result = mips[mip_count - 1];
+    for (int level = mip_count - 2; level >= 0; --level) {
+        RenderGraph::Resource smaller = result;
+        RenderGraph::Resource current = mips[level];
+        graph.add_pass(
+            "bloom_up",
+            [&](RenderGraph::PassBuilder& builder) {
+                builder.read(smaller);
+                builder.read(current);
+                result = builder.create(UP_NAMES[level], graph.desc(current));
+            },
+            [this, smaller, current](RenderGraph::PassContext& context) {
+                SourceRect rect = source_rect(context, smaller);
+                glUseProgram(up_program_);
+                set_uniform(up_program_, "uUvMax", rect.uv_max);
+                set_uniform(up_program_, "uTexel", rect.texel);
+                set_uniform(up_program_,
+                            "uCurrentUvMax",
+                            source_rect(context, current).uv_max);
+                set_uniform(up_program_, "uRadius", radius);
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, context.texture(current));
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, context.texture(smaller));
+                draw_fullscreen(VAO_);
+            });
+    }
+    return result;
+}
+
+auto Ssao::init() -> bool {
+    prepare_program_ = link_program(shaders::fullscreen_vertex_src,
+                                    shaders::ssao_prepare_fragment_src);
+    ao_program_ =
+        link_program(shaders::fullscreen_vertex_src, shaders::ssao_fragment_src);
+    blur_program_ =
+        link_program(shaders::fullscreen_vertex_src, shaders::ssao_blur_fragment_src);
+    apply_program_ =
+        link_program(shaders::fullscreen_vertex_src, shaders::ssao_apply_fragment_src);
+    if (prepare_program_ == 0 || ao_program_ == 0 || blur_program_ == 0 ||
+        apply_program_ == 0) {
+        shutdown();
+        return false;
+    }
+
+    // Samples in the unit hemisphere around +z, denser towards the centre so
+    // nearby geometry weighs more.
+    float kernel[KERNEL_SIZE * 3];
+    uint32_t state = 0x9e3779b9u;
+    for (int i = 0; i < KERNEL_SIZE; ++i) {
+        Vec3 direction = normalize({next_random(state) * 2.0f - 1.0f,
+                                    next_random(state) * 2.0f - 1.0f,
+                                    next_random(state) * 0.9f + 0.1f});
+        float t = static_cast<float>(i) / static_cast<float>(KERNEL_SIZE);
+        Vec3 sample = direction * (next_random(state) * (0.1f + 0.9f * t * t));
+        kernel[i * 3] = sample.x;
+        kernel[i * 3 + 1] = sample.y;
+        kernel[i * 3 + 2] = sample.z;
+    }
+    glUseProgram(ao_program_);
+    glUniform3fv(glGetUniformLocation(ao_program_, "uKernel"), KERNEL_SIZE, kernel);
+
+    glUseProgram(prepare_program_);
+    set_uniform(prepare_program_, "uDepth", 0);
+    set_uniform(prepare_program_, "uDepthMultisample", 1);
+    glUseProgram(blur_program_);
+    set_uniform(blur_program_, "uAo", 0);
+    set_uniform(blur_program_, "uDepthNormal", 1);
+    glUseProgram(apply_program_);
+    set_uniform(apply_program_, "uDepth", 1);
+    set_uniform(apply_program_, "uDepthMultisample", 2);
+    set_uniform(apply_program_, "uAo", 3);
+    set_uniform(apply_program_, "uDepthNormal", 4);
+    glUseProgram(0);
+    glGenVertexArrays(1, &VAO_);
+    return true;
+}
+
+void Ssao::shutdown() {
+    glDeleteVertexArrays(1, &VAO_);
+    glDeleteProgram(prepare_program_);
+    glDeleteProgram(ao_program_);
+    glDeleteProgram(blur_program_);
+    glDeleteProgram(apply_program_);
+    VAO_ = prepare_program_ = ao_program_ = blur_program_ = apply_program_ = 0;
+}
+
+auto Ssao::add_passes(RenderGraph& graph,
+                      RenderGraph::Resource color,
+                      RenderGraph::Resource depth,
+                      const Mat4& proj) -> RenderGraph::Resource {
+    RenderGraph::TextureDesc full = graph.desc(color);
+    int half_width = (full.width + 1) / 2;
+    int half_height = (full.height + 1) / 2;
+    Mat4 inverse_proj = inverse(proj);
+
+    // View-space normal and depth at half resolution.
+    RenderGraph::Resource depth_normal = -1;
+    graph.add_pass(
+        "ssao_prepare",
+        [&](RenderGraph::PassBuilder& builder) {
+            builder.read(depth);
+            depth_normal = builder.create(
+                "ssao_depth_normal", {half_width, half_height, DEPTH_NORMAL_FORMAT});
+        },
+        [this, depth, full, inverse_proj](RenderGraph::PassContext& context) {
+            glUseProgram(prepare_program_);
+            set_size_uniform(prepare_program_, "uSize", full.width, full.height);
+            set_uniform(prepare_program_, "uInverseProj", inverse_proj);
+            bind_depth(prepare_program_, context, depth, 0);
+            draw_fullscreen(VAO_);
+        });
+
+    RenderGraph::Resource raw = -1;
+    graph.add_pass(
+        "ssao",
+        [&](RenderGraph::PassBuilder& builder) {
+            builder.read(depth_normal);
+            raw = builder.create("ssao_raw", {half_width, half_height, AO_FORMAT});
+        },
+        [this, depth_normal, proj](RenderGraph::PassContext& context) {
+            glUseProgram(ao_program_);
+            set_size_uniform(ao_program_, "uSize", context.width, context.height);
+            set_uniform(ao_program_, "uProj", proj);
+            set_uniform(ao_program_, "uRadius", radius);
+            set_uniform(ao_program_, "uBias", bias);
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, context.texture(depth_normal));
+            draw_fullscreen(VAO_);
+        });
+
+    // Separable bilateral blur, horizontal then vertical.
+    RenderGraph::Resource blurred = raw;
+    for (int axis = 0; axis < 2; ++axis) {
+        RenderGraph::Resource input = blurred;
+        graph.add_pass(
+            axis == 0 ? "ssao_blur_x" : "ssao_blur_y",
+            [&](RenderGraph::PassBuilder& builder) {
+                builder.read(input);
+                builder.read(depth_normal);
+                blurred = builder.create(axis == 0 ? "ssao_blur_x" : "ssao_blurred",
+                                         {half_width, half_height, AO_FORMAT});
+            },
+            [this, input, depth_normal, axis](RenderGraph::PassContext& context) {
+                glUseProgram(blur_program_);
+                set_size_uniform(
+                    blur_program_, "uSize", context.width, context.height);
+                set_size_uniform(blur_program_, "uDirection", 1 - axis, axis);
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, context.texture(depth_normal));
+                glActiveTexture(GL_TEXTURE0);
+                glBindTexture(GL_TEXTURE_2D, context.texture(input));
+                draw_fullscreen(VAO_);
+            });
+    }
+
+    // Multiplied into the color by blending, so that a multisampled color works
+    // as well: every sample of a pixel is darkened alike.
+    graph.add_pass(
+        "ssao_apply",
+        [&](RenderGraph::PassBuilder& builder) {
+            builder.read(depth);
+            builder.read(blurred);
+            builder.read(depth_normal);
+            builder.write(color);
+        },
+        [this, depth, blurred, depth_normal, half_width, half_height, inverse_proj](
+            RenderGraph::PassContext& context) {
+            glUseProgram(apply_program_);
+            set_size_uniform(apply_program_, "uHalfSize", half_width, half_height);
+            set_uniform(apply_program_, "uInverseProj", inverse_proj);
+            set_uniform(apply_program_, "uStrength", strength);
+            glActiveTexture(GL_TEXTURE4);
+            glBindTexture(GL_TEXTURE_2D, context.texture(depth_normal));
+            glActiveTexture(GL_TEXTURE3);
+            glBindTexture(GL_TEXTURE_2D, context.texture(blurred));
+            bind_depth(apply_program_, context, depth, 1);
+            glActiveTexture(GL_TEXTURE0);
+            glEnable(GL_BLEND);
+            glBlendFuncSeparate(GL_ZERO, GL_SRC_COLOR, GL_ZERO, GL_ONE);
+            draw_fullscreen(VAO_);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            glDisable(GL_BLEND);
+        });
+    return color;
+}
+
+auto FinalPass::init() -> bool {
+    program_ =
+        link_program(shaders::fullscreen_vertex_src, shaders::final_fragment_src);
+    if (program_ == 0) {
+        return false;
+    }
+    glUseProgram(program_);
+    set_uniform(program_, "uScene", 0);
+    set_uniform(program_, "uBloom", 1);
+    glUseProgram(0);
+    glGenVertexArrays(1, &VAO_);
+    return true;
+}
+
+void FinalPass::shutdown() {
+    glDeleteVertexArrays(1, &VAO_);
+    glDeleteProgram(program_);
+    VAO_ = program_ = 0;
+}
+
+void FinalPass::draw(unsigned int scene,
+                     const SourceRect& scene_rect,
+                     unsigned int bloom,
+                     const SourceRect& bloom_rect,
+                     const FinalSettings& settings) {
+    glUseProgram(program_);
+    set_uniform(program_, "uSceneUvMax", scene_rect.uv_max);
+    set_uniform(program_, "uSceneTexel", scene_rect.texel);
+    set_uniform(program_, "uBloomUvMax", bloom_rect.uv_max);
+    set_uniform(program_, "uBloomTexel", bloom_rect.texel);
+    set_uniform(program_,
+                "uBloomStrength",
+                bloom == 0 ? 0.0f : settings.bloom_strength);
+    set_uniform(program_, "uExposure", settings.exposure);
+    set_uniform(program_,
+                "uSharpness",
+                settings.upscale == Upscale::Sharpen ? settings.sharpness : 0.0f);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, bloom);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, scene);
+    draw_fullscreen(VAO_);
+}
+
+auto Antialiasing::mode_name(Mode mode) -> const char* {
+    switch (mode) {
+        case Mode::None:
+            return "None";
+        case Mode::Msaa:
+            return "MSAA 4x";
+        case Mode::Fxaa:
+            return "FXAA";
+        case Mode::Taa:
+            return "TAA";
+    }
+    return "";
+}
+
+auto Antialiasing::init() -> bool {
+    fxaa_program_ =
+        link_program(shaders::fullscreen_vertex_src, shaders::fxaa_fragment_src);
+    taa_program_ =
+        link_program(shaders::fullscreen_vertex_src, shaders::taa_fragment_src);
+    if (fxaa_program_ == 0 || taa_program_ == 0) {
+        glDeleteProgram(fxaa_program_);
+        glDeleteProgram(taa_program_);
+        fxaa_program_ = taa_program_ = 0;
+        return false;
+    }
+    glUseProgram(taa_program_);
+    set_uniform(taa_program_, "uCurrent", 0);
+    set_uniform(taa_program_, "uDepth", 1);
+    set_uniform(taa_program_, "uHistory", 2);
+    glUseProgram(0);
+    glGenVertexArrays(1, &VAO_);
+    for (GpuTimer& timer : timers_) {
+        timer.init();
+    }
+    return true;
+}
+
+void Antialiasing::shutdown(RenderTargetPool& pool) {
+    for (RenderTarget& history : history_) {
+        if (history.texture != 0) {
+            pool.release(history.texture);
+        }
+        history = {};
+    }
+    for (GpuTimer& timer : timers_) {
+        timer.shutdown();
+    }
+    glDeleteVertexArrays(1, &VAO_);
+    glDeleteProgram(fxaa_program_);
+    glDeleteProgram(taa_program_);
+    VAO_ = fxaa_program_ = taa_program_ = 0;
+}
+
+void Antialiasing::set_mode(Mode mode) {
+    if (mode != mode_) {
+        history_valid_ = false;
+    }
+    mode_ = mode;
+}
+
+auto Antialiasing::jitter(int width, int height) const -> Mat4 {
+    if (mode_ != Mode::Taa) {
+        return Mat4 {};
+    }
+    // Halton (2, 3) covers the pixel evenly within a few frames. The offset is
+    // applied in clip space, i.e. before the perspective divide, so it moves every
+    // pixel by the same sub-pixel amount regardless of depth.
+    uint32_t phase = frame_ % JITTER_PHASES + 1;
+    float x = halton(phase, 2) - 0.5f;
+    float y = halton(phase, 3) - 0.5f;
+    return translate({2.0f * x / static_cast<float>(width),
+                      2.0f * y / static_cast<float>(height),
+                      0.0f});
+}
+
+auto Antialiasing::add_passes(RenderGraph& graph,
+                              RenderGraph::Resource color,
+                              RenderGraph::Resource depth,
+                              const Mat4& view_proj) -> RenderGraph::Resource {
+    if (mode_ != Mode::Taa && history_[0].texture != 0) {
+        for (RenderTarget& history : history_) {
+            graph.pool().release(history.texture);
+            history = {};
+        }
+    }
+
+    GpuTimer* timer = &timers_[static_cast<int>(mode_)];
+    RenderGraph::Resource result = color;
+    switch (mode_) {
+        case Mode::None:
+            break;
+        case Mode::Msaa:
+            // A blit from a multisampled to a single-sampled framebuffer averages
+            // the samples. The formats have to match exactly.
+            graph.add_pass(
+                "msaa_resolve",
+                [&](RenderGraph::PassBuilder& builder) {
+                    builder.read(color);
+                    RenderGraph::TextureDesc desc = graph.desc(color);
+                    desc.samples = 1;
+                    result = builder.create("scene_resolved", desc);
+                },
+                [color, timer](RenderGraph::PassContext& context) {
+                    timer->begin();
+                    glBindFramebuffer(GL_READ_FRAMEBUFFER,
+                                      context.read_framebuffer(color));
+                    glBlitFramebuffer(0,
+                                      0,
+                                      context.width,
+                                      context.height,
+                                      0,
+                                      0,
+                                      context.width,
+                                      context.height,
+                                      GL_COLOR_BUFFER_BIT,
+                                      GL_NEAREST);
+                    timer->end();
+                });
+            break;
+        case Mode::Fxaa:
+            graph.add_pass(
+                "fxaa",
+                [&](RenderGraph::PassBuilder& builder) {
+                    builder.read(color);
+                    result = builder.create("scene_fxaa", graph.desc(color));
+                },
+                [this, color, timer](RenderGraph::PassContext& context) {
+                    timer->begin();
+                    SourceRect rect = source_rect(context, color);
+                    glUseProgram(fxaa_program_);
+                    set_uniform(fxaa_program_, "uUvMax", rect.uv_max);
+                    set_uniform(fxaa_program_, "uTexel", rect.texel);
+                    glActiveTexture(GL_TEXTURE0);
+                    glBindTexture(GL_TEXTURE_2D, context.texture(color));
+                    draw_fullscreen(VAO_);
+                    timer->end();
+                });
+            break;
+        case Mode::Taa:
+            result = add_taa_pass(graph, color, depth, view_proj);
+            break;
+    }
+    return result;
+}
+
+auto Antialiasing::add_taa_pass(RenderGraph& graph,
+                                RenderGraph::Resource color,
+                                RenderGraph::Resource depth,
+                                const Mat4& view_proj) -> RenderGraph::Resource {
+    // The two history textures are held from the pool across frames. They follow
+    // the same bucketing as transients, so small size changes keep the history.
+    RenderGraph::TextureDesc desc = graph.desc(color);
+    RenderTargetDesc history_desc {desc.width, desc.height, GL_RGBA16F, 1};
+    if (history_[0].texture == 0 ||
+        !render_target_fits(
+            desc.width, desc.height, history_[0].width, history_[0].height)) {
+        for (RenderTarget& history : history_) {
+            if (history.texture != 0) {
+                graph.pool().release(history.texture);
+            }
+            history = graph.pool().acquire(history_desc);
+        }
+        history_valid_ = false;
+    }
+
+    const RenderTarget& previous = history_[1 - current_];
+    const RenderTarget& output = history_[current_];
+    bool valid = history_valid_;
+    RenderGraph::Resource history = -1;
+    if (valid) {
+        history = graph.import_texture("taa_history",
+                                       previous.texture,
+                                       {history_width_, history_height_, GL_RGBA16F},
+                                       {previous.width, previous.height});
+    }
+    auto result = graph.import_texture(
+        "taa_output", output.texture, history_desc, {output.width, output.height});
+    Mat4 reproject = previous_view_proj_ * inverse(view_proj);
+    GpuTimer* timer = &timers_[static_cast<int>(Mode::Taa)];
+
+    graph.add_pass(
+        "taa",
+        [&](RenderGraph::PassBuilder& builder) {
+            builder.read(color);
+            builder.read(depth);
+            if (valid) {
+                builder.read(history);
+            }
+            builder.write(result);
+        },
+        [this, color, depth, history, reproject, valid, timer](
+            RenderGraph::PassContext& context) {
+            timer->begin();
+            glUseProgram(taa_program_);
+            glUniform2i(glGetUniformLocation(taa_program_, "uSize"),
+                        context.width,
+                        context.height);
+            set_uniform(taa_program_, "uHistoryValid", valid ? 1 : 0);
+            set_uniform(taa_program_, "uFeedback", taa_feedback);
+            set_uniform(taa_program_, "uReproject", reproject);
+            if (valid) {
+                SourceRect rect = source_rect(context, history);
+                set_uniform(taa_program_, "uHistoryUvMax", rect.uv_max);
+                set_uniform(taa_program_, "uHistoryTexel", rect.texel);
+                glActiveTexture(GL_TEXTURE2);
+                glBindTexture(GL_TEXTURE_2D, context.texture(history));
+            }
+            glActiveTexture(GL_TEXTURE1);
+            glBindTexture(GL_TEXTURE_2D, context.texture(depth));
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, context.texture(color));
+            draw_fullscreen(VAO_);
+            timer->end();
+        });
+
+    history_width_ = desc.width;
+    history_height_ = desc.height;
+    history_valid_ = true;
+    current_ = 1 - current_;
+    previous_view_proj_ = view_proj;
+    ++frame_;
+    return result;
+}
+} // namespace post
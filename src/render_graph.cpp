@@ -0,0 +1,317 @@
+#include "render_graph.H"
+
+#include <algorithm>
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+namespace {
+auto has_stencil(unsigned int format) -> bool {
+    return format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+}
+} // namespace
+
+auto RenderGraph::PassBuilder::create(const char* name, const TextureDesc& desc)
+    -> Resource {
+    ResourceNode node;
+    node.name = name;
+    node.desc = desc;
+    graph_.resources_.push_back(std::move(node));
+    return write(static_cast<Resource>(graph_.resources_.size() - 1));
+}
+
+auto RenderGraph::PassBuilder::read(Resource resource) -> Resource {
+    auto& reads = graph_.passes_[pass_].reads;
+    if (std::find(reads.begin(), reads.end(), resource) == reads.end()) {
+        reads.push_back(resource);
+    }
+    return resource;
+}
+
+auto RenderGraph::PassBuilder::write(Resource resource) -> Resource {
+    auto& writes = graph_.passes_[pass_].writes;
+    if (std::find(writes.begin(), writes.end(), resource) == writes.end()) {
+        writes.push_back(resource);
+        graph_.resources_[resource].writers.push_back(pass_);
+    }
+    return resource;
+}
+
+void RenderGraph::PassBuilder::side_effect() {
+    graph_.passes_[pass_].side_effect = true;
+}
+
+auto RenderGraph::PassContext::texture(Resource resource) const -> unsigned int {
+    return graph_.resources_[resource].texture;
+}
+
+auto RenderGraph::PassContext::desc(Resource resource) const -> const TextureDesc& {
+    return graph_.resources_[resource].desc;
+}
+
+auto RenderGraph::PassContext::extent(Resource resource) const -> Extent {
+    const ResourceNode& node = graph_.resources_[resource];
+    return {node.extent_width, node.extent_height};
+}
+
+auto RenderGraph::PassContext::read_framebuffer(Resource resource) const
+    -> unsigned int {
+    const ResourceNode& node = graph_.resources_[resource];
+    if (node.backbuffer) {
+        return 0;
+    }
+    auto samples = static_cast<unsigned int>(node.desc.samples);
+    return graph_.framebuffer_for({node.texture, node.desc.format, samples});
+}
+
+void RenderGraph::reset() {
+    resources_.clear();
+    passes_.clear();
+    order_.clear();
+}
+
+void RenderGraph::shutdown() {
+    reset();
+    for (auto& [attachments, framebuffer] : framebuffers_) {
+        glDeleteFramebuffers(1, &framebuffer);
+    }
+    framebuffers_.clear();
+    pool_.shutdown();
+}
+
+auto RenderGraph::import_backbuffer(int width, int height) -> Resource {
+    ResourceNode node;
+    node.name = "backbuffer";
+    node.desc = {width, height, GL_RGBA8, 1};
+    node.extent_width = width;
+    node.extent_height = height;
+    node.imported = true;
+    node.backbuffer = true;
+    resources_.push_back(std::move(node));
+    return static_cast<Resource>(resources_.size() - 1);
+}
+
+auto RenderGraph::import_texture(const char* name,
+                                 unsigned int texture,
+                                 const TextureDesc& desc,
+                                 Extent extent) -> Resource {
+    ResourceNode node;
+    node.name = name;
+    node.desc = desc;
+    node.extent_width = extent.width > 0 ? extent.width : desc.width;
+    node.extent_height = extent.height > 0 ? extent.height : desc.height;
+    node.imported = true;
+    node.texture = texture;
+    resources_.push_back(std::move(node));
+    return static_cast<Resource>(resources_.size() - 1);
+}
+
+void RenderGraph::add_pass(const char* name, const SetupFn& setup, ExecuteFn execute) {
+    PassNode pass;
+    pass.name = name;
+    pass.execute = std::move(execute);
+    passes_.push_back(std::move(pass));
+    PassBuilder builder(*this, static_cast<int>(passes_.size() - 1));
+    setup(builder);
+}
+
+auto RenderGraph::desc(Resource resource) const -> const TextureDesc& {
+    return resources_[resource].desc;
+}
+
+void RenderGraph::compile() {
+    // Reference counts: a pass is referenced by each resource it writes, a resource
+    // by each pass reading it. Imported resources are consumed outside the graph
+    // and side-effect passes are consumed by the world, so both start one higher.
+    // A pass that reads and writes the same resource (e.g. blending on top of it)
+    // does not keep that resource alive by itself.
+    auto consumes = [](const PassNode& pass, Resource r) {
+        const auto& writes = pass.writes;
+        return std::find(writes.begin(), writes.end(), r) == writes.end();
+    };
+    for (PassNode& pass : passes_) {
+        pass.ref_count =
+            static_cast<int>(pass.writes.size()) + (pass.side_effect ? 1 : 0);
+        pass.culled = false;
+        for (Resource r : pass.reads) {
+            if (consumes(pass, r)) {
+                resources_[r].ref_count++;
+            }
+        }
+    }
+    std::vector<Resource> unreferenced;
+    for (size_t r = 0; r < resources_.size(); ++r) {
+        if (resources_[r].imported) {
+            resources_[r].ref_count++;
+        } else if (resources_[r].ref_count == 0) {
+            unreferenced.push_back(static_cast<Resource>(r));
+        }
+    }
+    while (!unreferenced.empty()) {
+        Resource r = unreferenced.back();
+        unreferenced.pop_back();
+        for (int writer : resources_[r].writers) {
+            PassNode& pass = passes_[writer];
+            if (--pass.ref_count > 0 || pass.culled) {
+                continue;
+            }
+            pass.culled = true;
+            for (Resource read : pass.reads) {
+                if (consumes(pass, read) && --resources_[read].ref_count == 0) {
+                    unreferenced.push_back(read);
+                }
+            }
+        }
+    }
+
+    // Passes can only read what an earlier declared pass has written, so
+    // declaration order is already a valid dependency order. We only verify it.
+    std::vector<bool> written(resources_.size(), false);
+    for (size_t p = 0; p < passes_.size(); ++p) {
+        PassNode& pass = passes_[p];
+        if (pass.culled) {
+            continue;
+        }
+        for (Resource r : pass.reads) {
+            if (!written[r] && !resources_[r].imported) {
+                spdlog::error("Pass '{}' reads '{}' before any pass writes it",
+                              pass.name,
+                              resources_[r].name);
+            }
+        }
+        for (Resource r : pass.writes) {
+            written[r] = true;
+        }
+        order_.push_back(static_cast<int>(p));
+    }
+
+    // Lifetimes, in execution order.
+    for (int i = 0; i < static_cast<int>(order_.size()); ++i) {
+        PassNode& pass = passes_[order_[i]];
+        for (const auto* list : {&pass.reads, &pass.writes}) {
+            for (Resource r : *list) {
+                ResourceNode& node = resources_[r];
+                if (node.first_use < 0) {
+                    node.first_use = i;
+                }
+                node.last_use = i;
+            }
+        }
+    }
+
+    // Hand out pooled textures. A texture goes back to the pool right after the
+    // last pass using it, so a transient declared later can alias it. Releasing
+    // after acquiring keeps a pass's inputs and outputs apart.
+    stats_ = {};
+    stats_.declared_passes = static_cast<int>(passes_.size());
+    stats_.executed_passes = static_cast<int>(order_.size());
+    for (int i = 0; i < static_cast<int>(order_.size()); ++i) {
+        for (ResourceNode& node : resources_) {
+            if (node.imported || node.first_use != i) {
+                continue;
+            }
+            RenderTarget target = pool_.acquire(node.desc);
+            node.texture = target.texture;
+            node.extent_width = target.width;
+            node.extent_height = target.height;
+            stats_.transient_textures++;
+        }
+        for (const ResourceNode& node : resources_) {
+            if (!node.imported && node.last_use == i) {
+                pool_.release(node.texture);
+            }
+        }
+    }
+    pool_.end_frame();
+    stats_.physical_textures = pool_.stats().textures;
+    stats_.physical_bytes = pool_.stats().bytes;
+    stats_.allocations = pool_.stats().allocations;
+}
+
+void RenderGraph::execute() {
+    PassContext context(*this);
+    for (int p : order_) {
+        PassNode& pass = passes_[p];
+
+        std::vector<unsigned int> attachments;
+        bool to_backbuffer = false;
+        for (Resource r : pass.writes) {
+            const ResourceNode& node = resources_[r];
+            to_backbuffer = to_backbuffer || node.backbuffer;
+            attachments.insert(attachments.end(),
+                               {node.texture,
+                                node.desc.format,
+                                static_cast<unsigned int>(node.desc.samples)});
+        }
+        if (to_backbuffer && pass.writes.size() > 1) {
+            spdlog::error("Pass '{}' mixes the backbuffer with other attachments",
+                          pass.name);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER,
+                          to_backbuffer || attachments.empty()
+                              ? 0
+                              : framebuffer_for(attachments));
+        if (!pass.writes.empty()) {
+            const TextureDesc& target = resources_[pass.writes.front()].desc;
+            context.width = target.width;
+            context.height = target.height;
+            glViewport(0, 0, target.width, target.height);
+        }
+        pass.execute(context);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+auto RenderGraph::framebuffer_for(const std::vector<unsigned int>& attachments)
+    -> unsigned int {
+    if (pool_generation_ != pool_.generation()) {
+        // Cached framebuffers may reference textures the pool has deleted.
+        for (auto& [key, framebuffer] : framebuffers_) {
+            glDeleteFramebuffers(1, &framebuffer);
+        }
+        framebuffers_.clear();
+        pool_generation_ = pool_.generation();
+    }
+    auto it = framebuffers_.find(attachments);
+    if (it != framebuffers_.end()) {
+        return it->second;
+    }
+
+    // This may run in the middle of a pass, so leave its bindings untouched.
+    int draw_binding, read_binding;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw_binding);
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_binding);
+
+    unsigned int framebuffer;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    std::vector<unsigned int> draw_buffers;
+    for (size_t i = 0; i < attachments.size(); i += 3) {
+        unsigned int texture = attachments[i];
+        unsigned int format = attachments[i + 1];
+        unsigned int target =
+            attachments[i + 2] > 1 ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D;
+        unsigned int attachment;
+        if (is_depth_format(format)) {
+            attachment = has_stencil(format) ? GL_DEPTH_STENCIL_ATTACHMENT
+                                             : GL_DEPTH_ATTACHMENT;
+        } else {
+            attachment =
+                GL_COLOR_ATTACHMENT0 + static_cast<unsigned int>(draw_buffers.size());
+            draw_buffers.push_back(attachment);
+        }
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, target, texture, 0);
+    }
+    if (draw_buffers.empty()) {
+        glDrawBuffer(GL_NONE);
+    } else {
+        glDrawBuffers(static_cast<int>(draw_buffers.size()), draw_buffers.data());
+    }
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        spdlog::error("Render graph framebuffer is incomplete");
+    }
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, static_cast<unsigned int>(draw_binding));
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, static_cast<unsigned int>(read_binding));
+    framebuffers_.emplace(attachments, framebuffer);
+    return framebuffer;
+}
@@ -0,0 +1,225 @@
+#include "render_target_pool.H"
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+namespace {
+// Textures nobody asked for during this many frames are released.
+auto constexpr MAX_IDLE_FRAMES = 120;
+
+// glTexImage2D wants a pixel transfer format and type even when no data is
+// uploaded, and they have to be compatible with the internal format.
+auto transfer_format(unsigned int format, unsigned int& type) -> unsigned int {
+    switch (format) {
+        case GL_R8:
+            type = GL_UNSIGNED_BYTE;
+            return GL_RED;
+        case GL_R16F:
+        case GL_R32F:
+            type = GL_FLOAT;
+            return GL_RED;
+        case GL_R32UI:
+            type = GL_UNSIGNED_INT;
+            return GL_RED_INTEGER;
+        case GL_RG8:
+            type = GL_UNSIGNED_BYTE;
+            return GL_RG;
+        case GL_RG16F:
+        case GL_RG32F:
+            type = GL_FLOAT;
+            return GL_RG;
+        case GL_R11F_G11F_B10F:
+            type = GL_FLOAT;
+            return GL_RGB;
+        case GL_RGB10_A2:
+            type = GL_UNSIGNED_INT_2_10_10_10_REV;
+            return GL_RGBA;
+        case GL_RGBA16F:
+        case GL_RGBA32F:
+            type = GL_FLOAT;
+            return GL_RGBA;
+        case GL_DEPTH_COMPONENT16:
+        case GL_DEPTH_COMPONENT24:
+        case GL_DEPTH_COMPONENT32F:
+            type = GL_FLOAT;
+            return GL_DEPTH_COMPONENT;
+        case GL_DEPTH24_STENCIL8:
+            type = GL_UNSIGNED_INT_24_8;
+            return GL_DEPTH_STENCIL;
+        case GL_DEPTH32F_STENCIL8:
+            type = GL_FLOAT_32_UNSIGNED_INT_24_8_REV;
+            return GL_DEPTH_STENCIL;
+        default:
+            type = GL_UNSIGNED_BYTE;
+            return GL_RGBA;
+    }
+}
+
+auto create_texture(const RenderTargetDesc& desc) -> unsigned int {
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    if (desc.samples > 1) {
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, texture);
+        glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE,
+                                desc.samples,
+                                desc.format,
+                                desc.width,
+                                desc.height,
+                                GL_TRUE);
+        glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+        return texture;
+    }
+    unsigned int type;
+    unsigned int format = transfer_format(desc.format, type);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D,
+                 0,
+                 static_cast<int>(desc.format),
+                 desc.width,
+                 desc.height,
+                 0,
+                 format,
+                 type,
+                 nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+auto texture_bytes(const RenderTargetDesc& desc) -> size_t {
+    return static_cast<size_t>(desc.width) * desc.height * desc.samples *
+           bytes_per_pixel(desc.format);
+}
+} // namespace
+
+auto is_depth_format(unsigned int format) -> bool {
+    switch (format) {
+        case GL_DEPTH_COMPONENT16:
+        case GL_DEPTH_COMPONENT24:
+        case GL_DEPTH_COMPONENT32F:
+        case GL_DEPTH24_STENCIL8:
+        case GL_DEPTH32F_STENCIL8:
+            return true;
+        default:
+            return false;
+    }
+}
+
+auto bytes_per_pixel(unsigned int format) -> size_t {
+    switch (format) {
+        case GL_R8:
+            return 1;
+        case GL_R16F:
+        case GL_RG8:
+        case GL_DEPTH_COMPONENT16:
+            return 2;
+        case GL_RGBA16F:
+        case GL_RG32F:
+        case GL_DEPTH32F_STENCIL8:
+            return 8;
+        case GL_RGBA32F:
+            return 16;
+        default:
+            return 4;
+    }
+}
+
+void RenderTargetPool::shutdown() {
+    for (Entry& entry : entries_) {
+        glDeleteTextures(1, &entry.texture);
+    }
+    entries_.clear();
+    stats_ = {};
+    ++generation_;
+}
+
+auto RenderTargetPool::acquire(const RenderTargetDesc& desc) -> RenderTarget {
+    RenderTargetDesc bucketed = desc;
+    bucketed.width = render_target_bucket(desc.width);
+    bucketed.height = render_target_bucket(desc.height);
+
+    Entry* best = nullptr;
+    for (Entry& entry : entries_) {
+        if (entry.in_use || entry.desc.format != desc.format ||
+            entry.desc.samples != desc.samples ||
+            !render_target_fits(
+                desc.width, desc.height, entry.desc.width, entry.desc.height)) {
+            continue;
+        }
+        int area = entry.desc.width * entry.desc.height;
+        if (best == nullptr || area < best->desc.width * best->desc.height) {
+            best = &entry;
+        }
+    }
+    if (best != nullptr) {
+        best->in_use = true;
+        best->idle_frames = 0;
+        return {best->texture, best->desc.width, best->desc.height};
+    }
+
+    spdlog::info("Allocating {}x{} render target (0x{:x}, {} samples)",
+                 bucketed.width,
+                 bucketed.height,
+                 bucketed.format,
+                 bucketed.samples);
+    Entry entry;
+    entry.desc = bucketed;
+    entry.texture = create_texture(bucketed);
+    entry.in_use = true;
+    entries_.push_back(entry);
+    stats_.textures++;
+    stats_.bytes += texture_bytes(bucketed);
+    stats_.allocations++;
+    return {entry.texture, bucketed.width, bucketed.height};
+}
+
+void RenderTargetPool::release(unsigned int texture) {
+    for (Entry& entry : entries_) {
+        if (entry.texture == texture) {
+            entry.in_use = false;
+            return;
+        }
+    }
+}
+
+void RenderTargetPool::end_frame() {
+    for (size_t i = 0; i < entries_.size();) {
+        Entry& entry = entries_[i];
+        if (entry.in_use || ++entry.idle_frames < MAX_IDLE_FRAMES) {
+            ++i;
+            continue;
+        }
+        glDeleteTextures(1, &entry.texture);
+        stats_.textures--;
+        stats_.bytes -= texture_bytes(entry.desc);
+        entries_.erase(entries_.begin() + static_cast<std::ptrdiff_t>(i));
+        ++generation_;
+    }
+}
+
+auto ResizeDebouncer::update(int width, int height, double now) -> bool {
+    if (width != pending_width_ || height != pending_height_) {
+        pending_width_ = width;
+        pending_height_ = height;
+        pending_since_ = now;
+    }
+    if (!pending()) {
+        return false;
+    }
+    // The first size and sizes the pooled textures can already hold cost nothing,
+    // so they apply immediately. Anything else waits until the user stops
+    // dragging.
+    bool fits = width_ == 0 || render_target_fits(width,
+                                                  height,
+                                                  render_target_bucket(width_),
+                                                  render_target_bucket(height_));
+    if (!fits && now - pending_since_ < settle_seconds_) {
+        return false;
+    }
+    width_ = width;
+    height_ = height;
+    return true;
+}
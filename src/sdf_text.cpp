@@ -0,0 +1,454 @@
+#include "sdf_text.H"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+#include "jobs.H"
+#include "sdf_text_shader.H"
+#include "shader.H"
+
+namespace {
+auto constexpr ATLAS_WIDTH = 512;
+auto constexpr ATLAS_MAGIC = 0x41464453u; // "SDFA"
+auto constexpr ATLAS_VERSION = 1u;
+// Far more than the printable ASCII glyphs need at any sane pixel size, to reject
+// corrupt headers.
+auto constexpr MAX_ATLAS_HEIGHT = 1u << 14;
+auto constexpr INF = 1e20f;
+
+struct Bitmap {
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> coverage;
+};
+
+// One dimensional squared Euclidean distance transform of a sampled function
+// (Felzenszwalb & Huttenlocher). `v` and `z` are scratch space of n and n + 1 items.
+void edt_1d(const float* f, float* d, int* v, float* z, int n) {
+    int k = 0;
+    v[0] = 0;
+    z[0] = -INF;
+    z[1] = INF;
+    auto intersect = [&](int q, int p) {
+        float fq = f[q] + static_cast<float>(q * q);
+        float fp = f[p] + static_cast<float>(p * p);
+        return (fq - fp) / static_cast<float>(2 * q - 2 * p);
+    };
+    for (int q = 1; q < n; ++q) {
+        float s = intersect(q, v[k]);
+        // z[0] is -INF, so this never walks past the first parabola.
+        while (s <= z[k]) {
+            --k;
+            s = intersect(q, v[k]);
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = INF;
+    }
+    k = 0;
+    for (int q = 0; q < n; ++q) {
+        while (z[k + 1] < static_cast<float>(q)) {
+            ++k;
+        }
+        float dq = static_cast<float>(q - v[k]);
+        d[q] = dq * dq + f[v[k]];
+    }
+}
+
+// In-place 2D squared distance transform: grid holds 0 at feature pixels, INF
+// elsewhere.
+void edt_2d(std::vector<float>& grid, int width, int height) {
+    int n = std::max(width, height);
+    std::vector<float> f(n), d(n), z(n + 1);
+    std::vector<int> v(n);
+    for (int x = 0; x < width; ++x) {
+        for (int y = 0; y < height; ++y) {
+            f[y] = grid[y * width + x];
+        }
+        edt_1d(f.data(), d.data(), v.data(), z.data(), height);
+        for (int y = 0; y < height; ++y) {
+            grid[y * width + x] = d[y];
+        }
+    }
+    for (int y = 0; y < height; ++y) {
+        edt_1d(&grid[y * width], d.data(), v.data(), z.data(), width);
+        std::copy(d.begin(), d.begin() + width, grid.begin() + y * width);
+    }
+}
+
+// Writes the padded distance field of `bitmap` into the atlas at (x, y).
+void write_distance_field(const Bitmap& bitmap,
+                          int spread,
+                          uint8_t* atlas,
+                          int atlas_width,
+                          int x,
+                          int y) {
+    int w = bitmap.width + 2 * spread;
+    int h = bitmap.height + 2 * spread;
+    std::vector<float> outside(w * h, INF);
+    std::vector<float> inside(w * h, 0.0f);
+    for (int row = 0; row < bitmap.height; ++row) {
+        for (int col = 0; col < bitmap.width; ++col) {
+            if (bitmap.coverage[row * bitmap.width + col] >= 128) {
+                int i = (row + spread) * w + col + spread;
+                outside[i] = 0.0f;
+                inside[i] = INF;
+            }
+        }
+    }
+    edt_2d(outside, w, h);
+    edt_2d(inside, w, h);
+
+    float scale = 127.0f / static_cast<float>(spread);
+    for (int row = 0; row < h; ++row) {
+        uint8_t* dst = atlas + (y + row) * atlas_width + x;
+        for (int col = 0; col < w; ++col) {
+            int i = row * w + col;
+            float distance = std::sqrt(outside[i]) - std::sqrt(inside[i]);
+            float value = 128.0f - distance * scale;
+            dst[col] = static_cast<uint8_t>(std::clamp(value, 0.0f, 255.0f));
+        }
+    }
+}
+} // namespace
+
+namespace sdf_text {
+auto build_atlas(const char* ttf_path, int pixel_size, int spread)
+    -> std::optional<Atlas> {
+    spdlog::info("Building SDF glyph atlas from {}", ttf_path);
+
+    FT_Library library;
+    if (FT_Init_FreeType(&library) != 0) {
+        spdlog::error("Failed to initialize FreeType");
+        return std::nullopt;
+    }
+    FT_Face face;
+    if (FT_New_Face(library, ttf_path, 0, &face) != 0) {
+        spdlog::error("Failed to load font {}", ttf_path);
+        FT_Done_FreeType(library);
+        return std::nullopt;
+    }
+    FT_Set_Pixel_Sizes(face, 0, pixel_size);
+
+    Atlas atlas;
+    atlas.pixel_size = pixel_size;
+    atlas.spread = spread;
+    auto em = static_cast<float>(pixel_size);
+    atlas.line_height = static_cast<float>(face->size->metrics.height >> 6) / em;
+
+    // FreeType faces are not thread safe, so rasterization stays on this thread.
+    std::vector<Bitmap> bitmaps(GLYPH_COUNT);
+    for (int i = 0; i < GLYPH_COUNT; ++i) {
+        if (FT_Load_Char(face, FIRST_CHAR + i, FT_LOAD_RENDER) != 0) {
+            spdlog::warn("Failed to load glyph '{}'",
+                         static_cast<char>(FIRST_CHAR + i));
+            continue;
+        }
+        FT_GlyphSlot slot = face->glyph;
+        Bitmap& bitmap = bitmaps[i];
+        bitmap.width = static_cast<int>(slot->bitmap.width);
+        bitmap.height = static_cast<int>(slot->bitmap.rows);
+        bitmap.coverage.resize(bitmap.width * bitmap.height);
+        for (int row = 0; row < bitmap.height; ++row) {
+            std::memcpy(&bitmap.coverage[row * bitmap.width],
+                        slot->bitmap.buffer + row * slot->bitmap.pitch,
+                        bitmap.width);
+        }
+
+        Glyph& glyph = atlas.glyphs[i];
+        glyph.advance = static_cast<float>(slot->advance.x >> 6) / em;
+        glyph.x_offset = static_cast<float>(slot->bitmap_left - spread) / em;
+        glyph.y_offset =
+            static_cast<float>(slot->bitmap_top - bitmap.height - spread) / em;
+        glyph.width = static_cast<float>(bitmap.width + 2 * spread) / em;
+        glyph.height = static_cast<float>(bitmap.height + 2 * spread) / em;
+    }
+    FT_Done_Face(face);
+    FT_Done_FreeType(library);
+
+    // Shelf packing, tallest glyphs first.
+    std::vector<int> order(GLYPH_COUNT);
+    for (int i = 0; i < GLYPH_COUNT; ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return bitmaps[a].height > bitmaps[b].height;
+    });
+    std::vector<int> rect_x(GLYPH_COUNT), rect_y(GLYPH_COUNT);
+    int pen_x = 0, pen_y = 0, shelf_height = 0;
+    for (int i : order) {
+        int w = bitmaps[i].width + 2 * spread;
+        int h = bitmaps[i].height + 2 * spread;
+        if (pen_x + w > ATLAS_WIDTH) {
+            pen_x = 0;
+            pen_y += shelf_height;
+            shelf_height = 0;
+        }
+        rect_x[i] = pen_x;
+        rect_y[i] = pen_y;
+        pen_x += w;
+        shelf_height = std::max(shelf_height, h);
+    }
+    atlas.width = ATLAS_WIDTH;
+    atlas.height = 1;
+    while (atlas.height < pen_y + shelf_height) {
+        atlas.height *= 2;
+    }
+    atlas.pixels.assign(atlas.width * atlas.height, 0);
+
+    // Glyph rects are disjoint, so every glyph can be transformed independently.
+    jobs::parallel_for(0, GLYPH_COUNT, 1, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) {
+            write_distance_field(bitmaps[i],
+                                 spread,
+                                 atlas.pixels.data(),
+                                 atlas.width,
+                                 rect_x[i],
+                                 rect_y[i]);
+        }
+    });
+
+    auto atlas_w = static_cast<float>(atlas.width);
+    auto atlas_h = static_cast<float>(atlas.height);
+    for (int i = 0; i < GLYPH_COUNT; ++i) {
+        Glyph& glyph = atlas.glyphs[i];
+        int w = bitmaps[i].width + 2 * spread;
+        int h = bitmaps[i].height + 2 * spread;
+        glyph.u0 = static_cast<float>(rect_x[i]) / atlas_w;
+        glyph.v0 = static_cast<float>(rect_y[i]) / atlas_h;
+        glyph.u1 = static_cast<float>(rect_x[i] + w) / atlas_w;
+        glyph.v1 = static_cast<float>(rect_y[i] + h) / atlas_h;
+    }
+
+    spdlog::info("SDF atlas is {}x{}", atlas.width, atlas.height);
+    return atlas;
+}
+
+auto save_atlas(const Atlas& atlas, const char* path) -> bool {
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        spdlog::error("Failed to open {} for writing", path);
+        return false;
+    }
+    uint32_t header[] = {ATLAS_MAGIC,
+                         ATLAS_VERSION,
+                         static_cast<uint32_t>(atlas.width),
+                         static_cast<uint32_t>(atlas.height),
+                         static_cast<uint32_t>(atlas.pixel_size),
+                         static_cast<uint32_t>(atlas.spread)};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(&atlas.line_height), sizeof(float));
+    file.write(reinterpret_cast<const char*>(atlas.glyphs.data()),
+               sizeof(Glyph) * atlas.glyphs.size());
+    file.write(reinterpret_cast<const char*>(atlas.pixels.data()),
+               static_cast<std::streamsize>(atlas.pixels.size()));
+    return static_cast<bool>(file);
+}
+
+auto load_atlas(const char* path, int pixel_size, int spread) -> std::optional<Atlas> {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return std::nullopt;
+    }
+    uint32_t header[6];
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    uint32_t height = header[3];
+    if (!file || header[0] != ATLAS_MAGIC || header[1] != ATLAS_VERSION ||
+        header[2] != static_cast<uint32_t>(ATLAS_WIDTH) ||
+        !std::has_single_bit(height) || height > MAX_ATLAS_HEIGHT) {
+        spdlog::warn("{} is not a compatible SDF atlas", path);
+        return std::nullopt;
+    }
+    if (header[4] != static_cast<uint32_t>(pixel_size) ||
+        header[5] != static_cast<uint32_t>(spread)) {
+        spdlog::info("{} was built with a different pixel size or spread", path);
+        return std::nullopt;
+    }
+
+    // The glyphs and pixels have to fill the rest of the file exactly, which also
+    // keeps a corrupt header from allocating more than the file holds.
+    Atlas atlas;
+    size_t payload = sizeof(float) + sizeof(Glyph) * atlas.glyphs.size() +
+                     static_cast<size_t>(ATLAS_WIDTH) * height;
+    std::streamoff start = file.tellg();
+    file.seekg(0, std::ios::end);
+    std::streamoff end = file.tellg();
+    file.seekg(start);
+    if (!file || end - start != static_cast<std::streamoff>(payload)) {
+        spdlog::warn("{} is truncated", path);
+        return std::nullopt;
+    }
+
+    atlas.width = ATLAS_WIDTH;
+    atlas.height = static_cast<int>(height);
+    atlas.pixel_size = pixel_size;
+    atlas.spread = spread;
+    file.read(reinterpret_cast<char*>(&atlas.line_height), sizeof(float));
+    file.read(reinterpret_cast<char*>(atlas.glyphs.data()),
+              sizeof(Glyph) * atlas.glyphs.size());
+    atlas.pixels.resize(static_cast<size_t>(atlas.width) * height);
+    file.read(reinterpret_cast<char*>(atlas.pixels.data()),
+              static_cast<std::streamsize>(atlas.pixels.size()));
+    if (!file) {
+        spdlog::warn("{} is truncated", path);
+        return std::nullopt;
+    }
+    return atlas;
+}
+
+auto TextRenderer::init(const Atlas& atlas) -> bool {
+    program_ =
+        link_program(shaders::sdf_text_vertex_src, shaders::sdf_text_fragment_src);
+    if (program_ == 0) {
+        return false;
+    }
+    view_proj_location_ = glGetUniformLocation(program_, "uViewProj");
+    right_location_ = glGetUniformLocation(program_, "uRight");
+    up_location_ = glGetUniformLocation(program_, "uUp");
+    glyphs_ = atlas.glyphs;
+    line_height_ = atlas.line_height;
+
+    glGenTextures(1, &texture_);
+    glBindTexture(GL_TEXTURE_2D, texture_);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D,
+                 0,
+                 GL_R8,
+                 atlas.width,
+                 atlas.height,
+                 0,
+                 GL_RED,
+                 GL_UNSIGNED_BYTE,
+                 atlas.pixels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    // Distance fields interpolate well, so plain bilinear filtering keeps edges sharp
+    // when magnified. No mipmaps: an average of distances is not a distance, and
+    // with unpadded rects the smaller levels blend neighbouring glyphs together.
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenVertexArrays(1, &VAO_);
+    glGenBuffers(1, &VBO_);
+    glBindVertexArray(VAO_);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_);
+    auto attribute = [](unsigned int index,
+                        int size,
+                        unsigned int type,
+                        bool normalized,
+                        size_t offset) {
+        glVertexAttribPointer(index,
+                              size,
+                              type,
+                              normalized ? GL_TRUE : GL_FALSE,
+                              sizeof(Instance),
+                              (void*)offset); // NOLINT
+        glEnableVertexAttribArray(index);
+        glVertexAttribDivisor(index, 1);
+    };
+    attribute(0, 3, GL_FLOAT, false, offsetof(Instance, anchor));
+    attribute(1, 2, GL_FLOAT, false, offsetof(Instance, offset));
+    attribute(2, 2, GL_FLOAT, false, offsetof(Instance, size));
+    attribute(3, 4, GL_FLOAT, false, offsetof(Instance, uv));
+    attribute(4, 4, GL_UNSIGNED_BYTE, true, offsetof(Instance, color));
+    glBindVertexArray(0);
+    return true;
+}
+
+void TextRenderer::shutdown() {
+    glDeleteVertexArrays(1, &VAO_);
+    glDeleteBuffers(1, &VBO_);
+    glDeleteTextures(1, &texture_);
+    glDeleteProgram(program_);
+    VAO_ = VBO_ = texture_ = program_ = 0;
+    vbo_capacity_ = 0;
+}
+
+void TextRenderer::add(const Vec3& position,
+                       std::string_view text,
+                       float height,
+                       uint32_t color) {
+    float pen_x = 0.0f;
+    float pen_y = 0.0f;
+    for (char c : text) {
+        if (c == '\n') {
+            pen_x = 0.0f;
+            pen_y -= line_height_ * height;
+            continue;
+        }
+        if (c < FIRST_CHAR || c > LAST_CHAR) {
+            c = '?';
+        }
+        const Glyph& glyph = glyphs_[c - FIRST_CHAR];
+        if (c != ' ') {
+            // The atlas' first row is the top of the glyph, while the quad's corner
+            // (0, 0) is its bottom left, hence the swapped v coordinates.
+            instances_.push_back({position,
+                                  {pen_x + glyph.x_offset * height,
+                                   pen_y + glyph.y_offset * height},
+                                  {glyph.width * height, glyph.height * height},
+                                  {glyph.u0, glyph.v1, glyph.u1, glyph.v0},
+                                  color});
+        }
+        pen_x += glyph.advance * height;
+    }
+}
+
+void TextRenderer::flush(const Mat4& view_proj, const Vec3& right, const Vec3& up) {
+    if (instances_.empty() || program_ == 0) {
+        instances_.clear();
+        return;
+    }
+
+    glBindVertexArray(VAO_);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_);
+    if (instances_.size() > vbo_capacity_) {
+        vbo_capacity_ = std::max<size_t>(vbo_capacity_ * 2, instances_.size());
+        glBufferData(GL_ARRAY_BUFFER,
+                     static_cast<GLsizeiptr>(vbo_capacity_ * sizeof(Instance)),
+                     nullptr,
+                     GL_STREAM_DRAW);
+    }
+    size_t bytes = instances_.size() * sizeof(Instance);
+    void* dst = glMapBufferRange(GL_ARRAY_BUFFER,
+                                 0,
+                                 static_cast<GLsizeiptr>(bytes),
+                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (dst != nullptr) {
+        std::memcpy(dst, instances_.data(), bytes);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+
+        GLboolean blend_was_enabled = glIsEnabled(GL_BLEND);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        glUseProgram(program_);
+        glUniformMatrix4fv(view_proj_location_, 1, GL_FALSE, view_proj.m);
+        glUniform3f(right_location_, right.x, right.y, right.z);
+        glUniform3f(up_location_, up.x, up.y, up.z);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, texture_);
+        glDrawArraysInstanced(
+            GL_TRIANGLE_STRIP, 0, 4, static_cast<GLsizei>(instances_.size()));
+
+        if (blend_was_enabled != GL_TRUE) {
+            glDisable(GL_BLEND);
+        }
+    }
+    glBindVertexArray(0);
+    instances_.clear();
+}
+} // namespace sdf_text
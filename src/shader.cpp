@@ -0,0 +1,101 @@
+#include "shader.H"
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+namespace {
+auto stage_name(unsigned int type) -> const char* {
+    switch (type) {
+        case GL_VERTEX_SHADER:
+            return "Vertex";
+        case GL_FRAGMENT_SHADER:
+            return "Fragment";
+        case GL_COMPUTE_SHADER:
+            return "Compute";
+        default:
+            return "Unknown";
+    }
+}
+
+auto check_link(unsigned int program) -> unsigned int {
+    int success;
+    char info_log[512];
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    if (!static_cast<bool>(success)) {
+        glGetProgramInfoLog(program, 512, nullptr, info_log);
+        spdlog::error("Shader program compilation failed: {}", info_log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+} // namespace
+
+auto compile_shader(unsigned int type, const char* source) -> unsigned int {
+    unsigned int shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, nullptr);
+    glCompileShader(shader);
+
+    int success;
+    char info_log[512];
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+    if (!static_cast<bool>(success)) {
+        glGetShaderInfoLog(shader, 512, nullptr, info_log);
+        spdlog::error("{} shader compilation failed: {}", stage_name(type), info_log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+auto link_program(const char* vertex_src, const char* fragment_src) -> unsigned int {
+    unsigned int vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_src);
+    unsigned int fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_src);
+    if (vertex_shader == 0 || fragment_shader == 0) {
+        glDeleteShader(vertex_shader);
+        glDeleteShader(fragment_shader);
+        return 0;
+    }
+
+    unsigned int program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, fragment_shader);
+    glLinkProgram(program);
+
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    return check_link(program);
+}
+
+auto link_feedback_program(const char* vertex_src,
+                           const char* const* varyings,
+                           int varying_count) -> unsigned int {
+    unsigned int vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_src);
+    if (vertex_shader == 0) {
+        return 0;
+    }
+
+    unsigned int program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    // The captured outputs have to be known before linking.
+    glTransformFeedbackVaryings(
+        program, varying_count, varyings, GL_INTERLEAVED_ATTRIBS);
+    glLinkProgram(program);
+
+    glDeleteShader(vertex_shader);
+    return check_link(program);
+}
+
+auto link_compute_program(const char* compute_src) -> unsigned int {
+    unsigned int compute_shader = compile_shader(GL_COMPUTE_SHADER, compute_src);
+    if (compute_shader == 0) {
+        return 0;
+    }
+
+    unsigned int program = glCreateProgram();
+    glAttachShader(program, compute_shader);
+    glLinkProgram(program);
+
+    glDeleteShader(compute_shader);
+    return check_link(program);
+}
@@ -0,0 +1,881 @@
+#include "shadows.H"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+#include "shader.H"
+#include "shadows_shader.H"
+
+namespace {
+auto constexpr SHADOW_FORMAT = GL_DEPTH_COMPONENT24;
+// Cached cascades move in steps of this many texels, with a margin of half a step
+// around the slice so it stays covered in between.
+auto constexpr CACHED_SNAP_TEXELS = 128;
+// World units of depth range beyond the static casters. Dynamic casters past it
+// are clamped onto the near plane, which keeps their shadows.
+auto constexpr CASTER_DEPTH_MARGIN = 1.0f;
+// Slope-scaled and constant depth bias of the caster pass.
+auto constexpr POLYGON_OFFSET_FACTOR = 2.0f;
+auto constexpr POLYGON_OFFSET_UNITS = 4.0f;
+// 16 bits are plenty for the short range of a point light.
+auto constexpr ATLAS_FORMAT = GL_DEPTH_COMPONENT16;
+// One texel for the light, then four matrix columns and the tile rectangle of each
+// cube face.
+auto constexpr FACE_TEXELS = 5;
+auto constexpr RECORD_TEXELS = 1 + 6 * FACE_TEXELS;
+// Importance bonus of lights that already have a shadow, so that lights of similar
+// importance do not keep trading places.
+auto constexpr KEEP_BONUS = 1.25f;
+
+auto transform_direction(const Mat4& m, const Vec3& d) -> Vec3 {
+    Vec4 r = m * Vec4 {d.x, d.y, d.z, 0.0f};
+    return {r.x, r.y, r.z};
+}
+
+auto corner(const Vec3& min, const Vec3& max, int i) -> Vec3 {
+    return {i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z};
+}
+
+auto sphere_overlaps_box(const Vec3& center,
+                         float radius,
+                         const Vec3& min,
+                         const Vec3& max) -> bool {
+    Vec3 d {std::max({min.x - center.x, 0.0f, center.x - max.x}),
+            std::max({min.y - center.y, 0.0f, center.y - max.y}),
+            std::max({min.z - center.z, 0.0f, center.z - max.z})};
+    return dot(d, d) <= radius * radius;
+}
+
+// Power-of-two tile size for a light `wanted` texels across, currently in a tile of
+// `current` texels. Tiles shrink only once they are well over twice the size
+// wanted, so a light near the boundary does not switch back and forth.
+auto choose_tile_size(int current, float wanted) -> int {
+    auto size = static_cast<float>(current);
+    if (current > 0 && wanted <= size && wanted >= size * 0.375f) {
+        return current;
+    }
+    int n = shadows::ShadowAtlas::MIN_TILE;
+    while (static_cast<float>(n) < wanted && n < shadows::ShadowAtlas::MAX_TILE) {
+        n *= 2;
+    }
+    return n;
+}
+
+// Cube face directions and up vectors, in the order the shader picks faces in:
+// +x, -x, +y, -y, +z, -z.
+auto constexpr FACE_DIRECTIONS = std::array {Vec3 {1.0f, 0.0f, 0.0f},
+                                             Vec3 {-1.0f, 0.0f, 0.0f},
+                                             Vec3 {0.0f, 1.0f, 0.0f},
+                                             Vec3 {0.0f, -1.0f, 0.0f},
+                                             Vec3 {0.0f, 0.0f, 1.0f},
+                                             Vec3 {0.0f, 0.0f, -1.0f}};
+auto constexpr FACE_UPS = std::array {Vec3 {0.0f, -1.0f, 0.0f},
+                                      Vec3 {0.0f, -1.0f, 0.0f},
+                                      Vec3 {0.0f, 0.0f, 1.0f},
+                                      Vec3 {0.0f, 0.0f, -1.0f},
+                                      Vec3 {0.0f, -1.0f, 0.0f},
+                                      Vec3 {0.0f, -1.0f, 0.0f}};
+} // namespace
+
+namespace shadows {
+auto CascadedShadowMaps::init() -> bool {
+    program_ = link_program(shaders::shadow_caster_vertex_src,
+                            shaders::shadow_caster_fragment_src);
+    if (program_ == 0) {
+        return false;
+    }
+
+    glGenTextures(1, &texture_);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY,
+                 0,
+                 SHADOW_FORMAT,
+                 RESOLUTION,
+                 RESOLUTION,
+                 CASCADE_COUNT,
+                 0,
+                 GL_DEPTH_COMPONENT,
+                 GL_UNSIGNED_INT,
+                 nullptr);
+    // Linear filtering with compare mode on gives a bilinear 2x2 PCF per lookup.
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(
+        GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    glGenFramebuffers(1, &framebuffer_);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture_, 0, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    bool complete =
+        glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete) {
+        spdlog::error("Shadow map framebuffer is incomplete");
+        shutdown();
+        return false;
+    }
+
+    timer_.init();
+    cache_valid_ = false;
+    return true;
+}
+
+void CascadedShadowMaps::shutdown() {
+    timer_.shutdown();
+    glDeleteFramebuffers(1, &framebuffer_);
+    glDeleteTextures(1, &texture_);
+    glDeleteProgram(program_);
+    framebuffer_ = texture_ = program_ = 0;
+}
+
+auto CascadedShadowMaps::shader_source() -> const char* {
+    return shaders::directional_light_src;
+}
+
+void CascadedShadowMaps::update(const Mat4& view,
+                                const Mat4& proj,
+                                const Vec3& direction,
+                                const std::vector<Caster>& casters) {
+    Vec3 light = normalize(direction);
+    if (std::memcmp(&light, &direction_, sizeof(light)) != 0) {
+        direction_ = light;
+        cache_valid_ = false;
+    }
+    Vec3 up = std::abs(light.y) > 0.99f ? Vec3 {1.0f, 0.0f, 0.0f}
+                                        : Vec3 {0.0f, 1.0f, 0.0f};
+    light_view_ = look_at({0.0f, 0.0f, 0.0f}, light, up);
+    inverse_view_ = inverse(view);
+    view_direction_ = normalize(transform_direction(view, light * -1.0f));
+
+    // Light space bounds of the casters. The depth range of the static ones is
+    // shared by every cascade, so that moving a dynamic caster never moves a cached
+    // cascade; the x/y bounds drive culling.
+    float min_z = INFINITY, max_z = -INFINITY;
+    float dynamic_min_z = INFINITY, dynamic_max_z = -INFINITY;
+    caster_bounds_.resize(casters.size());
+    for (size_t i = 0; i < casters.size(); ++i) {
+        Vec4& b = caster_bounds_[i];
+        b = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+        float& low = casters[i].dynamic ? dynamic_min_z : min_z;
+        float& high = casters[i].dynamic ? dynamic_max_z : max_z;
+        for (int c = 0; c < 8; ++c) {
+            Vec3 p = transform_point(
+                light_view_, corner(casters[i].bounds_min, casters[i].bounds_max, c));
+            b.x = std::min(b.x, p.x);
+            b.y = std::min(b.y, p.y);
+            b.z = std::max(b.z, p.x);
+            b.w = std::max(b.w, p.y);
+            low = std::min(low, p.z);
+            high = std::max(high, p.z);
+        }
+    }
+    // Without static casters there is nothing to cache, the dynamic ones will do.
+    if (min_z > max_z) {
+        min_z = dynamic_min_z;
+        max_z = dynamic_max_z;
+    }
+    if (min_z > max_z) {
+        min_z = -1.0f;
+        max_z = 1.0f;
+    }
+    // Orthographic near and far distances, with a margin for the bias and for
+    // receivers just outside the casters.
+    float near = -max_z - CASTER_DEPTH_MARGIN;
+    float far = -min_z + CASTER_DEPTH_MARGIN;
+
+    // Split the shadowed depth range between logarithmic spacing, which keeps the
+    // texel density proportional to screen density, and uniform spacing, which
+    // stops the near cascades from getting uselessly small.
+    float camera_near = proj(2, 3) / (proj(2, 2) - 1.0f);
+    float camera_far = proj(2, 3) / (proj(2, 2) + 1.0f);
+    float shadow_far = std::min(shadow_distance, camera_far);
+    Mat4 inverse_proj = inverse(proj);
+    Vec3 rays[4];
+    for (int i = 0; i < 4; ++i) {
+        Vec3 on_near_plane = transform_point(
+            inverse_proj, {i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, -1.0f});
+        rays[i] = on_near_plane * (1.0f / -on_near_plane.z);
+    }
+
+    float slice_near = camera_near;
+    for (int i = 0; i < CASCADE_COUNT; ++i) {
+        Cascade& cascade = cascades_[i];
+        float t = static_cast<float>(i + 1) / CASCADE_COUNT;
+        float logarithmic = camera_near * std::pow(shadow_far / camera_near, t);
+        float uniform = camera_near + (shadow_far - camera_near) * t;
+        cascade.split = logarithmic * split_lambda + uniform * (1.0f - split_lambda);
+
+        // Bounding sphere of the slice in light space. Its radius only depends on
+        // the projection, so rotating the camera does not change the texel size.
+        Vec3 corners[8];
+        Vec3 center;
+        for (int c = 0; c < 8; ++c) {
+            Vec3 in_view = rays[c & 3] * (c < 4 ? slice_near : cascade.split);
+            corners[c] = transform_point(light_view_,
+                                         transform_point(inverse_view_, in_view));
+            center = center + corners[c] * 0.125f;
+        }
+        float radius = 0.0f;
+        for (const Vec3& c : corners) {
+            radius = std::max(radius, length(c - center));
+        }
+        radius = std::ceil(radius * 16.0f) / 16.0f;
+
+        // Snap the centre to whole texels, or to coarse steps for cached cascades,
+        // growing the extent so that the slice stays inside between steps.
+        int snap_texels = is_cached(i) ? CACHED_SNAP_TEXELS : 1;
+        cascade.extent =
+            radius / (1.0f - static_cast<float>(snap_texels) / RESOLUTION);
+        cascade.texel = 2.0f * cascade.extent / RESOLUTION;
+        float step = cascade.texel * static_cast<float>(snap_texels);
+        cascade.center_x = std::round(center.x / step) * step;
+        cascade.center_y = std::round(center.y / step) * step;
+        cascade.view_proj = orthographic(cascade.center_x - cascade.extent,
+                                         cascade.center_x + cascade.extent,
+                                         cascade.center_y - cascade.extent,
+                                         cascade.center_y + cascade.extent,
+                                         near,
+                                         far) *
+                            light_view_;
+
+        bool moved = std::memcmp(cascade.view_proj.m,
+                                 cascade.rendered_view_proj.m,
+                                 sizeof(cascade.view_proj.m)) != 0;
+        cascade.needs_render = !is_cached(i) || !cache_valid_ || moved;
+        slice_near = cascade.split;
+    }
+}
+
+void CascadedShadowMaps::render(const std::vector<Caster>& casters) {
+    stats_ = {};
+    bool any = false;
+    for (const Cascade& cascade : cascades_) {
+        any = any || cascade.needs_render;
+    }
+    if (!any) {
+        return;
+    }
+
+    timer_.begin();
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+    glViewport(0, 0, RESOLUTION, RESOLUTION);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_DEPTH_CLAMP);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(POLYGON_OFFSET_FACTOR, POLYGON_OFFSET_UNITS);
+    glUseProgram(program_);
+    int location = glGetUniformLocation(program_, "uModelViewProj");
+    for (int i = 0; i < CASCADE_COUNT; ++i) {
+        Cascade& cascade = cascades_[i];
+        if (!cascade.needs_render) {
+            continue;
+        }
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture_, 0, i);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        for (size_t c = 0; c < casters.size(); ++c) {
+            const Caster& caster = casters[c];
+            const Vec4& b = caster_bounds_[c];
+            if ((caster.dynamic && is_cached(i)) ||
+                b.z < cascade.center_x - cascade.extent ||
+                b.x > cascade.center_x + cascade.extent ||
+                b.w < cascade.center_y - cascade.extent ||
+                b.y > cascade.center_y + cascade.extent) {
+                stats_.casters_culled++;
+                continue;
+            }
+            Mat4 model_view_proj = cascade.view_proj * caster.model;
+            glUniformMatrix4fv(location, 1, GL_FALSE, model_view_proj.m);
+            glBindVertexArray(caster.vao);
+            glDrawElements(GL_TRIANGLES,
+                           caster.index_count,
+                           GL_UNSIGNED_INT,
+                           // NOLINTNEXTLINE
+                           (void*)(caster.first_index * sizeof(unsigned int)));
+            stats_.casters_drawn++;
+        }
+        cascade.rendered_view_proj = cascade.view_proj;
+        cascade.needs_render = false;
+        stats_.cascades_rendered++;
+    }
+    glBindVertexArray(0);
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDisable(GL_DEPTH_CLAMP);
+    glDisable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    cache_valid_ = true;
+    timer_.end();
+}
+
+void CascadedShadowMaps::bind(unsigned int program, int unit) const {
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(unit));
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture_);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(glGetUniformLocation(program, "uShadowMap"), unit);
+
+    // View space straight to shadow map texture coordinates and depth.
+    Mat4 to_texture = translate({0.5f, 0.5f, 0.5f}) * scale({0.5f, 0.5f, 0.5f});
+    float matrices[CASCADE_COUNT * 16];
+    float splits[CASCADE_COUNT];
+    float texels[CASCADE_COUNT];
+    for (int i = 0; i < CASCADE_COUNT; ++i) {
+        Mat4 m = to_texture * cascades_[i].view_proj * inverse_view_;
+        std::memcpy(&matrices[i * 16], m.m, sizeof(m.m));
+        splits[i] = cascades_[i].split;
+        texels[i] = cascades_[i].texel;
+    }
+    glUniformMatrix4fv(glGetUniformLocation(program, "uCascadeMatrices"),
+                       CASCADE_COUNT,
+                       GL_FALSE,
+                       matrices);
+    glUniform4fv(glGetUniformLocation(program, "uCascadeSplits"), 1, splits);
+    glUniform4fv(glGetUniformLocation(program, "uCascadeTexels"), 1, texels);
+    glUniform3f(glGetUniformLocation(program, "uLightDirection"),
+                view_direction_.x,
+                view_direction_.y,
+                view_direction_.z);
+    glUniform3f(
+        glGetUniformLocation(program, "uLightColor"), color.x, color.y, color.z);
+}
+
+void QuadtreeAllocator::init(int size, int min_size) {
+    size_ = size;
+    levels_ = 1;
+    size_t count = 1;
+    for (int s = size; s > min_size; s /= 2) {
+        count = count * 4 + 1;
+        ++levels_;
+    }
+    states_.assign(count, FREE);
+    node_levels_.assign(count, 0);
+    x_.assign(count, 0);
+    y_.assign(count, 0);
+    // Children of node i are 4i + 1 to 4i + 4, parents come first.
+    for (size_t i = 0; i * 4 + 4 < count; ++i) {
+        int half = this->size(static_cast<int>(i)) / 2;
+        for (size_t c = 0; c < 4; ++c) {
+            size_t child = i * 4 + 1 + c;
+            node_levels_[child] = static_cast<uint8_t>(node_levels_[i] + 1);
+            x_[child] = static_cast<uint16_t>(x_[i] + (c & 1 ? half : 0));
+            y_[child] = static_cast<uint16_t>(y_[i] + (c & 2 ? half : 0));
+        }
+    }
+    used_ = 0;
+}
+
+auto QuadtreeAllocator::size(int node) const -> int {
+    return size_ >> node_levels_[static_cast<size_t>(node)];
+}
+
+auto QuadtreeAllocator::usage() const -> float {
+    return static_cast<float>(static_cast<double>(used_) /
+                              (static_cast<double>(size_) * size_));
+}
+
+auto QuadtreeAllocator::allocate(int size) -> int {
+    int level = 0;
+    while (level < levels_ && (size_ >> level) > size) {
+        ++level;
+    }
+    if (level == levels_ || (size_ >> level) != size) {
+        return -1;
+    }
+    int node = allocate(0, 0, level);
+    if (node >= 0) {
+        used_ += static_cast<int64_t>(size) * size;
+    }
+    return node;
+}
+
+auto QuadtreeAllocator::allocate(int node, int level, int target) -> int {
+    auto i = static_cast<size_t>(node);
+    if (level == target) {
+        if (states_[i] != FREE) {
+            return -1;
+        }
+        states_[i] = USED;
+        return node;
+    }
+    if (states_[i] == USED) {
+        return -1;
+    }
+    int first_child = node * 4 + 1;
+    if (states_[i] == FREE) {
+        // The descendants of a free node are all free.
+        states_[i] = SPLIT;
+        return allocate(first_child, level + 1, target);
+    }
+    for (State state : {SPLIT, FREE}) {
+        for (int c = first_child; c < first_child + 4; ++c) {
+            if (states_[static_cast<size_t>(c)] == state) {
+                int found = allocate(c, level + 1, target);
+                if (found >= 0) {
+                    return found;
+                }
+            }
+        }
+    }
+    return -1;
+}
+
+void QuadtreeAllocator::free(int node) {
+    used_ -= static_cast<int64_t>(size(node)) * size(node);
+    states_[static_cast<size_t>(node)] = FREE;
+    while (node > 0) {
+        int parent = (node - 1) / 4;
+        for (int c = parent * 4 + 1; c < parent * 4 + 5; ++c) {
+            if (states_[static_cast<size_t>(c)] != FREE) {
+                return;
+            }
+        }
+        states_[static_cast<size_t>(parent)] = FREE;
+        node = parent;
+    }
+}
+
+auto ShadowAtlas::init() -> bool {
+    program_ = link_program(shaders::shadow_caster_vertex_src,
+                            shaders::shadow_caster_fragment_src);
+    if (program_ == 0) {
+        return false;
+    }
+
+    glGenTextures(1, &atlas_);
+    glBindTexture(GL_TEXTURE_2D, atlas_);
+    glTexImage2D(GL_TEXTURE_2D,
+                 0,
+                 ATLAS_FORMAT,
+                 RESOLUTION,
+                 RESOLUTION,
+                 0,
+                 GL_DEPTH_COMPONENT,
+                 GL_UNSIGNED_SHORT,
+                 nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &framebuffer_);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+    glFramebufferTexture2D(
+        GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, atlas_, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    bool complete =
+        glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // The per light records: where the light was and how each face maps into the
+    // atlas.
+    glGenBuffers(1, &buffer_);
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer_);
+    glBufferData(GL_TEXTURE_BUFFER,
+                 MAX_SHADOWED_LIGHTS * RECORD_TEXELS * sizeof(Vec4),
+                 nullptr,
+                 GL_STREAM_DRAW);
+    glGenTextures(1, &buffer_texture_);
+    glBindTexture(GL_TEXTURE_BUFFER, buffer_texture_);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffer_);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    if (!complete) {
+        spdlog::error("Shadow atlas framebuffer is incomplete");
+        shutdown();
+        return false;
+    }
+
+    allocator_.init(RESOLUTION, MIN_TILE);
+    for (Record& record : records_) {
+        record = {};
+    }
+    gpu_records_.assign(MAX_SHADOWED_LIGHTS * RECORD_TEXELS, {});
+    timer_.init();
+    return true;
+}
+
+void ShadowAtlas::shutdown() {
+    timer_.shutdown();
+    glDeleteTextures(1, &buffer_texture_);
+    glDeleteBuffers(1, &buffer_);
+    glDeleteFramebuffers(1, &framebuffer_);
+    glDeleteTextures(1, &atlas_);
+    glDeleteProgram(program_);
+    buffer_texture_ = buffer_ = framebuffer_ = atlas_ = program_ = 0;
+}
+
+auto ShadowAtlas::shader_source() -> const char* {
+    return shaders::local_light_shadow_src;
+}
+
+void ShadowAtlas::invalidate() {
+    for (Record& record : records_) {
+        record.dirty = true;
+    }
+}
+
+void ShadowAtlas::release(Record& record) {
+    for (int& node : record.nodes) {
+        if (node >= 0) {
+            allocator_.free(node);
+            node = -1;
+        }
+    }
+    record.tile_size = 0;
+    record.has_map = false;
+}
+
+auto ShadowAtlas::allocate(Record& record, int tile_size) -> bool {
+    release(record);
+    record.denied_size = 0;
+    // Settle for smaller tiles while the atlas is crowded.
+    for (int size = tile_size; size >= MIN_TILE; size /= 2) {
+        int placed = 0;
+        while (placed < 6) {
+            int node = allocator_.allocate(size);
+            if (node < 0) {
+                break;
+            }
+            record.nodes[placed++] = node;
+        }
+        if (placed == 6) {
+            record.tile_size = size;
+            if (size < tile_size) {
+                record.denied_size = size * 2;
+                record.denied_usage = allocator_.usage();
+            }
+            return true;
+        }
+        release(record);
+    }
+    record.denied_size = MIN_TILE;
+    record.denied_usage = allocator_.usage();
+    return false;
+}
+
+auto ShadowAtlas::wanted_tile_size(const Record& record) const -> int {
+    int tile_size = choose_tile_size(
+        record.tile_size,
+        coverage_[static_cast<size_t>(record.light)] * resolution_scale);
+    if (record.denied_size > 0 && tile_size >= record.denied_size &&
+        allocator_.usage() >= record.denied_usage) {
+        return record.tile_size;
+    }
+    return tile_size;
+}
+
+void ShadowAtlas::update(std::vector<lighting::PointLight>& lights,
+                         const std::vector<Caster>& casters,
+                         const Mat4& view,
+                         const Mat4& proj,
+                         int width,
+                         int height) {
+    stats_ = {};
+    inverse_view_ = inverse(view);
+    size_t light_count = lights.size();
+    record_of_light_.assign(light_count, -1);
+    for (int r = 0; r < MAX_SHADOWED_LIGHTS; ++r) {
+        Record& record = records_[r];
+        if (record.light >= static_cast<int>(light_count)) {
+            release(record);
+            record = {};
+        } else if (record.light >= 0) {
+            record_of_light_[static_cast<size_t>(record.light)] = r;
+        }
+    }
+
+    // Importance is the light's radius on screen, in pixels, weighted by its
+    // brightness. Lights entirely outside the frustum have none.
+    float camera_near = proj(2, 3) / (proj(2, 2) - 1.0f);
+    float x_scale = proj(0, 0), y_scale = proj(1, 1);
+    float x_norm = 1.0f / std::sqrt(x_scale * x_scale + 1.0f);
+    float y_norm = 1.0f / std::sqrt(y_scale * y_scale + 1.0f);
+    importance_.assign(light_count, 0.0f);
+    coverage_.assign(light_count, 0.0f);
+    candidates_.clear();
+    for (size_t i = 0; i < light_count; ++i) {
+        const lighting::PointLight& light = lights[i];
+        Vec3 p = transform_point(view, light.position);
+        float r = light.radius;
+        if (p.z - r > -camera_near || (x_scale * p.x + p.z) * x_norm > r ||
+            (-x_scale * p.x + p.z) * x_norm > r ||
+            (y_scale * p.y + p.z) * y_norm > r ||
+            (-y_scale * p.y + p.z) * y_norm > r) {
+            continue;
+        }
+        float distance2 = dot(p, p);
+        float pixels = static_cast<float>(std::max(width, height));
+        if (distance2 > r * r) {
+            pixels = std::min(pixels,
+                              r * y_scale * 0.5f * static_cast<float>(height) /
+                                  std::sqrt(distance2 - r * r));
+        }
+        float brightness = std::max({light.color.x, light.color.y, light.color.z});
+        coverage_[i] = pixels;
+        importance_[i] = pixels * brightness;
+        if (record_of_light_[i] >= 0) {
+            importance_[i] *= KEEP_BONUS;
+        }
+        if (importance_[i] > 0.0f) {
+            candidates_.push_back(static_cast<int>(i));
+        }
+    }
+
+    // Keep the most important lights, dropping the shadows of the others.
+    size_t keep = static_cast<size_t>(std::clamp(max_lights, 0, MAX_SHADOWED_LIGHTS));
+    if (candidates_.size() > keep) {
+        std::nth_element(candidates_.begin(),
+                         candidates_.begin() + static_cast<std::ptrdiff_t>(keep),
+                         candidates_.end(),
+                         [&](int a, int b) {
+                             return importance_[static_cast<size_t>(a)] >
+                                    importance_[static_cast<size_t>(b)];
+                         });
+        for (size_t c = keep; c < candidates_.size(); ++c) {
+            int& r = record_of_light_[static_cast<size_t>(candidates_[c])];
+            if (r >= 0) {
+                release(records_[r]);
+                records_[r] = {};
+                r = -1;
+            }
+        }
+        candidates_.resize(keep);
+    }
+    for (Record& record : records_) {
+        if (record.light >= 0 &&
+            importance_[static_cast<size_t>(record.light)] <= 0.0f) {
+            record_of_light_[static_cast<size_t>(record.light)] = -1;
+            release(record);
+            record = {};
+        }
+    }
+    int next_free = 0;
+    for (int i : candidates_) {
+        auto light = static_cast<size_t>(i);
+        if (record_of_light_[light] >= 0) {
+            continue;
+        }
+        while (records_[next_free].light >= 0) {
+            ++next_free;
+        }
+        records_[next_free].light = i;
+        record_of_light_[light] = next_free;
+    }
+
+    // A map is dirty once its light moved, its tile size should change or a
+    // dynamic caster is in range. Maps that never were rendered go first, then the
+    // dirty ones by importance times the frames they have been waiting.
+    int schedule[MAX_SHADOWED_LIGHTS];
+    float priorities[MAX_SHADOWED_LIGHTS];
+    int dirty_count = 0;
+    for (int r = 0; r < MAX_SHADOWED_LIGHTS; ++r) {
+        Record& record = records_[r];
+        record.scheduled = false;
+        if (record.light < 0) {
+            continue;
+        }
+        const lighting::PointLight& light = lights[static_cast<size_t>(record.light)];
+        auto light_index = static_cast<size_t>(record.light);
+        int tile_size = wanted_tile_size(record);
+        record.importance = importance_[light_index];
+        record.age++;
+        // No room for even the smallest tile, until some is freed.
+        if (tile_size == 0) {
+            continue;
+        }
+        bool moved =
+            std::memcmp(&light.position, &record.position, sizeof(Vec3)) != 0 ||
+            light.radius != record.radius;
+        bool dynamic_in_range = false;
+        for (const Caster& caster : casters) {
+            if (caster.dynamic && sphere_overlaps_box(light.position,
+                                                      light.radius,
+                                                      caster.bounds_min,
+                                                      caster.bounds_max)) {
+                dynamic_in_range = true;
+                break;
+            }
+        }
+        record.dirty = record.dirty || moved || dynamic_in_range ||
+                       tile_size != record.tile_size;
+        if (record.dirty) {
+            schedule[dirty_count] = r;
+            priorities[r] = record.has_map
+                                ? record.importance * static_cast<float>(record.age)
+                                : INFINITY;
+            ++dirty_count;
+        }
+    }
+    int budget = std::clamp(updates_per_frame, 0, dirty_count);
+    std::partial_sort(schedule,
+                      schedule + budget,
+                      schedule + dirty_count,
+                      [&](int a, int b) { return priorities[a] > priorities[b]; });
+
+    for (int s = 0; s < budget; ++s) {
+        Record& record = records_[schedule[s]];
+        const lighting::PointLight& light = lights[static_cast<size_t>(record.light)];
+        int tile_size = wanted_tile_size(record);
+        if (tile_size != record.tile_size && !allocate(record, tile_size)) {
+            continue;
+        }
+        // Each face is a 90 degree frustum from the light to its radius.
+        Mat4 face_proj =
+            perspective(1.5707964f, 1.0f, light.radius * 0.02f, light.radius);
+        for (int f = 0; f < 6; ++f) {
+            record.face_view_proj[f] =
+                face_proj * look_at(light.position,
+                                    light.position + FACE_DIRECTIONS[f],
+                                    FACE_UPS[f]);
+        }
+        record.position = light.position;
+        record.radius = light.radius;
+        record.age = 0;
+        record.has_map = true;
+        record.dirty = false;
+        record.scheduled = true;
+    }
+
+    // Every light with a map samples it, whether it was rendered just now or a
+    // while ago.
+    auto atlas_size = static_cast<float>(RESOLUTION);
+    for (int r = 0; r < MAX_SHADOWED_LIGHTS; ++r) {
+        const Record& record = records_[r];
+        if (record.light < 0 || !record.has_map) {
+            continue;
+        }
+        lights[static_cast<size_t>(record.light)].shadow = r;
+        stats_.shadowed_lights++;
+        if (!record.scheduled) {
+            continue;
+        }
+        Vec4* texels = &gpu_records_[static_cast<size_t>(r * RECORD_TEXELS)];
+        texels[0] = {record.position.x,
+                     record.position.y,
+                     record.position.z,
+                     static_cast<float>(record.tile_size)};
+        float size = static_cast<float>(record.tile_size) / atlas_size;
+        for (int f = 0; f < 6; ++f) {
+            float x = static_cast<float>(allocator_.x(record.nodes[f])) / atlas_size;
+            float y = static_cast<float>(allocator_.y(record.nodes[f])) / atlas_size;
+            // Clip space into the face's tile, depth into [0, 1].
+            Mat4 to_tile = translate({x + size * 0.5f, y + size * 0.5f, 0.5f}) *
+                           scale({size * 0.5f, size * 0.5f, 0.5f});
+            Mat4 m = to_tile * record.face_view_proj[f];
+            Vec4* face = texels + 1 + f * FACE_TEXELS;
+            std::memcpy(face, m.m, sizeof(m.m));
+            // Lookups are clamped half a texel inside the tile, so filtering never
+            // reaches into a neighbour.
+            float half_texel = 0.5f / atlas_size;
+            face[4] = {x + half_texel,
+                       y + half_texel,
+                       x + size - half_texel,
+                       y + size - half_texel};
+        }
+    }
+    for (size_t i = 0; i < light_count; ++i) {
+        if (record_of_light_[i] < 0 || !records_[record_of_light_[i]].has_map) {
+            lights[i].shadow = -1;
+        }
+    }
+    stats_.atlas_usage = allocator_.usage();
+
+    glBindBuffer(GL_TEXTURE_BUFFER, buffer_);
+    glBufferData(GL_TEXTURE_BUFFER,
+                 static_cast<GLsizeiptr>(gpu_records_.size() * sizeof(Vec4)),
+                 gpu_records_.data(),
+                 GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void ShadowAtlas::render(const std::vector<Caster>& casters) {
+    bool any = false;
+    for (const Record& record : records_) {
+        any = any || record.scheduled;
+    }
+    if (!any) {
+        return;
+    }
+
+    timer_.begin();
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer_);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_SCISSOR_TEST);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(POLYGON_OFFSET_FACTOR, POLYGON_OFFSET_UNITS);
+    glUseProgram(program_);
+    int location = glGetUniformLocation(program_, "uModelViewProj");
+    for (Record& record : records_) {
+        if (!record.scheduled) {
+            continue;
+        }
+        for (int f = 0; f < 6; ++f) {
+            int x = allocator_.x(record.nodes[f]);
+            int y = allocator_.y(record.nodes[f]);
+            glViewport(x, y, record.tile_size, record.tile_size);
+            glScissor(x, y, record.tile_size, record.tile_size);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            Vec3 axis = FACE_DIRECTIONS[f];
+            for (const Caster& caster : casters) {
+                // Within the light's reach and on the face's side of it.
+                Vec3 far_corner = corner(caster.bounds_min,
+                                         caster.bounds_max,
+                                         (axis.x > 0.0f ? 1 : 0) |
+                                             (axis.y > 0.0f ? 2 : 0) |
+                                             (axis.z > 0.0f ? 4 : 0));
+                if (!sphere_overlaps_box(record.position,
+                                         record.radius,
+                                         caster.bounds_min,
+                                         caster.bounds_max) ||
+                    dot(far_corner - record.position, axis) < 0.0f) {
+                    continue;
+                }
+                Mat4 model_view_proj = record.face_view_proj[f] * caster.model;
+                glUniformMatrix4fv(location, 1, GL_FALSE, model_view_proj.m);
+                glBindVertexArray(caster.vao);
+                glDrawElements(GL_TRIANGLES,
+                               caster.index_count,
+                               GL_UNSIGNED_INT,
+                               // NOLINTNEXTLINE
+                               (void*)(caster.first_index * sizeof(unsigned int)));
+                stats_.casters_drawn++;
+            }
+        }
+        record.scheduled = false;
+        stats_.maps_rendered++;
+    }
+    glBindVertexArray(0);
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDisable(GL_SCISSOR_TEST);
+    glDisable(GL_DEPTH_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    timer_.end();
+}
+
+void ShadowAtlas::bind(unsigned int program, int first_unit) const {
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(first_unit));
+    glBindTexture(GL_TEXTURE_BUFFER, buffer_texture_);
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(first_unit + 1));
+    glBindTexture(GL_TEXTURE_2D, atlas_);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(glGetUniformLocation(program, "uShadowRecords"), first_unit);
+    glUniform1i(glGetUniformLocation(program, "uShadowAtlas"), first_unit + 1);
+    glUniformMatrix4fv(glGetUniformLocation(program, "uShadowInverseView"),
+                       1,
+                       GL_FALSE,
+                       inverse_view_.m);
+}
+} // namespace shadows
@@ -0,0 +1,398 @@
+#include "streaming.H"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+namespace {
+auto constexpr FORMAT = GL_SRGB8_ALPHA8;
+auto constexpr BYTES_PER_TEXEL = 4;
+// Samples per axis and texel of generated posters, at most.
+auto constexpr POSTER_SUPERSAMPLING = 4;
+
+auto level_extent(int size, int level) -> int {
+    return std::max(1, size >> level);
+}
+
+// The poster at level 0 texel coordinates (x, y) of a `size` texel card.
+void poster_texel(int seed, int size, float x, float y, float color[3]) {
+    float s = static_cast<float>(size);
+    float u = x / s - 0.5f;
+    float v = y / s - 0.5f;
+    float hue = static_cast<float>(seed) * 0.618034f;
+    hue -= std::floor(hue);
+    for (int c = 0; c < 3; ++c) {
+        float phase = 6.2831853f * (hue + static_cast<float>(c) / 3.0f);
+        color[c] = 0.55f + 0.35f * std::cos(phase);
+    }
+    // Rings around the center, a different count per seed.
+    float rings = std::cos(std::sqrt(u * u + v * v) *
+                           (40.0f + 8.0f * static_cast<float>(seed % 5)));
+    float shade = 0.75f + 0.25f * rings;
+    // A one texel grid every 32 texels and a fine checker in one quadrant, which
+    // only the finest levels resolve.
+    auto xi = static_cast<int>(x);
+    auto yi = static_cast<int>(y);
+    if (xi % 32 == 0 || yi % 32 == 0) {
+        shade = 0.1f;
+    } else if (u > 0.0f && v > 0.0f && ((xi ^ yi) & 2) != 0) {
+        shade *= 0.5f;
+    }
+    for (int c = 0; c < 3; ++c) {
+        color[c] *= shade;
+    }
+}
+} // namespace
+
+namespace streaming {
+auto procedural_poster(int seed, int size) -> TextureSource {
+    TextureSource source;
+    source.width = size;
+    source.height = size;
+    source.load = [seed, size](int level, std::vector<uint8_t>& pixels) {
+        int extent = level_extent(size, level);
+        int samples = std::min(1 << level, POSTER_SUPERSAMPLING);
+        float texel = static_cast<float>(size) / static_cast<float>(extent);
+        float step = texel / static_cast<float>(samples);
+        pixels.resize(static_cast<size_t>(extent * extent * BYTES_PER_TEXEL));
+        for (int y = 0; y < extent; ++y) {
+            for (int x = 0; x < extent; ++x) {
+                float sum[3] = {};
+                for (int sy = 0; sy < samples; ++sy) {
+                    for (int sx = 0; sx < samples; ++sx) {
+                        float color[3];
+                        poster_texel(seed,
+                                     size,
+                                     static_cast<float>(x) * texel +
+                                         (static_cast<float>(sx) + 0.5f) * step,
+                                     static_cast<float>(y) * texel +
+                                         (static_cast<float>(sy) + 0.5f) * step,
+                                     color);
+                        for (int c = 0; c < 3; ++c) {
+                            sum[c] += color[c];
+                        }
+                    }
+                }
+                uint8_t* p = &pixels[static_cast<size_t>(
+                    (y * extent + x) * BYTES_PER_TEXEL)];
+                float weight = 1.0f / static_cast<float>(samples * samples);
+                for (int c = 0; c < 3; ++c) {
+                    p[c] = static_cast<uint8_t>(
+                        std::clamp(sum[c] * weight, 0.0f, 1.0f) * 255.0f + 0.5f);
+                }
+                p[3] = 255;
+            }
+        }
+        return true;
+    };
+    return source;
+}
+
+auto projected_size(float world_size,
+                    float distance,
+                    float fovy,
+                    int viewport_height) -> float {
+    float height = 2.0f * std::max(distance, 1e-4f) * std::tan(0.5f * fovy);
+    return world_size / height * static_cast<float>(viewport_height);
+}
+
+auto TextureStreamer::init(size_t budget) -> bool {
+    budget_ = budget;
+    glGenBuffers(1, &unpack_buffer_);
+    stopping_ = false;
+    loader_ = std::thread([this] { loader_loop(); });
+    return true;
+}
+
+TextureStreamer::~TextureStreamer() {
+    stop_loader();
+}
+
+void TextureStreamer::shutdown() {
+    stop_loader();
+    completed_.clear();
+    for (Texture& texture : textures_) {
+        glDeleteTextures(1, &texture.id);
+    }
+    textures_.clear();
+    glDeleteBuffers(1, &unpack_buffer_);
+    unpack_buffer_ = 0;
+    resident_bytes_ = in_flight_bytes_ = 0;
+}
+
+void TextureStreamer::stop_loader() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+        requests_.clear();
+    }
+    wake_.notify_all();
+    if (loader_.joinable()) {
+        loader_.join();
+    }
+}
+
+auto TextureStreamer::add(TextureSource source) -> int {
+    if (source.width <= 0 || source.height <= 0 || !source.load) {
+        spdlog::error("Streamed textures need a size and a source");
+        return -1;
+    }
+    Texture texture;
+    texture.levels = 1;
+    while ((std::max(source.width, source.height) >> texture.levels) > 0) {
+        ++texture.levels;
+    }
+    texture.pinned = 0;
+    while (std::max(level_extent(source.width, texture.pinned),
+                    level_extent(source.height, texture.pinned)) >
+           MIN_RESIDENT_SIZE) {
+        ++texture.pinned;
+    }
+    texture.resident = texture.pinned;
+    texture.wanted = texture.levels - 1;
+
+    glGenTextures(1, &texture.id);
+    glBindTexture(GL_TEXTURE_2D, texture.id);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    std::vector<uint8_t> pixels;
+    for (int level = texture.pinned; level < texture.levels; ++level) {
+        if (!source.load(level, pixels)) {
+            spdlog::error("Failed to load level {} of a streamed texture", level);
+            glDeleteTextures(1, &texture.id);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            return -1;
+        }
+        glTexImage2D(GL_TEXTURE_2D,
+                     level,
+                     FORMAT,
+                     level_extent(source.width, level),
+                     level_extent(source.height, level),
+                     0,
+                     GL_RGBA,
+                     GL_UNSIGNED_BYTE,
+                     pixels.data());
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, texture.pinned);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, texture.levels - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    texture.source = std::move(source);
+    std::lock_guard lock(mutex_);
+    textures_.push_back(std::move(texture));
+    return static_cast<int>(textures_.size()) - 1;
+}
+
+auto TextureStreamer::texture(int texture) const -> unsigned int {
+    return textures_[static_cast<size_t>(texture)].id;
+}
+
+void TextureStreamer::request(int texture, float screen_size) {
+    Texture& t = textures_[static_cast<size_t>(texture)];
+    // The level whose texels come closest to one per pixel without going over.
+    float texels = static_cast<float>(std::max(t.source.width, t.source.height));
+    int level = 0;
+    if (screen_size < texels) {
+        level = static_cast<int>(std::log2(texels / std::max(screen_size, 1.0f)));
+    }
+    t.wanted = std::min(t.wanted, std::clamp(level, 0, t.levels - 1));
+    t.last_used = frame_;
+}
+
+auto TextureStreamer::level_bytes(const Texture& texture, int level) const
+    -> size_t {
+    return static_cast<size_t>(level_extent(texture.source.width, level)) *
+           static_cast<size_t>(level_extent(texture.source.height, level)) *
+           BYTES_PER_TEXEL;
+}
+
+auto TextureStreamer::evict(bool needed) -> bool {
+    Texture* victim = nullptr;
+    for (Texture& texture : textures_) {
+        if (texture.resident >= texture.pinned ||
+            (!needed && texture.resident >= texture.wanted)) {
+            continue;
+        }
+        // Least recently used first, then the finest level, the largest one.
+        if (victim == nullptr || texture.last_used < victim->last_used ||
+            (texture.last_used == victim->last_used &&
+             texture.resident < victim->resident)) {
+            victim = &texture;
+        }
+    }
+    if (victim == nullptr) {
+        return false;
+    }
+    int level = victim->resident++;
+    glBindTexture(GL_TEXTURE_2D, victim->id);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, victim->resident);
+    // Outside [base, max] an empty level leaves the texture complete.
+    glTexImage2D(
+        GL_TEXTURE_2D, level, FORMAT, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    resident_bytes_ -= level_bytes(*victim, level);
+    ++stats_.evictions;
+    return true;
+}
+
+void TextureStreamer::update() {
+    auto start = std::chrono::steady_clock::now();
+    stats_.uploads = 0;
+    stats_.evictions = 0;
+
+    // Upload what the loader finished, up to the per frame budget. A level that no
+    // longer borders the resident ones was overtaken by an eviction.
+    std::deque<Load> completed;
+    {
+        std::lock_guard lock(mutex_);
+        completed.swap(completed_);
+    }
+    size_t uploaded = 0;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpack_buffer_);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    while (!completed.empty()) {
+        Load& load = completed.front();
+        Texture& texture = textures_[static_cast<size_t>(load.texture)];
+        size_t bytes = level_bytes(texture, load.level);
+        if (load.ok && load.level == texture.resident - 1) {
+            if (uploaded > 0 && uploaded + bytes > UPLOAD_BUDGET) {
+                break;
+            }
+            // Orphaning hands out fresh memory instead of waiting for the previous
+            // upload to be read.
+            glBufferData(GL_PIXEL_UNPACK_BUFFER,
+                         static_cast<GLsizeiptr>(bytes),
+                         nullptr,
+                         GL_STREAM_DRAW);
+            void* dst =
+                glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+                                 0,
+                                 static_cast<GLsizeiptr>(bytes),
+                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            if (dst != nullptr) {
+                std::memcpy(dst, load.pixels.data(), bytes);
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+                glBindTexture(GL_TEXTURE_2D, texture.id);
+                glTexImage2D(GL_TEXTURE_2D,
+                             load.level,
+                             FORMAT,
+                             level_extent(texture.source.width, load.level),
+                             level_extent(texture.source.height, load.level),
+                             0,
+                             GL_RGBA,
+                             GL_UNSIGNED_BYTE,
+                             nullptr);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, load.level);
+                texture.resident = load.level;
+                resident_bytes_ += bytes;
+                uploaded += bytes;
+                ++stats_.uploads;
+            }
+        }
+        texture.loading = false;
+        in_flight_bytes_ -= bytes;
+        completed.pop_front();
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!completed.empty()) {
+        std::lock_guard lock(mutex_);
+        for (auto it = completed.rbegin(); it != completed.rend(); ++it) {
+            completed_.push_front(std::move(*it));
+        }
+    }
+
+    // A smaller budget takes effect right away, needed levels or not.
+    while (resident_bytes_ + in_flight_bytes_ > budget_ && evict(true)) {
+    }
+
+    // Load the next finer level of every texture that wants one, the textures
+    // furthest from what they want first. Only levels that are not needed make
+    // room for them.
+    std::vector<int> wanting;
+    for (size_t i = 0; i < textures_.size(); ++i) {
+        const Texture& texture = textures_[i];
+        if (!texture.loading && texture.wanted < texture.resident) {
+            wanting.push_back(static_cast<int>(i));
+        }
+    }
+    std::sort(wanting.begin(), wanting.end(), [&](int a, int b) {
+        const Texture& ta = textures_[static_cast<size_t>(a)];
+        const Texture& tb = textures_[static_cast<size_t>(b)];
+        return ta.resident - ta.wanted > tb.resident - tb.wanted;
+    });
+    std::vector<Load> loads;
+    for (int index : wanting) {
+        Texture& texture = textures_[static_cast<size_t>(index)];
+        size_t bytes = level_bytes(texture, texture.resident - 1);
+        auto over_budget = [&] {
+            return resident_bytes_ + in_flight_bytes_ + bytes > budget_;
+        };
+        while (over_budget() && evict(false)) {
+        }
+        if (over_budget()) {
+            continue;
+        }
+        texture.loading = true;
+        in_flight_bytes_ += bytes;
+        loads.push_back({index, texture.resident - 1, {}, false});
+    }
+    if (!loads.empty()) {
+        {
+            std::lock_guard lock(mutex_);
+            for (Load& load : loads) {
+                requests_.push_back(std::move(load));
+            }
+        }
+        wake_.notify_one();
+    }
+
+    stats_.textures = static_cast<int>(textures_.size());
+    stats_.loads_in_flight = 0;
+    stats_.missing_levels = 0;
+    for (Texture& texture : textures_) {
+        stats_.loads_in_flight += texture.loading ? 1 : 0;
+        stats_.missing_levels += std::max(texture.resident - texture.wanted, 0);
+        // Requests only last a frame.
+        texture.wanted = texture.levels - 1;
+    }
+    stats_.resident_bytes = resident_bytes_;
+    stats_.budget_bytes = budget_;
+    ++frame_;
+    stats_.update_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                  start)
+            .count();
+}
+
+void TextureStreamer::loader_loop() {
+    while (true) {
+        Load load;
+        const TextureSource* source = nullptr;
+        {
+            std::unique_lock lock(mutex_);
+            wake_.wait(lock, [this] { return stopping_ || !requests_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            load = std::move(requests_.front());
+            requests_.pop_front();
+            // Sources do not change once added.
+            source = &textures_[static_cast<size_t>(load.texture)].source;
+        }
+        load.ok = source->load(load.level, load.pixels);
+        std::lock_guard lock(mutex_);
+        completed_.push_back(std::move(load));
+    }
+}
+} // namespace streaming
@@ -0,0 +1,1364 @@
+#include "texture_compression.H"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TEXTURE_COMPRESSION_SSE 1
+#endif
+
+#include "jobs.H"
+
+namespace {
+using texture_compression::Format;
+
+// Texels of a 4x4 block, RGBA8 row by row.
+auto constexpr BLOCK_TEXELS = 16;
+// Of the principal axis of a block's colors.
+auto constexpr PCA_ITERATIONS = 8;
+// Rounds of quantizing a BC7 subset's endpoints and refitting them to the indices
+// the quantized ones give.
+auto constexpr BC7_REFINE_PASSES = 3;
+// Two subset partitions of an opaque block encoded in full, the best fitting ones.
+auto constexpr BC7_PARTITION_CANDIDATES = 4;
+
+struct Bc7Mode {
+    int subsets;
+    int partition_bits;
+    int rotation_bits;
+    int index_selection_bits;
+    int color_bits;
+    int alpha_bits;
+    int endpoint_pbits; // one per endpoint
+    int shared_pbits;   // one per subset
+    int index_bits;
+    int index_bits2;    // of the second set of indices, for alpha
+};
+
+constexpr Bc7Mode BC7_MODES[8] = {
+    {3, 4, 0, 0, 4, 0, 1, 0, 3, 0},
+    {2, 6, 0, 0, 6, 0, 0, 1, 3, 0},
+    {3, 6, 0, 0, 5, 0, 0, 0, 2, 0},
+    {2, 6, 0, 0, 7, 0, 1, 0, 2, 0},
+    {1, 0, 2, 1, 5, 6, 0, 0, 2, 3},
+    {1, 0, 2, 0, 7, 8, 0, 0, 2, 2},
+    {1, 0, 0, 0, 7, 7, 1, 0, 4, 0},
+    {2, 6, 0, 0, 5, 5, 1, 0, 2, 0},
+};
+
+// Subset of every texel in the two subset partitions, a bit per texel, and in
+// the three subset ones, two bits per texel.
+constexpr uint16_t BC7_PARTITIONS_2[64] = {
+    0xCCCC, 0x8888, 0xEEEE, 0xECC8, 0xC880, 0xFEEC, 0xFEC8, 0xEC80,
+    0xC800, 0xFFEC, 0xFE80, 0xE800, 0xFFE8, 0xFF00, 0xFFF0, 0xF000,
+    0xF710, 0x008E, 0x7100, 0x08CE, 0x008C, 0x7310, 0x3100, 0x8CCE,
+    0x088C, 0x3110, 0x6666, 0x366C, 0x17E8, 0x0FF0, 0x718E, 0x399C,
+    0xAAAA, 0xF0F0, 0x5A5A, 0x33CC, 0x3C3C, 0x55AA, 0x9696, 0xA55A,
+    0x73CE, 0x13C8, 0x324C, 0x3BDC, 0x6996, 0xC33C, 0x9966, 0x0660,
+    0x0272, 0x04E4, 0x4E40, 0x2720, 0xC936, 0x936C, 0x39C6, 0x639C,
+    0x9336, 0x9CC6, 0x817E, 0xE718, 0xCCF0, 0x0FCC, 0x7744, 0xEE22,
+};
+
+constexpr uint32_t BC7_PARTITIONS_3[64] = {
+    0xAA685050u, 0x6A5A5040u, 0x5A5A4200u, 0x5450A0A8u, 0xA5A50000u, 0xA0A05050u,
+    0x5555A0A0u, 0x5A5A5050u, 0xAA550000u, 0xAA555500u, 0xAAAA5500u, 0x90909090u,
+    0x94949494u, 0xA4A4A4A4u, 0xA9A59450u, 0x2A0A4250u, 0xA5945040u, 0x0A425054u,
+    0xA5A5A500u, 0x55A0A0A0u, 0xA8A85454u, 0x6A6A4040u, 0xA4A45000u, 0x1A1A0500u,
+    0x0050A4A4u, 0xAAA59090u, 0x14696914u, 0x69691400u, 0xA08585A0u, 0xAA821414u,
+    0x50A4A450u, 0x6A5A0200u, 0xA9A58000u, 0x5090A0A8u, 0xA8A09050u, 0x24242424u,
+    0x00AA5500u, 0x24924924u, 0x24499224u, 0x50A50A50u, 0x500AA550u, 0xAAAA4444u,
+    0x66660000u, 0xA5A0A5A0u, 0x50A050A0u, 0x69286928u, 0x44AAAA44u, 0x66666600u,
+    0xAA444444u, 0x54A854A8u, 0x95809580u, 0x96969600u, 0xA85454A8u, 0x80959580u,
+    0xAA141414u, 0x96960000u, 0xAAAA1414u, 0xA05050A0u, 0xA0A5A5A0u, 0x96000000u,
+    0x40804080u, 0xA9A8A9A8u, 0xAAAAAA44u, 0x2A4A5254u,
+};
+
+// Texels whose index is stored with one bit less, besides texel 0: the anchor of
+// the second subset in two subset partitions, and of the second and third in three
+// subset ones.
+constexpr uint8_t BC7_ANCHORS_2[64] = {
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15, 2,  8,  2,  2,  8,  8,  15, 2,  8,  2,  2,  8,  8,  2,  2,
+    15, 15, 6,  8,  2,  8,  15, 15, 2,  8,  2,  2,  2,  15, 15, 6,
+    6,  2,  6,  8,  15, 15, 2,  2,  15, 15, 15, 15, 15, 2,  2,  15,
+};
+constexpr uint8_t BC7_ANCHORS_3A[64] = {
+    3,  3,  15, 15, 8,  3,  15, 15, 8,  8,  6,  6,  6,  5,  3,  3,
+    3,  3,  8,  15, 3,  3,  6,  10, 5,  8,  8,  6,  8,  5,  15, 15,
+    8,  15, 3,  5,  6,  10, 8,  15, 15, 3,  15, 5,  15, 15, 15, 15,
+    3,  15, 5,  5,  5,  8,  5,  10, 5,  10, 8,  13, 15, 12, 3,  3,
+};
+constexpr uint8_t BC7_ANCHORS_3B[64] = {
+    15, 8,  8,  3,  15, 15, 3,  8,  15, 15, 15, 15, 15, 15, 15, 8,
+    15, 8,  15, 3,  15, 8,  15, 8,  3,  15, 6,  10, 15, 15, 10, 8,
+    15, 3,  15, 10, 10, 8,  9,  10, 6,  15, 8,  15, 3,  6,  6,  8,
+    15, 3,  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 3,  15, 15, 8,
+};
+
+constexpr uint8_t BC7_WEIGHTS_2[4] = {0, 21, 43, 64};
+constexpr uint8_t BC7_WEIGHTS_3[8] = {0, 9, 18, 27, 37, 46, 55, 64};
+constexpr uint8_t BC7_WEIGHTS_4[16] = {
+    0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+// Intensity modifiers of ETC1 and ETC2 blocks, per table codeword, for pixel
+// indices 0 and 1; 2 and 3 are their negations.
+constexpr int ETC_MODIFIERS[8][2] = {
+    {2, 8}, {5, 17}, {9, 29}, {13, 42}, {18, 60}, {24, 80}, {33, 106}, {47, 183}};
+// Distances of the T and H modes of ETC2.
+constexpr int ETC_DISTANCES[8] = {3, 6, 11, 16, 23, 32, 41, 64};
+constexpr int EAC_MODIFIERS[16][8] = {
+    {-3, -6, -9, -15, 2, 5, 8, 14},
+    {-3, -7, -10, -13, 2, 6, 9, 12},
+    {-2, -5, -8, -13, 1, 4, 7, 12},
+    {-2, -4, -6, -13, 1, 3, 5, 12},
+    {-3, -6, -8, -12, 2, 5, 7, 11},
+    {-3, -7, -9, -11, 2, 6, 8, 10},
+    {-4, -7, -8, -11, 3, 6, 7, 10},
+    {-3, -5, -8, -11, 2, 4, 7, 10},
+    {-2, -6, -8, -10, 1, 5, 7, 9},
+    {-2, -5, -8, -10, 1, 4, 7, 9},
+    {-2, -4, -8, -10, 1, 3, 7, 9},
+    {-2, -5, -7, -10, 1, 4, 6, 9},
+    {-3, -4, -7, -10, 2, 3, 6, 9},
+    {-1, -2, -3, -10, 0, 1, 2, 9},
+    {-4, -6, -8, -9, 3, 5, 7, 8},
+    {-3, -5, -7, -9, 2, 4, 6, 8},
+};
+
+auto clamp_byte(int value) -> uint8_t {
+    return static_cast<uint8_t>(std::clamp(value, 0, 255));
+}
+
+auto load_le64(const uint8_t* bytes) -> uint64_t {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+// ETC and EAC blocks are big-endian.
+auto load_be64(const uint8_t* bytes) -> uint64_t {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+void expand_565(uint16_t color, uint8_t* rgb) {
+    int r = color >> 11 & 31;
+    int g = color >> 5 & 63;
+    int b = color & 31;
+    rgb[0] = static_cast<uint8_t>(r << 3 | r >> 2);
+    rgb[1] = static_cast<uint8_t>(g << 2 | g >> 4);
+    rgb[2] = static_cast<uint8_t>(b << 3 | b >> 2);
+}
+
+// The color half of BC1, BC2 and BC3 blocks. Only BC1 has the three color mode,
+// in which index 3 is black, transparent with `alpha`.
+void decode_bc1_color(const uint8_t* block, bool bc1, bool alpha, uint8_t* texels) {
+    auto c0 = static_cast<uint16_t>(block[0] | block[1] << 8);
+    auto c1 = static_cast<uint16_t>(block[2] | block[3] << 8);
+    uint8_t palette[4][4] = {};
+    expand_565(c0, palette[0]);
+    expand_565(c1, palette[1]);
+    palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+    for (int c = 0; c < 3; ++c) {
+        int a = palette[0][c];
+        int b = palette[1][c];
+        if (c0 > c1 || !bc1) {
+            palette[2][c] = static_cast<uint8_t>((2 * a + b) / 3);
+            palette[3][c] = static_cast<uint8_t>((a + 2 * b) / 3);
+        } else {
+            palette[2][c] = static_cast<uint8_t>((a + b) / 2);
+        }
+    }
+    if (c0 <= c1 && bc1 && alpha) {
+        palette[3][3] = 0;
+    }
+    uint32_t indices = static_cast<uint32_t>(block[4]) | block[5] << 8 |
+                       block[6] << 16 | static_cast<uint32_t>(block[7]) << 24;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        std::memcpy(texels + i * 4, palette[indices >> (2 * i) & 3], 4);
+    }
+}
+
+// The interpolated alpha of BC3, also the channels of BC4 and BC5, into channel
+// `channel` of `texels`.
+void decode_bc3_alpha(const uint8_t* block, int channel, uint8_t* texels) {
+    int a0 = block[0];
+    int a1 = block[1];
+    int palette[8] = {a0, a1};
+    if (a0 > a1) {
+        for (int i = 2; i < 8; ++i) {
+            palette[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+        }
+    } else {
+        for (int i = 2; i < 6; ++i) {
+            palette[i] = ((6 - i) * a0 + (i - 1) * a1) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+    uint64_t indices = load_le64(block) >> 16;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        int index = static_cast<int>(indices >> (3 * i) & 7);
+        texels[i * 4 + channel] = static_cast<uint8_t>(palette[index]);
+    }
+}
+
+class BitReader {
+public:
+    explicit BitReader(const uint8_t* block)
+        : low_(load_le64(block)), high_(load_le64(block + 8)) {}
+
+    auto read(int bits) -> int {
+        if (bits == 0) {
+            return 0;
+        }
+        auto value = static_cast<int>(low_ & ((1u << bits) - 1));
+        low_ = low_ >> bits | high_ << (64 - bits);
+        high_ >>= bits;
+        return value;
+    }
+
+private:
+    uint64_t low_;
+    uint64_t high_;
+};
+
+void decode_bc7(const uint8_t* block, uint8_t* texels) {
+    BitReader reader(block);
+    int mode = 0;
+    while (mode < 8 && reader.read(1) == 0) {
+        ++mode;
+    }
+    if (mode == 8) {
+        // Reserved, decodes to transparent black.
+        std::memset(texels, 0, BLOCK_TEXELS * 4);
+        return;
+    }
+    const Bc7Mode& m = BC7_MODES[mode];
+    int partition = reader.read(m.partition_bits);
+    int rotation = reader.read(m.rotation_bits);
+    int index_selection = reader.read(m.index_selection_bits);
+
+    int endpoints[3][2][4] = {};
+    for (int c = 0; c < 4; ++c) {
+        int bits = c < 3 ? m.color_bits : m.alpha_bits;
+        for (int s = 0; s < m.subsets; ++s) {
+            for (int e = 0; e < 2; ++e) {
+                endpoints[s][e][c] = reader.read(bits);
+            }
+        }
+    }
+    int pbits[3][2] = {};
+    for (int s = 0; s < m.subsets; ++s) {
+        if (m.endpoint_pbits != 0) {
+            pbits[s][0] = reader.read(1);
+            pbits[s][1] = reader.read(1);
+        } else if (m.shared_pbits != 0) {
+            pbits[s][0] = pbits[s][1] = reader.read(1);
+        }
+    }
+    bool has_pbits = m.endpoint_pbits != 0 || m.shared_pbits != 0;
+    for (int s = 0; s < m.subsets; ++s) {
+        for (int e = 0; e < 2; ++e) {
+            for (int c = 0; c < 4; ++c) {
+                int bits = c < 3 ? m.color_bits : m.alpha_bits;
+                int& value = endpoints[s][e][c];
+                if (bits == 0) {
+                    value = 255;
+                    continue;
+                }
+                if (has_pbits) {
+                    value = value << 1 | pbits[s][e];
+                    ++bits;
+                }
+                value = value << (8 - bits) | value >> (2 * bits - 8);
+            }
+        }
+    }
+
+    auto subset_of = [&](int texel) {
+        if (m.subsets == 2) {
+            return BC7_PARTITIONS_2[partition] >> texel & 1;
+        }
+        if (m.subsets == 3) {
+            return static_cast<int>(BC7_PARTITIONS_3[partition] >> (2 * texel) & 3);
+        }
+        return 0;
+    };
+    auto is_anchor = [&](int texel) {
+        return texel == 0 || (m.subsets == 2 && texel == BC7_ANCHORS_2[partition]) ||
+               (m.subsets == 3 && (texel == BC7_ANCHORS_3A[partition] ||
+                                   texel == BC7_ANCHORS_3B[partition]));
+    };
+    int indices[BLOCK_TEXELS];
+    int indices2[BLOCK_TEXELS] = {};
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        indices[i] = reader.read(m.index_bits - (is_anchor(i) ? 1 : 0));
+    }
+    if (m.index_bits2 != 0) {
+        for (int i = 0; i < BLOCK_TEXELS; ++i) {
+            indices2[i] = reader.read(m.index_bits2 - (i == 0 ? 1 : 0));
+        }
+    }
+
+    auto weights = [](int bits) {
+        return bits == 2 ? BC7_WEIGHTS_2 : bits == 3 ? BC7_WEIGHTS_3 : BC7_WEIGHTS_4;
+    };
+    int color_bits = m.index_bits;
+    int alpha_bits = m.index_bits2 != 0 ? m.index_bits2 : m.index_bits;
+    const int* color_indices = indices;
+    const int* alpha_indices = m.index_bits2 != 0 ? indices2 : indices;
+    if (index_selection != 0) {
+        std::swap(color_bits, alpha_bits);
+        std::swap(color_indices, alpha_indices);
+    }
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        const int(*e)[4] = endpoints[subset_of(i)];
+        uint8_t* texel = texels + i * 4;
+        auto interpolate = [&](int c, int w) {
+            return static_cast<uint8_t>(((64 - w) * e[0][c] + w * e[1][c] + 32) >> 6);
+        };
+        for (int c = 0; c < 3; ++c) {
+            texel[c] = interpolate(c, weights(color_bits)[color_indices[i]]);
+        }
+        texel[3] = interpolate(3, weights(alpha_bits)[alpha_indices[i]]);
+        if (rotation != 0) {
+            std::swap(texel[3], texel[rotation - 1]);
+        }
+    }
+}
+
+// ETC2 RGB blocks, with punch-through alpha when `punch_through`.
+void decode_etc2_color(const uint8_t* block, bool punch_through, uint8_t* texels) {
+    uint64_t bits = load_be64(block);
+    // Bit 33 is the differential flag, or in punch-through blocks the opaque one,
+    // differential mode being implied.
+    bool flag = (bits >> 33 & 1) != 0;
+    bool differential = punch_through || flag;
+    bool opaque = !punch_through || flag;
+    auto field = [&](int shift, int width) {
+        return static_cast<int>(bits >> shift & ((1u << width) - 1));
+    };
+    auto extend4 = [](int v) { return v << 4 | v; };
+    auto extend5 = [](int v) { return v << 3 | v >> 2; };
+    auto pixel_index = [&](int texel) {
+        // Indices are stored column by column, most significant bits first.
+        int i = (texel & 3) * 4 + texel / 4;
+        return (field(16 + i, 1) << 1) | field(i, 1);
+    };
+    auto set = [&](int texel, const int* rgb, bool transparent) {
+        uint8_t* t = texels + texel * 4;
+        if (transparent) {
+            std::memset(t, 0, 4);
+            return;
+        }
+        t[0] = clamp_byte(rgb[0]);
+        t[1] = clamp_byte(rgb[1]);
+        t[2] = clamp_byte(rgb[2]);
+        t[3] = 255;
+    };
+
+    int base[2][3];
+    if (!differential) {
+        for (int c = 0; c < 3; ++c) {
+            base[0][c] = extend4(field(60 - 8 * c, 4));
+            base[1][c] = extend4(field(56 - 8 * c, 4));
+        }
+    } else {
+        int r = field(59, 5);
+        int g = field(51, 5);
+        int b = field(43, 5);
+        auto delta = [&](int shift) { return (field(shift, 3) ^ 4) - 4; };
+        int r2 = r + delta(56);
+        int g2 = g + delta(48);
+        int b2 = b + delta(40);
+        if (r2 < 0 || r2 > 31) {
+            // T mode: one color, and a second one with two more at a distance.
+            int c0[3] = {extend4(field(59, 2) << 2 | field(56, 2)),
+                         extend4(field(52, 4)),
+                         extend4(field(48, 4))};
+            int c1[3] = {
+                extend4(field(44, 4)), extend4(field(40, 4)), extend4(field(36, 4))};
+            int d = ETC_DISTANCES[field(34, 2) << 1 | field(32, 1)];
+            int paint[4][3];
+            for (int c = 0; c < 3; ++c) {
+                paint[0][c] = c0[c];
+                paint[1][c] = c1[c] + d;
+                paint[2][c] = c1[c];
+                paint[3][c] = c1[c] - d;
+            }
+            for (int i = 0; i < BLOCK_TEXELS; ++i) {
+                int index = pixel_index(i);
+                set(i, paint[index], !opaque && index == 2);
+            }
+            return;
+        }
+        if (g2 < 0 || g2 > 31) {
+            // H mode: two colors, each with two at a distance around it.
+            int c0[3] = {extend4(field(59, 4)),
+                         extend4(field(56, 3) << 1 | field(52, 1)),
+                         extend4(field(51, 1) << 3 | field(47, 3))};
+            int c1[3] = {
+                extend4(field(43, 4)), extend4(field(39, 4)), extend4(field(35, 4))};
+            int v0 = (c0[0] & 15) << 8 | (c0[1] & 15) << 4 | (c0[2] & 15);
+            int v1 = (c1[0] & 15) << 8 | (c1[1] & 15) << 4 | (c1[2] & 15);
+            int d = ETC_DISTANCES[field(34, 1) << 2 | field(32, 1) << 1 |
+                                  (v0 >= v1 ? 1 : 0)];
+            int paint[4][3];
+            for (int c = 0; c < 3; ++c) {
+                paint[0][c] = c0[c] + d;
+                paint[1][c] = c0[c] - d;
+                paint[2][c] = c1[c] + d;
+                paint[3][c] = c1[c] - d;
+            }
+            for (int i = 0; i < BLOCK_TEXELS; ++i) {
+                int index = pixel_index(i);
+                set(i, paint[index], !opaque && index == 2);
+            }
+            return;
+        }
+        if (b2 < 0 || b2 > 31) {
+            // Planar mode: a gradient through three colors, always opaque.
+            auto extend6 = [](int v) { return v << 2 | v >> 4; };
+            auto extend7 = [](int v) { return v << 1 | v >> 6; };
+            int o[3] = {extend6(field(57, 6)),
+                        extend7(field(56, 1) << 6 | field(49, 6)),
+                        extend6(field(48, 1) << 5 | field(43, 2) << 3 | field(39, 3))};
+            int h[3] = {extend6(field(34, 5) << 1 | field(32, 1)),
+                        extend7(field(25, 7)),
+                        extend6(field(19, 6))};
+            int v[3] = {
+                extend6(field(13, 6)), extend7(field(6, 7)), extend6(field(0, 6))};
+            for (int i = 0; i < BLOCK_TEXELS; ++i) {
+                int x = i & 3;
+                int y = i / 4;
+                int rgb[3];
+                for (int c = 0; c < 3; ++c) {
+                    rgb[c] =
+                        (x * (h[c] - o[c]) + y * (v[c] - o[c]) + 4 * o[c] + 2) >> 2;
+                }
+                set(i, rgb, false);
+            }
+            return;
+        }
+        base[0][0] = extend5(r);
+        base[0][1] = extend5(g);
+        base[0][2] = extend5(b);
+        base[1][0] = extend5(r2);
+        base[1][1] = extend5(g2);
+        base[1][2] = extend5(b2);
+    }
+
+    // Two subblocks of 2x4 texels, side by side unless flipped.
+    bool flip = field(32, 1) != 0;
+    int tables[2] = {field(37, 3), field(34, 3)};
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        int x = i & 3;
+        int y = i / 4;
+        int subblock = (flip ? y : x) >= 2 ? 1 : 0;
+        int index = pixel_index(i);
+        const int* modifiers = ETC_MODIFIERS[tables[subblock]];
+        int modifier = index & 1 ? modifiers[1] : modifiers[0];
+        if (index & 2) {
+            modifier = -modifier;
+        }
+        // Without the opaque flag, index 0 is the base color and 2 transparent.
+        if (!opaque && index == 0) {
+            modifier = 0;
+        }
+        int rgb[3] = {base[subblock][0] + modifier,
+                      base[subblock][1] + modifier,
+                      base[subblock][2] + modifier};
+        set(i, rgb, !opaque && index == 2);
+    }
+}
+
+// An EAC block into channel `channel` of `texels`, with 11 bit precision for the
+// R11 and RG11 formats.
+void decode_eac(const uint8_t* block, bool eleven_bits, int channel, uint8_t* texels) {
+    uint64_t bits = load_be64(block);
+    int base = static_cast<int>(bits >> 56);
+    int multiplier = static_cast<int>(bits >> 52 & 15);
+    const int* modifiers = EAC_MODIFIERS[bits >> 48 & 15];
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        // Indices are stored column by column.
+        int texel = (i & 3) * 4 + i / 4;
+        int modifier = modifiers[bits >> (45 - 3 * i) & 7];
+        int value = 0;
+        if (eleven_bits) {
+            int scale = multiplier != 0 ? multiplier * 8 : 1;
+            int value11 = std::clamp(base * 8 + 4 + modifier * scale, 0, 2047);
+            value = (value11 * 255 + 1023) / 2047;
+        } else {
+            value = base + modifier * multiplier;
+        }
+        texels[texel * 4 + channel] = clamp_byte(value);
+    }
+}
+
+// Channels missing from single and two channel formats.
+void fill_missing(int first_channel, uint8_t* texels) {
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        for (int c = first_channel; c < 3; ++c) {
+            texels[i * 4 + c] = 0;
+        }
+        texels[i * 4 + 3] = 255;
+    }
+}
+
+// A block's texels as floats, a channel at a time, for the SIMD kernels.
+struct Texels {
+    alignas(16) float channels[4][BLOCK_TEXELS];
+};
+
+auto to_texels(const uint8_t* rgba) -> Texels {
+    Texels texels;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        for (int c = 0; c < 4; ++c) {
+            texels.channels[c][i] = rgba[i * 4 + c];
+        }
+    }
+    return texels;
+}
+
+// Finds the palette entry nearest to every texel by squared distance, weighted per
+// channel, storing its index and the distance.
+void nearest_indices(const Texels& texels,
+                     const float (*palette)[4],
+                     int count,
+                     const float* weights,
+                     uint8_t* indices,
+                     float* errors) {
+#ifdef TEXTURE_COMPRESSION_SSE
+    // Four texels at a time against each entry, keeping the closest in each lane.
+    for (int i = 0; i < BLOCK_TEXELS; i += 4) {
+        __m128 best = _mm_set1_ps(std::numeric_limits<float>::max());
+        __m128i best_index = _mm_setzero_si128();
+        for (int p = 0; p < count; ++p) {
+            __m128 distance = _mm_setzero_ps();
+            for (int c = 0; c < 4; ++c) {
+                __m128 d = _mm_sub_ps(_mm_load_ps(&texels.channels[c][i]),
+                                      _mm_set1_ps(palette[p][c]));
+                distance = _mm_add_ps(
+                    distance, _mm_mul_ps(_mm_mul_ps(d, d), _mm_set1_ps(weights[c])));
+            }
+            __m128i closer = _mm_castps_si128(_mm_cmplt_ps(distance, best));
+            best = _mm_min_ps(distance, best);
+            best_index = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(p)),
+                                      _mm_andnot_si128(closer, best_index));
+        }
+        alignas(16) int32_t lanes[4];
+        _mm_store_si128(reinterpret_cast<__m128i*>(lanes), best_index);
+        _mm_storeu_ps(errors + i, best);
+        for (int lane = 0; lane < 4; ++lane) {
+            indices[i + lane] = static_cast<uint8_t>(lanes[lane]);
+        }
+    }
+#else
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        float best = std::numeric_limits<float>::max();
+        for (int p = 0; p < count; ++p) {
+            float distance = 0.0f;
+            for (int c = 0; c < 4; ++c) {
+                float d = texels.channels[c][i] - palette[p][c];
+                distance += d * d * weights[c];
+            }
+            if (distance < best) {
+                best = distance;
+                indices[i] = static_cast<uint8_t>(p);
+            }
+        }
+        errors[i] = best;
+    }
+#endif
+}
+
+auto sum_errors(const float* errors, uint32_t members) -> float {
+    float sum = 0.0f;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        if (members >> i & 1) {
+            sum += errors[i];
+        }
+    }
+    return sum;
+}
+
+// Fits a line through the texels in `members`, the first `channels` channels of
+// them, along their principal axis. Sets the endpoints to where the extreme texels
+// project onto it and returns the squared distance of the texels from the line.
+auto fit_line(const Texels& texels,
+              uint32_t members,
+              int channels,
+              float* start,
+              float* end) -> float {
+    float mean[4] = {};
+    int count = 0;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        if (members >> i & 1) {
+            for (int c = 0; c < channels; ++c) {
+                mean[c] += texels.channels[c][i];
+            }
+            ++count;
+        }
+    }
+    for (int c = 0; c < channels; ++c) {
+        mean[c] /= static_cast<float>(std::max(count, 1));
+    }
+    float covariance[4][4] = {};
+    float variance = 0.0f;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        if ((members >> i & 1) == 0) {
+            continue;
+        }
+        for (int a = 0; a < channels; ++a) {
+            float da = texels.channels[a][i] - mean[a];
+            variance += da * da;
+            for (int b = 0; b < channels; ++b) {
+                covariance[a][b] += da * (texels.channels[b][i] - mean[b]);
+            }
+        }
+    }
+    // The principal axis by power iteration, from the covariances of the channel
+    // that varies most.
+    int widest = 0;
+    for (int c = 1; c < channels; ++c) {
+        if (covariance[c][c] > covariance[widest][widest]) {
+            widest = c;
+        }
+    }
+    float axis[4] = {};
+    for (int c = 0; c < channels; ++c) {
+        axis[c] = covariance[widest][c];
+    }
+    for (int iteration = 0; iteration < PCA_ITERATIONS; ++iteration) {
+        float next[4] = {};
+        float length = 0.0f;
+        for (int a = 0; a < channels; ++a) {
+            for (int b = 0; b < channels; ++b) {
+                next[a] += covariance[a][b] * axis[b];
+            }
+            length = std::max(length, std::abs(next[a]));
+        }
+        if (length == 0.0f) {
+            break;
+        }
+        for (int c = 0; c < channels; ++c) {
+            axis[c] = next[c] / length;
+        }
+    }
+    float length2 = 0.0f;
+    for (int c = 0; c < channels; ++c) {
+        length2 += axis[c] * axis[c];
+    }
+    if (length2 == 0.0f) {
+        std::copy(mean, mean + 4, start);
+        std::copy(mean, mean + 4, end);
+        return variance;
+    }
+    float inverse_length = 1.0f / std::sqrt(length2);
+    for (int c = 0; c < channels; ++c) {
+        axis[c] *= inverse_length;
+    }
+    float low = std::numeric_limits<float>::max();
+    float high = -low;
+    float along = 0.0f;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        if ((members >> i & 1) == 0) {
+            continue;
+        }
+        float t = 0.0f;
+        for (int c = 0; c < channels; ++c) {
+            t += (texels.channels[c][i] - mean[c]) * axis[c];
+        }
+        low = std::min(low, t);
+        high = std::max(high, t);
+        along += t * t;
+    }
+    for (int c = 0; c < channels; ++c) {
+        start[c] = std::clamp(mean[c] + axis[c] * low, 0.0f, 255.0f);
+        end[c] = std::clamp(mean[c] + axis[c] * high, 0.0f, 255.0f);
+    }
+    return std::max(variance - along, 0.0f);
+}
+
+// Refits the endpoints to the texels in `members` by least squares, given the
+// weight of `end` in each texel's palette entry. Leaves them be when the weights
+// are all the same.
+void refine_endpoints(const Texels& texels,
+                      uint32_t members,
+                      const float* weights,
+                      int channels,
+                      float* start,
+                      float* end) {
+    float aa = 0.0f;
+    float ab = 0.0f;
+    float bb = 0.0f;
+    float ax[4] = {};
+    float bx[4] = {};
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        if ((members >> i & 1) == 0) {
+            continue;
+        }
+        float b = weights[i];
+        float a = 1.0f - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < channels; ++c) {
+            ax[c] += a * texels.channels[c][i];
+            bx[c] += b * texels.channels[c][i];
+        }
+    }
+    float determinant = aa * bb - ab * ab;
+    if (std::abs(determinant) < 1e-6f) {
+        return;
+    }
+    for (int c = 0; c < channels; ++c) {
+        start[c] = std::clamp((ax[c] * bb - bx[c] * ab) / determinant, 0.0f, 255.0f);
+        end[c] = std::clamp((bx[c] * aa - ax[c] * ab) / determinant, 0.0f, 255.0f);
+    }
+}
+
+auto quantize_565(const float* rgb) -> uint16_t {
+    auto quantize = [](float v, int max) {
+        return static_cast<int>(v * static_cast<float>(max) / 255.0f + 0.5f);
+    };
+    return static_cast<uint16_t>(quantize(rgb[0], 31) << 11 |
+                                 quantize(rgb[1], 63) << 5 | quantize(rgb[2], 31));
+}
+
+void write_le(uint64_t value, int bytes, uint8_t* out) {
+    for (int i = 0; i < bytes; ++i) {
+        out[i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+// The color half of BC1 and BC3 blocks, always in four color mode.
+void encode_bc1_color(const Texels& texels, uint8_t* block) {
+    auto constexpr ALL = 0xFFFFu;
+    const float weights[4] = {1.0f, 1.0f, 1.0f, 0.0f};
+    // Weight of the second endpoint in each palette entry.
+    const float palette_weights[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+    float start[4] = {};
+    float end[4] = {};
+    fit_line(texels, ALL, 3, start, end);
+
+    uint16_t best_colors[2] = {};
+    uint8_t best_indices[BLOCK_TEXELS] = {};
+    float best_error = std::numeric_limits<float>::max();
+    for (int pass = 0; pass < 2; ++pass) {
+        // The end of the axis first, making c0 > c1 in most blocks.
+        uint16_t c0 = quantize_565(end);
+        uint16_t c1 = quantize_565(start);
+        if (c0 < c1) {
+            std::swap(c0, c1);
+        }
+        uint8_t rgb[2][3];
+        expand_565(c0, rgb[0]);
+        expand_565(c1, rgb[1]);
+        float palette[4][4] = {};
+        for (int c = 0; c < 3; ++c) {
+            int a = rgb[0][c];
+            int b = rgb[1][c];
+            palette[0][c] = static_cast<float>(a);
+            palette[1][c] = static_cast<float>(b);
+            palette[2][c] = static_cast<float>((2 * a + b) / 3);
+            palette[3][c] = static_cast<float>((a + 2 * b) / 3);
+        }
+        uint8_t indices[BLOCK_TEXELS];
+        float errors[BLOCK_TEXELS];
+        // With c0 == c1 the block is in three color mode, where only index 0 is
+        // still c0.
+        nearest_indices(texels, palette, c0 == c1 ? 1 : 4, weights, indices, errors);
+        float error = sum_errors(errors, ALL);
+        if (error < best_error) {
+            best_error = error;
+            best_colors[0] = c0;
+            best_colors[1] = c1;
+            std::copy(indices, indices + BLOCK_TEXELS, best_indices);
+        }
+        if (c0 == c1) {
+            break;
+        }
+        float texel_weights[BLOCK_TEXELS];
+        for (int i = 0; i < BLOCK_TEXELS; ++i) {
+            texel_weights[i] = palette_weights[indices[i]];
+        }
+        // Refitting from the quantized ends, the first one being c0.
+        for (int c = 0; c < 3; ++c) {
+            end[c] = palette[0][c];
+            start[c] = palette[1][c];
+        }
+        refine_endpoints(texels, ALL, texel_weights, 3, end, start);
+    }
+    write_le(best_colors[0], 2, block);
+    write_le(best_colors[1], 2, block + 2);
+    uint32_t indices = 0;
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        indices |= static_cast<uint32_t>(best_indices[i]) << (2 * i);
+    }
+    write_le(indices, 4, block + 4);
+}
+
+// The interpolated alpha of BC3, between the block's extremes.
+void encode_bc3_alpha(const Texels& texels, uint8_t* block) {
+    const float* alpha = texels.channels[3];
+    int a0 = static_cast<int>(*std::max_element(alpha, alpha + BLOCK_TEXELS));
+    int a1 = static_cast<int>(*std::min_element(alpha, alpha + BLOCK_TEXELS));
+    block[0] = static_cast<uint8_t>(a0);
+    block[1] = static_cast<uint8_t>(a1);
+    uint64_t indices = 0;
+    if (a0 > a1) {
+        float palette[8][4] = {};
+        palette[0][3] = static_cast<float>(a0);
+        palette[1][3] = static_cast<float>(a1);
+        for (int i = 2; i < 8; ++i) {
+            palette[i][3] = static_cast<float>(((8 - i) * a0 + (i - 1) * a1) / 7);
+        }
+        const float weights[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+        uint8_t texel_indices[BLOCK_TEXELS];
+        float errors[BLOCK_TEXELS];
+        nearest_indices(texels, palette, 8, weights, texel_indices, errors);
+        for (int i = 0; i < BLOCK_TEXELS; ++i) {
+            indices |= static_cast<uint64_t>(texel_indices[i]) << (3 * i);
+        }
+    }
+    write_le(indices, 6, block + 2);
+}
+
+class BitWriter {
+public:
+    void write(uint32_t value, int bits) {
+        for (int i = 0; i < bits; ++i, ++position_) {
+            uint64_t bit = value >> i & 1;
+            if (position_ < 64) {
+                low_ |= bit << position_;
+            } else {
+                high_ |= bit << (position_ - 64);
+            }
+        }
+    }
+
+    void store(uint8_t* block) const {
+        write_le(low_, 8, block);
+        write_le(high_, 8, block + 8);
+    }
+
+private:
+    uint64_t low_ = 0;
+    uint64_t high_ = 0;
+    int position_ = 0;
+};
+
+// The value of `bits` bits, the last one `pbit`, whose expansion to 8 bits is
+// closest to `value`.
+auto quantize_bc7(float value, int bits, int pbit) -> int {
+    int best = 0;
+    float best_error = std::numeric_limits<float>::max();
+    auto max = static_cast<float>((1 << bits) - 1);
+    auto estimate = static_cast<int>(value * max / 255.0f);
+    for (int q = (estimate >> 1) - 1; q <= (estimate >> 1) + 1; ++q) {
+        int clamped = std::clamp(q, 0, (1 << (bits - 1)) - 1);
+        int v = clamped << 1 | pbit;
+        int expanded = v << (8 - bits) | v >> (2 * bits - 8);
+        float error = std::abs(static_cast<float>(expanded) - value);
+        if (error < best_error) {
+            best_error = error;
+            best = clamped;
+        }
+    }
+    return best;
+}
+
+// An endpoint pair of one subset, quantized with its p-bits.
+struct Bc7Endpoints {
+    int values[2][4];
+    int pbits[2];
+    int expanded[2][4];
+};
+
+// Quantizes `ends` to `bits` bits a channel plus a p-bit, one per endpoint or
+// shared by the pair, picking the p-bits that lose the least.
+auto quantize_endpoints(const float (*ends)[4], int channels, int bits, bool shared)
+    -> Bc7Endpoints {
+    Bc7Endpoints best = {};
+    float best_error = std::numeric_limits<float>::max();
+    for (int p = 0; p < 4; ++p) {
+        int pbits[2] = {p & 1, p >> 1};
+        if (shared && pbits[0] != pbits[1]) {
+            continue;
+        }
+        Bc7Endpoints candidate = {};
+        float error = 0.0f;
+        for (int e = 0; e < 2; ++e) {
+            candidate.pbits[e] = pbits[e];
+            for (int c = 0; c < 4; ++c) {
+                if (c >= channels) {
+                    candidate.expanded[e][c] = 255;
+                    continue;
+                }
+                int q = quantize_bc7(ends[e][c], bits + 1, pbits[e]);
+                int v = q << 1 | pbits[e];
+                int expanded = v << (7 - bits) | v >> (2 * bits - 6);
+                candidate.values[e][c] = q;
+                candidate.expanded[e][c] = expanded;
+                float d = static_cast<float>(expanded) - ends[e][c];
+                error += d * d;
+            }
+        }
+        if (error < best_error) {
+            best_error = error;
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+// A block in BC7 mode 6, one subset with alpha and 4 bit indices, or mode 1, two
+// opaque subsets of `partition` with 3 bit indices.
+void encode_bc7_mode(const Texels& texels, int mode, int partition, uint8_t* block) {
+    const Bc7Mode& m = BC7_MODES[mode];
+    int channels = m.alpha_bits != 0 ? 4 : 3;
+    int index_count = 1 << m.index_bits;
+    const uint8_t* weights = m.index_bits == 4 ? BC7_WEIGHTS_4 : BC7_WEIGHTS_3;
+    const float channel_weights[4] = {1.0f, 1.0f, 1.0f, channels == 4 ? 1.0f : 0.0f};
+    uint32_t subset_members[2] = {0xFFFFu, 0};
+    if (m.subsets == 2) {
+        subset_members[1] = BC7_PARTITIONS_2[partition];
+        subset_members[0] = ~subset_members[1] & 0xFFFFu;
+    }
+
+    Bc7Endpoints endpoints[2] = {};
+    uint8_t indices[BLOCK_TEXELS] = {};
+    for (int s = 0; s < m.subsets; ++s) {
+        float ends[2][4] = {};
+        fit_line(texels, subset_members[s], channels, ends[0], ends[1]);
+        float best_error = std::numeric_limits<float>::max();
+        for (int pass = 0; pass < BC7_REFINE_PASSES; ++pass) {
+            Bc7Endpoints quantized =
+                quantize_endpoints(ends, channels, m.color_bits, m.shared_pbits != 0);
+            float palette[16][4];
+            for (int i = 0; i < index_count; ++i) {
+                for (int c = 0; c < 4; ++c) {
+                    palette[i][c] = static_cast<float>(
+                        ((64 - weights[i]) * quantized.expanded[0][c] +
+                         weights[i] * quantized.expanded[1][c] + 32) >>
+                        6);
+                }
+            }
+            uint8_t candidate[BLOCK_TEXELS];
+            float errors[BLOCK_TEXELS];
+            nearest_indices(
+                texels, palette, index_count, channel_weights, candidate, errors);
+            float error = sum_errors(errors, subset_members[s]);
+            if (error < best_error) {
+                best_error = error;
+                endpoints[s] = quantized;
+                for (int i = 0; i < BLOCK_TEXELS; ++i) {
+                    if (subset_members[s] >> i & 1) {
+                        indices[i] = candidate[i];
+                    }
+                }
+            }
+            float texel_weights[BLOCK_TEXELS];
+            for (int i = 0; i < BLOCK_TEXELS; ++i) {
+                texel_weights[i] = static_cast<float>(weights[candidate[i]]) / 64.0f;
+            }
+            refine_endpoints(texels,
+                             subset_members[s],
+                             texel_weights,
+                             channels,
+                             ends[0],
+                             ends[1]);
+        }
+        // The anchor's index drops its top bit, so it has to be in the lower half:
+        // swapping the endpoints mirrors the indices.
+        int anchor = s == 0 ? 0 : BC7_ANCHORS_2[partition];
+        if (indices[anchor] >= index_count / 2) {
+            std::swap(endpoints[s].values[0], endpoints[s].values[1]);
+            std::swap(endpoints[s].pbits[0], endpoints[s].pbits[1]);
+            for (int i = 0; i < BLOCK_TEXELS; ++i) {
+                if (subset_members[s] >> i & 1) {
+                    indices[i] = static_cast<uint8_t>(index_count - 1 - indices[i]);
+                }
+            }
+        }
+    }
+
+    BitWriter writer;
+    writer.write(1u << mode, mode + 1);
+    writer.write(static_cast<uint32_t>(partition), m.partition_bits);
+    for (int c = 0; c < channels; ++c) {
+        for (int s = 0; s < m.subsets; ++s) {
+            for (int e = 0; e < 2; ++e) {
+                auto value = static_cast<uint32_t>(endpoints[s].values[e][c]);
+                writer.write(value, c < 3 ? m.color_bits : m.alpha_bits);
+            }
+        }
+    }
+    for (int s = 0; s < m.subsets; ++s) {
+        writer.write(static_cast<uint32_t>(endpoints[s].pbits[0]), 1);
+        if (m.endpoint_pbits != 0) {
+            writer.write(static_cast<uint32_t>(endpoints[s].pbits[1]), 1);
+        }
+    }
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        bool anchor = i == 0 || (m.subsets == 2 && i == BC7_ANCHORS_2[partition]);
+        writer.write(indices[i], m.index_bits - (anchor ? 1 : 0));
+    }
+    writer.store(block);
+}
+
+// The value of `bits` bits, with no p-bit, whose expansion to 8 bits is closest
+// to `value`.
+auto quantize_bc7_plain(float value, int bits) -> int {
+    int best = 0;
+    float best_error = std::numeric_limits<float>::max();
+    auto max = static_cast<float>((1 << bits) - 1);
+    auto estimate = static_cast<int>(value * max / 255.0f + 0.5f);
+    for (int q = estimate - 1; q <= estimate + 1; ++q) {
+        int clamped = std::clamp(q, 0, (1 << bits) - 1);
+        int expanded = clamped << (8 - bits) | clamped >> (2 * bits - 8);
+        float error = std::abs(static_cast<float>(expanded) - value);
+        if (error < best_error) {
+            best_error = error;
+            best = clamped;
+        }
+    }
+    return best;
+}
+
+// Color or alpha of a BC7 mode 4 or 5 block, each with endpoints and indices of
+// its own.
+struct Bc7Component {
+    int values[2][3];
+    uint8_t indices[BLOCK_TEXELS];
+};
+
+// Fits the first `channels` channels of `texels`, with `bits` bits endpoints and
+// `index_bits` bits indices, texel 0's in the lower half.
+auto encode_bc7_component(const Texels& texels, int channels, int bits, int index_bits)
+    -> Bc7Component {
+    int index_count = 1 << index_bits;
+    const uint8_t* weights = index_bits == 3 ? BC7_WEIGHTS_3 : BC7_WEIGHTS_2;
+    float channel_weights[4] = {};
+    std::fill(channel_weights, channel_weights + channels, 1.0f);
+
+    Bc7Component best = {};
+    float best_error = std::numeric_limits<float>::max();
+    float ends[2][4] = {};
+    fit_line(texels, 0xFFFFu, channels, ends[0], ends[1]);
+    for (int pass = 0; pass < BC7_REFINE_PASSES; ++pass) {
+        Bc7Component candidate = {};
+        int expanded[2][4] = {};
+        for (int e = 0; e < 2; ++e) {
+            for (int c = 0; c < channels; ++c) {
+                int q = quantize_bc7_plain(ends[e][c], bits);
+                candidate.values[e][c] = q;
+                expanded[e][c] = q << (8 - bits) | q >> (2 * bits - 8);
+            }
+        }
+        float palette[8][4];
+        for (int i = 0; i < index_count; ++i) {
+            for (int c = 0; c < 4; ++c) {
+                palette[i][c] = static_cast<float>(
+                    ((64 - weights[i]) * expanded[0][c] + weights[i] * expanded[1][c] +
+                     32) >>
+                    6);
+            }
+        }
+        float errors[BLOCK_TEXELS];
+        nearest_indices(
+            texels, palette, index_count, channel_weights, candidate.indices, errors);
+        float error = sum_errors(errors, 0xFFFFu);
+        if (error < best_error) {
+            best_error = error;
+            best = candidate;
+        }
+        float texel_weights[BLOCK_TEXELS];
+        for (int i = 0; i < BLOCK_TEXELS; ++i) {
+            texel_weights[i] =
+                static_cast<float>(weights[candidate.indices[i]]) / 64.0f;
+        }
+        refine_endpoints(texels, 0xFFFFu, texel_weights, channels, ends[0], ends[1]);
+    }
+    if (best.indices[0] >= index_count / 2) {
+        std::swap(best.values[0], best.values[1]);
+        for (uint8_t& index : best.indices) {
+            index = static_cast<uint8_t>(index_count - 1 - index);
+        }
+    }
+    return best;
+}
+
+// A block in BC7 mode 4 or 5, one subset with color and alpha indexed apart.
+// `rotation` swaps alpha with red, green or blue, so that channel gets the
+// indices of its own, and in mode 4 `index_selection` gives color the 3 bit
+// indices instead of alpha.
+void encode_bc7_separate_alpha(const Texels& texels,
+                               int mode,
+                               int rotation,
+                               int index_selection,
+                               uint8_t* block) {
+    const Bc7Mode& m = BC7_MODES[mode];
+    Texels color = texels;
+    if (rotation != 0) {
+        std::swap(color.channels[3], color.channels[rotation - 1]);
+    }
+    Texels alpha = {};
+    std::copy_n(color.channels[3], BLOCK_TEXELS, alpha.channels[0]);
+    int color_index_bits = index_selection != 0 ? m.index_bits2 : m.index_bits;
+    int alpha_index_bits = index_selection != 0 ? m.index_bits : m.index_bits2;
+    Bc7Component components[2] = {
+        encode_bc7_component(color, 3, m.color_bits, color_index_bits),
+        encode_bc7_component(alpha, 1, m.alpha_bits, alpha_index_bits),
+    };
+
+    BitWriter writer;
+    writer.write(1u << mode, mode + 1);
+    writer.write(static_cast<uint32_t>(rotation), m.rotation_bits);
+    writer.write(static_cast<uint32_t>(index_selection), m.index_selection_bits);
+    for (int c = 0; c < 4; ++c) {
+        const Bc7Component& component = components[c < 3 ? 0 : 1];
+        for (int e = 0; e < 2; ++e) {
+            auto value = static_cast<uint32_t>(component.values[e][c < 3 ? c : 0]);
+            writer.write(value, c < 3 ? m.color_bits : m.alpha_bits);
+        }
+    }
+    // The 2 bit indices come first, whichever component has them.
+    const Bc7Component& primary = components[index_selection != 0 ? 1 : 0];
+    const Bc7Component& secondary = components[index_selection != 0 ? 0 : 1];
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        writer.write(primary.indices[i], m.index_bits - (i == 0 ? 1 : 0));
+    }
+    for (int i = 0; i < BLOCK_TEXELS; ++i) {
+        writer.write(secondary.indices[i], m.index_bits2 - (i == 0 ? 1 : 0));
+    }
+    writer.store(block);
+}
+
+auto block_error(const uint8_t* block, const uint8_t* rgba) -> int {
+    uint8_t decoded[BLOCK_TEXELS * 4];
+    decode_bc7(block, decoded);
+    int error = 0;
+    for (int i = 0; i < BLOCK_TEXELS * 4; ++i) {
+        int d = decoded[i] - rgba[i];
+        error += d * d;
+    }
+    return error;
+}
+
+// Mode 6 for every block, then for ones with alpha modes 5 and 4 in every rotation
+// and index selection, and for opaque ones mode 1 on the partitions whose subsets
+// lie closest to a line each, keeping whichever decodes closest.
+void encode_bc7(const uint8_t* rgba, uint8_t* block) {
+    Texels texels = to_texels(rgba);
+    encode_bc7_mode(texels, 6, 0, block);
+    int best_error = block_error(block, rgba);
+    if (best_error == 0) {
+        return;
+    }
+    const float* alpha = texels.channels[3];
+    if (std::any_of(alpha, alpha + BLOCK_TEXELS, [](float a) { return a < 255.0f; })) {
+        for (int mode = 5; mode >= 4; --mode) {
+            for (int rotation = 0; rotation < 4; ++rotation) {
+                for (int selection = 0; selection < (mode == 4 ? 2 : 1); ++selection) {
+                    uint8_t candidate[16];
+                    encode_bc7_separate_alpha(
+                        texels, mode, rotation, selection, candidate);
+                    int error = block_error(candidate, rgba);
+                    if (error < best_error) {
+                        best_error = error;
+                        std::memcpy(block, candidate, 16);
+                    }
+                }
+            }
+        }
+        return;
+    }
+    std::pair<float, int> partitions[64];
+    for (int p = 0; p < 64; ++p) {
+        float ends[2][4];
+        uint32_t second = BC7_PARTITIONS_2[p];
+        float residual = fit_line(texels, ~second & 0xFFFFu, 3, ends[0], ends[1]) +
+                         fit_line(texels, second, 3, ends[0], ends[1]);
+        partitions[p] = {residual, p};
+    }
+    std::partial_sort(partitions,
+                      partitions + BC7_PARTITION_CANDIDATES,
+                      partitions + 64);
+    for (int i = 0; i < BC7_PARTITION_CANDIDATES; ++i) {
+        uint8_t candidate[16];
+        encode_bc7_mode(texels, 1, partitions[i].second, candidate);
+        int error = block_error(candidate, rgba);
+        if (error < best_error) {
+            best_error = error;
+            std::memcpy(block, candidate, 16);
+        }
+    }
+}
+} // namespace
+
+namespace texture_compression {
+auto block_bytes(Format format) -> int {
+    switch (format) {
+        case Format::BC1:
+        case Format::BC1_ALPHA:
+        case Format::BC4:
+        case Format::ETC2_RGB:
+        case Format::ETC2_RGB_A1:
+        case Format::EAC_R11:
+            return 8;
+        default:
+            return 16;
+    }
+}
+
+void decode_block(Format format, const uint8_t* block, uint8_t* texels) {
+    switch (format) {
+        case Format::BC1:
+        case Format::BC1_ALPHA:
+            decode_bc1_color(block, true, format == Format::BC1_ALPHA, texels);
+            break;
+        case Format::BC2: {
+            decode_bc1_color(block + 8, false, false, texels);
+            uint64_t alpha = load_le64(block);
+            for (int i = 0; i < BLOCK_TEXELS; ++i) {
+                texels[i * 4 + 3] = static_cast<uint8_t>((alpha >> (4 * i) & 15) * 17);
+            }
+            break;
+        }
+        case Format::BC3:
+            decode_bc1_color(block + 8, false, false, texels);
+            decode_bc3_alpha(block, 3, texels);
+            break;
+        case Format::BC4:
+            decode_bc3_alpha(block, 0, texels);
+            fill_missing(1, texels);
+            break;
+        case Format::BC5:
+            decode_bc3_alpha(block, 0, texels);
+            decode_bc3_alpha(block + 8, 1, texels);
+            fill_missing(2, texels);
+            break;
+        case Format::BC7:
+            decode_bc7(block, texels);
+            break;
+        case Format::ETC2_RGB:
+            decode_etc2_color(block, false, texels);
+            break;
+        case Format::ETC2_RGB_A1:
+            decode_etc2_color(block, true, texels);
+            break;
+        case Format::ETC2_RGBA:
+            decode_etc2_color(block + 8, false, texels);
+            decode_eac(block, false, 3, texels);
+            break;
+        case Format::EAC_R11:
+            decode_eac(block, true, 0, texels);
+            fill_missing(1, texels);
+            break;
+        case Format::EAC_RG11:
+            decode_eac(block, true, 0, texels);
+            decode_eac(block + 8, true, 1, texels);
+            fill_missing(2, texels);
+            break;
+    }
+}
+
+auto can_encode(Format format) -> bool {
+    return format == Format::BC1 || format == Format::BC3 || format == Format::BC7;
+}
+
+void encode_block(Format format, const uint8_t* texels, uint8_t* block) {
+    switch (format) {
+        case Format::BC1:
+            encode_bc1_color(to_texels(texels), block);
+            break;
+        case Format::BC3: {
+            Texels floats = to_texels(texels);
+            encode_bc3_alpha(floats, block);
+            encode_bc1_color(floats, block + 8);
+            break;
+        }
+        case Format::BC7:
+            encode_bc7(texels, block);
+            break;
+        default:
+            std::memset(block, 0, static_cast<size_t>(block_bytes(format)));
+            break;
+    }
+}
+
+void encode(Format format,
+            const uint8_t* texels,
+            int width,
+            int height,
+            uint8_t* blocks) {
+    int blocks_x = (width + 3) / 4;
+    int blocks_y = (height + 3) / 4;
+    auto bytes = static_cast<size_t>(block_bytes(format));
+    auto encode_rows = [&](size_t first, size_t last) {
+        uint8_t block[BLOCK_TEXELS * 4];
+        for (size_t by = first; by < last; ++by) {
+            for (int bx = 0; bx < blocks_x; ++bx) {
+                // Blocks hanging over the edge of the image repeat its last texels.
+                for (int y = 0; y < 4; ++y) {
+                    int row = std::min(static_cast<int>(by) * 4 + y, height - 1);
+                    for (int x = 0; x < 4; ++x) {
+                        int column = std::min(bx * 4 + x, width - 1);
+                        size_t texel = static_cast<size_t>(row) * width + column;
+                        std::memcpy(block + (y * 4 + x) * 4, texels + texel * 4, 4);
+                    }
+                }
+                encode_block(format,
+                             block,
+                             blocks + (by * static_cast<size_t>(blocks_x) +
+                                       static_cast<size_t>(bx)) * bytes);
+            }
+        }
+    };
+    jobs::parallel_for(0, static_cast<size_t>(blocks_y), 1, encode_rows);
+}
+
+void decode(Format format,
+            const uint8_t* blocks,
+            int width,
+            int height,
+            uint8_t* texels) {
+    int blocks_x = (width + 3) / 4;
+    int blocks_y = (height + 3) / 4;
+    auto bytes = static_cast<size_t>(block_bytes(format));
+    auto decode_rows = [&](size_t first, size_t last) {
+        uint8_t decoded[BLOCK_TEXELS * 4];
+        for (size_t by = first; by < last; ++by) {
+            for (int bx = 0; bx < blocks_x; ++bx) {
+                decode_block(format,
+                             blocks + (by * static_cast<size_t>(blocks_x) +
+                                       static_cast<size_t>(bx)) * bytes,
+                             decoded);
+                // Blocks hanging over the edge of the image are cropped.
+                int x0 = bx * 4;
+                auto y0 = static_cast<int>(by) * 4;
+                int columns = std::min(4, width - x0);
+                for (int y = 0; y < std::min(4, height - y0); ++y) {
+                    size_t texel = static_cast<size_t>(y0 + y) * width + x0;
+                    std::memcpy(texels + texel * 4,
+                                decoded + y * 16,
+                                static_cast<size_t>(columns) * 4);
+                }
+            }
+        }
+    };
+    jobs::parallel_for(0, static_cast<size_t>(blocks_y), 1, decode_rows);
+}
+} // namespace texture_compression
@@ -0,0 +1,125 @@
+#include "transparency.H"
+
+#include <utility>
+
+#include <glad/glad.h>
+
+#include "shader.H"
+#include "transparency_shader.H"
+
+namespace {
+auto constexpr ACCUMULATION_FORMAT = GL_RGBA16F;
+auto constexpr WEIGHT_FORMAT = GL_R16F;
+
+// Texture units of the composite pass; the multisampled variants follow.
+enum Unit {
+    ACCUMULATION_UNIT,
+    WEIGHT_UNIT,
+    ACCUMULATION_MULTISAMPLE_UNIT,
+    WEIGHT_MULTISAMPLE_UNIT
+};
+
+void bind_texture(int unit, bool multisampled, unsigned int texture) {
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(unit));
+    glBindTexture(multisampled ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D, texture);
+}
+} // namespace
+
+namespace transparency {
+auto WeightedBlendedOit::init() -> bool {
+    composite_program_ = link_program(shaders::transparency_composite_vertex_src,
+                                      shaders::transparency_composite_fragment_src);
+    if (composite_program_ == 0) {
+        return false;
+    }
+    glUseProgram(composite_program_);
+    glUniform1i(glGetUniformLocation(composite_program_, "uAccumulation"),
+                ACCUMULATION_UNIT);
+    glUniform1i(glGetUniformLocation(composite_program_, "uWeight"), WEIGHT_UNIT);
+    glUniform1i(glGetUniformLocation(composite_program_, "uAccumulationMultisample"),
+                ACCUMULATION_MULTISAMPLE_UNIT);
+    glUniform1i(glGetUniformLocation(composite_program_, "uWeightMultisample"),
+                WEIGHT_MULTISAMPLE_UNIT);
+    glUseProgram(0);
+    glGenVertexArrays(1, &VAO_);
+    timer_.init();
+    return true;
+}
+
+void WeightedBlendedOit::shutdown() {
+    timer_.shutdown();
+    glDeleteVertexArrays(1, &VAO_);
+    glDeleteProgram(composite_program_);
+    VAO_ = composite_program_ = 0;
+}
+
+auto WeightedBlendedOit::shader_source() -> const char* {
+    return shaders::transparency_src;
+}
+
+auto WeightedBlendedOit::add_passes(RenderGraph& graph,
+                                    RenderGraph::Resource color,
+                                    RenderGraph::Resource depth,
+                                    std::function<void()> draw)
+    -> RenderGraph::Resource {
+    RenderGraph::TextureDesc desc = graph.desc(color);
+    RenderGraph::Resource accumulation = -1;
+    RenderGraph::Resource weight = -1;
+    graph.add_pass(
+        "transparency_accumulate",
+        [&](RenderGraph::PassBuilder& builder) {
+            desc.format = ACCUMULATION_FORMAT;
+            accumulation = builder.create("transparency_accumulation", desc);
+            desc.format = WEIGHT_FORMAT;
+            weight = builder.create("transparency_weight", desc);
+            builder.write(depth);
+        },
+        [this, draw = std::move(draw)](RenderGraph::PassContext&) {
+            timer_.begin();
+            const float accumulation_clear[] = {0.0f, 0.0f, 0.0f, 1.0f};
+            const float weight_clear[] = {0.0f, 0.0f, 0.0f, 0.0f};
+            glClearBufferfv(GL_COLOR, 0, accumulation_clear);
+            glClearBufferfv(GL_COLOR, 1, weight_clear);
+            glEnable(GL_DEPTH_TEST);
+            glDepthMask(GL_FALSE);
+            glEnable(GL_BLEND);
+            glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+            draw();
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            glDisable(GL_BLEND);
+            glDepthMask(GL_TRUE);
+            glDisable(GL_DEPTH_TEST);
+        });
+
+    graph.add_pass(
+        "transparency_composite",
+        [&](RenderGraph::PassBuilder& builder) {
+            builder.read(accumulation);
+            builder.read(weight);
+            builder.write(color);
+        },
+        [this, accumulation, weight](RenderGraph::PassContext& context) {
+            int samples = context.desc(accumulation).samples;
+            bool multisampled = samples > 1;
+            glUseProgram(composite_program_);
+            glUniform1i(glGetUniformLocation(composite_program_, "uSamples"), samples);
+            bind_texture(multisampled ? ACCUMULATION_MULTISAMPLE_UNIT
+                                      : ACCUMULATION_UNIT,
+                         multisampled,
+                         context.texture(accumulation));
+            bind_texture(multisampled ? WEIGHT_MULTISAMPLE_UNIT : WEIGHT_UNIT,
+                         multisampled,
+                         context.texture(weight));
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE_MINUS_SRC_ALPHA, GL_SRC_ALPHA);
+            glBindVertexArray(VAO_);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glBindVertexArray(0);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            glDisable(GL_BLEND);
+            glActiveTexture(GL_TEXTURE0);
+            timer_.end();
+        });
+    return color;
+}
+} // namespace transparency
@@ -22,18 +22,78 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "animation.H"
+#include "debug_draw.H"
+#include "deferred.H"
+#include "dynamic_resolution.H"
+#include "gpu_timer.H"
+#include "ibl.H"
+#include "jobs.H"
+#include "ktx.H"
+#include "lighting.H"
+#include "math.H"
+#include "mipmaps.H"
+#include "particles.H"
+#include "post_process.H"
+#include "render_graph.H"
+#include "sdf_text.H"
+#include "shader.H"
+#include "shadows.H"
+#include "streaming.H"
+#include "transparency.H"
+#include "virtual_texture.H"
 #include "triangle_shader.H"
 
 auto constexpr WINDOW_WIDTH = 800;
 auto constexpr WINDOW_HEIGHT = 600;
 
+// The cooked atlas is written the first time the font is built from the TTF, so later
+// runs skip FreeType and the distance transforms entirely.
+auto constexpr FONT_TTF_PATH = "assets/fonts/font.ttf";
+auto constexpr FONT_ATLAS_PATH = "assets/fonts/font.sdfatlas";
+auto constexpr ENVIRONMENT_CACHE_PATH = "assets/environment.ibl";
+auto constexpr ENVIRONMENT_SIZE = 256;
+
+auto constexpr PARTICLE_CAPACITY = size_t {1} << 20;
+auto constexpr MAX_LIGHT_COUNT = 2048;
+auto constexpr MAX_CHARACTER_COUNT = 4096;
+auto constexpr MAX_BAKED_CHARACTER_COUNT = 131072;
+auto constexpr POSTER_COUNT = 24;
+auto constexpr POSTER_SIZE = 1024;
+auto constexpr MAP_PATH = "assets/map.vtex";
+auto constexpr MAP_SIZE = 1 << 15;
+auto constexpr MAP_CACHE_SIZE = 16; // pages a side
+auto constexpr TEXTURES_PATH = "assets/textures";
+auto constexpr COOKED_POSTER_SIZE = 512;
+
+auto constexpr CAMERA_DISTANCE = 2.0f;
+auto constexpr CAMERA_FOVY = 1.05f; // radians
+auto constexpr CAMERA_NEAR = 0.1f;
+auto constexpr CAMERA_FAR = 100.0f;
+
 void framebuffer_resize_callback(GLFWwindow* window, int width, int height);
 void escape_key_pressed_callback(GLFWwindow* window);
+void animate_lights(std::vector<lighting::PointLight>& lights, int count, float time);
+void place_characters(std::vector<animation::Character>& characters,
+                      int count,
+                      float time);
+void place_posters(std::vector<Vec4>& posters, int count, float time);
+auto map_window(float time) -> Vec4;
+auto sun_direction(float elevation, float azimuth) -> Vec3;
 
 auto main(void) -> int {
     // initialized GLFW
     spdlog::info("Initializing GLFW");
     glfwInit();
+    jobs::init();
+    jobs::ShutdownGuard jobs_guard;
 
     // We'd tell GLFW that 3.3 is the OpenGL version we want to use. This way GLFW can
     // make the proper arrangements when creating the OpenGL context. This ensures that
@@ -78,8 +138,293 @@ auto main(void) -> int {
     ImGui_ImplOpenGL3_Init("#version 330");
     ImGui::StyleColorsDark();
 
+    if (!debug_draw::init()) {
+        spdlog::error("Failed to initialize debug draw");
+        return -1;
+    }
+
+    // Text labels are optional, we keep running without them if no font is around.
+    sdf_text::TextRenderer text_renderer;
+    auto font_atlas = sdf_text::load_atlas(FONT_ATLAS_PATH);
+    if (!font_atlas) {
+        font_atlas = sdf_text::build_atlas(FONT_TTF_PATH);
+        if (font_atlas) {
+            sdf_text::save_atlas(*font_atlas, FONT_ATLAS_PATH);
+        }
+    }
+    bool has_text = font_atlas && text_renderer.init(*font_atlas);
+    font_atlas.reset();
+
+    // Compute shaders need GL 4.3. Drivers usually hand out their newest core
+    // profile even though we ask for 3.3, but if not we keep the simulation on the
+    // GPU through transform feedback. A GPU backend that fails to set up, say
+    // because a driver rejects its shaders, falls back to the CPU one.
+    particles::ParticleSystem particle_system;
+    auto init_particles = [&](particles::Backend backend) {
+        if (particle_system.init(backend, PARTICLE_CAPACITY)) {
+            return true;
+        }
+        particle_system.shutdown();
+        if (backend == particles::Backend::Cpu) {
+            spdlog::error("Failed to initialize particles");
+            return false;
+        }
+        spdlog::error("Failed to initialize {} particles, falling back to {}",
+                      particles::backend_name(backend),
+                      particles::backend_name(particles::Backend::Cpu));
+        return particle_system.init(particles::Backend::Cpu, PARTICLE_CAPACITY);
+    };
+    auto particle_backend = particles::is_supported(particles::Backend::Compute)
+                                ? particles::Backend::Compute
+                                : particles::Backend::TransformFeedback;
+    if (!init_particles(particle_backend)) {
+        return -1;
+    }
+    particles::Emitter emitter;
+    emitter.origin = {0.0f, -0.6f, 0.0f};
+
+    RenderGraph frame_graph;
+    // Offscreen targets follow the window size only once it stops changing, unless
+    // the new size fits into the textures we already have.
+    ResizeDebouncer resize_debouncer;
+
+    // The scene is rendered in HDR at a scale of the window size. Bloom blurs it over
+    // a chain of smaller targets and the final pass upscales, adds the bloom,
+    // tonemaps and gamma-encodes in one go. With dynamic resolution on, the scale
+    // follows the GPU time of the whole frame so that it stays within budget.
+    post::Bloom bloom;
+    post::FinalPass final_pass;
+    if (!bloom.init() || !final_pass.init()) {
+        spdlog::error("Failed to initialize post-processing");
+        return -1;
+    }
+    post::FinalSettings final_settings;
+    bool use_bloom = true;
+
+    // Antialiasing modes are timed on the GPU: the scene pass separately, since
+    // MSAA pays for its samples there, plus whatever passes the mode adds.
+    post::Antialiasing antialiasing;
+    if (!antialiasing.init()) {
+        spdlog::error("Failed to initialize antialiasing");
+        return -1;
+    }
+    // Ambient occlusion reads the scene depth, which the triangle writes.
+    post::Ssao ssao;
+    if (!ssao.init()) {
+        spdlog::error("Failed to initialize SSAO");
+        return -1;
+    }
+    bool use_ssao = true;
+
+    // Glass panels crossing the triangle and each other. Sorting cannot get
+    // intersecting surfaces right, so they are blended order-independently.
+    transparency::WeightedBlendedOit transparency;
+    if (!transparency.init()) {
+        spdlog::error("Failed to initialize transparency");
+        return -1;
+    }
+    bool show_glass = true;
+    float glass_opacity = 0.4f;
+
+    // A crowd of skinned stick figures on the backdrop, each blending between a
+    // walk and a wave at its own pace, both compressed. They do not cast shadows.
+    // Baked, the same animation comes from a vertex animation texture and the
+    // crowd can be far larger.
+    animation::Crowd crowd;
+    animation::BakedCrowd baked_crowd;
+    {
+        animation::Skeleton skeleton = animation::figure_skeleton();
+        animation::SkinnedMesh mesh = animation::figure_mesh(skeleton);
+        animation::CompressedClip walk =
+            animation::compress(animation::figure_walk(skeleton));
+        animation::CompressedClip wave =
+            animation::compress(animation::figure_wave(skeleton));
+        if (!crowd.init(skeleton, mesh, walk, wave, MAX_CHARACTER_COUNT) ||
+            !baked_crowd.init(skeleton, mesh, walk, wave, MAX_BAKED_CHARACTER_COUNT)) {
+            spdlog::error("Failed to initialize the crowd");
+            return -1;
+        }
+    }
+    std::vector<animation::Character> characters;
+    int character_count = 256;
+    bool bake_crowd = false;
+
+    // Posters in front of the backdrop, growing and shrinking, each with its own
+    // texture. All their levels take several times the default budget, so they
+    // stream in and out as the posters change size.
+    streaming::TextureStreamer texture_streamer;
+    int streaming_budget_mb = 32;
+    texture_streamer.init(static_cast<size_t>(streaming_budget_mb) << 20);
+    std::vector<int> posters;
+    for (int i = 0; i < POSTER_COUNT; ++i) {
+        int poster =
+            texture_streamer.add(streaming::procedural_poster(i, POSTER_SIZE));
+        if (poster < 0) {
+            spdlog::error("Failed to add a poster");
+            return -1;
+        }
+        posters.push_back(poster);
+    }
+    std::vector<Vec4> poster_placements; // center, size
+    bool show_posters = false;
+
+    // A map of a gigapixel over the backdrop, in a page cache of a few dozen
+    // megabytes, read from a tiled file. The file is cooked on a thread of its own
+    // the first time and whenever the terrain changes, which takes minutes and
+    // gigabytes, so meanwhile the pages are generated as they are needed and the
+    // map switches over to the file once it is written.
+    virtual_texture::VirtualTexture map_texture;
+    auto map_terrain = virtual_texture::procedural_terrain(MAP_SIZE);
+    auto map_source = virtual_texture::open_tiled(MAP_PATH);
+    std::atomic<bool> map_cooked = false;
+    std::jthread map_cooker;
+    if (!map_source || map_source->hash != map_terrain.hash) {
+        spdlog::info("Cooking {} in the background", MAP_PATH);
+        map_source = map_terrain;
+        map_cooker = std::jthread([&map_cooked, map_terrain](std::stop_token stop) {
+            if (virtual_texture::write_tiled(map_terrain, MAP_PATH, stop)) {
+                spdlog::info("Cooked {}", MAP_PATH);
+                map_cooked = true;
+            }
+        });
+    }
+    bool has_map = map_texture.init(std::move(*map_source), MAP_CACHE_SIZE);
+    bool show_map = false;
+
+    // A poster cooked into every format the encoders produce, the first time and
+    // again whenever the poster or the encoders change.
+    std::error_code missing;
+    std::filesystem::create_directories(TEXTURES_PATH, missing);
+    {
+        streaming::TextureSource poster =
+            streaming::procedural_poster(0, COOKED_POSTER_SIZE);
+        // Only the first level is drawn, the rest are filtered down from it, in
+        // linear light, once a format needs cooking.
+        std::vector<std::vector<uint8_t>> levels(1);
+        poster.load(0, levels[0]);
+        uint64_t poster_hash = ktx::hash_levels(levels);
+        std::pair<const char*, texture_compression::Format> cooked_posters[] = {
+            {"poster_bc1.ktx2", texture_compression::Format::BC1},
+            {"poster_bc3.ktx2", texture_compression::Format::BC3},
+            {"poster_bc7.ktx2", texture_compression::Format::BC7},
+        };
+        for (const auto& [name, format] : cooked_posters) {
+            std::string path = std::string(TEXTURES_PATH) + "/" + name;
+            if (!ktx::is_cooked(path.c_str(), format, true, poster_hash)) {
+                if (levels.size() == 1) {
+                    levels = mipmaps::generate(levels[0].data(),
+                                               poster.width,
+                                               poster.height,
+                                               true,
+                                               mipmaps::Filter::Kaiser);
+                }
+                ktx::save_texture(path.c_str(),
+                                  format,
+                                  true,
+                                  poster.width,
+                                  poster.height,
+                                  levels,
+                                  poster_hash);
+            }
+        }
+    }
+
+    // Block compressed textures, shown as they load: uploaded as they are where the
+    // driver has their format, decoded on the CPU where it does not.
+    std::vector<std::string> texture_names;
+    std::vector<ktx::Texture> textures;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(TEXTURES_PATH, missing)) {
+        if (entry.path().extension() != ".ktx2") {
+            continue;
+        }
+        if (auto texture = ktx::load_texture(entry.path().string().c_str())) {
+            texture_names.push_back(entry.path().filename().string());
+            textures.push_back(*texture);
+        }
+    }
+    int shown_texture = -1;
+
+    // The triangle and its backdrop are lit by point lights circling in front of
+    // them, binned into clusters every frame.
+    lighting::ClusteredLighting clustered_lighting;
+    if (!clustered_lighting.init()) {
+        spdlog::error("Failed to initialize clustered lighting");
+        return -1;
+    }
+    std::vector<lighting::PointLight> lights;
+    int light_count = 256;
+
+    // The same lights can be shaded forward, in the geometry pass, or deferred,
+    // from a G-buffer. Each path's geometry pass is timed on the GPU, and the
+    // backdrop can be stacked into layers to see how overdraw shifts the balance.
+    deferred::DeferredShading deferred_shading;
+    if (!deferred_shading.init()) {
+        spdlog::error("Failed to initialize deferred shading");
+        return -1;
+    }
+    bool use_deferred = false;
+    int overdraw_layers = 1;
+    GpuTimer geometry_timers[2]; // forward, deferred
+    for (GpuTimer& timer : geometry_timers) {
+        timer.init();
+    }
+
+    // A sun shining on the scene from the camera's side, with cascaded shadows.
+    // Everything in the scene is static, so once the sun stops moving the cached
+    // cascades are not rendered again.
+    shadows::CascadedShadowMaps shadow_maps;
+    if (!shadow_maps.init()) {
+        spdlog::error("Failed to initialize shadow maps");
+        return -1;
+    }
+    float sun_elevation = 0.6f; // radians
+    float sun_azimuth = 0.4f;
+    float sun_intensity = 1.0f;
+    std::vector<shadows::Caster> shadow_casters;
+    int shadow_layers = 0;
+    // The point lights share a shadow atlas. Only a few of them get a shadow and
+    // only a few of those are rendered each frame, however many lights there are.
+    shadows::ShadowAtlas shadow_atlas;
+    if (!shadow_atlas.init()) {
+        spdlog::error("Failed to initialize the shadow atlas");
+        return -1;
+    }
+    // The ambient light comes from a sky around the scene, with the sun where it
+    // starts out. Prefiltering it takes a while, so the result is cached on disk.
+    ibl::ImageBasedLighting image_lighting;
+    {
+        ibl::Environment sky = ibl::procedural_sky(
+            ENVIRONMENT_SIZE, sun_direction(sun_elevation, sun_azimuth));
+        uint64_t sky_hash = ibl::hash_environment(sky);
+        auto prefiltered = ibl::load_prefiltered(ENVIRONMENT_CACHE_PATH, sky_hash);
+        if (!prefiltered) {
+            prefiltered = ibl::prefilter(sky);
+            prefiltered->source_hash = sky_hash;
+            ibl::save_prefiltered(*prefiltered, ENVIRONMENT_CACHE_PATH);
+        }
+        if (!image_lighting.init(*prefiltered)) {
+            spdlog::error("Failed to initialize image-based lighting");
+            return -1;
+        }
+    }
+    float roughness = 0.5f;
+    GpuTimer scene_timers[post::Antialiasing::MODE_COUNT];
+    for (GpuTimer& timer : scene_timers) {
+        timer.init();
+    }
+    dynamic_resolution::Controller resolution_controller;
+    GpuTimer frame_timer;
+    frame_timer.init();
+    int seen_frame_times = 0;
+
     // Our state
     bool show_tip_window = true;
+    bool show_debug_draw = false;
+    bool show_particles = false;
+    int label_count = 1;
+    bool use_dynamic_resolution = false;
+    double last_frame_time = glfwGetTime();
     auto clear_color = ImVec4(0.11f, 0.11f, 0.11f, 1.0f);
 
     // The first two parameters of glViewport set the location of the lower left corner
@@ -116,7 +461,14 @@ auto main(void) -> int {
     // although this time we use the GL_FRAGMENT_SHADER constant as the shader type
     unsigned int fragment_shader;
     fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &shaders::fragment_shader_src, NULL);
+    // The lighting functions the fragment shader calls are passed as further
+    // strings, which GL compiles as if they were concatenated to the first.
+    const char* fragment_sources[] = {shaders::fragment_shader_src,
+                                      lighting::ClusteredLighting::shader_source(),
+                                      shadows::CascadedShadowMaps::shader_source(),
+                                      shadows::ShadowAtlas::shader_source(),
+                                      ibl::ImageBasedLighting::shader_source()};
+    glShaderSource(fragment_shader, 5, fragment_sources, NULL);
     glCompileShader(fragment_shader);
 
     glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &success);
@@ -143,6 +495,67 @@ auto main(void) -> int {
     glDeleteShader(vertex_shader);
     glDeleteShader(fragment_shader);
 
+    // The deferred path's geometry pass shares the vertex shader.
+    std::string gbuffer_fragment_src =
+        std::string(shaders::gbuffer_fragment_shader_src) +
+        deferred::DeferredShading::gbuffer_source();
+    unsigned int gbuffer_program =
+        link_program(shaders::vertex_shader_src, gbuffer_fragment_src.c_str());
+    // The crowd is shaded like the triangle, only skinned.
+    std::string forward_fragment_src;
+    for (const char* source : fragment_sources) {
+        forward_fragment_src += source;
+    }
+    unsigned int skinned_program = link_program(
+        animation::Crowd::vertex_shader_source(), forward_fragment_src.c_str());
+    unsigned int skinned_gbuffer_program = link_program(
+        animation::Crowd::vertex_shader_source(), gbuffer_fragment_src.c_str());
+    unsigned int baked_program = link_program(
+        animation::BakedCrowd::vertex_shader_source(), forward_fragment_src.c_str());
+    unsigned int baked_gbuffer_program = link_program(
+        animation::BakedCrowd::vertex_shader_source(), gbuffer_fragment_src.c_str());
+    // The posters too, with their albedo from a texture.
+    std::string poster_fragment_src = shaders::poster_fragment_shader_src;
+    for (const char* source : fragment_sources) {
+        if (source != shaders::fragment_shader_src) {
+            poster_fragment_src += source;
+        }
+    }
+    std::string poster_gbuffer_fragment_src =
+        std::string(shaders::poster_gbuffer_fragment_shader_src) +
+        deferred::DeferredShading::gbuffer_source();
+    unsigned int poster_program = link_program(shaders::poster_vertex_shader_src,
+                                               poster_fragment_src.c_str());
+    unsigned int poster_gbuffer_program = link_program(
+        shaders::poster_vertex_shader_src, poster_gbuffer_fragment_src.c_str());
+    // The map as well, plus its feedback pass.
+    const char* virtual_texture_src =
+        virtual_texture::VirtualTexture::shader_source();
+    std::string map_fragment_src = shaders::map_fragment_shader_src;
+    for (const char* source : fragment_sources) {
+        if (source != shaders::fragment_shader_src) {
+            map_fragment_src += source;
+        }
+    }
+    map_fragment_src += virtual_texture_src;
+    std::string map_gbuffer_fragment_src =
+        std::string(shaders::map_gbuffer_fragment_shader_src) +
+        deferred::DeferredShading::gbuffer_source() + virtual_texture_src;
+    std::string map_feedback_fragment_src =
+        std::string(virtual_texture::VirtualTexture::feedback_fragment_source()) +
+        virtual_texture_src;
+    unsigned int map_program =
+        link_program(shaders::map_vertex_shader_src, map_fragment_src.c_str());
+    unsigned int map_gbuffer_program = link_program(
+        shaders::map_vertex_shader_src, map_gbuffer_fragment_src.c_str());
+    unsigned int map_feedback_program = link_program(
+        shaders::map_vertex_shader_src, map_feedback_fragment_src.c_str());
+    // And so does the glass.
+    std::string glass_fragment_src = std::string(shaders::glass_fragment_shader_src) +
+                                     transparency::WeightedBlendedOit::shader_source();
+    unsigned int glass_program =
+        link_program(shaders::vertex_shader_src, glass_fragment_src.c_str());
+
     // Because we want to render a single triangle we want to specify a total of three
     // vertices with each vertex having a 3D position. We define them in normalized
     // device coordinates (the visible region of OpenGL) in a float array.
@@ -151,11 +564,37 @@ auto main(void) -> int {
         // positions          // colors
         0.5f, -0.5f, 0.0f,  1.0f, 0.0f, 0.0f,  // bottom left
        -0.5f, -0.5f, 0.0f,  0.0f, 1.0f, 0.0f,  // bottom right
-        0.0f,  0.5f, 0.0f,  0.0f, 0.0f, 1.0f   // top
+        0.0f,  0.5f, 0.0f,  0.0f, 0.0f, 1.0f,  // top
+        // a grey backdrop behind the triangle for the lights to shine on
+       -2.0f, -1.5f, -0.3f,  0.5f, 0.5f, 0.5f,
+        2.0f, -1.5f, -0.3f,  0.5f, 0.5f, 0.5f,
+        2.0f,  1.5f, -0.3f,  0.5f, 0.5f, 0.5f,
+       -2.0f,  1.5f, -0.3f,  0.5f, 0.5f, 0.5f,
+        // tinted glass panels, the first two leaning into each other
+       -1.0f, -0.8f, -0.2f,  1.0f, 0.3f, 0.2f,
+        0.2f, -0.8f,  0.25f, 1.0f, 0.3f, 0.2f,
+        0.2f,  0.6f,  0.25f, 1.0f, 0.3f, 0.2f,
+       -1.0f,  0.6f, -0.2f,  1.0f, 0.3f, 0.2f,
+       -0.2f, -0.6f,  0.25f, 0.2f, 1.0f, 0.4f,
+        1.0f, -0.6f, -0.2f,  0.2f, 1.0f, 0.4f,
+        1.0f,  0.8f, -0.2f,  0.2f, 1.0f, 0.4f,
+       -0.2f,  0.8f,  0.25f, 0.2f, 1.0f, 0.4f,
+       -0.7f, -1.0f,  0.1f,  0.3f, 0.5f, 1.0f,
+        0.7f, -1.0f,  0.1f,  0.3f, 0.5f, 1.0f,
+        0.7f, -0.1f,  0.1f,  0.3f, 0.5f, 1.0f,
+       -0.7f, -0.1f,  0.1f,  0.3f, 0.5f, 1.0f
     };
 
     unsigned int indices[] = {
-        0, 1, 2  // First triangle
+        0, 1, 2,  // First triangle
+        3, 4, 5,  // Backdrop
+        3, 5, 6,
+        7, 8, 9,  // Glass
+        7, 9, 10,
+        11, 12, 13,
+        11, 13, 14,
+        15, 16, 17,
+        15, 17, 18
     };
     // clang-format on
 
@@ -243,6 +682,34 @@ auto main(void) -> int {
     // glBindBuffer(GL_ARRAY_BUFFER, 0);
     // glBindVertexArray(0);
 
+    // A unit quad for the posters, positions and texture coordinates.
+    // clang-format off
+    float poster_vertices[] = {
+        -0.5f, -0.5f, 0.0f,  0.0f, 0.0f,
+         0.5f, -0.5f, 0.0f,  1.0f, 0.0f,
+         0.5f,  0.5f, 0.0f,  1.0f, 1.0f,
+        -0.5f,  0.5f, 0.0f,  0.0f, 1.0f
+    };
+    // clang-format on
+    unsigned int poster_VAO;
+    unsigned int poster_VBO;
+    glGenVertexArrays(1, &poster_VAO);
+    glGenBuffers(1, &poster_VBO);
+    glBindVertexArray(poster_VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, poster_VBO);
+    glBufferData(
+        GL_ARRAY_BUFFER, sizeof(poster_vertices), poster_vertices, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(2,
+                          2,
+                          GL_FLOAT,
+                          GL_FALSE,
+                          5 * sizeof(float),
+                          (void*)(3 * sizeof(float))); // NOLINT
+    glEnableVertexAttribArray(2);
+    glBindVertexArray(VAO);
+
     while (!static_cast<bool>(glfwWindowShouldClose(window))) {
         // The glfwPollEvents function checks if any events are triggered (like
         // keyboard input or mouse movement events), updates the window state, and
@@ -250,6 +717,10 @@ auto main(void) -> int {
         // methods).
         glfwPollEvents();
 
+        double frame_time = glfwGetTime();
+        auto dt = static_cast<float>(frame_time - last_frame_time);
+        last_frame_time = frame_time;
+
         // start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
@@ -258,36 +729,684 @@ auto main(void) -> int {
         // If escape key is pressed, the windows should be closed.
         escape_key_pressed_callback(window);
 
-        // We can clear the screen's color buffer using glClear where we pass in buffer
-        // bits to specify which buffer we would like to clear. The possible bits we
-        // can set are GL_COLOR_BUFFER_BIT, GL_DEPTH_BUFFER_BIT and
-        // GL_STENCIL_BUFFER_BIT. the glClearColor function is a state-setting function
-        // and glClear is a state-using function in that it uses the current state to
-        // retrieve the clearing color from.
-        // glClearColor(0.11f, 0.11f, 0.11f, 1.0f);
-        glClearColor(clear_color.x, clear_color.y, clear_color.z, clear_color.w);
-        glClear(GL_COLOR_BUFFER_BIT);
-
-        // Every shader and rendering call after glUseProgram will now use this program
-        // object (and thus the shaders).
-        glUseProgram(shader_program);
-        glBindVertexArray(VAO);
-        // glDrawArrays(GL_TRIANGLES, 0, 3);
-        glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, 0);
-
-        glBindVertexArray(0);
         if (show_tip_window) {
             ImGui::Begin("Tip");
             ImGui::Text("Change backgroung color");
             ImGui::ColorEdit3("Select color", (float*)&clear_color);
+            ImGui::Checkbox("Debug draw", &show_debug_draw);
+            if (has_text) {
+                ImGui::SliderInt("SDF labels", &label_count, 0, 10000);
+            }
+            ImGui::Checkbox("Particles", &show_particles);
+            if (show_particles) {
+                for (auto backend : {particles::Backend::Compute,
+                                     particles::Backend::TransformFeedback,
+                                     particles::Backend::Cpu}) {
+                    if (particles::is_supported(backend) &&
+                        ImGui::RadioButton(particles::backend_name(backend),
+                                           backend == particle_system.backend()) &&
+                        backend != particle_system.backend()) {
+                        particle_system.shutdown();
+                        if (!init_particles(backend)) {
+                            show_particles = false;
+                        }
+                    }
+                }
+                ImGui::SliderFloat("Emit rate", &emitter.rate, 0.0f, 1000000.0f);
+            }
+            ImGui::Checkbox("Dynamic resolution", &use_dynamic_resolution);
+            if (use_dynamic_resolution) {
+                ImGui::SliderFloat(
+                    "GPU budget (ms)", &resolution_controller.budget_ms, 2.0f, 33.0f);
+                ImGui::Text("Scale %.2f, GPU %.2f ms",
+                            resolution_controller.scale(),
+                            frame_timer.milliseconds());
+            }
+            if (ImGui::RadioButton(
+                    "Bilinear", final_settings.upscale == post::Upscale::Bilinear)) {
+                final_settings.upscale = post::Upscale::Bilinear;
+            }
+            ImGui::SameLine();
+            if (ImGui::RadioButton(
+                    "Sharpen", final_settings.upscale == post::Upscale::Sharpen)) {
+                final_settings.upscale = post::Upscale::Sharpen;
+            }
+            if (final_settings.upscale == post::Upscale::Sharpen) {
+                ImGui::SliderFloat(
+                    "Sharpness", &final_settings.sharpness, 0.01f, 1.0f);
+            }
+            ImGui::SliderFloat("Exposure", &final_settings.exposure, 0.1f, 8.0f);
+            ImGui::Text("Antialiasing (GPU ms: scene + AA)");
+            for (int i = 0; i < post::Antialiasing::MODE_COUNT; ++i) {
+                auto mode = static_cast<post::Antialiasing::Mode>(i);
+                if (ImGui::RadioButton(post::Antialiasing::mode_name(mode),
+                                       mode == antialiasing.mode())) {
+                    antialiasing.set_mode(mode);
+                }
+                ImGui::SameLine(120.0f);
+                ImGui::Text("%.3f + %.3f",
+                            std::max(scene_timers[i].milliseconds(), 0.0),
+                            std::max(antialiasing.milliseconds(mode), 0.0));
+            }
+            ImGui::SliderInt("Lights", &light_count, 0, MAX_LIGHT_COUNT);
+            const auto& light_stats = clustered_lighting.stats();
+            ImGui::Text("Clusters: %d references, at most %d per cluster, "
+                        "binned in %.3f ms",
+                        light_stats.references,
+                        light_stats.max_cluster_lights,
+                        light_stats.binning_ms);
+            ImGui::SliderInt("Overdraw layers", &overdraw_layers, 1, 64);
+            ImGui::Checkbox("Posters", &show_posters);
+            if (show_posters) {
+                ImGui::SliderInt(
+                    "Streaming budget (MB)", &streaming_budget_mb, 1, 256);
+                const auto& streaming_stats = texture_streamer.stats();
+                ImGui::Text("Streaming: %.1f MB resident, %d levels missing, "
+                            "%d loading, %d uploads, %d evictions, %.3f ms",
+                            static_cast<double>(streaming_stats.resident_bytes) /
+                                (1 << 20),
+                            streaming_stats.missing_levels,
+                            streaming_stats.loads_in_flight,
+                            streaming_stats.uploads,
+                            streaming_stats.evictions,
+                            streaming_stats.update_ms);
+            }
+            if (has_map) {
+                ImGui::Checkbox("Map", &show_map);
+            }
+            if (show_map) {
+                const auto& map_stats = map_texture.stats();
+                ImGui::Text("Virtual texture: %d of %d pages, %d requested, "
+                            "%d loading, %d uploads, %d evictions, %.3f ms",
+                            map_stats.resident_pages,
+                            map_stats.cache_pages,
+                            map_stats.requested_pages,
+                            map_stats.loads_in_flight,
+                            map_stats.uploads,
+                            map_stats.evictions,
+                            map_stats.update_ms);
+            }
+            if (!textures.empty()) {
+                std::vector<const char*> names = {"None"};
+                for (const std::string& name : texture_names) {
+                    names.push_back(name.c_str());
+                }
+                int selected = shown_texture + 1;
+                ImGui::Combo("Texture",
+                             &selected,
+                             names.data(),
+                             static_cast<int>(names.size()));
+                shown_texture = selected - 1;
+            }
+            if (shown_texture >= 0) {
+                const ktx::Texture& texture = textures[shown_texture];
+                ImGui::Text("%dx%d %s, %d levels, %zu KB%s, loaded in %.1f ms",
+                            texture.width,
+                            texture.height,
+                            texture.format,
+                            texture.levels,
+                            texture.gpu_bytes / 1024,
+                            texture.transcoded ? " decoded on the CPU" : "",
+                            texture.load_ms);
+                float width = std::min(256.0f, static_cast<float>(texture.width));
+                ImGui::Image((ImTextureID)(intptr_t)texture.id,
+                             ImVec2(width,
+                                    width * static_cast<float>(texture.height) /
+                                        static_cast<float>(texture.width)));
+            }
+            if (ImGui::Checkbox("Baked crowd", &bake_crowd) && !bake_crowd) {
+                character_count = std::min(character_count, MAX_CHARACTER_COUNT);
+            }
+            ImGui::SliderInt("Characters",
+                             &character_count,
+                             0,
+                             bake_crowd ? MAX_BAKED_CHARACTER_COUNT
+                                        : MAX_CHARACTER_COUNT);
+            if (bake_crowd) {
+                const auto& baked_stats = baked_crowd.stats();
+                ImGui::Text("Crowd: %d instances placed in %.3f ms, %zu KB baked",
+                            baked_stats.characters,
+                            baked_stats.update_ms,
+                            baked_stats.texture_bytes / 1024);
+            } else {
+                const auto& crowd_stats = crowd.stats();
+                ImGui::Text("Crowd: %d joints posed in %.3f ms, %d morph deltas",
+                            crowd_stats.joints,
+                            crowd_stats.update_ms,
+                            crowd_stats.morph_deltas);
+            }
+            ImGui::Text("Shading (GPU ms: geometry + lighting)");
+            if (ImGui::RadioButton("Forward", !use_deferred)) {
+                use_deferred = false;
+            }
+            ImGui::SameLine(120.0f);
+            ImGui::Text("%.3f", std::max(geometry_timers[0].milliseconds(), 0.0));
+            if (gbuffer_program != 0 && ImGui::RadioButton("Deferred", use_deferred)) {
+                use_deferred = true;
+            }
+            ImGui::SameLine(120.0f);
+            ImGui::Text("%.3f + %.3f",
+                        std::max(geometry_timers[1].milliseconds(), 0.0),
+                        std::max(deferred_shading.milliseconds(), 0.0));
+            ImGui::SliderFloat("Sun elevation", &sun_elevation, 0.05f, 1.55f);
+            ImGui::SliderFloat("Sun azimuth", &sun_azimuth, -1.5f, 1.5f);
+            ImGui::SliderFloat("Sun intensity", &sun_intensity, 0.0f, 4.0f);
+            ImGui::SliderFloat("Sky intensity", &image_lighting.intensity, 0.0f, 2.0f);
+            ImGui::SliderFloat("Roughness", &roughness, 0.0f, 1.0f);
+            ImGui::Checkbox("Cache far cascades", &shadow_maps.caching);
+            const auto& shadow_stats = shadow_maps.stats();
+            ImGui::Text("Shadows: %d cascades, %d casters drawn, %d culled, %.3f ms",
+                        shadow_stats.cascades_rendered,
+                        shadow_stats.casters_drawn,
+                        shadow_stats.casters_culled,
+                        std::max(shadow_maps.milliseconds(), 0.0));
+            ImGui::SliderInt("Shadowed lights",
+                             &shadow_atlas.max_lights,
+                             0,
+                             shadows::ShadowAtlas::MAX_SHADOWED_LIGHTS);
+            ImGui::SliderInt("Shadow updates", &shadow_atlas.updates_per_frame, 0, 16);
+            const auto& atlas_stats = shadow_atlas.stats();
+            ImGui::Text("Light shadows: %d lights, %d maps rendered, %d casters, "
+                        "%.0f%% of the atlas, %.3f ms",
+                        atlas_stats.shadowed_lights,
+                        atlas_stats.maps_rendered,
+                        atlas_stats.casters_drawn,
+                        atlas_stats.atlas_usage * 100.0f,
+                        std::max(shadow_atlas.milliseconds(), 0.0));
+            ImGui::Checkbox("Glass", &show_glass);
+            if (show_glass) {
+                ImGui::SameLine(120.0f);
+                ImGui::Text("%.3f", std::max(transparency.milliseconds(), 0.0));
+                ImGui::SliderFloat("Glass opacity", &glass_opacity, 0.0f, 1.0f);
+            }
+            ImGui::Checkbox("SSAO", &use_ssao);
+            if (use_ssao) {
+                ImGui::SliderFloat("SSAO radius", &ssao.radius, 0.05f, 2.0f);
+                ImGui::SliderFloat("SSAO strength", &ssao.strength, 0.0f, 1.0f);
+            }
+            ImGui::Checkbox("Bloom", &use_bloom);
+            if (use_bloom) {
+                ImGui::SliderFloat(
+                    "Bloom strength", &final_settings.bloom_strength, 0.0f, 0.3f);
+            }
+            const auto& graph_stats = frame_graph.stats();
+            ImGui::Text("Render graph: %d/%d passes, %d transients in %d textures "
+                        "(%.1f MiB, %d allocations)",
+                        graph_stats.executed_passes,
+                        graph_stats.declared_passes,
+                        graph_stats.transient_textures,
+                        graph_stats.physical_textures,
+                        static_cast<double>(graph_stats.physical_bytes) / (1 << 20),
+                        graph_stats.allocations);
             if (ImGui::Button("Close")) {
                 show_tip_window = false;
             }
             ImGui::End();
         }
 
-        ImGui::Render();
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        // The frame is declared as a render graph: every pass states which
+        // attachments it reads and writes, and the graph culls passes whose output
+        // is never used and lets transient textures with disjoint lifetimes share
+        // memory. The graph is rebuilt every frame, its textures are not.
+        int fb_width, fb_height;
+        glfwGetFramebufferSize(window, &fb_width, &fb_height);
+        fb_width = std::max(fb_width, 1);
+        fb_height = std::max(fb_height, 1);
+        resize_debouncer.update(fb_width, fb_height, frame_time);
+        int render_width = resize_debouncer.width();
+        int render_height = resize_debouncer.height();
+        if (!use_dynamic_resolution) {
+            resolution_controller.reset();
+        } else if (frame_timer.results() != seen_frame_times) {
+            seen_frame_times = frame_timer.results();
+            resolution_controller.update(frame_timer.milliseconds());
+        }
+        float scale = resolution_controller.scale();
+        int scene_width = std::max(static_cast<int>(render_width * scale + 0.5f), 1);
+        int scene_height =
+            std::max(static_cast<int>(render_height * scale + 0.5f), 1);
+
+        frame_graph.reset();
+        auto backbuffer = frame_graph.import_backbuffer(fb_width, fb_height);
+        RenderGraph::Resource scene_color = -1;
+        RenderGraph::Resource scene_depth = -1;
+        // A fixed camera looking down -z at the triangle. TAA shifts the
+        // projection by a sub-pixel offset every frame.
+        Mat4 view = look_at(
+            {0.0f, 0.0f, CAMERA_DISTANCE}, {0.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f});
+        Mat4 proj = perspective(CAMERA_FOVY,
+                                static_cast<float>(scene_width) /
+                                    static_cast<float>(scene_height),
+                                CAMERA_NEAR,
+                                CAMERA_FAR);
+        Mat4 view_proj = proj * view;
+        Mat4 jittered_view_proj =
+            antialiasing.jitter(scene_width, scene_height) * view_proj;
+        GpuTimer& scene_timer = scene_timers[static_cast<int>(antialiasing.mode())];
+
+        animate_lights(lights, light_count, static_cast<float>(frame_time));
+        place_characters(characters, character_count, static_cast<float>(frame_time));
+        if (bake_crowd) {
+            baked_crowd.update(characters);
+        } else {
+            crowd.update(characters);
+        }
+        // Ask for every poster on screen at the size it covers, which the fixed
+        // camera makes a matter of distance.
+        place_posters(poster_placements, POSTER_COUNT, static_cast<float>(frame_time));
+        if (show_posters) {
+            for (size_t i = 0; i < posters.size(); ++i) {
+                const Vec4& poster = poster_placements[i];
+                Vec3 eye_to_poster = Vec3 {poster.x, poster.y, poster.z} -
+                                     Vec3 {0.0f, 0.0f, CAMERA_DISTANCE};
+                texture_streamer.request(
+                    posters[i],
+                    streaming::projected_size(
+                        poster.w, length(eye_to_poster), CAMERA_FOVY, scene_height));
+            }
+        }
+        texture_streamer.set_budget(static_cast<size_t>(streaming_budget_mb) << 20);
+        texture_streamer.update();
+        Vec4 map_uv = map_window(static_cast<float>(frame_time));
+        if (map_cooked.exchange(false)) {
+            auto tiled = virtual_texture::open_tiled(MAP_PATH);
+            if (tiled) {
+                map_texture.shutdown();
+                has_map = map_texture.init(std::move(*tiled), MAP_CACHE_SIZE);
+            }
+        }
+        if (show_map) {
+            map_texture.update();
+        }
+
+        // The triangle and every backdrop layer cast shadows. They only change
+        // when the number of layers does.
+        if (shadow_layers != overdraw_layers) {
+            shadow_layers = overdraw_layers;
+            shadow_maps.invalidate();
+            shadow_atlas.invalidate();
+            shadow_casters.clear();
+            for (int layer = 0; layer < overdraw_layers; ++layer) {
+                float z = -0.3f - 0.01f * static_cast<float>(layer);
+                shadows::Caster backdrop;
+                backdrop.model = translate({0.0f, 0.0f, z + 0.3f});
+                backdrop.bounds_min = {-2.0f, -1.5f, z};
+                backdrop.bounds_max = {2.0f, 1.5f, z};
+                backdrop.vao = VAO;
+                backdrop.index_count = 6;
+                backdrop.first_index = 3;
+                shadow_casters.push_back(backdrop);
+            }
+            shadows::Caster triangle;
+            triangle.bounds_min = {-0.5f, -0.5f, 0.0f};
+            triangle.bounds_max = {0.5f, 0.5f, 0.0f};
+            triangle.vao = VAO;
+            triangle.index_count = 3;
+            shadow_casters.push_back(triangle);
+        }
+        shadow_maps.color = {sun_intensity, sun_intensity, sun_intensity};
+        shadow_maps.update(
+            view, proj, sun_direction(sun_elevation, sun_azimuth), shadow_casters);
+        // Which lights have a shadow goes into the light data, so the atlas comes
+        // first.
+        shadow_atlas.update(
+            lights, shadow_casters, view, proj, scene_width, scene_height);
+        clustered_lighting.update(lights, view, proj, scene_width, scene_height);
+        image_lighting.update(view);
+
+        // The shadow maps live outside the graph, so the pass has no attachments
+        // and has to be kept alive explicitly.
+        frame_graph.add_pass(
+            "shadows",
+            [&](RenderGraph::PassBuilder& builder) { builder.side_effect(); },
+            [&](RenderGraph::PassContext&) {
+                shadow_maps.render(shadow_casters);
+                shadow_atlas.render(shadow_casters);
+            });
+
+        // The triangle in front of the backdrop, which is drawn `overdraw_layers`
+        // times from back to front so that every layer gets shaded.
+        auto draw_geometry = [&](unsigned int program) {
+            auto set_matrices = [&](const Mat4& model) {
+                Mat4 model_view_proj = jittered_view_proj * model;
+                Mat4 model_view = view * model;
+                glUniformMatrix4fv(glGetUniformLocation(program, "uViewProj"),
+                                   1,
+                                   GL_FALSE,
+                                   model_view_proj.m);
+                glUniformMatrix4fv(glGetUniformLocation(program, "uView"),
+                                   1,
+                                   GL_FALSE,
+                                   model_view.m);
+            };
+            glUniform1f(glGetUniformLocation(program, "uRoughness"), roughness);
+            glBindVertexArray(VAO);
+            glEnable(GL_DEPTH_TEST);
+            for (int layer = overdraw_layers - 1; layer >= 0; --layer) {
+                float depth_offset = -0.01f * static_cast<float>(layer);
+                set_matrices(translate({0.0f, 0.0f, depth_offset}));
+                glDrawElements(GL_TRIANGLES,
+                               6,
+                               GL_UNSIGNED_INT,
+                               (void*)(3 * sizeof(unsigned int))); // NOLINT
+            }
+            set_matrices(Mat4 {});
+            // glDrawArrays(GL_TRIANGLES, 0, 3);
+            glDrawElements(GL_TRIANGLES, 3, GL_UNSIGNED_INT, 0);
+            glDisable(GL_DEPTH_TEST);
+            glBindVertexArray(0);
+        };
+        // The crowd is already in world space.
+        auto draw_characters = [&](unsigned int program, int animation_unit) {
+            glUniformMatrix4fv(glGetUniformLocation(program, "uViewProj"),
+                               1,
+                               GL_FALSE,
+                               jittered_view_proj.m);
+            glUniformMatrix4fv(
+                glGetUniformLocation(program, "uView"), 1, GL_FALSE, view.m);
+            glUniform1f(glGetUniformLocation(program, "uRoughness"), roughness);
+            glEnable(GL_DEPTH_TEST);
+            if (bake_crowd) {
+                baked_crowd.draw(program, animation_unit);
+            } else {
+                crowd.draw(program, animation_unit);
+            }
+            glDisable(GL_DEPTH_TEST);
+        };
+        auto draw_posters = [&](unsigned int program, int poster_unit) {
+            glUniform1f(glGetUniformLocation(program, "uRoughness"), roughness);
+            glUniform1i(glGetUniformLocation(program, "uPoster"), poster_unit);
+            glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(poster_unit));
+            glBindVertexArray(poster_VAO);
+            glEnable(GL_DEPTH_TEST);
+            for (size_t i = 0; i < posters.size(); ++i) {
+                const Vec4& poster = poster_placements[i];
+                Mat4 model = translate({poster.x, poster.y, poster.z}) *
+                             ::scale({poster.w, poster.w, 1.0f});
+                Mat4 model_view_proj = jittered_view_proj * model;
+                Mat4 model_view = view * model;
+                glUniformMatrix4fv(glGetUniformLocation(program, "uViewProj"),
+                                   1,
+                                   GL_FALSE,
+                                   model_view_proj.m);
+                glUniformMatrix4fv(
+                    glGetUniformLocation(program, "uView"), 1, GL_FALSE, model_view.m);
+                glBindTexture(GL_TEXTURE_2D, texture_streamer.texture(posters[i]));
+                glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+            }
+            glDisable(GL_DEPTH_TEST);
+            glBindVertexArray(0);
+            glActiveTexture(GL_TEXTURE0);
+        };
+        // The map covers the backdrop, just in front of it.
+        auto draw_map = [&](unsigned int program, int map_unit) {
+            Mat4 model =
+                translate({0.0f, 0.0f, -0.28f}) * ::scale({4.0f, 3.0f, 1.0f});
+            Mat4 model_view_proj = jittered_view_proj * model;
+            Mat4 model_view = view * model;
+            glUniformMatrix4fv(glGetUniformLocation(program, "uViewProj"),
+                               1,
+                               GL_FALSE,
+                               model_view_proj.m);
+            glUniformMatrix4fv(
+                glGetUniformLocation(program, "uView"), 1, GL_FALSE, model_view.m);
+            glUniform4f(glGetUniformLocation(program, "uMapWindow"),
+                        map_uv.x,
+                        map_uv.y,
+                        map_uv.z,
+                        map_uv.w);
+            glUniform1f(glGetUniformLocation(program, "uRoughness"), roughness);
+            map_texture.bind(program, map_unit);
+            glBindVertexArray(poster_VAO);
+            glEnable(GL_DEPTH_TEST);
+            glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+            glDisable(GL_DEPTH_TEST);
+            glBindVertexArray(0);
+        };
+
+        // Particles, debug geometry and labels are not lit, so both paths draw them
+        // over the shaded scene.
+        auto draw_unlit = [&]() {
+            if (show_particles) {
+                particle_system.update(emitter, dt);
+                particle_system.render(
+                    jittered_view_proj, {1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, 0.01f);
+            }
+
+            if (show_debug_draw) {
+                debug_draw::aabb(
+                    {-0.5f, -0.5f, 0.0f}, {0.5f, 0.5f, 0.0f}, debug_draw::YELLOW);
+                debug_draw::text({0.0f, 0.5f, 0.0f}, "top");
+            }
+            debug_draw::flush(jittered_view_proj);
+
+            if (has_text) {
+                // Lay the labels out on a grid below the triangle; all of them
+                // end up in a single instanced draw.
+                int columns = 1;
+                while (columns * columns < label_count) {
+                    ++columns;
+                }
+                float cell = 2.0f / static_cast<float>(columns);
+                for (int i = 0; i < label_count; ++i) {
+                    auto column = static_cast<float>(i % columns);
+                    auto row = static_cast<float>(i / columns);
+                    Vec3 position {-1.0f + cell * column, -1.0f + cell * row, 0.0f};
+                    text_renderer.add(
+                        position, "triangle", cell * 0.25f, debug_draw::WHITE);
+                }
+                text_renderer.flush(
+                    jittered_view_proj, {1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f});
+            }
+        };
+
+        // The scene target holds linear HDR values, while the color picker works
+        // in sRGB.
+        Vec3 background {std::pow(clear_color.x, 2.2f),
+                         std::pow(clear_color.y, 2.2f),
+                         std::pow(clear_color.z, 2.2f)};
+
+        // Which pages of the map the frame samples, for the next ones.
+        if (show_map) {
+            map_texture.add_feedback_pass(
+                frame_graph, scene_width, scene_height, [&]() {
+                    glUseProgram(map_feedback_program);
+                    draw_map(map_feedback_program, 0);
+                });
+        }
+
+        if (!use_deferred) {
+            frame_graph.add_pass(
+                "scene",
+                [&](RenderGraph::PassBuilder& builder) {
+                    int samples = antialiasing.samples();
+                    scene_color = builder.create(
+                        "scene_color",
+                        {scene_width, scene_height, GL_RGBA16F, samples});
+                    scene_depth = builder.create(
+                        "scene_depth",
+                        {scene_width, scene_height, GL_DEPTH24_STENCIL8, samples});
+                },
+                [&](RenderGraph::PassContext&) {
+                    scene_timer.begin();
+                    geometry_timers[0].begin();
+                    // We can clear the screen's color buffer using glClear where we
+                    // pass in buffer bits to specify which buffer we would like to
+                    // clear. The possible bits we can set are GL_COLOR_BUFFER_BIT,
+                    // GL_DEPTH_BUFFER_BIT and GL_STENCIL_BUFFER_BIT. the
+                    // glClearColor function is a state-setting function and glClear
+                    // is a state-using function in that it uses the current state to
+                    // retrieve the clearing color from.
+                    // glClearColor(0.11f, 0.11f, 0.11f, 1.0f);
+                    glClearColor(
+                        background.x, background.y, background.z, clear_color.w);
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+                    // Every shader and rendering call after glUseProgram will now
+                    // use this program object (and thus the shaders).
+                    glUseProgram(shader_program);
+                    clustered_lighting.bind(shader_program, 0);
+                    shadow_maps.bind(shader_program, 3);
+                    shadow_atlas.bind(shader_program, 4);
+                    image_lighting.bind(shader_program, 6);
+                    draw_geometry(shader_program);
+                    unsigned int character_program =
+                        bake_crowd ? baked_program : skinned_program;
+                    glUseProgram(character_program);
+                    clustered_lighting.bind(character_program, 0);
+                    shadow_maps.bind(character_program, 3);
+                    shadow_atlas.bind(character_program, 4);
+                    image_lighting.bind(character_program, 6);
+                    draw_characters(character_program, 8);
+                    if (show_posters) {
+                        glUseProgram(poster_program);
+                        clustered_lighting.bind(poster_program, 0);
+                        shadow_maps.bind(poster_program, 3);
+                        shadow_atlas.bind(poster_program, 4);
+                        image_lighting.bind(poster_program, 6);
+                        draw_posters(poster_program, 8);
+                    }
+                    if (show_map) {
+                        glUseProgram(map_program);
+                        clustered_lighting.bind(map_program, 0);
+                        shadow_maps.bind(map_program, 3);
+                        shadow_atlas.bind(map_program, 4);
+                        image_lighting.bind(map_program, 6);
+                        draw_map(map_program, 8);
+                    }
+                    geometry_timers[0].end();
+                });
+        } else {
+            // The G-buffer is never multisampled, so MSAA only resolves a single
+            // sample here.
+            deferred::GBuffer gbuffer;
+            frame_graph.add_pass(
+                "gbuffer",
+                [&](RenderGraph::PassBuilder& builder) {
+                    gbuffer = deferred::DeferredShading::create_gbuffer(
+                        builder, scene_width, scene_height);
+                },
+                [&](RenderGraph::PassContext&) {
+                    scene_timer.begin();
+                    geometry_timers[1].begin();
+                    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                    glUseProgram(gbuffer_program);
+                    draw_geometry(gbuffer_program);
+                    unsigned int character_program =
+                        bake_crowd ? baked_gbuffer_program : skinned_gbuffer_program;
+                    glUseProgram(character_program);
+                    draw_characters(character_program, 0);
+                    if (show_posters) {
+                        glUseProgram(poster_gbuffer_program);
+                        draw_posters(poster_gbuffer_program, 0);
+                    }
+                    if (show_map) {
+                        glUseProgram(map_gbuffer_program);
+                        draw_map(map_gbuffer_program, 0);
+                    }
+                    geometry_timers[1].end();
+                });
+            scene_color = deferred_shading.add_lighting_pass(
+                frame_graph,
+                gbuffer,
+                clustered_lighting,
+                shadow_maps,
+                shadow_atlas,
+                image_lighting,
+                antialiasing.jitter(scene_width, scene_height) * proj,
+                background);
+            scene_depth = gbuffer.depth;
+        }
+
+        // Occlusion only darkens the opaque, lit surfaces: it goes in before the
+        // unlit overlays, the glass and antialiasing.
+        if (use_ssao) {
+            scene_color = ssao.add_passes(
+                frame_graph,
+                scene_color,
+                scene_depth,
+                antialiasing.jitter(scene_width, scene_height) * proj);
+        }
+        frame_graph.add_pass(
+            "scene_unlit",
+            [&](RenderGraph::PassBuilder& builder) {
+                builder.write(scene_color);
+                builder.write(scene_depth);
+            },
+            [&](RenderGraph::PassContext&) {
+                draw_unlit();
+                scene_timer.end();
+            });
+
+        if (show_glass) {
+            scene_color = transparency.add_passes(
+                frame_graph, scene_color, scene_depth, [&]() {
+                    auto location = [&](const char* name) {
+                        return glGetUniformLocation(glass_program, name);
+                    };
+                    glUseProgram(glass_program);
+                    glUniformMatrix4fv(
+                        location("uViewProj"), 1, GL_FALSE, jittered_view_proj.m);
+                    glUniformMatrix4fv(location("uView"), 1, GL_FALSE, view.m);
+                    glUniform1f(location("uOpacity"), glass_opacity);
+                    glBindVertexArray(VAO);
+                    glDrawElements(GL_TRIANGLES,
+                                   18,
+                                   GL_UNSIGNED_INT,
+                                   (void*)(9 * sizeof(unsigned int))); // NOLINT
+                    glBindVertexArray(0);
+                });
+        }
+
+        // Everything after this point works on the single-sampled, antialiased
+        // image.
+        auto scene_aa =
+            antialiasing.add_passes(frame_graph, scene_color, scene_depth, view_proj);
+
+        // Nothing is culled by hand when bloom is off: the final pass simply stops
+        // reading it and the graph drops the whole chain.
+        auto bloom_result =
+            bloom.add_passes(frame_graph, scene_aa, scene_width, scene_height);
+        bool composite_bloom = use_bloom && bloom_result >= 0;
+
+        // Besides the dynamic resolution scale, the scene is also smaller than the
+        // window while a resize is being debounced; both are stretched here.
+        frame_graph.add_pass(
+            "final",
+            [&](RenderGraph::PassBuilder& builder) {
+                builder.read(scene_aa);
+                if (composite_bloom) {
+                    builder.read(bloom_result);
+                }
+                builder.write(backbuffer);
+            },
+            [&](RenderGraph::PassContext& context) {
+                post::SourceRect bloom_rect {};
+                unsigned int bloom_texture = 0;
+                if (composite_bloom) {
+                    bloom_rect = post::source_rect(context, bloom_result);
+                    bloom_texture = context.texture(bloom_result);
+                }
+                final_pass.draw(context.texture(scene_aa),
+                                post::source_rect(context, scene_aa),
+                                bloom_texture,
+                                bloom_rect,
+                                final_settings);
+            });
+
+        frame_graph.add_pass(
+            "imgui",
+            [&](RenderGraph::PassBuilder& builder) { builder.write(backbuffer); },
+            [&](RenderGraph::PassContext&) {
+                ImGui::Render();
+                ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+            });
+
+        frame_graph.compile();
+        frame_timer.begin();
+        frame_graph.execute();
+        frame_timer.end();
 
         // The glfwSwapBuffers will swap the color buffer (a large 2D buffer that
         // contains color values for each pixel in GLFW's window) that is used to
@@ -298,15 +1417,61 @@ auto main(void) -> int {
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
     glDeleteBuffers(1, &EBO);
+    glDeleteVertexArrays(1, &poster_VAO);
+    glDeleteBuffers(1, &poster_VBO);
     glDeleteProgram(shader_program);
+    glDeleteProgram(gbuffer_program);
+    glDeleteProgram(glass_program);
+    glDeleteProgram(skinned_program);
+    glDeleteProgram(skinned_gbuffer_program);
+    glDeleteProgram(baked_program);
+    glDeleteProgram(baked_gbuffer_program);
+    glDeleteProgram(poster_program);
+    glDeleteProgram(poster_gbuffer_program);
+    glDeleteProgram(map_program);
+    glDeleteProgram(map_gbuffer_program);
+    glDeleteProgram(map_feedback_program);
+    debug_draw::shutdown();
+    particle_system.shutdown();
+    antialiasing.shutdown(frame_graph.pool());
+    for (GpuTimer& timer : scene_timers) {
+        timer.shutdown();
+    }
+    frame_graph.shutdown();
+    bloom.shutdown();
+    ssao.shutdown();
+    transparency.shutdown();
+    crowd.shutdown();
+    baked_crowd.shutdown();
+    texture_streamer.shutdown();
+    if (has_map) {
+        map_texture.shutdown();
+    }
+    for (const ktx::Texture& texture : textures) {
+        glDeleteTextures(1, &texture.id);
+    }
+    clustered_lighting.shutdown();
+    deferred_shading.shutdown();
+    shadow_maps.shutdown();
+    shadow_atlas.shutdown();
+    image_lighting.shutdown();
+    for (GpuTimer& timer : geometry_timers) {
+        timer.shutdown();
+    }
+    final_pass.shutdown();
+    frame_timer.shutdown();
+    text_renderer.shutdown();
+    jobs::shutdown();
 
     glfwTerminate();
     return 0;
 }
 
 void framebuffer_resize_callback(GLFWwindow* window, int width, int height) {
-    spdlog::info("Resizing framebuffer to {}x{}", width, height);
-    glViewport(0, 0, width, height);
+    // Dragging a window edge fires this for every intermediate size. The render
+    // graph sets the viewport for each pass and the offscreen targets are resized
+    // through ResizeDebouncer, so there is nothing to do here but log.
+    spdlog::debug("Resizing framebuffer to {}x{}", width, height);
 }
 
 void escape_key_pressed_callback(GLFWwindow* window) {
@@ -315,3 +1480,95 @@ void escape_key_pressed_callback(GLFWwindow* window) {
         glfwSetWindowShouldClose(window, static_cast<int>(true));
     }
 }
+
+// Spreads the lights over the backdrop on a golden-ratio sequence, each circling its
+// own centre at its own speed.
+void animate_lights(std::vector<lighting::PointLight>& lights, int count, float time) {
+    auto constexpr GOLDEN_RATIO = 0.618034f;
+    auto constexpr TWO_PI = 6.2831853f;
+    lights.resize(static_cast<size_t>(count));
+    for (int i = 0; i < count; ++i) {
+        float a = std::fmod(static_cast<float>(i) * GOLDEN_RATIO, 1.0f);
+        float b = std::fmod(static_cast<float>(i) * GOLDEN_RATIO * GOLDEN_RATIO, 1.0f);
+        float angle = time * (0.3f + a) + b * TWO_PI;
+        lighting::PointLight& light = lights[static_cast<size_t>(i)];
+        light.position = {-1.8f + 3.6f * a + 0.2f * std::cos(angle),
+                          -1.3f + 2.6f * b + 0.2f * std::sin(angle),
+                          -0.2f + 0.4f * std::fmod(a + b, 1.0f)};
+        light.radius = 0.25f + 0.25f * b;
+        light.color = {0.5f + 0.5f * std::cos(a * TWO_PI),
+                       0.5f + 0.5f * std::cos((a + 0.33f) * TWO_PI),
+                       0.5f + 0.5f * std::cos((a + 0.67f) * TWO_PI)};
+    }
+}
+
+// The direction sunlight travels, for the sun `elevation` radians above the horizon.
+auto sun_direction(float elevation, float azimuth) -> Vec3 {
+    return {-std::cos(elevation) * std::sin(azimuth),
+            -std::sin(elevation),
+            -std::cos(elevation) * std::cos(azimuth)};
+}
+
+// Lines the characters up in rows on the backdrop, facing the camera, smaller the
+// more there are, each breathing and puffing its head at its own pace.
+void place_characters(std::vector<animation::Character>& characters,
+                      int count,
+                      float time) {
+    auto constexpr GOLDEN_RATIO = 0.618034f;
+    characters.resize(static_cast<size_t>(count));
+    int columns = 1;
+    while (columns * columns < count * 2) {
+        ++columns;
+    }
+    int rows = (count + columns - 1) / std::max(columns, 1);
+    float width = 3.8f / static_cast<float>(columns);
+    float height = 2.4f / static_cast<float>(std::max(rows, 1));
+    for (int i = 0; i < count; ++i) {
+        float a = std::fmod(static_cast<float>(i) * GOLDEN_RATIO, 1.0f);
+        animation::Character& character = characters[static_cast<size_t>(i)];
+        character.position = {-1.9f + width * (static_cast<float>(i % columns) + 0.5f),
+                              -1.3f + height * static_cast<float>(i / columns),
+                              -0.28f};
+        character.heading = 0.6f * (a - 0.5f);
+        character.scale = std::min(height * 0.9f, 0.3f);
+        character.time = time * (0.8f + 0.4f * a) + a * 10.0f;
+        character.blend = 0.5f + 0.5f * std::sin(time * 0.5f + a * 6.2831853f);
+        // Breathing, and puffing the head now and then.
+        character.morph_targets[0] = animation::FIGURE_DEEP_BREATH;
+        character.morph_targets[1] = animation::FIGURE_PUFFED_HEAD;
+        character.morph_weights[0] = 0.5f + 0.5f * std::sin(time * 2.0f + a * 20.0f);
+        character.morph_weights[1] =
+            std::max(0.0f, std::sin(time * (0.7f + a) + a * 40.0f));
+    }
+}
+
+// Lays the posters out in a grid just in front of the backdrop, each growing and
+// shrinking at its own pace.
+void place_posters(std::vector<Vec4>& posters, int count, float time) {
+    auto constexpr COLUMNS = 6;
+    auto constexpr CELL = 0.6f;
+    posters.resize(static_cast<size_t>(count));
+    int rows = (count + COLUMNS - 1) / COLUMNS;
+    for (int i = 0; i < count; ++i) {
+        float column = static_cast<float>(i % COLUMNS) -
+                       0.5f * static_cast<float>(COLUMNS - 1);
+        float row =
+            static_cast<float>(i / COLUMNS) - 0.5f * static_cast<float>(rows - 1);
+        float pulse =
+            0.5f + 0.5f * std::sin(time * 0.4f + static_cast<float>(i) * 1.7f);
+        posters[static_cast<size_t>(i)] = {
+            column * CELL, row * CELL, -0.25f, CELL * (0.15f + 0.8f * pulse)};
+    }
+}
+
+// The part of the map shown on the backdrop, as the texture coordinates of its
+// corner and its extent. It zooms from the whole map in to about a texel per
+// pixel and back out, drifting across the map while close.
+auto map_window(float time) -> Vec4 {
+    float zoom = 0.5f - 0.5f * std::cos(time * 0.15f);
+    float extent = std::exp2(-7.0f * zoom);
+    float x = 0.5f + 0.3f * zoom * std::sin(time * 0.05f);
+    float y = 0.5f + 0.3f * zoom * std::sin(time * 0.07f + 1.0f);
+    // The backdrop is 4:3.
+    return {x - 0.5f * extent, y - 0.375f * extent, extent, 0.75f * extent};
+}
@@ -0,0 +1,741 @@
+#include "virtual_texture.H"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+
+#include <glad/glad.h>
+#include <spdlog/spdlog.h>
+
+#include "hash.H"
+#include "virtual_texture_shader.H"
+
+namespace {
+using virtual_texture::VirtualTexture;
+
+auto constexpr TILED_MAGIC = 0x58455456u; // "VTEX"
+auto constexpr TILED_VERSION = 2u;
+auto constexpr TILED_HEADER_BYTES = 5 * sizeof(uint32_t) + sizeof(uint64_t);
+// Of the terrain generator, in its sources' hash: bump it whenever the terrain
+// changes, so tiled files cooked from the old one are cooked again.
+auto constexpr TERRAIN_VERSION = 1u;
+auto constexpr BYTES_PER_TEXEL = 4;
+auto constexpr SLOT_BYTES = static_cast<size_t>(VirtualTexture::SLOT_SIZE) *
+                            VirtualTexture::SLOT_SIZE * BYTES_PER_TEXEL;
+// Feedback pixels not covered by virtually textured geometry.
+auto constexpr NO_PAGE = 0xFFFFFFFFu;
+// Pages a side the 12 bits of feedback coordinates can name.
+auto constexpr MAX_PAGES = 4096;
+
+auto pack_page(int level, int x, int y) -> uint32_t {
+    return static_cast<uint32_t>(level) << 24 | static_cast<uint32_t>(y) << 12 |
+           static_cast<uint32_t>(x);
+}
+
+// Mip levels of a virtual texture of `size` texels a side, down to a single page;
+// 0 if the size is unusable.
+auto level_count(int size) -> int {
+    int pages = size / VirtualTexture::PAGE_SIZE;
+    if (size <= 0 || size % VirtualTexture::PAGE_SIZE != 0 ||
+        (pages & (pages - 1)) != 0 || pages > MAX_PAGES) {
+        return 0;
+    }
+    int levels = 1;
+    while ((pages >> levels) > 0) {
+        ++levels;
+    }
+    return levels;
+}
+
+// Position of a page among all pages, finest level first.
+auto page_ordinal(int size, int level, int x, int y) -> size_t {
+    int pages = size / VirtualTexture::PAGE_SIZE;
+    size_t ordinal = 0;
+    for (int finer = 0; finer < level; ++finer) {
+        auto level_pages = static_cast<size_t>(pages >> finer);
+        ordinal += level_pages * level_pages;
+    }
+    return ordinal + static_cast<size_t>(y) * static_cast<size_t>(pages >> level) +
+           static_cast<size_t>(x);
+}
+
+auto lattice(int x, int y) -> float {
+    auto h = static_cast<uint32_t>(x) * 0x8DA6B343u ^
+             static_cast<uint32_t>(y) * 0xD8163841u;
+    h ^= h >> 13;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 16;
+    return static_cast<float>(h & 0xFFFFu) / 65535.0f;
+}
+
+auto value_noise(float x, float y) -> float {
+    float fx = std::floor(x);
+    float fy = std::floor(y);
+    auto ix = static_cast<int>(fx);
+    auto iy = static_cast<int>(fy);
+    float tx = x - fx;
+    float ty = y - fy;
+    tx = tx * tx * (3.0f - 2.0f * tx);
+    ty = ty * ty * (3.0f - 2.0f * ty);
+    float top = lattice(ix, iy) + (lattice(ix + 1, iy) - lattice(ix, iy)) * tx;
+    float bottom =
+        lattice(ix, iy + 1) + (lattice(ix + 1, iy + 1) - lattice(ix, iy + 1)) * tx;
+    return top + (bottom - top) * ty;
+}
+
+// The terrain at level 0 texel coordinates (x, y), averaged over `footprint`
+// texels: octaves finer than the footprint are left out, at their mean.
+void terrain_texel(float x, float y, float footprint, int size, uint8_t* texel) {
+    struct Stop {
+        float height;
+        float color[3];
+    };
+    static constexpr Stop STOPS[] = {
+        {0.00f, {20, 45, 95}},    // deep water
+        {0.42f, {40, 90, 140}},   // shallows
+        {0.45f, {200, 190, 140}}, // sand
+        {0.50f, {80, 130, 50}},   // grass
+        {0.65f, {60, 95, 40}},    // forest
+        {0.75f, {120, 110, 95}},  // rock
+        {0.85f, {240, 240, 245}}, // snow
+        {1.00f, {255, 255, 255}},
+    };
+    auto s = static_cast<float>(size);
+    float height = 0.5f;
+    float amplitude = 0.5f;
+    for (float wavelength = s * 0.25f; wavelength >= 2.0f * footprint;
+         wavelength *= 0.5f) {
+        height += amplitude * (value_noise(x / wavelength, y / wavelength) - 0.5f);
+        amplitude *= 0.55f;
+    }
+    // A continent, sinking into the ocean towards the edges.
+    float u = x / s - 0.5f;
+    float v = y / s - 0.5f;
+    height += 0.2f - 1.6f * (u * u + v * v);
+    height = std::clamp(height, 0.0f, 1.0f);
+
+    size_t stop = 1;
+    while (stop + 1 < std::size(STOPS) && STOPS[stop].height < height) {
+        ++stop;
+    }
+    const Stop& low = STOPS[stop - 1];
+    const Stop& high = STOPS[stop];
+    float t = std::clamp(
+        (height - low.height) / (high.height - low.height), 0.0f, 1.0f);
+    // Grid lines every 2048 texels, one texel wide, fading out as the footprint
+    // grows past them.
+    auto grid_distance = [](float coordinate) {
+        float cell = coordinate / 2048.0f;
+        return std::abs(cell - std::round(cell)) * 2048.0f;
+    };
+    float line = std::min(grid_distance(x), grid_distance(y)) < 0.5f * footprint + 0.5f
+                     ? 0.6f * std::min(1.0f, 2.0f / footprint)
+                     : 0.0f;
+    for (int c = 0; c < 3; ++c) {
+        float color = low.color[c] + (high.color[c] - low.color[c]) * t;
+        texel[c] = static_cast<uint8_t>(color * (1.0f - line) + 0.5f);
+    }
+    texel[3] = 255;
+}
+} // namespace
+
+namespace virtual_texture {
+auto procedural_terrain(int size) -> PageSource {
+    uint32_t identity[] = {TERRAIN_VERSION, static_cast<uint32_t>(size)};
+    PageSource source;
+    source.size = size;
+    source.hash = fnv1a(identity, sizeof(identity));
+    source.load = [size](int level, int x, int y, std::vector<uint8_t>& texels) {
+        auto constexpr SLOT = VirtualTexture::SLOT_SIZE;
+        auto constexpr PAGE = VirtualTexture::PAGE_SIZE;
+        auto constexpr BORDER = VirtualTexture::BORDER;
+        int level_size = size >> level;
+        auto footprint = static_cast<float>(1 << level);
+        texels.resize(SLOT_BYTES);
+        for (int j = 0; j < SLOT; ++j) {
+            int ty = std::clamp(y * PAGE + j - BORDER, 0, level_size - 1);
+            for (int i = 0; i < SLOT; ++i) {
+                int tx = std::clamp(x * PAGE + i - BORDER, 0, level_size - 1);
+                terrain_texel((static_cast<float>(tx) + 0.5f) * footprint,
+                              (static_cast<float>(ty) + 0.5f) * footprint,
+                              footprint,
+                              size,
+                              &texels[static_cast<size_t>((j * SLOT + i) *
+                                                          BYTES_PER_TEXEL)]);
+            }
+        }
+        return true;
+    };
+    return source;
+}
+
+auto write_tiled(const PageSource& source, const char* path, std::stop_token stop)
+    -> bool {
+    int levels = level_count(source.size);
+    if (levels == 0 || !source.load) {
+        spdlog::error("Cannot write a virtual texture of size {}", source.size);
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        spdlog::error("Failed to open {} for writing", path);
+        return false;
+    }
+    uint32_t header[] = {TILED_MAGIC,
+                         TILED_VERSION,
+                         static_cast<uint32_t>(source.size),
+                         VirtualTexture::PAGE_SIZE,
+                         VirtualTexture::BORDER};
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(&source.hash), sizeof(source.hash));
+    std::vector<uint8_t> texels;
+    for (int level = 0; level < levels; ++level) {
+        int pages = (source.size / VirtualTexture::PAGE_SIZE) >> level;
+        for (int y = 0; y < pages; ++y) {
+            if (stop.stop_requested()) {
+                return false;
+            }
+            for (int x = 0; x < pages; ++x) {
+                if (!source.load(level, x, y, texels) || texels.size() != SLOT_BYTES) {
+                    spdlog::error(
+                        "Failed to load page ({}, {}) of level {}", x, y, level);
+                    return false;
+                }
+                file.write(reinterpret_cast<const char*>(texels.data()),
+                           static_cast<std::streamsize>(texels.size()));
+            }
+        }
+    }
+    return static_cast<bool>(file);
+}
+
+auto open_tiled(const char* path) -> std::optional<PageSource> {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return std::nullopt;
+    }
+    auto file_size = static_cast<size_t>(file.tellg());
+    file.seekg(0);
+    uint32_t header[5] = {};
+    uint64_t hash = 0;
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    file.read(reinterpret_cast<char*>(&hash), sizeof(hash));
+    auto size = static_cast<int>(header[2]);
+    int levels = header[2] > (1u << 30) ? 0 : level_count(size);
+    if (!file || header[0] != TILED_MAGIC || header[1] != TILED_VERSION ||
+        header[3] != VirtualTexture::PAGE_SIZE ||
+        header[4] != VirtualTexture::BORDER || levels == 0) {
+        spdlog::warn("{} is not a compatible tiled virtual texture", path);
+        return std::nullopt;
+    }
+    size_t page_count = page_ordinal(size, levels - 1, 0, 0) + 1;
+    if (file_size < TILED_HEADER_BYTES + page_count * SLOT_BYTES) {
+        spdlog::warn("{} is truncated", path);
+        return std::nullopt;
+    }
+    PageSource source;
+    source.size = size;
+    source.hash = hash;
+    // Every load opens the file anew, so that the I/O threads never share a
+    // stream.
+    source.load = [path = std::string(path), size](
+                      int level, int x, int y, std::vector<uint8_t>& texels) {
+        std::ifstream pages(path, std::ios::binary);
+        pages.seekg(static_cast<std::streamoff>(
+            TILED_HEADER_BYTES + page_ordinal(size, level, x, y) * SLOT_BYTES));
+        texels.resize(SLOT_BYTES);
+        pages.read(reinterpret_cast<char*>(texels.data()),
+                   static_cast<std::streamsize>(texels.size()));
+        return static_cast<bool>(pages);
+    };
+    return source;
+}
+
+auto VirtualTexture::init(PageSource source, int cache_size) -> bool {
+    levels_ = level_count(source.size);
+    if (levels_ == 0 || !source.load) {
+        spdlog::error("Virtual textures need a source of PAGE_SIZE times a power of "
+                      "two texels, got {}",
+                      source.size);
+        return false;
+    }
+    int max_texture_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+    // Slot coordinates are 8 bits in the indirection texture.
+    if (cache_size < 2 || cache_size > 256 ||
+        cache_size * SLOT_SIZE > max_texture_size) {
+        spdlog::error("A page cache of {} pages a side is not supported", cache_size);
+        return false;
+    }
+    source_ = std::move(source);
+    cache_size_ = cache_size;
+
+    int pages = source_.size / PAGE_SIZE;
+    level_offsets_.clear();
+    indirection_.clear();
+    int page_count = 0;
+    for (int level = 0; level < levels_; ++level) {
+        int level_pages = pages >> level;
+        level_offsets_.push_back(page_count);
+        page_count += level_pages * level_pages;
+        indirection_.emplace_back(static_cast<size_t>(level_pages * level_pages * 4));
+    }
+    page_slots_.assign(static_cast<size_t>(page_count), -1);
+    loading_.assign(static_cast<size_t>(page_count), 0);
+    slots_.assign(static_cast<size_t>(cache_size * cache_size), {});
+    feedback_count_ = 0;
+    in_flight_ = 0;
+    stats_ = {};
+
+    int cache_texels = cache_size * SLOT_SIZE;
+    glGenTextures(1, &cache_texture_);
+    glBindTexture(GL_TEXTURE_2D, cache_texture_);
+    glTexImage2D(GL_TEXTURE_2D,
+                 0,
+                 GL_SRGB8_ALPHA8,
+                 cache_texels,
+                 cache_texels,
+                 0,
+                 GL_RGBA,
+                 GL_UNSIGNED_BYTE,
+                 nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenTextures(1, &indirection_texture_);
+    glBindTexture(GL_TEXTURE_2D, indirection_texture_);
+    for (int level = 0; level < levels_; ++level) {
+        glTexImage2D(GL_TEXTURE_2D,
+                     level,
+                     GL_RGBA8UI,
+                     pages >> level,
+                     pages >> level,
+                     0,
+                     GL_RGBA_INTEGER,
+                     GL_UNSIGNED_BYTE,
+                     nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels_ - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenBuffers(1, &unpack_buffer_);
+    for (Readback& readback : readbacks_) {
+        glGenBuffers(1, &readback.buffer);
+    }
+    next_readback_ = 0;
+
+    // The root page, which everything falls back to.
+    Load root;
+    root.level = levels_ - 1;
+    root.page = page_index(root.level, 0, 0);
+    if (!source_.load(root.level, 0, 0, root.texels) ||
+        root.texels.size() != SLOT_BYTES) {
+        spdlog::error("Failed to load the coarsest page of a virtual texture");
+        shutdown();
+        return false;
+    }
+    upload(root, take_slot());
+    update_indirection();
+
+    stopping_ = false;
+    for (int i = 0; i < IO_THREAD_COUNT; ++i) {
+        io_threads_.emplace_back([this] { io_loop(); });
+    }
+    return true;
+}
+
+VirtualTexture::~VirtualTexture() {
+    stop_io();
+}
+
+void VirtualTexture::shutdown() {
+    stop_io();
+    completed_.clear();
+    if (cache_texture_ == 0) {
+        return;
+    }
+    for (Readback& readback : readbacks_) {
+        if (readback.fence != nullptr) {
+            glDeleteSync(static_cast<GLsync>(readback.fence));
+        }
+        glDeleteBuffers(1, &readback.buffer);
+        readback = {};
+    }
+    glDeleteBuffers(1, &unpack_buffer_);
+    glDeleteTextures(1, &indirection_texture_);
+    glDeleteTextures(1, &cache_texture_);
+    unpack_buffer_ = indirection_texture_ = cache_texture_ = 0;
+    page_slots_.clear();
+    loading_.clear();
+    slots_.clear();
+    indirection_.clear();
+}
+
+void VirtualTexture::stop_io() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+        requests_.clear();
+    }
+    wake_.notify_all();
+    for (std::thread& thread : io_threads_) {
+        thread.join();
+    }
+    io_threads_.clear();
+}
+
+auto VirtualTexture::shader_source() -> const char* {
+    return shaders::virtual_texture_src;
+}
+
+auto VirtualTexture::feedback_fragment_source() -> const char* {
+    return shaders::virtual_texture_feedback_fragment_src;
+}
+
+auto VirtualTexture::page_index(int level, int x, int y) const -> int {
+    int pages = (source_.size / PAGE_SIZE) >> level;
+    return level_offsets_[static_cast<size_t>(level)] + y * pages + x;
+}
+
+void VirtualTexture::update() {
+    auto start = std::chrono::steady_clock::now();
+    stats_.uploads = 0;
+    stats_.evictions = 0;
+
+    // Feedback the GPU is done with, oldest first; the ring is written in order,
+    // so the first pending buffer after the next one to write is the oldest.
+    for (int i = 0; i < READBACK_RING_SIZE; ++i) {
+        Readback& readback = readbacks_[(next_readback_ + i) % READBACK_RING_SIZE];
+        if (readback.fence == nullptr) {
+            continue;
+        }
+        auto fence = static_cast<GLsync>(readback.fence);
+        GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            break;
+        }
+        glDeleteSync(fence);
+        readback.fence = nullptr;
+        int count = readback.width * readback.height;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+        const void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER,
+                                              0,
+                                              static_cast<GLsizeiptr>(count) * 4,
+                                              GL_MAP_READ_BIT);
+        if (pixels != nullptr) {
+            process_feedback(static_cast<const uint32_t*>(pixels), count);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    std::deque<Load> completed;
+    {
+        std::lock_guard lock(mutex_);
+        completed.swap(completed_);
+    }
+    while (!completed.empty() && stats_.uploads < UPLOADS_PER_FRAME) {
+        Load& load = completed.front();
+        loading_[static_cast<size_t>(load.page)] = 0;
+        --in_flight_;
+        if (!load.ok || load.texels.size() != SLOT_BYTES) {
+            spdlog::warn("Failed to load page ({}, {}) of level {}",
+                         load.x,
+                         load.y,
+                         load.level);
+        } else if (int slot = take_slot(); slot < 0) {
+            ++stats_.dropped;
+        } else {
+            upload(load, slot);
+            ++stats_.uploads;
+        }
+        completed.pop_front();
+    }
+    if (!completed.empty()) {
+        std::lock_guard lock(mutex_);
+        for (auto it = completed.rbegin(); it != completed.rend(); ++it) {
+            completed_.push_front(std::move(*it));
+        }
+    }
+    if (indirection_dirty_) {
+        update_indirection();
+    }
+
+    stats_.resident_pages = static_cast<int>(
+        std::count_if(slots_.begin(), slots_.end(), [](const Slot& slot) {
+            return slot.page >= 0;
+        }));
+    stats_.cache_pages = static_cast<int>(slots_.size());
+    stats_.loads_in_flight = in_flight_;
+    stats_.update_ms =
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                  start)
+            .count();
+}
+
+void VirtualTexture::process_feedback(const uint32_t* pixels, int count) {
+    requested_.clear();
+    int pages = source_.size / PAGE_SIZE;
+    for (int i = 0; i < count; ++i) {
+        uint32_t page = pixels[i];
+        if (page == NO_PAGE) {
+            continue;
+        }
+        auto level = static_cast<int>(page >> 24);
+        auto y = static_cast<int>(page >> 12 & 0xFFFu);
+        auto x = static_cast<int>(page & 0xFFFu);
+        if (level < levels_ && x < (pages >> level) && y < (pages >> level)) {
+            requested_.push_back(page);
+        }
+    }
+    std::sort(requested_.begin(), requested_.end());
+    requested_.erase(std::unique(requested_.begin(), requested_.end()),
+                     requested_.end());
+    // Ancestors are the fallback until a page arrives, and load much faster.
+    size_t direct = requested_.size();
+    for (size_t i = 0; i < direct; ++i) {
+        uint32_t page = requested_[i];
+        auto level = static_cast<int>(page >> 24);
+        auto y = static_cast<int>(page >> 12 & 0xFFFu);
+        auto x = static_cast<int>(page & 0xFFFu);
+        while (++level < levels_) {
+            x /= 2;
+            y /= 2;
+            requested_.push_back(pack_page(level, x, y));
+        }
+    }
+    // The level is in the top bits, so descending order is coarsest first.
+    std::sort(requested_.begin(), requested_.end(), std::greater<>());
+    requested_.erase(std::unique(requested_.begin(), requested_.end()),
+                     requested_.end());
+    ++feedback_count_;
+    stats_.requested_pages = static_cast<int>(requested_.size());
+
+    std::lock_guard lock(mutex_);
+    // Requests no I/O thread has started on are superseded by this feedback.
+    for (const Load& load : requests_) {
+        loading_[static_cast<size_t>(load.page)] = 0;
+        --in_flight_;
+    }
+    requests_.clear();
+    for (uint32_t page : requested_) {
+        Load load;
+        load.level = static_cast<int>(page >> 24);
+        load.y = static_cast<int>(page >> 12 & 0xFFFu);
+        load.x = static_cast<int>(page & 0xFFFu);
+        load.page = page_index(load.level, load.x, load.y);
+        auto index = static_cast<size_t>(load.page);
+        if (page_slots_[index] >= 0) {
+            auto slot = static_cast<size_t>(page_slots_[index]);
+            slots_[slot].last_seen = feedback_count_;
+        } else if (loading_[index] == 0 && in_flight_ < MAX_LOADS_IN_FLIGHT) {
+            loading_[index] = 1;
+            ++in_flight_;
+            requests_.push_back(std::move(load));
+        }
+    }
+    wake_.notify_all();
+}
+
+auto VirtualTexture::take_slot() -> int {
+    // A free slot, or the one of the page least recently seen in the feedback, as
+    // long as the latest feedback did not ask for it. The root page stays.
+    int root = static_cast<int>(page_slots_.size()) - 1;
+    int victim = -1;
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        const Slot& slot = slots_[i];
+        if (slot.page < 0) {
+            return static_cast<int>(i);
+        }
+        if (slot.page == root || slot.last_seen >= feedback_count_) {
+            continue;
+        }
+        if (victim < 0 ||
+            slot.last_seen < slots_[static_cast<size_t>(victim)].last_seen) {
+            victim = static_cast<int>(i);
+        }
+    }
+    if (victim >= 0) {
+        Slot& slot = slots_[static_cast<size_t>(victim)];
+        page_slots_[static_cast<size_t>(slot.page)] = -1;
+        slot.page = -1;
+        indirection_dirty_ = true;
+        ++stats_.evictions;
+    }
+    return victim;
+}
+
+void VirtualTexture::upload(const Load& load, int slot) {
+    // Orphaning hands out fresh memory instead of waiting for the previous upload
+    // to be read.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpack_buffer_);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER,
+                 static_cast<GLsizeiptr>(SLOT_BYTES),
+                 nullptr,
+                 GL_STREAM_DRAW);
+    void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+                                 0,
+                                 static_cast<GLsizeiptr>(SLOT_BYTES),
+                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (dst != nullptr) {
+        std::memcpy(dst, load.texels.data(), SLOT_BYTES);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindTexture(GL_TEXTURE_2D, cache_texture_);
+        glTexSubImage2D(GL_TEXTURE_2D,
+                        0,
+                        slot % cache_size_ * SLOT_SIZE,
+                        slot / cache_size_ * SLOT_SIZE,
+                        SLOT_SIZE,
+                        SLOT_SIZE,
+                        GL_RGBA,
+                        GL_UNSIGNED_BYTE,
+                        nullptr);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        page_slots_[static_cast<size_t>(load.page)] = slot;
+        slots_[static_cast<size_t>(slot)] = {load.page, feedback_count_};
+        indirection_dirty_ = true;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void VirtualTexture::update_indirection() {
+    // Coarse to fine, so that a page that is not resident can take its parent's
+    // entry, already resolved to the finest resident ancestor.
+    int pages = source_.size / PAGE_SIZE;
+    for (int level = levels_ - 1; level >= 0; --level) {
+        int level_pages = pages >> level;
+        std::vector<uint8_t>& texels = indirection_[static_cast<size_t>(level)];
+        for (int y = 0; y < level_pages; ++y) {
+            for (int x = 0; x < level_pages; ++x) {
+                uint8_t* texel =
+                    &texels[static_cast<size_t>((y * level_pages + x) * 4)];
+                int slot = page_slots_[static_cast<size_t>(page_index(level, x, y))];
+                if (slot >= 0) {
+                    texel[0] = static_cast<uint8_t>(slot % cache_size_);
+                    texel[1] = static_cast<uint8_t>(slot / cache_size_);
+                    texel[2] = static_cast<uint8_t>(level);
+                    texel[3] = 0;
+                } else {
+                    // The root page is always resident, so there is a parent.
+                    const std::vector<uint8_t>& parent =
+                        indirection_[static_cast<size_t>(level + 1)];
+                    std::memcpy(texel,
+                                &parent[static_cast<size_t>(
+                                    ((y / 2) * (level_pages / 2) + x / 2) * 4)],
+                                4);
+                }
+            }
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, indirection_texture_);
+    for (int level = 0; level < levels_; ++level) {
+        glTexSubImage2D(GL_TEXTURE_2D,
+                        level,
+                        0,
+                        0,
+                        pages >> level,
+                        pages >> level,
+                        GL_RGBA_INTEGER,
+                        GL_UNSIGNED_BYTE,
+                        indirection_[static_cast<size_t>(level)].data());
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    indirection_dirty_ = false;
+}
+
+void VirtualTexture::add_feedback_pass(RenderGraph& graph,
+                                       int width,
+                                       int height,
+                                       std::function<void()> draw) {
+    if (readbacks_[next_readback_].fence != nullptr) {
+        return;
+    }
+    int feedback_width = std::max(width / FEEDBACK_DIVISOR, 1);
+    int feedback_height = std::max(height / FEEDBACK_DIVISOR, 1);
+    graph.add_pass(
+        "virtual_texture_feedback",
+        [&](RenderGraph::PassBuilder& builder) {
+            builder.create("virtual_texture_feedback",
+                           {feedback_width, feedback_height, GL_R32UI, 1});
+            builder.create("virtual_texture_feedback_depth",
+                           {feedback_width, feedback_height, GL_DEPTH_COMPONENT24, 1});
+            builder.side_effect();
+        },
+        [this, feedback_width, feedback_height, draw = std::move(draw)](
+            RenderGraph::PassContext&) {
+            const GLuint no_page[] = {NO_PAGE, 0, 0, 0};
+            glClearBufferuiv(GL_COLOR, 0, no_page);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            glEnable(GL_DEPTH_TEST);
+            draw();
+            glDisable(GL_DEPTH_TEST);
+
+            // Into a pixel pack buffer, so that glReadPixels returns right away;
+            // update() maps it once the fence says the copy is done.
+            Readback& readback = readbacks_[next_readback_];
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+            glBufferData(GL_PIXEL_PACK_BUFFER,
+                         static_cast<GLsizeiptr>(feedback_width) * feedback_height * 4,
+                         nullptr,
+                         GL_STREAM_READ);
+            glReadPixels(0,
+                         0,
+                         feedback_width,
+                         feedback_height,
+                         GL_RED_INTEGER,
+                         GL_UNSIGNED_INT,
+                         nullptr);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            readback.width = feedback_width;
+            readback.height = feedback_height;
+            next_readback_ = (next_readback_ + 1) % READBACK_RING_SIZE;
+        });
+}
+
+void VirtualTexture::bind(unsigned int program, int first_unit) const {
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(first_unit));
+    glBindTexture(GL_TEXTURE_2D, cache_texture_);
+    glActiveTexture(GL_TEXTURE0 + static_cast<unsigned int>(first_unit + 1));
+    glBindTexture(GL_TEXTURE_2D, indirection_texture_);
+    glActiveTexture(GL_TEXTURE0);
+    glUniform1i(glGetUniformLocation(program, "uPageCache"), first_unit);
+    glUniform1i(glGetUniformLocation(program, "uIndirection"), first_unit + 1);
+    glUniform1f(glGetUniformLocation(program, "uVirtualSize"),
+                static_cast<float>(source_.size));
+    glUniform1i(glGetUniformLocation(program, "uVirtualMaxLevel"), levels_ - 1);
+    glUniform1f(glGetUniformLocation(program, "uPageCacheSize"),
+                static_cast<float>(cache_size_ * SLOT_SIZE));
+    // The feedback pass is smaller than the scene by FEEDBACK_DIVISOR, which makes
+    // its derivatives that much larger.
+    glUniform1f(glGetUniformLocation(program, "uFeedbackBias"),
+                -std::log2(static_cast<float>(FEEDBACK_DIVISOR)));
+}
+
+void VirtualTexture::io_loop() {
+    while (true) {
+        Load load;
+        {
+            std::unique_lock lock(mutex_);
+            wake_.wait(lock, [this] { return stopping_ || !requests_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            load = std::move(requests_.front());
+            requests_.pop_front();
+        }
+        load.ok = source_.load(load.level, load.x, load.y, load.texels);
+        std::lock_guard lock(mutex_);
+        completed_.push_back(std::move(load));
+    }
+}
+} // namespace virtual_texture